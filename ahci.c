@@ -2,6 +2,8 @@
 #include "pci.h"
 #include "shell.h"
 #include "ports.h" // for ata_io_wait
+#include "idt.h"
+#include "timer.h"
 #include <stddef.h>
 
 // Required externs from kernel.c
@@ -12,19 +14,32 @@ extern void print_int(int n);
 extern void* memset(void* s, int c, size_t n);
 extern void print_string(const char* str);
 
-#define AHCI_MEMORY_SIZE 0x10000 // 64KB for our AHCI structures
+#define AHCI_PORT_MEMORY 0x9000 // 36KB per port: command list, FIS, command tables
+#define AHCI_MEMORY_SIZE (AHCI_PORT_MEMORY * AHCI_MAX_PORTS)
+#define AHCI_CMD_TABLE_OFFSET 0x1000
+#define AHCI_CMD_TABLE_SIZE   sizeof(HBA_CMD_TBL)
 __attribute__((aligned(1024))) static char ahci_memory_block[AHCI_MEMORY_SIZE];
 
+// Time budget for one command; generous enough for a spun-down disk.
+#define AHCI_TIMEOUT_MS 10000
+
 static HBA_MEM* ahci_base_memory = 0;
-HBA_PORT* active_port = 0;
+static AhciPort ahci_ports[AHCI_MAX_PORTS];
+static int ahci_num_ports = 0;
+__attribute__((aligned(4096))) static uint64_t ahci_trim_ranges[AHCI_TRIM_MAX_BLOCKS * AHCI_TRIM_RANGES_PER_BLOCK];
 int ahci_drive_present = 0;
 
+#define AHCI_IRQ_NONE 0
+#define AHCI_IRQ_INTX 1
+#define AHCI_IRQ_MSI  2
+static int ahci_irq_mode = AHCI_IRQ_NONE;
+static int ahci_ccc_enabled = 0;
+static volatile uint32_t ahci_interrupts = 0;
+
 // --- PCI Definitions ---
 #define PCI_CLASS_MASS_STORAGE 0x01
 #define PCI_SUBCLASS_SATA      0x06
 #define PCI_PROGIF_AHCI        0x01
-#define PCI_VENDOR_ID          0x00
-#define PCI_BAR5               0x24
 
 // Stop command engine of a port
 void stop_cmd(HBA_PORT *port) {
@@ -41,167 +56,579 @@ void start_cmd(HBA_PORT *port) {
 }
 
 // Find a free command slot
-int find_cmdslot(HBA_PORT *port) {
-    // We only support one command at a time for simplicity
-    uint32_t slots = (port->sact | port->ci);
-    if ((slots & 1) == 0) return 0;
-    return -1;
+static int find_cmdslot(AhciPort *ap) {
+    uint32_t free = ap->slot_mask & ~ap->busy;
+    if (free == 0) return -1;
+    return __builtin_ctz(free);
 }
 
-static void probe_port(HBA_MEM *abar) {
-    uint32_t pi = abar->pi;
-    int i = 0;
-    while (i < 32) {
-        if (pi & 1) {
-            HBA_PORT *port = &abar->ports[i];
-            uint8_t ssts = port->ssts & 0x0F;
-            uint8_t ipm = (port->ssts >> 8) & 0x0F;
-
-            if (ssts == 3 && ipm == 1) { // Check for active device
-                print_string("SATA device found on port "); print_int(i); new_line();
-                active_port = port;
-                ahci_drive_present = 1;
-                return;
-            }
-        }
-        pi >>= 1;
-        i++;
+// Fills the slot's command header, PRDT and command FIS (all but the
+// command byte). The FIS type, the C bit and the FIS length were written
+// once by port_rebase; every other field is overwritten here, so the table
+// is never cleared. `nsegs` may be 0 for non-data commands.
+static FIS_REG_H2D* ahci_prepare(AhciPort *ap, int slot, uint64_t lba,
+                                 const BlockSegment *segs, int nsegs, int write) {
+    HBA_CMD_HEADER *cmdheader = (HBA_CMD_HEADER*)ap->port->clb;
+    cmdheader += slot;
+    cmdheader->w = write ? 1 : 0;
+    cmdheader->prdtl = nsegs;
+    cmdheader->prdbc = 0;
+
+    HBA_CMD_TBL *cmdtbl = (HBA_CMD_TBL*)(cmdheader->ctba);
+    for (int i = 0; i < nsegs; i++) {
+        cmdtbl->prdt_entry[i].dba = (uint32_t)segs[i].addr;
+        cmdtbl->prdt_entry[i].dbc = segs[i].len - 1;
     }
+
+    FIS_REG_H2D *cmdfis = (FIS_REG_H2D*)(&cmdtbl->cfis);
+    cmdfis->featurel = 0;
+    cmdfis->featureh = 0;
+    cmdfis->device = 1 << 6;
+    cmdfis->lba0 = (uint8_t)lba;
+    cmdfis->lba1 = (uint8_t)(lba >> 8);
+    cmdfis->lba2 = (uint8_t)(lba >> 16);
+    cmdfis->lba3 = (uint8_t)(lba >> 24);
+    cmdfis->lba4 = (uint8_t)(lba >> 32);
+    cmdfis->lba5 = (uint8_t)(lba >> 40);
+    cmdfis->countl = 0;
+    cmdfis->counth = 0;
+    return cmdfis;
 }
 
-void ahci_init() {
-    uint32_t pci_bar5 = 0;
-    
-    for (uint16_t bus = 0; bus < 256; bus++) {
-        for (uint8_t device = 0; device < 32; device++) {
-            uint32_t vendor = pci_read_dword(bus, device, 0, PCI_VENDOR_ID);
-            if ((vendor & 0xFFFF) == 0xFFFF) continue;
-            
-            uint32_t class_info = pci_read_dword(bus, device, 0, 0x08);
-            if (((class_info >> 24) & 0xFF) == PCI_CLASS_MASS_STORAGE &&
-                ((class_info >> 16) & 0xFF) == PCI_SUBCLASS_SATA &&
-                ((class_info >> 8) & 0xFF) == PCI_PROGIF_AHCI) {
-                pci_bar5 = pci_read_dword(bus, device, 0, PCI_BAR5);
-                goto found;
-            }
-        }
+// Records the completion and hands the slot to the HBA. Queued commands
+// must be marked in SActive before their CI bit is set.
+static void ahci_start(AhciPort *ap, int slot, int queued, ahci_callback_t callback, void *ctx) {
+    uint32_t bit = 1u << slot;
+    ap->callbacks[slot] = callback;
+    ap->contexts[slot] = ctx;
+    ap->busy |= bit;
+    if (queued) {
+        ap->queued |= bit;
+        ap->port->sact = bit;
     }
-found:
-    if (!pci_bar5) return;
-    
-    ahci_base_memory = (HBA_MEM*)(pci_bar5 & 0xFFFFFFF0);
-    
-    probe_port(ahci_base_memory);
-    if (!active_port) return;
+    ap->port->ci = bit;
+}
+
+// Brings the port back after a task file error or a timeout and fails
+// everything that was outstanding. Clearing ST makes the HBA drop CI and
+// SActive, so the slots are free again once the engine restarts.
+static void ahci_port_recover(AhciPort *ap) {
+    HBA_PORT *port = ap->port;
+    print_string("AHCI: Error on port "); print_int(ap->index);
+    int outstanding = 0;
+    for (uint32_t b = ap->busy; b; b &= b - 1) outstanding++;
+    print_string(", failing "); print_int(outstanding);
+    print_string(" command(s).\n");
+
+    stop_cmd(port);
+    port->serr = port->serr;
+    port->is = (uint32_t)-1;
+    start_cmd(port);
+
+    uint32_t failed = ap->busy;
+    ap->busy = 0;
+    ap->queued = 0;
+    while (failed) {
+        int slot = __builtin_ctz(failed);
+        failed &= failed - 1;
+        if (ap->callbacks[slot]) ap->callbacks[slot](ap->contexts[slot], -1);
+    }
+}
+
+// Reaps finished slots. Runs with interrupts off, either from ahci_poll
+// or from the interrupt handler. PxIS is acknowledged even when nothing is
+// outstanding so a level-triggered INTx line drops.
+static int ahci_reap(AhciPort *ap) {
+    HBA_PORT *port = ap->port;
+    uint32_t is = port->is;
+    if (is & HBA_PxIE_ERRORS) {
+        ahci_port_recover(ap);
+        return 0;
+    }
+    port->is = is;
+    if (ap->busy == 0) return 0;
+
+    // A non-queued command is done when its CI bit drops. A queued one is
+    // done when the drive's Set Device Bits FIS clears its tag, which the
+    // HBA applies to SActive (and flags with PxIS.SDBS).
+    uint32_t done = ap->busy & ~(port->ci | port->sact);
+    int completed = 0;
+    while (done) {
+        int slot = __builtin_ctz(done);
+        uint32_t bit = 1u << slot;
+        done &= ~bit;
+        ap->busy &= ~bit;
+        ap->queued &= ~bit;
+        completed++;
+        if (ap->callbacks[slot]) ap->callbacks[slot](ap->contexts[slot], 0);
+    }
+    return completed;
+}
 
-    stop_cmd(active_port);
+int ahci_poll(AhciPort *ap) {
+    uint32_t flags = irq_save();
+    int completed = ahci_reap(ap);
+    irq_restore(flags);
+    return completed;
+}
 
-    uint32_t mem_base = (uint32_t)ahci_memory_block;
-    
-    active_port->clb = mem_base;
-    active_port->clbu = 0;
-    memset((void*)active_port->clb, 0, 1024);
+// One interrupt may cover several ports, and with coalescing on, the CCC
+// bit stands for every port in CCC_PORTS.
+static void ahci_irq_handler(int irq) {
+    HBA_MEM *abar = ahci_base_memory;
+    uint32_t is = abar->is;
+    if (is == 0) return; // Shared INTx line, not ours
+    ahci_interrupts++;
+
+    uint32_t ccc_bit = ahci_ccc_enabled ? 1u << ((abar->ccc_ctl >> 3) & 0x1F) : 0;
+    for (int i = 0; i < ahci_num_ports; i++) {
+        AhciPort *ap = &ahci_ports[i];
+        if ((is & (1u << ap->index)) || (is & ccc_bit)) ahci_reap(ap);
+    }
+    abar->is = is;
+}
 
-    active_port->fb = mem_base + 1024;
-    active_port->fbu = 0;
-    memset((void*)active_port->fb, 0, 256);
+int ahci_submitv(AhciPort *ap, uint64_t lba, const BlockSegment *segs, int nsegs, int flags,
+                 ahci_callback_t callback, void *ctx) {
+    if (nsegs < 1 || nsegs > AHCI_PRDT_ENTRIES) return -1;
+    uint32_t bytes = 0;
+    for (int i = 0; i < nsegs; i++) {
+        // PRDs need word-aligned addresses and even byte counts.
+        if (segs[i].len == 0 || (segs[i].len & 1) || ((uint32_t)segs[i].addr & 1)) return -1;
+        if (segs[i].len > AHCI_PRDT_MAX_BYTES) return -1;
+        bytes += segs[i].len;
+    }
+    if (bytes % 512) return -1;
+    uint32_t count = bytes / 512;
+    if (count == 0 || count > AHCI_MAX_SECTORS) return -1;
+    int write = (flags & AHCI_SUBMIT_WRITE) != 0;
+    int fua = (flags & AHCI_SUBMIT_FUA) != 0;
+    if (fua && !(ap->block.caps.flags & BLOCK_CAP_FUA)) return -1;
+    int ncq = (ap->block.caps.flags & BLOCK_CAP_NCQ) != 0;
+
+    // Slot state is shared with the interrupt handler.
+    uint32_t irq_flags = irq_save();
+    // Queued and non-queued commands can't be outstanding together.
+    int slot = -1;
+    if (!ncq || !(ap->busy & ~ap->queued)) slot = find_cmdslot(ap);
+    if (slot == -1) {
+        irq_restore(irq_flags);
+        return 1;
+    }
 
-    HBA_CMD_HEADER *cmdheader = (HBA_CMD_HEADER*)active_port->clb;
-    cmdheader->ctba = mem_base + 4096;
-    cmdheader->ctbau = 0;
-    memset((void*)cmdheader->ctba, 0, 256);
+    FIS_REG_H2D *cmdfis = ahci_prepare(ap, slot, lba, segs, nsegs, write);
+    if (ncq) {
+        // FPDMA QUEUED: the sector count moves to the feature registers and
+        // the tag goes in count bits 7:3. FUA is device bit 7.
+        cmdfis->command = write ? ATA_CMD_WRITE_FPDMA_QUEUED : ATA_CMD_READ_FPDMA_QUEUED;
+        cmdfis->featurel = count & 0xFF;
+        cmdfis->featureh = (count >> 8) & 0xFF;
+        cmdfis->countl = slot << 3;
+        if (fua) cmdfis->device |= 1 << 7;
+    } else {
+        if (fua) cmdfis->command = ATA_CMD_WRITE_DMA_FUA_EXT;
+        else cmdfis->command = write ? ATA_CMD_WRITE_DMA_EXT : ATA_CMD_READ_DMA_EXT;
+        cmdfis->countl = count & 0xFF;
+        cmdfis->counth = (count >> 8) & 0xFF;
+    }
 
-    start_cmd(active_port);
+    ahci_start(ap, slot, ncq, callback, ctx);
+    irq_restore(irq_flags);
+    return 0;
 }
 
-int ahci_read(HBA_PORT *port, uint64_t lba, uint32_t count, void *buf) {
-    port->is = (uint32_t)-1;
-    int slot = find_cmdslot(port);
+int ahci_submit(AhciPort *ap, uint64_t lba, uint32_t count, void *buf, int flags,
+                ahci_callback_t callback, void *ctx) {
+    BlockSegment seg = { buf, count * 512 };
+    if (count == 0 || count > AHCI_MAX_SECTORS) return -1;
+    return ahci_submitv(ap, lba, &seg, 1, flags, callback, ctx);
+}
+
+#define AHCI_PENDING 1
+
+static void ahci_sync_done(void *ctx, int status) {
+    *(volatile int*)ctx = status;
+}
+
+void ahci_wait_event(AhciPort *ap) {
+    if (ahci_irq_mode != AHCI_IRQ_NONE) {
+        __asm__ volatile("sti; hlt");
+    } else {
+        __asm__ volatile("sti");
+        ahci_poll(ap);
+    }
+}
+
+// One step of a wait whose condition the caller just checked with
+// interrupts off. Returns -1 once the command timeout has passed.
+static int ahci_wait_step(AhciPort *ap, uint32_t start) {
+    if (timer_ms() - start > AHCI_TIMEOUT_MS) {
+        __asm__ volatile("sti");
+        return -1;
+    }
+    ahci_wait_event(ap);
+    return 0;
+}
+
+void ahci_abort(AhciPort *ap) {
+    uint32_t flags = irq_save();
+    if (ap->busy) ahci_port_recover(ap);
+    irq_restore(flags);
+}
+
+static void ahci_timeout(AhciPort *ap) {
+    print_string("AHCI: Command timeout!\n");
+    ahci_abort(ap);
+}
+
+// Waits until `*status` leaves AHCI_PENDING.
+static int ahci_wait(AhciPort *ap, volatile int *status) {
+    uint32_t start = timer_ms();
+    for (;;) {
+        __asm__ volatile("cli");
+        if (*status != AHCI_PENDING) break;
+        if (ahci_wait_step(ap, start) != 0) {
+            ahci_timeout(ap);
+            return -1;
+        }
+    }
+    __asm__ volatile("sti");
+    return *status;
+}
+
+// Waits until every outstanding command on the port has completed.
+static int ahci_drain(AhciPort *ap) {
+    uint32_t start = timer_ms();
+    for (;;) {
+        __asm__ volatile("cli");
+        if (ap->busy == 0) break;
+        if (ahci_wait_step(ap, start) != 0) {
+            ahci_timeout(ap);
+            return -1;
+        }
+    }
+    __asm__ volatile("sti");
+    return 0;
+}
+
+// Runs one non-queued command synchronously once the queue is empty.
+static int ahci_run_command(AhciPort *ap, uint8_t command, uint8_t features, void *buf, uint32_t bytes) {
+    if (ahci_drain(ap) != 0) return -1;
+    int slot = find_cmdslot(ap);
     if (slot == -1) return -1;
 
+    BlockSegment seg = { buf, bytes };
+    FIS_REG_H2D *cmdfis = ahci_prepare(ap, slot, 0, &seg, bytes ? 1 : 0, 0);
+    cmdfis->command = command;
+    cmdfis->featurel = features;
+
+    volatile int status = AHCI_PENDING;
+    ahci_start(ap, slot, 0, ahci_sync_done, (void*)&status);
+    return ahci_wait(ap, &status);
+}
+
+// Submits one transfer and waits for it, polling to free a slot if the
+// queue is full.
+static int ahci_transfer(AhciPort *ap, uint64_t lba, const BlockSegment *segs, int nsegs, int flags) {
+    volatile int status = AHCI_PENDING;
+    uint32_t start = timer_ms();
+    int ret;
+    while ((ret = ahci_submitv(ap, lba, segs, nsegs, flags, ahci_sync_done, (void*)&status)) == 1) {
+        __asm__ volatile("cli");
+        if (ahci_wait_step(ap, start) != 0) return -1;
+    }
+    if (ret != 0) return -1;
+    return ahci_wait(ap, &status);
+}
+
+// Gives the port its slice of ahci_memory_block and starts the engine.
+static void port_rebase(HBA_PORT *port, int n) {
+    stop_cmd(port);
+
+    uint32_t mem_base = (uint32_t)ahci_memory_block + n * AHCI_PORT_MEMORY;
+
+    port->clb = mem_base;
+    port->clbu = 0;
+    memset((void*)port->clb, 0, 1024);
+
+    port->fb = mem_base + 1024;
+    port->fbu = 0;
+    memset((void*)port->fb, 0, 256);
+
+    // One 1 KB command table per slot, from +4 KB to +36 KB, with the
+    // fields that never change filled in once here.
     HBA_CMD_HEADER *cmdheader = (HBA_CMD_HEADER*)port->clb;
-    cmdheader += slot;
-    cmdheader->cfl = sizeof(FIS_REG_H2D) / sizeof(uint32_t);
-    cmdheader->w = 0; // Read
-    cmdheader->prdtl = 1;
+    memset((void*)(mem_base + AHCI_CMD_TABLE_OFFSET), 0, 32 * AHCI_CMD_TABLE_SIZE);
+    for (int slot = 0; slot < 32; slot++) {
+        HBA_CMD_TBL *cmdtbl = (HBA_CMD_TBL*)(mem_base + AHCI_CMD_TABLE_OFFSET + slot * AHCI_CMD_TABLE_SIZE);
+        FIS_REG_H2D *cmdfis = (FIS_REG_H2D*)(&cmdtbl->cfis);
+        cmdfis->fis_type = 0x27;
+        cmdfis->c = 1;
+        cmdheader[slot].cfl = sizeof(FIS_REG_H2D) / sizeof(uint32_t);
+        cmdheader[slot].ctba = (uint32_t)cmdtbl;
+        cmdheader[slot].ctbau = 0;
+    }
 
-    HBA_CMD_TBL *cmdtbl = (HBA_CMD_TBL*)(cmdheader->ctba);
-    memset(cmdtbl, 0, sizeof(HBA_CMD_TBL) + (cmdheader->prdtl - 1) * sizeof(HBA_PRDT_ENTRY));
+    start_cmd(port);
+}
 
-    cmdtbl->prdt_entry[0].dba = (uint32_t)buf;
-    cmdtbl->prdt_entry[0].dbau = 0;
-    cmdtbl->prdt_entry[0].dbc = (count * 512) - 1;
+// Fills the port's capability descriptor from IDENTIFY DEVICE.
+// Word 76 bit 8 and word 75 give NCQ support and depth; NCQ also needs
+// the HBA's SNCQ bit.
+static int port_identify(AhciPort *ap) {
+    __attribute__((aligned(2))) static uint16_t identify_data[256];
+    if (ahci_run_command(ap, ATA_CMD_IDENTIFY, 0, identify_data, 512) != 0) {
+        print_string("AHCI: IDENTIFY failed.\n");
+        return -1;
+    }
 
-    FIS_REG_H2D *cmdfis = (FIS_REG_H2D*)(&cmdtbl->cfis);
-    cmdfis->fis_type = 0x27;
-    cmdfis->c = 1;
-    cmdfis->command = ATA_CMD_READ_DMA_EXT;
+    BlockCaps *caps = &ap->block.caps;
+    caps->sector_count = (uint64_t)identify_data[100] |
+                         ((uint64_t)identify_data[101] << 16) |
+                         ((uint64_t)identify_data[102] << 32) |
+                         ((uint64_t)identify_data[103] << 48);
+    if (caps->sector_count == 0) {
+        caps->sector_count = (uint32_t)identify_data[60] | ((uint32_t)identify_data[61] << 16);
+    }
+    caps->max_sectors = AHCI_MAX_SECTORS;
+    caps->max_segments = AHCI_PRDT_ENTRIES;
+    caps->flags = BLOCK_CAP_DMA;
+    if (identify_data[83] & (1 << 10)) caps->flags |= BLOCK_CAP_LBA48;
+    if (identify_data[84] & (1 << 6)) caps->flags |= BLOCK_CAP_FUA;
+    // Keep the volatile write cache on; ordering comes from flushes and FUA.
+    if ((identify_data[82] & (1 << 5)) &&
+        ahci_run_command(ap, ATA_CMD_SET_FEATURES, ATA_FEATURE_ENABLE_WCACHE, 0, 0) == 0) {
+        caps->flags |= BLOCK_CAP_WRITE_CACHE;
+    } else if (identify_data[85] & (1 << 5)) {
+        caps->flags |= BLOCK_CAP_WRITE_CACHE;
+    }
+    // Word 169 bit 0: TRIM; word 105: range blocks per command (0 means one).
+    if ((identify_data[169] & 0x01) && (caps->flags & BLOCK_CAP_LBA48)) {
+        uint32_t blocks = identify_data[105] ? identify_data[105] : 1;
+        if (blocks > AHCI_TRIM_MAX_BLOCKS) blocks = AHCI_TRIM_MAX_BLOCKS;
+        caps->flags |= BLOCK_CAP_DISCARD;
+        caps->max_discard_ranges = blocks * AHCI_TRIM_RANGES_PER_BLOCK;
+        caps->max_discard_sectors = AHCI_TRIM_RANGE_MAX;
+    }
+    caps->mwdma_modes = identify_data[63] & 0x07;
+    if (identify_data[53] & (1 << 2)) caps->udma_modes = identify_data[88] & 0x7F;
+    caps->queue_depth = 1;
+    if ((ahci_base_memory->cap & HBA_CAP_SNCQ) && (identify_data[76] & (1 << 8))) {
+        caps->flags |= BLOCK_CAP_NCQ;
+        caps->queue_depth = (identify_data[75] & 0x1F) + 1;
+        // Tags above the drive's queue depth are invalid.
+        if (caps->queue_depth < 32) ap->slot_mask &= (1u << caps->queue_depth) - 1;
+    }
+    return 0;
+}
 
-    cmdfis->lba0 = (uint8_t)lba;
-    cmdfis->lba1 = (uint8_t)(lba >> 8);
-    cmdfis->lba2 = (uint8_t)(lba >> 16);
-    cmdfis->device = 1 << 6;
+static void probe_ports(HBA_MEM *abar) {
+    uint32_t pi = abar->pi;
+    for (int i = 0; i < 32 && ahci_num_ports < AHCI_MAX_PORTS; i++) {
+        if (!(pi & (1u << i))) continue;
+        HBA_PORT *port = &abar->ports[i];
+        uint8_t ssts = port->ssts & 0x0F;
+        uint8_t ipm = (port->ssts >> 8) & 0x0F;
+
+        if (ssts != 3 || ipm != 1) continue; // No active device
+        if (port->sig != SATA_SIG_ATA) {
+            print_string("AHCI: Skipping non-disk device on port "); print_int(i); new_line();
+            continue;
+        }
 
-    cmdfis->lba3 = (uint8_t)(lba >> 24);
-    cmdfis->lba4 = (uint8_t)(lba >> 32);
-    cmdfis->lba5 = (uint8_t)(lba >> 40);
+        AhciPort *ap = &ahci_ports[ahci_num_ports];
+        memset(ap, 0, sizeof(AhciPort));
+        ap->port = port;
+        ap->index = i;
+        uint32_t slots = HBA_CAP_NCS(abar->cap);
+        ap->slot_mask = slots == 32 ? 0xFFFFFFFF : (1u << slots) - 1;
+        port_rebase(port, ahci_num_ports);
+        if (port_identify(ap) != 0) {
+            stop_cmd(port); // Its memory slice goes to the next port
+            continue;
+        }
 
-    cmdfis->countl = count & 0xFF;
-    cmdfis->counth = (count >> 8) & 0xFF;
+        print_string("SATA device found on port "); print_int(i);
+        print_string(", "); print_int((uint32_t)(ap->block.caps.sector_count >> 11));
+        print_string(" MB"); new_line();
+        ahci_num_ports++;
+        ahci_drive_present = 1;
+    }
+}
 
-    port->ci = 1 << slot;
+// Routes HBA interrupts to ahci_irq_handler: MSI to the local APIC if the
+// function has the capability, otherwise its legacy INTx line through the
+// PIC. Without either, commands are still completed by polling.
+static void ahci_setup_interrupts(const PciAddress *hba) {
+    HBA_MEM *abar = ahci_base_memory;
+    if (pci_find_capability(hba, PCI_CAP_ID_MSI)) {
+        int irq = irq_alloc_msi(ahci_irq_handler);
+        if (irq >= 0 && pci_enable_msi(hba, lapic_msi_address(), irq_msi_vector(irq))) {
+            ahci_irq_mode = AHCI_IRQ_MSI;
+        }
+    }
+    if (ahci_irq_mode == AHCI_IRQ_NONE) {
+        uint8_t line = pci_read_dword(hba->bus, hba->device, hba->function, PCI_INTERRUPT_LINE) & 0xFF;
+        // Lines are not shared between drivers here.
+        if (line >= 16 || irq_has_handler(line)) {
+            print_string("AHCI: No usable interrupt, polling for completions.\n");
+            return;
+        }
+        irq_install_handler(line, ahci_irq_handler);
+        ahci_irq_mode = AHCI_IRQ_INTX;
+    }
 
-    while (1) {
-        if ((port->ci & (1 << slot)) == 0) break;
-        if (port->is & HBA_PxIS_TFES) return -1;
+    for (int i = 0; i < ahci_num_ports; i++) {
+        HBA_PORT *port = ahci_ports[i].port;
+        port->is = (uint32_t)-1;
+        port->ie = HBA_PxIE_COMPLETION | HBA_PxIE_ERRORS;
     }
+    abar->is = (uint32_t)-1;
+    abar->ghc |= HBA_GHC_IE;
+    print_string("AHCI: Completion interrupts via ");
+    print_string(ahci_interrupt_mode());
+    new_line();
+}
+
+void ahci_init() {
+    PciAddress hba;
+    if (!pci_find_class(PCI_CLASS_MASS_STORAGE, PCI_SUBCLASS_SATA, &hba)) return;
+    uint32_t class_info = pci_read_dword(hba.bus, hba.device, hba.function, PCI_CLASS_INFO);
+    if (((class_info >> 8) & 0xFF) != PCI_PROGIF_AHCI) return;
+
+    uint32_t pci_bar5 = pci_read_dword(hba.bus, hba.device, hba.function, PCI_BAR5);
+    if (!pci_bar5) return;
+    pci_enable(&hba, PCI_COMMAND_MEMORY | PCI_COMMAND_BUS_MASTER);
+
+    ahci_base_memory = (HBA_MEM*)(pci_bar5 & 0xFFFFFFF0);
+    ahci_base_memory->ghc |= HBA_GHC_AE;
+
+    probe_ports(ahci_base_memory);
+    if (ahci_num_ports > 0) ahci_setup_interrupts(&hba);
+}
 
-    if (port->is & HBA_PxIS_TFES) return -1;
+int ahci_set_coalescing(uint8_t commands, uint16_t timeout_ms) {
+    HBA_MEM *abar = ahci_base_memory;
+    if (!abar || !(abar->cap & HBA_CAP_CCCS) || ahci_irq_mode == AHCI_IRQ_NONE) return -1;
+    if (commands && timeout_ms == 0) return -1; // A zero timeout is reserved
+
+    uint32_t flags = irq_save();
+    // CCC_CTL may only be reprogrammed while disabled.
+    abar->ccc_ctl &= ~HBA_CCC_EN;
+    uint32_t ports = 0;
+    for (int i = 0; i < ahci_num_ports; i++) ports |= 1u << ahci_ports[i].index;
+
+    if (commands) {
+        abar->ccc_pts = ports;
+        abar->ccc_ctl = ((uint32_t)timeout_ms << 16) | ((uint32_t)commands << 8) | HBA_CCC_EN;
+        ahci_ccc_enabled = 1;
+    } else {
+        ahci_ccc_enabled = 0;
+    }
+    // Completions on coalesced ports are reported through the CCC interrupt
+    // only; errors still interrupt immediately.
+    for (int i = 0; i < ahci_num_ports; i++) {
+        ahci_ports[i].port->ie = HBA_PxIE_ERRORS | (commands ? 0 : HBA_PxIE_COMPLETION);
+    }
+    irq_restore(flags);
     return 0;
 }
 
-int ahci_write(HBA_PORT *port, uint64_t lba, uint32_t count, const void *buf) {
-    port->is = (uint32_t)-1;
-    int slot = find_cmdslot(port);
-    if (slot == -1) return -1;
+int ahci_get_coalescing(uint8_t *commands, uint16_t *timeout_ms) {
+    if (!ahci_ccc_enabled) return 0;
+    uint32_t ccc_ctl = ahci_base_memory->ccc_ctl;
+    *commands = (ccc_ctl >> 8) & 0xFF;
+    *timeout_ms = ccc_ctl >> 16;
+    return 1;
+}
 
-    HBA_CMD_HEADER *cmdheader = (HBA_CMD_HEADER*)port->clb;
-    cmdheader += slot;
-    cmdheader->cfl = sizeof(FIS_REG_H2D) / sizeof(uint32_t);
-    cmdheader->w = 1; // Write
-    cmdheader->prdtl = 1;
+uint32_t ahci_interrupt_count() {
+    return ahci_interrupts;
+}
 
-    HBA_CMD_TBL *cmdtbl = (HBA_CMD_TBL*)(cmdheader->ctba);
-    memset(cmdtbl, 0, sizeof(HBA_CMD_TBL) + (cmdheader->prdtl - 1) * sizeof(HBA_PRDT_ENTRY));
+const char* ahci_interrupt_mode() {
+    if (ahci_irq_mode == AHCI_IRQ_MSI) return "MSI";
+    if (ahci_irq_mode == AHCI_IRQ_INTX) return "INTx";
+    return "polling";
+}
 
-    cmdtbl->prdt_entry[0].dba = (uint32_t)buf;
-    cmdtbl->prdt_entry[0].dbau = 0;
-    cmdtbl->prdt_entry[0].dbc = (count * 512) - 1;
+int ahci_port_count() {
+    return ahci_num_ports;
+}
 
-    FIS_REG_H2D *cmdfis = (FIS_REG_H2D*)(&cmdtbl->cfis);
-    cmdfis->fis_type = 0x27;
-    cmdfis->c = 1;
-    cmdfis->command = ATA_CMD_WRITE_DMA_EXT;
+AhciPort* ahci_get_port(int index) {
+    if (index < 0 || index >= ahci_num_ports) return 0;
+    return &ahci_ports[index];
+}
 
-    cmdfis->lba0 = (uint8_t)lba;
-    cmdfis->lba1 = (uint8_t)(lba >> 8);
-    cmdfis->lba2 = (uint8_t)(lba >> 16);
-    cmdfis->device = 1 << 6;
+int ahci_read(AhciPort *ap, uint64_t lba, uint32_t count, void *buf) {
+    BlockSegment seg = { buf, count * 512 };
+    if (count == 0 || count > AHCI_MAX_SECTORS) return -1;
+    return ahci_transfer(ap, lba, &seg, 1, 0);
+}
 
-    cmdfis->lba3 = (uint8_t)(lba >> 24);
-    cmdfis->lba4 = (uint8_t)(lba >> 32);
-    cmdfis->lba5 = (uint8_t)(lba >> 40);
+int ahci_write(AhciPort *ap, uint64_t lba, uint32_t count, const void *buf) {
+    BlockSegment seg = { (void*)buf, count * 512 };
+    if (count == 0 || count > AHCI_MAX_SECTORS) return -1;
+    return ahci_transfer(ap, lba, &seg, 1, AHCI_SUBMIT_WRITE);
+}
+
+int ahci_write_fua(AhciPort *ap, uint64_t lba, uint32_t count, const void *buf) {
+    BlockSegment seg = { (void*)buf, count * 512 };
+    if (count == 0 || count > AHCI_MAX_SECTORS) return -1;
+    return ahci_transfer(ap, lba, &seg, 1, AHCI_SUBMIT_WRITE | AHCI_SUBMIT_FUA);
+}
+
+int ahci_readv(AhciPort *ap, uint64_t lba, const BlockSegment *segs, int nsegs) {
+    return ahci_transfer(ap, lba, segs, nsegs, 0);
+}
+
+int ahci_writev(AhciPort *ap, uint64_t lba, const BlockSegment *segs, int nsegs) {
+    return ahci_transfer(ap, lba, segs, nsegs, AHCI_SUBMIT_WRITE);
+}
 
-    cmdfis->countl = count & 0xFF;
-    cmdfis->counth = (count >> 8) & 0xFF;
+int ahci_flush(AhciPort *ap) {
+    if (ahci_run_command(ap, ATA_CMD_FLUSH_CACHE_EXT, 0, 0, 0) != 0) {
+        print_string("AHCI: FLUSH CACHE failed!\n");
+        return -1;
+    }
+    return 0;
+}
 
-    port->ci = 1 << slot;
+// DATA SET MANAGEMENT is not queueable on most drives, so it runs alone
+// like the other non-data commands, but writes its range list to the drive.
+int ahci_trim(AhciPort *ap, const BlockRange *ranges, int nranges) {
+    if (!(ap->block.caps.flags & BLOCK_CAP_DISCARD)) return -1;
+    if (nranges <= 0 || nranges > ap->block.caps.max_discard_ranges) return -1;
 
-    while (1) {
-        if ((port->ci & (1 << slot)) == 0) break;
-        if (port->is & HBA_PxIS_TFES) return -1;
+    uint32_t blocks = (nranges + AHCI_TRIM_RANGES_PER_BLOCK - 1) / AHCI_TRIM_RANGES_PER_BLOCK;
+    for (int i = 0; i < nranges; i++) {
+        if (ranges[i].count == 0 || ranges[i].count > AHCI_TRIM_RANGE_MAX) return -1;
+        if (ranges[i].lba + ranges[i].count > ap->block.caps.sector_count) return -1;
     }
+    if (ahci_drain(ap) != 0) return -1;
+    int slot = find_cmdslot(ap);
+    if (slot == -1) return -1;
 
-    if (port->is & HBA_PxIS_TFES) return -1;
+    // The buffer is shared by all ports; the drain above means no other
+    // TRIM can be using it on this port, and commands run one at a time.
+    memset(ahci_trim_ranges, 0, blocks * 512);
+    for (int i = 0; i < nranges; i++) {
+        ahci_trim_ranges[i] = ranges[i].lba | ((uint64_t)ranges[i].count << 48);
+    }
+
+    BlockSegment seg = { ahci_trim_ranges, blocks * 512 };
+    FIS_REG_H2D *cmdfis = ahci_prepare(ap, slot, 0, &seg, 1, 1);
+    cmdfis->command = ATA_CMD_DATA_SET_MANAGEMENT;
+    cmdfis->featurel = ATA_DSM_TRIM;
+    cmdfis->countl = (uint8_t)blocks;
+    cmdfis->counth = (uint8_t)(blocks >> 8);
+
+    volatile int status = AHCI_PENDING;
+    ahci_start(ap, slot, 0, ahci_sync_done, (void*)&status);
+    if (ahci_wait(ap, &status) != 0) {
+        print_string("AHCI: DATA SET MANAGEMENT failed.\n");
+        return -1;
+    }
     return 0;
-}
\ No newline at end of file
+}
@@ -2,16 +2,58 @@
 #define AHCI_H
 
 #include <stdint.h>
+#include "block.h"
 
 // --- AHCI Structure Definitions ---
 #define ATA_CMD_READ_DMA_EXT  0x25
 #define ATA_CMD_WRITE_DMA_EXT 0x35
+#define ATA_CMD_WRITE_DMA_FUA_EXT 0x3D
+#define ATA_CMD_READ_FPDMA_QUEUED  0x60
+#define ATA_CMD_WRITE_FPDMA_QUEUED 0x61
+#define ATA_CMD_FLUSH_CACHE_EXT 0xEA
+#define ATA_CMD_IDENTIFY      0xEC
+#define ATA_CMD_SET_FEATURES  0xEF
+#define ATA_FEATURE_ENABLE_WCACHE 0x02
+#define ATA_CMD_DATA_SET_MANAGEMENT 0x06
+#define ATA_DSM_TRIM          0x01
+
+// TRIM payload: 512-byte blocks of 64 entries (48-bit LBA, 16-bit length).
+#define AHCI_TRIM_RANGES_PER_BLOCK 64
+#define AHCI_TRIM_MAX_BLOCKS  8
+#define AHCI_TRIM_RANGE_MAX   0xFFFF
 #define ATA_DEV_BUSY 0x80
 #define ATA_DEV_DRQ 0x08
 #define HBA_PxCMD_ST  0x0001
 #define HBA_PxCMD_FRE 0x0010
 #define HBA_PxCMD_CR  0x8000
 #define HBA_PxIS_TFES (1 << 30) // Task File Error Status
+#define HBA_PxIS_SDBS (1 << 3)  // Set Device Bits FIS received
+#define HBA_PxIS_HBDS (1 << 28) // Host Bus Data Error
+#define HBA_PxIS_HBFS (1 << 29) // Host Bus Fatal Error
+#define HBA_PxIS_IFS  (1 << 27) // Interface Fatal Error
+#define HBA_CAP_SNCQ  (1 << 30) // HBA supports Native Command Queuing
+#define HBA_CAP_CCCS  (1 << 7)  // HBA supports Command Completion Coalescing
+#define HBA_GHC_AE    (1u << 31) // AHCI Enable
+#define HBA_GHC_IE    (1 << 1)  // Interrupt Enable
+#define HBA_CCC_EN    (1 << 0)
+
+// PxIE bits share PxIS positions. Completion events: D2H Register FIS,
+// PIO Setup FIS, DMA Setup FIS and Set Device Bits FIS.
+#define HBA_PxIE_COMPLETION 0x0000000F
+#define HBA_PxIE_ERRORS     (HBA_PxIS_TFES | HBA_PxIS_HBFS | HBA_PxIS_HBDS | HBA_PxIS_IFS)
+#define HBA_CAP_NCS(cap) ((((cap) >> 8) & 0x1F) + 1) // Command slots per port
+#define SATA_SIG_ATA  0x00000101 // Plain SATA disk (not ATAPI, PM or SEMB)
+
+// Ports we drive at once. Each gets its own 36 KB of command list,
+// received-FIS area and command tables.
+#define AHCI_MAX_PORTS 8
+
+// A PRDT entry carries at most 4 MB. Commands are capped at that size too,
+// so any segment of a command fits in one entry.
+#define AHCI_PRDT_MAX_BYTES (4 * 1024 * 1024)
+#define AHCI_MAX_SECTORS    (AHCI_PRDT_MAX_BYTES / 512)
+// Scatter-gather entries per command; makes each command table 1 KB.
+#define AHCI_PRDT_ENTRIES   56
 
 typedef volatile struct {
     uint32_t clb;       // Command List Base Address, 1K-byte aligned
@@ -91,7 +133,7 @@ typedef struct {
     uint8_t  cfis[64];    // Command FIS
     uint8_t  acmd[16];    // ATAPI Command
     uint8_t  rsv[48];     // Reserved
-    HBA_PRDT_ENTRY prdt_entry[1]; // Physical region descriptor table
+    HBA_PRDT_ENTRY prdt_entry[AHCI_PRDT_ENTRIES]; // Physical region descriptor table
 } HBA_CMD_TBL;
 
 // ** THIS STRUCT IS NOW FULLY CORRECTED **
@@ -112,11 +154,89 @@ typedef struct {
     uint32_t rsv1[4];     // Reserved
 } HBA_CMD_HEADER;
 
+// Flags for ahci_submit
+#define AHCI_SUBMIT_WRITE 0x01
+#define AHCI_SUBMIT_FUA   0x02 // Forced Unit Access; needs BLOCK_CAP_FUA
+
+// Called from ahci_poll once a submitted command has finished.
+// `status` is 0 on success, -1 if the command failed.
+typedef void (*ahci_callback_t)(void* ctx, int status);
+
+// One active port with a disk behind it. Ports share nothing but the HBA,
+// so commands on different ports never wait for each other.
+typedef struct {
+    HBA_PORT* port;
+    uint8_t   index;     // Port number on the HBA (0-31)
+    uint32_t  slot_mask; // Command slots usable on this port
+    uint32_t  busy;      // Slots issued and not yet reaped
+    uint32_t  queued;    // Subset of `busy` issued as NCQ commands
+    ahci_callback_t callbacks[32];
+    void*     contexts[32];
+    BlockDevice block;
+} AhciPort;
+
 // --- Public Function Prototypes ---
 extern int ahci_drive_present; // Flag if a usable port was found
 
 void ahci_init();
-int ahci_read(HBA_PORT *port, uint64_t lba, uint32_t count, void *buf);
-int ahci_write(HBA_PORT *port, uint64_t lba, uint32_t count, const void *buf);
+
+// Ports with a disk, in port-number order; filled in by ahci_init.
+int ahci_port_count();
+AhciPort* ahci_get_port(int index);
+
+// Issues a read or write in a free command slot and returns immediately.
+// NCQ disks get READ/WRITE FPDMA QUEUED, so up to caps.queue_depth
+// commands run at once; other disks get READ/WRITE DMA EXT, which the HBA
+// executes in slot order. Returns 0, 1 if every slot is busy or NCQ is
+// held off by a non-queued command (call ahci_poll and retry), or -1 if
+// the request is invalid.
+int ahci_submit(AhciPort *ap, uint64_t lba, uint32_t count, void *buf, int flags,
+                ahci_callback_t callback, void *ctx);
+
+// Scatter-gather form of ahci_submit: 1..AHCI_PRDT_ENTRIES word-aligned
+// segments of even length, AHCI_MAX_SECTORS in total, as one command.
+// Misaligned buffers are rejected, never handed to the HBA.
+int ahci_submitv(AhciPort *ap, uint64_t lba, const BlockSegment *segs, int nsegs, int flags,
+                 ahci_callback_t callback, void *ctx);
+
+// Reaps finished commands and runs their callbacks. Returns how many
+// completed. A task file error fails every outstanding command on the port.
+int ahci_poll(AhciPort *ap);
+
+// Waits for progress on `ap`: in interrupt mode sleeps until the next
+// interrupt, otherwise polls the port once. Call with interrupts disabled,
+// right after checking the wait condition; returns with them enabled.
+void ahci_wait_event(AhciPort *ap);
+
+// Restarts the port and fails every outstanding command (callbacks run
+// with status -1). For callers giving up on a timeout.
+void ahci_abort(AhciPort *ap);
+
+// Command Completion Coalescing: one interrupt per `commands` completions
+// or after `timeout_ms`, whichever comes first. `commands` = 0 turns it
+// off. Returns -1 if the HBA lacks CCC or runs without interrupts.
+int ahci_set_coalescing(uint8_t commands, uint16_t timeout_ms);
+// Returns 1 and the current settings if coalescing is on, else 0.
+int ahci_get_coalescing(uint8_t *commands, uint16_t *timeout_ms);
+
+// Interrupts taken so far, and a short description of how they arrive
+// ("MSI", "INTx", or "polling").
+uint32_t ahci_interrupt_count();
+const char* ahci_interrupt_mode();
+
+// Synchronous wrappers: submit; then sleep (IRQ) or poll until done.
+// `count` must be 1..AHCI_MAX_SECTORS; larger requests are rejected, as
+// are buffers that aren't word-aligned (block_dev_read bounces those).
+int ahci_read(AhciPort *ap, uint64_t lba, uint32_t count, void *buf);
+int ahci_write(AhciPort *ap, uint64_t lba, uint32_t count, const void *buf);
+int ahci_readv(AhciPort *ap, uint64_t lba, const BlockSegment *segs, int nsegs);
+int ahci_writev(AhciPort *ap, uint64_t lba, const BlockSegment *segs, int nsegs);
+// FUA write; only valid on ports whose caps carry BLOCK_CAP_FUA.
+int ahci_write_fua(AhciPort *ap, uint64_t lba, uint32_t count, const void *buf);
+// FLUSH CACHE EXT: returns once earlier writes have left the drive cache.
+int ahci_flush(AhciPort *ap);
+// DATA SET MANAGEMENT / TRIM of up to caps.max_discard_ranges ranges, each
+// at most AHCI_TRIM_RANGE_MAX sectors, in one command.
+int ahci_trim(AhciPort *ap, const BlockRange *ranges, int nranges);
 
 #endif // AHCI_H
\ No newline at end of file
@@ -1,32 +1,89 @@
-
 #include "ata.h"
 #include "ports.h"
+#include "idt.h"
+#include "timer.h"
+#include "pci.h"
+#include "extrainclude.h"
 
 // You must declare your print function as extern so this file can use it.
 extern void print_string(const char* str);
 extern void print_char(char c);
 extern void new_line();
+extern void print_int(int n);
+extern void print_hex(uint32_t val);
 // This new function is needed from kernel.c for the y/n prompt
 extern char get_single_keypress();
 
 // Global state variable, 1 if drive is present, 0 otherwise.
 int ata_drive_present = 0;
+static int ata_pio_mode = ATA_PIO_MULTIPLE;
 
 // Timeout for ATA commands, a simple busy-wait counter.
 #define ATA_TIMEOUT 10000000
+// Timeout for interrupt-driven waits, in milliseconds of the PIT tick.
+#define ATA_IRQ_TIMEOUT_MS 5000
+// A cache flush may have to write out the whole cache first.
+#define ATA_FLUSH_TIMEOUT_MS 30000
+
+// --- Bus-master DMA ---
+#define PCI_CLASS_MASS_STORAGE 0x01
+#define PCI_SUBCLASS_IDE       0x01
+#define PCI_PROGIF_BUS_MASTER  0x80
+
+// 65536 sectors (32 MB) in 64 KB pieces, plus one for a misaligned start.
+#define ATA_PRD_MAX 1024
+#define ATA_PRD_EOT 0x8000
+
+typedef struct {
+    uint32_t address;    // Physical buffer address
+    uint16_t byte_count; // 0 means 64 KB
+    uint16_t flags;      // Bit 15: end of table
+} __attribute__((packed)) AtaPrd;
+
+// One table per channel, each 8 KB aligned and 8 KB long, so a table never
+// crosses the 64 KB boundary the controller forbids.
+__attribute__((aligned(8192))) static AtaPrd ata_prdt[2][ATA_PRD_MAX];
+__attribute__((aligned(4096))) static uint64_t ata_trim_ranges[ATA_TRIM_MAX_BLOCKS * ATA_TRIM_RANGES_PER_BLOCK];
+int ata_dma_available = 0;
+static int ata_dma_enabled = 0;
+
+// --- Channels ---
+// Master and slave share a channel's registers, IRQ line and PRD table;
+// the two channels are fully independent of each other.
+typedef struct {
+    uint16_t io_base;
+    uint16_t ctrl_base;
+    uint8_t irq;
+    volatile int irq_pending;     // Set by the IRQ handler
+    volatile uint8_t irq_status;  // Status register as read by the handler
+} AtaChannel;
 
-static void ata_io_wait() { // Wait 400ns by reading the status port 4 times
-    inb(ATA_PORT_STATUS);
-    inb(ATA_PORT_STATUS);
-    inb(ATA_PORT_STATUS);
-    inb(ATA_PORT_STATUS);
+static AtaChannel ata_channels[2] = {
+    { ATA_PORT_DATA, ATA_PORT_CONTROL, IRQ_ATA_PRIMARY, 0, 0 },
+    { ATA_SECONDARY_PORT_DATA, ATA_SECONDARY_PORT_CONTROL, IRQ_ATA_SECONDARY, 0, 0 },
+};
+static int ata_completion_mode = ATA_COMPLETION_POLL;
+
+static AtaDevice ata_devices[4];
+static int ata_device_count = 0;
+
+static const char* const ata_device_names[4] = { "hda", "hdb", "hdc", "hdd" };
+static const char* const ata_position_names[4] = {
+    "Primary Master", "Primary Slave", "Secondary Master", "Secondary Slave"
+};
+
+static void ata_io_wait(AtaChannel* ch) { // Wait 400ns by reading the status port 4 times
+    inb(ch->io_base + ATA_REG_STATUS);
+    inb(ch->io_base + ATA_REG_STATUS);
+    inb(ch->io_base + ATA_REG_STATUS);
+    inb(ch->io_base + ATA_REG_STATUS);
 }
 
 // Polls the status port until the busy bit is cleared.
 // Returns 0 on success, or an error code on failure/timeout.
-static int ata_wait_not_busy() {
+static int ata_wait_not_busy(AtaChannel* ch) {
     for(int i = 0; i < ATA_TIMEOUT; i++) {
-        if (!(inb(ATA_PORT_STATUS) & ATA_STATUS_BUSY)) {
+        if (!(inb(ch->io_base + ATA_REG_STATUS) & ATA_STATUS_BUSY)) {
             return 0; // Success, not busy
         }
     }
@@ -36,9 +93,9 @@ static int ata_wait_not_busy() {
 
 // Polls until the drive is ready for data transfer (DRQ is set).
 // Returns 0 on success, or an error code on failure/timeout.
-static int ata_wait_drq() {
+static int ata_wait_drq(AtaChannel* ch) {
     for(int i = 0; i < ATA_TIMEOUT; i++) {
-        uint8_t status = inb(ATA_PORT_STATUS);
+        uint8_t status = inb(ch->io_base + ATA_REG_STATUS);
         if (status & ATA_STATUS_ERR) {
             print_string("ATA: ERR set!\n");
             return ATA_STATUS_ERR;
@@ -51,51 +108,311 @@ static int ata_wait_drq() {
     return ATA_STATUS_TIMEOUT;
 }
 
-// This function is completely rewritten
-void ata_init() {
-    print_string("Scanning for ATA devices...\n");
-    ata_drive_present = 0;
+// One status check per DRQ block: wait for BSY to drop, then read the
+// status register exactly once and require DRQ without ERR.
+static int ata_wait_block(AtaChannel* ch) {
+    int ret;
+    if ((ret = ata_wait_not_busy(ch)) != 0) return ret;
+    uint8_t status = inb(ch->io_base + ATA_REG_STATUS);
+    if (status & ATA_STATUS_ERR) {
+        print_string("ATA: ERR set!\n");
+        return ATA_STATUS_ERR;
+    }
+    if (!(status & ATA_STATUS_DRQ)) {
+        print_string("ATA: DRQ not set!\n");
+        return ATA_STATUS_TIMEOUT;
+    }
+    return 0;
+}
+
+// Fills the capability descriptor from IDENTIFY data.
+// Word 83 bit 10 advertises the 48-bit feature set; its capacity is in
+// words 100-103, the LBA28 capacity in words 60-61. Words 63 and 88 carry
+// the Multiword and Ultra DMA modes, word 85 bit 5 the write cache state.
+static void ata_setup_geometry(AtaDevice* dev, const uint16_t* identify_data) {
+    BlockCaps* caps = &dev->block.caps;
+    dev->lba48 = (identify_data[83] & (1 << 10)) != 0;
+    if (dev->lba48) {
+        caps->sector_count = (uint64_t)identify_data[100] |
+                             ((uint64_t)identify_data[101] << 16) |
+                             ((uint64_t)identify_data[102] << 32) |
+                             ((uint64_t)identify_data[103] << 48);
+        caps->max_sectors = ATA_MAX_SECTORS_LBA48;
+        caps->flags |= BLOCK_CAP_LBA48;
+    } else {
+        caps->sector_count = (uint32_t)identify_data[60] | ((uint32_t)identify_data[61] << 16);
+        caps->max_sectors = ATA_MAX_SECTORS_LBA28;
+    }
+    caps->mwdma_modes = identify_data[63] & 0x07;
+    if (identify_data[53] & (1 << 2)) caps->udma_modes = identify_data[88] & 0x7F;
+    caps->queue_depth = 1;
+    // Each segment costs at most one PRD per 64 KB plus one, so a full
+    // LBA48 command with BLOCK_MAX_SEGMENTS segments still fits the table.
+    caps->max_segments = BLOCK_MAX_SEGMENTS;
+
+    print_string("ATA: ");
+    print_int((uint32_t)(caps->sector_count >> 11));
+    print_string(dev->lba48 ? " MB, LBA48.\n" : " MB, LBA28.\n");
+}
+
+// Programs the drive's DRQ block size for READ/WRITE MULTIPLE.
+// Word 47 bits 7:0 of IDENTIFY give the largest block the drive accepts.
+static void ata_setup_multiple(AtaDevice* dev, const uint16_t* identify_data) {
+    AtaChannel* ch = &ata_channels[dev->channel];
+    uint8_t max_block = identify_data[47] & 0xFF;
+    if (max_block == 0) return;
+
+    outb(ch->io_base + ATA_REG_DRIVE_HEAD, 0xA0 | (dev->slave << 4));
+    ata_io_wait(ch);
+    outb(ch->io_base + ATA_REG_SECTOR_COUNT, max_block);
+    outb(ch->io_base + ATA_REG_COMMAND, ATA_CMD_SET_MULTIPLE);
+    ata_io_wait(ch);
+    if (ata_wait_not_busy(ch) != 0) return;
+    if (inb(ch->io_base + ATA_REG_STATUS) & ATA_STATUS_ERR) {
+        print_string("ATA: SET MULTIPLE MODE rejected.\n");
+        return;
+    }
+
+    dev->block.caps.multiple_sectors = max_block;
+    if (max_block > 1) dev->block.caps.flags |= BLOCK_CAP_MULTIPLE;
+    print_string("ATA: READ/WRITE MULTIPLE enabled, ");
+    print_int(max_block);
+    print_string(" sectors per block.\n");
+}
+
+// Turns the drive's volatile write cache on (IDENTIFY word 82 bit 5) so
+// writes complete at cache speed; ordering is then up to FLUSH CACHE and
+// FUA writes. Word 84 bit 6 advertises the FUA EXT commands.
+static void ata_setup_write_cache(AtaDevice* dev, const uint16_t* identify_data) {
+    AtaChannel* ch = &ata_channels[dev->channel];
+    if (dev->lba48 && (identify_data[84] & (1 << 6))) {
+        dev->fua = 1;
+        dev->block.caps.flags |= BLOCK_CAP_FUA;
+    }
+    if (!(identify_data[82] & (1 << 5))) return;
+
+    outb(ch->io_base + ATA_REG_DRIVE_HEAD, 0xA0 | (dev->slave << 4));
+    ata_io_wait(ch);
+    outb(ch->io_base + ATA_REG_FEATURES, ATA_FEATURE_ENABLE_WCACHE);
+    outb(ch->io_base + ATA_REG_COMMAND, ATA_CMD_SET_FEATURES);
+    ata_io_wait(ch);
+    if (ata_wait_not_busy(ch) != 0) return;
+    if (inb(ch->io_base + ATA_REG_STATUS) & ATA_STATUS_ERR) {
+        print_string("ATA: Drive refused to enable its write cache.\n");
+        // Word 85 bit 5: the cache may already be on regardless.
+        if (identify_data[85] & (1 << 5)) dev->block.caps.flags |= BLOCK_CAP_WRITE_CACHE;
+        return;
+    }
+    dev->block.caps.flags |= BLOCK_CAP_WRITE_CACHE;
+}
+
+// IDENTIFY word 169 bit 0 advertises TRIM, word 105 how many 512-byte
+// blocks of ranges one command may carry (0 means one). DATA SET
+// MANAGEMENT is a DMA command with an LBA48 task file.
+static void ata_setup_trim(AtaDevice* dev, const uint16_t* identify_data) {
+    if (!(identify_data[169] & 0x01) || !dev->lba48 || !dev->dma_available) return;
+    uint32_t blocks = identify_data[105] ? identify_data[105] : 1;
+    if (blocks > ATA_TRIM_MAX_BLOCKS) blocks = ATA_TRIM_MAX_BLOCKS;
+    dev->block.caps.flags |= BLOCK_CAP_DISCARD;
+    dev->block.caps.max_discard_ranges = blocks * ATA_TRIM_RANGES_PER_BLOCK;
+    dev->block.caps.max_discard_sectors = ATA_TRIM_RANGE_MAX;
+}
 
-    // --- Select Master Drive ---
-    outb(ATA_PORT_DRIVE_HEAD, 0xA0);
-    ata_io_wait();
+void ata_set_pio_mode(int mode) {
+    ata_pio_mode = (mode == ATA_PIO_MULTIPLE) ? ATA_PIO_MULTIPLE : ATA_PIO_SINGLE;
+}
+
+int ata_get_pio_mode() {
+    return ata_pio_mode;
+}
+
+// Looks up the IDE controller's bus-master BAR4 and enables DMA if both it
+// and the drive (IDENTIFY word 49 bit 8) support it.
+static void ata_setup_dma(AtaDevice* dev, const uint16_t* identify_data) {
+    if (!(identify_data[49] & 0x0100)) return;
+
+    PciAddress ide;
+    if (!pci_find_class(PCI_CLASS_MASS_STORAGE, PCI_SUBCLASS_IDE, &ide)) return;
+    uint32_t class_info = pci_read_dword(ide.bus, ide.device, ide.function, PCI_CLASS_INFO);
+    if (!((class_info >> 8) & PCI_PROGIF_BUS_MASTER)) return;
+
+    uint32_t bar4 = pci_read_dword(ide.bus, ide.device, ide.function, PCI_BAR4);
+    if (!(bar4 & 1)) return; // Bus-master registers always live in I/O space
+    dev->bm_base = (bar4 & 0xFFFC) + dev->channel * 8;
+    pci_enable(&ide, PCI_COMMAND_IO | PCI_COMMAND_BUS_MASTER);
+
+    dev->dma_available = 1;
+    dev->block.caps.flags |= BLOCK_CAP_DMA;
+    ata_dma_available = 1;
+    ata_dma_enabled = 1;
+    print_string("ATA: Bus-master DMA enabled at I/O ");
+    print_hex(dev->bm_base);
+    new_line();
+}
+
+void ata_set_dma_enabled(int enabled) {
+    ata_dma_enabled = enabled && ata_dma_available;
+}
+
+int ata_get_dma_enabled() {
+    return ata_dma_enabled;
+}
+
+static void ata_irq_handler(int irq) {
+    AtaChannel* ch = &ata_channels[irq == IRQ_ATA_PRIMARY ? 0 : 1];
+    // Reading the status register acknowledges the drive's INTRQ.
+    ch->irq_status = inb(ch->io_base + ATA_REG_STATUS);
+    ch->irq_pending = 1;
+}
+
+// Sleeps until the channel's IRQ fires. The flag is tested with interrupts
+// off and `sti; hlt` re-enables them atomically, so an IRQ landing between
+// the test and the hlt still wakes us.
+static int ata_wait_irq(AtaChannel* ch, uint32_t timeout_ms) {
+    uint32_t start = timer_ms();
+    for (;;) {
+        __asm__ volatile("cli");
+        if (ch->irq_pending) break;
+        if (timer_ms() - start > timeout_ms) {
+            __asm__ volatile("sti");
+            print_string("ATA: IRQ timeout!\n");
+            return ATA_STATUS_TIMEOUT;
+        }
+        __asm__ volatile("sti; hlt");
+    }
+    ch->irq_pending = 0;
+    __asm__ volatile("sti");
+    if (ch->irq_status & ATA_STATUS_ERR) {
+        print_string("ATA: ERR set!\n");
+        return ATA_STATUS_ERR;
+    }
+    return 0;
+}
+
+void ata_set_completion_mode(int mode) {
+    ata_completion_mode = (mode == ATA_COMPLETION_IRQ) ? ATA_COMPLETION_IRQ : ATA_COMPLETION_POLL;
+    for (int c = 0; c < 2; c++) {
+        outb(ata_channels[c].ctrl_base, ata_completion_mode == ATA_COMPLETION_IRQ ? 0 : ATA_CONTROL_NIEN);
+    }
+}
+
+int ata_get_completion_mode() {
+    return ata_completion_mode;
+}
+
+// Waits for the next DRQ block. In IRQ mode the drive interrupts once per
+// block (except the first block of a write), so the CPU sleeps in hlt and
+// only checks the status port once the data is ready.
+static int ata_wait_data(AtaChannel* ch, int irq_expected) {
+    int ret;
+    if (ata_completion_mode == ATA_COMPLETION_IRQ && irq_expected) {
+        if ((ret = ata_wait_irq(ch, ATA_IRQ_TIMEOUT_MS)) != 0) return ret;
+    }
+    return ata_wait_block(ch);
+}
+
+// Waits for the final interrupt of a write or non-data command.
+static int ata_wait_done(AtaChannel* ch, uint32_t timeout_ms) {
+    int ret;
+    if (ata_completion_mode == ATA_COMPLETION_IRQ) {
+        if ((ret = ata_wait_irq(ch, timeout_ms)) != 0) return ret;
+    }
+    if ((ret = ata_wait_not_busy(ch)) != 0) return ret;
+    if (inb(ch->io_base + ATA_REG_STATUS) & ATA_STATUS_ERR) return ATA_STATUS_ERR;
+    return 0;
+}
+
+static int ata_block_read(BlockDevice* dev, uint64_t lba, uint32_t count, void* buf) {
+    return ata_read_sectors((AtaDevice*)dev->driver_data, lba, count, buf);
+}
+
+static int ata_block_write(BlockDevice* dev, uint64_t lba, uint32_t count, const void* buf) {
+    return ata_write_sectors((AtaDevice*)dev->driver_data, lba, count, buf);
+}
+
+static int ata_block_write_fua(BlockDevice* dev, uint64_t lba, uint32_t count, const void* buf) {
+    return ata_write_sectors_fua((AtaDevice*)dev->driver_data, lba, count, buf);
+}
+
+static int ata_block_flush(BlockDevice* dev) {
+    return ata_flush_cache((AtaDevice*)dev->driver_data);
+}
+
+static int ata_block_readv(BlockDevice* dev, uint64_t lba, const BlockSegment* segs, int nsegs) {
+    return ata_readv((AtaDevice*)dev->driver_data, lba, segs, nsegs);
+}
+
+static int ata_block_writev(BlockDevice* dev, uint64_t lba, const BlockSegment* segs, int nsegs) {
+    return ata_writev((AtaDevice*)dev->driver_data, lba, segs, nsegs);
+}
+
+static int ata_block_discard(BlockDevice* dev, const BlockRange* ranges, int nranges) {
+    return ata_trim((AtaDevice*)dev->driver_data, ranges, nranges);
+}
+
+static const BlockDeviceOps ata_block_ops = {
+    ata_block_read,
+    ata_block_write,
+    ata_block_write_fua,
+    ata_block_flush,
+    ata_block_readv,
+    ata_block_writev,
+    0,
+    0,
+    0,
+    0,
+    0,
+    ata_block_discard,
+};
+
+// Identifies one drive position and, if it holds an ATA hard disk the user
+// wants to use, registers it with the block layer.
+static void ata_probe(uint8_t channel, uint8_t slave) {
+    AtaChannel* ch = &ata_channels[channel];
+    int position = channel * 2 + slave;
+
+    // --- Select Drive ---
+    outb(ch->io_base + ATA_REG_DRIVE_HEAD, 0xA0 | (slave << 4));
+    ata_io_wait(ch);
 
     // Check if any device is present on the bus
-    if (inb(ATA_PORT_STATUS) == 0xFF) {
-        print_string("No device on Primary Master.\n");
+    if (inb(ch->io_base + ATA_REG_STATUS) == 0xFF) {
+        print_string("No device on ");
+        print_string(ata_position_names[position]);
+        print_string(".\n");
         return;
     }
 
     // --- Send IDENTIFY Command ---
-    outb(ATA_PORT_SECTOR_COUNT, 0);
-    outb(ATA_PORT_LBA_LOW, 0);
-    outb(ATA_PORT_LBA_MID, 0);
-    outb(ATA_PORT_LBA_HIGH, 0);
-    outb(ATA_PORT_COMMAND, ATA_CMD_IDENTIFY);
-    ata_io_wait();
-    
+    outb(ch->io_base + ATA_REG_SECTOR_COUNT, 0);
+    outb(ch->io_base + ATA_REG_LBA_LOW, 0);
+    outb(ch->io_base + ATA_REG_LBA_MID, 0);
+    outb(ch->io_base + ATA_REG_LBA_HIGH, 0);
+    outb(ch->io_base + ATA_REG_COMMAND, ATA_CMD_IDENTIFY);
+    ata_io_wait(ch);
+
     // Check status again
-    if (inb(ATA_PORT_STATUS) == 0x00) {
-        print_string("No device responded to IDENTIFY.\n");
+    if (inb(ch->io_base + ATA_REG_STATUS) == 0x00) {
+        print_string("No device responded to IDENTIFY on ");
+        print_string(ata_position_names[position]);
+        print_string(".\n");
         return;
     }
 
-    if (ata_wait_not_busy() != 0) {
+    if (ata_wait_not_busy(ch) != 0) {
         print_string("Device hung after IDENTIFY command.\n");
         return;
     }
 
-    if (!(inb(ATA_PORT_STATUS) & ATA_STATUS_DRQ)) {
+    if (!(inb(ch->io_base + ATA_REG_STATUS) & ATA_STATUS_DRQ)) {
         print_string("Device did not set DRQ after IDENTIFY. Likely not ATA.\n");
         return;
     }
 
     // --- Read IDENTIFY data ---
     uint16_t identify_data[256];
-    for (int i = 0; i < 256; i++) {
-        identify_data[i] = inw(ATA_PORT_DATA);
-    }
-    
+    insw(ch->io_base + ATA_REG_DATA, identify_data, 256);
+
     // --- Extract and print model name ---
     char model[41];
     for (int i = 0; i < 20; i++) {
@@ -103,90 +420,433 @@ void ata_init() {
         model[i * 2 + 1] = identify_data[27 + i] & 0xFF;
     }
     model[40] = '\0';
-    
+
     // Trim trailing spaces from model name for cleaner printing
     for (int i = 39; i >= 0; i--) {
         if (model[i] != ' ') break;
         model[i] = '\0';
     }
 
-    print_string("Device Detected: ");
+    print_string("Device Detected (");
+    print_string(ata_position_names[position]);
+    print_string("): ");
     print_string(model);
     print_string("\nScan this drive? (y/n): ");
 
     char response = get_single_keypress();
     print_char(response);
     new_line();
-    
-    if (response == 'y' || response == 'Y') {
-        // Check if it's an ATA device (not ATAPI) from the IDENTIFY data
-        // Bit 15 of word 0 is 0 for ATA, 1 for ATAPI
-        if (identify_data[0] & 0x8000) {
-            print_string("This is an ATAPI device (like a CD-ROM) and is not supported for file storage.\n");
-        } else {
-            print_string("ATA Hard Disk selected. Filesystem will be initialized.\n");
-            ata_drive_present = 1;
+
+    if (response != 'y' && response != 'Y') {
+        print_string("Skipping device.\n");
+        return;
+    }
+
+    // Check if it's an ATA device (not ATAPI) from the IDENTIFY data
+    // Bit 15 of word 0 is 0 for ATA, 1 for ATAPI
+    if (identify_data[0] & 0x8000) {
+        print_string("This is an ATAPI device (like a CD-ROM) and is not supported for file storage.\n");
+        return;
+    }
+
+    AtaDevice* dev = &ata_devices[ata_device_count];
+    dev->io_base = ch->io_base;
+    dev->ctrl_base = ch->ctrl_base;
+    dev->channel = channel;
+    dev->slave = slave;
+    dev->block.name[0] = ata_device_names[position][0];
+    dev->block.name[1] = ata_device_names[position][1];
+    dev->block.name[2] = ata_device_names[position][2];
+    dev->block.name[3] = '\0';
+    dev->block.type = BLOCK_TYPE_PATA;
+    dev->block.ops = &ata_block_ops;
+    dev->block.driver_data = dev;
+
+    print_string("ATA Hard Disk selected as ");
+    print_string(dev->block.name);
+    print_string(".\n");
+    ata_setup_geometry(dev, identify_data);
+    ata_setup_multiple(dev, identify_data);
+    ata_setup_dma(dev, identify_data);
+    ata_setup_write_cache(dev, identify_data);
+    ata_setup_trim(dev, identify_data);
+
+    if (block_register(&dev->block) < 0) return;
+    ata_device_count++;
+    ata_drive_present = 1;
+}
+
+void ata_init() {
+    print_string("Scanning for ATA devices...\n");
+    ata_drive_present = 0;
+
+    // Probe with the drives' interrupts masked; IRQ mode is enabled below
+    // once a drive has been selected.
+    outb(ATA_PORT_CONTROL, ATA_CONTROL_NIEN);
+    outb(ATA_SECONDARY_PORT_CONTROL, ATA_CONTROL_NIEN);
+
+    for (uint8_t channel = 0; channel < 2; channel++) {
+        for (uint8_t slave = 0; slave < 2; slave++) {
+            ata_probe(channel, slave);
         }
+    }
+
+    if (ata_drive_present) {
+        irq_install_handler(IRQ_ATA_PRIMARY, ata_irq_handler);
+        irq_install_handler(IRQ_ATA_SECONDARY, ata_irq_handler);
+        ata_set_completion_mode(ATA_COMPLETION_IRQ);
+    }
+}
+
+// LBA28 commands are cheaper to issue, so LBA48 is only used when the
+// request doesn't fit: more than 256 sectors, or past the 28-bit limit.
+static int ata_needs_lba48(AtaDevice* dev, uint64_t lba, uint32_t count) {
+    return dev->lba48 && (count > ATA_MAX_SECTORS_LBA28 || lba + count > ATA_LBA28_LIMIT);
+}
+
+// Programs the task file and issues the LBA28 or LBA48 form of a command.
+// A count of 256 (LBA28) or 65536 (LBA48) is written as 0 on the wire.
+// Commands with no LBA28 form (the FUA writes) pass command28 = 0.
+static void ata_issue(AtaDevice* dev, uint64_t lba, uint32_t count, uint8_t command28, uint8_t command48) {
+    AtaChannel* ch = &ata_channels[dev->channel];
+    uint16_t io = ch->io_base;
+    if (command28 == 0 || ata_needs_lba48(dev, lba, count)) {
+        outb(io + ATA_REG_DRIVE_HEAD, 0x40 | (dev->slave << 4));
+        ata_io_wait(ch);
+        // High-order bytes first; each register is a two-deep FIFO.
+        outb(io + ATA_REG_SECTOR_COUNT, (uint8_t)(count >> 8));
+        outb(io + ATA_REG_LBA_LOW, (uint8_t)(lba >> 24));
+        outb(io + ATA_REG_LBA_MID, (uint8_t)(lba >> 32));
+        outb(io + ATA_REG_LBA_HIGH, (uint8_t)(lba >> 40));
+        outb(io + ATA_REG_SECTOR_COUNT, (uint8_t)count);
+        outb(io + ATA_REG_LBA_LOW, (uint8_t)lba);
+        outb(io + ATA_REG_LBA_MID, (uint8_t)(lba >> 8));
+        outb(io + ATA_REG_LBA_HIGH, (uint8_t)(lba >> 16));
+        ch->irq_pending = 0;
+        outb(io + ATA_REG_COMMAND, command48);
     } else {
-        print_string("Skipping device.\n");
+        // Select the drive (0xE0 for LBA mode) and send high 4 bits of LBA
+        outb(io + ATA_REG_DRIVE_HEAD, 0xE0 | (dev->slave << 4) | ((lba >> 24) & 0x0F));
+        ata_io_wait(ch);
+        outb(io + ATA_REG_SECTOR_COUNT, (uint8_t)count);
+        outb(io + ATA_REG_LBA_LOW, (uint8_t)lba);
+        outb(io + ATA_REG_LBA_MID, (uint8_t)(lba >> 8));
+        outb(io + ATA_REG_LBA_HIGH, (uint8_t)(lba >> 16));
+        ch->irq_pending = 0;
+        outb(io + ATA_REG_COMMAND, command28);
+    }
+    ata_io_wait(ch);
+}
+
+// READ MULTIPLE: the drive raises DRQ once per block of
+// `multiple_sectors` sectors, and each block is drained with one
+// `rep insw`.
+static int ata_read_multiple(AtaDevice* dev, uint64_t lba, uint32_t count, void* buffer) {
+    AtaChannel* ch = &ata_channels[dev->channel];
+    uint32_t per_block = dev->block.caps.multiple_sectors;
+    ata_issue(dev, lba, count, ATA_CMD_READ_MULTIPLE, ATA_CMD_READ_MULTIPLE_EXT);
+
+    uint16_t* target = (uint16_t*)buffer;
+    uint32_t remaining = count;
+    int ret;
+    while (remaining > 0) {
+        uint32_t block = remaining < per_block ? remaining : per_block;
+        if ((ret = ata_wait_data(ch, 1)) != 0) return ret;
+        insw(ch->io_base + ATA_REG_DATA, target, block * 256);
+        target += block * 256;
+        remaining -= block;
+    }
+    return 0;
+}
+
+static int ata_write_multiple(AtaDevice* dev, uint64_t lba, uint32_t count, const void* buffer, int fua) {
+    AtaChannel* ch = &ata_channels[dev->channel];
+    uint32_t per_block = dev->block.caps.multiple_sectors;
+    if (fua) ata_issue(dev, lba, count, 0, ATA_CMD_WRITE_MULTIPLE_FUA_EXT);
+    else ata_issue(dev, lba, count, ATA_CMD_WRITE_MULTIPLE, ATA_CMD_WRITE_MULTIPLE_EXT);
+
+    const uint16_t* source = (const uint16_t*)buffer;
+    uint32_t remaining = count;
+    int first = 1;
+    int ret;
+    while (remaining > 0) {
+        uint32_t block = remaining < per_block ? remaining : per_block;
+        if ((ret = ata_wait_data(ch, !first)) != 0) return ret;
+        outsw(ch->io_base + ATA_REG_DATA, source, block * 256);
+        source += block * 256;
+        remaining -= block;
+        first = 0;
+    }
+
+    return ata_wait_done(ch, ATA_IRQ_TIMEOUT_MS);
+}
+
+// Describes the segments with PRDs that never cross a 64 KB boundary.
+// Returns the number of entries, or 0 if the table is too small.
+static int ata_build_prdt(AtaPrd* prdt, const BlockSegment* segs, int nsegs) {
+    int n = 0;
+    for (int i = 0; i < nsegs; i++) {
+        uint32_t addr = (uint32_t)segs[i].addr;
+        uint32_t bytes = segs[i].len;
+        while (bytes > 0) {
+            if (n == ATA_PRD_MAX) return 0;
+            uint32_t to_boundary = 0x10000 - (addr & 0xFFFF);
+            uint32_t len = bytes < to_boundary ? bytes : to_boundary;
+            prdt[n].address = addr;
+            prdt[n].byte_count = len & 0xFFFF;
+            prdt[n].flags = 0;
+            addr += len;
+            bytes -= len;
+            n++;
+        }
+    }
+    if (n == 0) return 0;
+    prdt[n - 1].flags = ATA_PRD_EOT;
+    return n;
+}
+
+// Waits for the bus-master engine to drain the PRD table. In IRQ mode the
+// drive's interrupt marks completion; otherwise poll until the engine goes
+// inactive and the drive drops BSY.
+static int ata_wait_dma(AtaDevice* dev) {
+    AtaChannel* ch = &ata_channels[dev->channel];
+    if (ata_completion_mode == ATA_COMPLETION_IRQ) return ata_wait_irq(ch, ATA_IRQ_TIMEOUT_MS);
+
+    for (int i = 0; i < ATA_TIMEOUT; i++) {
+        uint8_t bm_status = inb(dev->bm_base + ATA_BM_STATUS);
+        if (bm_status & ATA_BM_STATUS_ERROR) return ATA_STATUS_ERR;
+        if (!(bm_status & ATA_BM_STATUS_ACTIVE)) return ata_wait_not_busy(ch);
+    }
+    print_string("ATA: DMA timeout!\n");
+    return ATA_STATUS_TIMEOUT;
+}
+
+// Loads the channel's PRD table and arms the bus-master engine. The
+// caller then issues the DMA command and calls ata_dma_run.
+static int ata_dma_prepare(AtaDevice* dev, const BlockSegment* segs, int nsegs, int write) {
+    AtaPrd* prdt = ata_prdt[dev->channel];
+    uint16_t bm = dev->bm_base;
+    if (!ata_build_prdt(prdt, segs, nsegs)) return -1;
+
+    outb(bm + ATA_BM_COMMAND, 0);
+    outl(bm + ATA_BM_PRDT, (uint32_t)prdt);
+    outb(bm + ATA_BM_COMMAND, write ? 0 : ATA_BM_CMD_READ);
+    // Error and interrupt bits are write-1-to-clear.
+    outb(bm + ATA_BM_STATUS, inb(bm + ATA_BM_STATUS) | ATA_BM_STATUS_ERROR | ATA_BM_STATUS_IRQ);
+    return 0;
+}
+
+// Starts the engine for the command just issued and waits for both.
+static int ata_dma_run(AtaDevice* dev, int write) {
+    uint16_t bm = dev->bm_base;
+    uint8_t direction = write ? 0 : ATA_BM_CMD_READ;
+    outb(bm + ATA_BM_COMMAND, direction | ATA_BM_CMD_START);
+
+    int ret = ata_wait_dma(dev);
+
+    outb(bm + ATA_BM_COMMAND, direction);
+    uint8_t bm_status = inb(bm + ATA_BM_STATUS);
+    outb(bm + ATA_BM_STATUS, bm_status | ATA_BM_STATUS_ERROR | ATA_BM_STATUS_IRQ);
+
+    if (ret != 0) return ret;
+    if (bm_status & ATA_BM_STATUS_ERROR) {
+        print_string("ATA: Bus-master DMA error!\n");
+        return ATA_STATUS_ERR;
+    }
+    if (inb(dev->io_base + ATA_REG_STATUS) & ATA_STATUS_ERR) return ATA_STATUS_ERR;
+    return 0;
+}
+
+// READ DMA / WRITE DMA (or their EXT and FUA forms) through the channel's
+// bus-master engine.
+static int ata_dma_transfer(AtaDevice* dev, uint64_t lba, uint32_t count,
+                            const BlockSegment* segs, int nsegs, int write, int fua) {
+    if (ata_dma_prepare(dev, segs, nsegs, write) != 0) return -1;
+    if (write && fua) ata_issue(dev, lba, count, 0, ATA_CMD_WRITE_DMA_FUA_EXT);
+    else if (write) ata_issue(dev, lba, count, ATA_CMD_WRITE_DMA, ATA_CMD_WRITE_DMA_EXT);
+    else ata_issue(dev, lba, count, ATA_CMD_READ_DMA, ATA_CMD_READ_DMA_EXT);
+    return ata_dma_run(dev, write);
+}
+
+// The bus-master engine needs word-aligned buffers; anything else goes
+// through PIO.
+static int ata_can_dma(AtaDevice* dev, const void* buffer) {
+    return ata_dma_enabled && dev->dma_available && ((uint32_t)buffer & 1) == 0;
+}
+
+static int ata_can_dma_segments(AtaDevice* dev, const BlockSegment* segs, int nsegs) {
+    for (int i = 0; i < nsegs; i++) {
+        if (!ata_can_dma(dev, segs[i].addr)) return 0;
     }
+    return 1;
+}
+
+static int ata_use_multiple(AtaDevice* dev) {
+    return ata_pio_mode == ATA_PIO_MULTIPLE && (dev->block.caps.flags & BLOCK_CAP_MULTIPLE);
 }
 
+// Rejects transfers a single command can't express instead of letting the
+// count or the LBA wrap.
+static int ata_check_range(AtaDevice* dev, uint64_t lba, uint32_t count) {
+    if (count == 0 || count > dev->block.caps.max_sectors) return -1;
+    if (!dev->lba48 && lba + count > ATA_LBA28_LIMIT) return -1;
+    return 0;
+}
 
-int ata_read_sectors(uint32_t lba, uint8_t num_sectors, void* buffer) {
-    if (!ata_drive_present) return -1;
-    if (ata_wait_not_busy() != 0) return -1;
+int ata_read_sectors(AtaDevice* dev, uint64_t lba, uint32_t count, void* buffer) {
+    AtaChannel* ch = &ata_channels[dev->channel];
+    if (ata_check_range(dev, lba, count) != 0) return -1;
+    if (ata_wait_not_busy(ch) != 0) return -1;
+    if (ata_can_dma(dev, buffer)) {
+        BlockSegment seg = { buffer, count * 512 };
+        return ata_dma_transfer(dev, lba, count, &seg, 1, 0, 0);
+    }
+    if (ata_use_multiple(dev)) return ata_read_multiple(dev, lba, count, buffer);
 
-    // Select master drive (0xE0 for LBA mode) and send high 4 bits of LBA
-    outb(ATA_PORT_DRIVE_HEAD, 0xE0 | ((lba >> 24) & 0x0F));
-    ata_io_wait();
-    outb(ATA_PORT_SECTOR_COUNT, num_sectors);
-    outb(ATA_PORT_LBA_LOW, (uint8_t)lba);
-    outb(ATA_PORT_LBA_MID, (uint8_t)(lba >> 8));
-    outb(ATA_PORT_LBA_HIGH, (uint8_t)(lba >> 16));
-    outb(ATA_PORT_COMMAND, ATA_CMD_READ_SECTORS);
+    // Fallback: one DRQ block and one status poll per sector.
+    ata_issue(dev, lba, count, ATA_CMD_READ_SECTORS, ATA_CMD_READ_SECTORS_EXT);
 
     uint16_t* target = (uint16_t*)buffer;
     int ret;
-    for (int s = 0; s < num_sectors; s++) {
-        if ((ret = ata_wait_not_busy()) != 0) return ret;
-        if ((ret = ata_wait_drq()) != 0) return ret;
+    for (uint32_t s = 0; s < count; s++) {
+        if (ata_completion_mode == ATA_COMPLETION_IRQ && (ret = ata_wait_irq(ch, ATA_IRQ_TIMEOUT_MS)) != 0) return ret;
+        if ((ret = ata_wait_not_busy(ch)) != 0) return ret;
+        if ((ret = ata_wait_drq(ch)) != 0) return ret;
 
         for (int i = 0; i < 256; i++) {
-            target[i] = inw(ATA_PORT_DATA);
+            target[i] = inw(ch->io_base + ATA_REG_DATA);
         }
         target += 256;
     }
     return 0;
 }
 
-int ata_write_sectors(uint32_t lba, uint8_t num_sectors, const void* buffer) {
-    if (!ata_drive_present) return -1;
-    if (ata_wait_not_busy() != 0) return -1;
+static int ata_write(AtaDevice* dev, uint64_t lba, uint32_t count, const void* buffer, int fua) {
+    AtaChannel* ch = &ata_channels[dev->channel];
+    if (ata_check_range(dev, lba, count) != 0) return -1;
+    if (ata_wait_not_busy(ch) != 0) return -1;
+    if (ata_can_dma(dev, buffer)) {
+        BlockSegment seg = { (void*)buffer, count * 512 };
+        return ata_dma_transfer(dev, lba, count, &seg, 1, 1, fua);
+    }
+    if (ata_use_multiple(dev)) return ata_write_multiple(dev, lba, count, buffer, fua);
 
-    outb(ATA_PORT_DRIVE_HEAD, 0xE0 | ((lba >> 24) & 0x0F));
-    ata_io_wait();
-    outb(ATA_PORT_SECTOR_COUNT, num_sectors);
-    outb(ATA_PORT_LBA_LOW, (uint8_t)lba);
-    outb(ATA_PORT_LBA_MID, (uint8_t)(lba >> 8));
-    outb(ATA_PORT_LBA_HIGH, (uint8_t)(lba >> 16));
-    outb(ATA_PORT_COMMAND, ATA_CMD_WRITE_SECTORS);
+    ata_issue(dev, lba, count, ATA_CMD_WRITE_SECTORS, ATA_CMD_WRITE_SECTORS_EXT);
 
     const uint16_t* source = (const uint16_t*)buffer;
     int ret;
-    for (int s = 0; s < num_sectors; s++) {
-        if ((ret = ata_wait_not_busy()) != 0) return ret;
-        if ((ret = ata_wait_drq()) != 0) return ret;
+    for (uint32_t s = 0; s < count; s++) {
+        // The first sector is requested without an interrupt.
+        if (s > 0 && ata_completion_mode == ATA_COMPLETION_IRQ && (ret = ata_wait_irq(ch, ATA_IRQ_TIMEOUT_MS)) != 0) return ret;
+        if ((ret = ata_wait_not_busy(ch)) != 0) return ret;
+        if ((ret = ata_wait_drq(ch)) != 0) return ret;
 
         for (int i = 0; i < 256; i++) {
-            outw(ATA_PORT_DATA, source[i]);
+            outw(ch->io_base + ATA_REG_DATA, source[i]);
         }
         source += 256;
     }
 
-    // After writing, the drive may need to cache. We can flush it.
-    // For simplicity, we just wait for it to not be busy again.
-    if ((ret = ata_wait_not_busy()) != 0) return ret;
+    // The data may still sit in the drive's write cache; callers that need
+    // it on the media use ata_write_sectors_fua or ata_flush_cache.
+    return ata_wait_done(ch, ATA_IRQ_TIMEOUT_MS);
+}
 
+int ata_write_sectors(AtaDevice* dev, uint64_t lba, uint32_t count, const void* buffer) {
+    return ata_write(dev, lba, count, buffer, 0);
+}
+
+int ata_write_sectors_fua(AtaDevice* dev, uint64_t lba, uint32_t count, const void* buffer) {
+    // Per-sector PIO has no FUA form.
+    if (dev->fua && (ata_can_dma(dev, buffer) || ata_use_multiple(dev))) {
+        return ata_write(dev, lba, count, buffer, 1);
+    }
+    int ret = ata_write(dev, lba, count, buffer, 0);
+    if (ret != 0) return ret;
+    return ata_flush_cache(dev);
+}
+
+// One scatter-gather DMA command for the whole vector when every segment
+// is DMA-able; otherwise one PIO command per segment.
+static int ata_transfer_segments(AtaDevice* dev, uint64_t lba, const BlockSegment* segs, int nsegs, int write) {
+    uint32_t count = 0;
+    for (int i = 0; i < nsegs; i++) count += segs[i].len / 512;
+
+    if (ata_can_dma_segments(dev, segs, nsegs)) {
+        if (ata_check_range(dev, lba, count) != 0) return -1;
+        if (ata_wait_not_busy(&ata_channels[dev->channel]) != 0) return -1;
+        return ata_dma_transfer(dev, lba, count, segs, nsegs, write, 0);
+    }
+
+    for (int i = 0; i < nsegs; i++) {
+        uint32_t sectors = segs[i].len / 512;
+        int ret = write ? ata_write(dev, lba, sectors, segs[i].addr, 0)
+                        : ata_read_sectors(dev, lba, sectors, segs[i].addr);
+        if (ret != 0) return ret;
+        lba += sectors;
+    }
     return 0;
-}
\ No newline at end of file
+}
+
+int ata_readv(AtaDevice* dev, uint64_t lba, const BlockSegment* segs, int nsegs) {
+    return ata_transfer_segments(dev, lba, segs, nsegs, 0);
+}
+
+int ata_writev(AtaDevice* dev, uint64_t lba, const BlockSegment* segs, int nsegs) {
+    return ata_transfer_segments(dev, lba, segs, nsegs, 1);
+}
+
+int ata_trim(AtaDevice* dev, const BlockRange* ranges, int nranges) {
+    AtaChannel* ch = &ata_channels[dev->channel];
+    uint16_t io = ch->io_base;
+    if (!(dev->block.caps.flags & BLOCK_CAP_DISCARD) || !ata_dma_enabled) return -1;
+    if (nranges <= 0 || nranges > dev->block.caps.max_discard_ranges) return -1;
+
+    uint32_t blocks = (nranges + ATA_TRIM_RANGES_PER_BLOCK - 1) / ATA_TRIM_RANGES_PER_BLOCK;
+    memset(ata_trim_ranges, 0, blocks * 512); // Unused entries have length 0
+    for (int i = 0; i < nranges; i++) {
+        if (ranges[i].count == 0 || ranges[i].count > ATA_TRIM_RANGE_MAX) return -1;
+        if (ranges[i].lba + ranges[i].count > dev->block.caps.sector_count) return -1;
+        ata_trim_ranges[i] = ranges[i].lba | ((uint64_t)ranges[i].count << 48);
+    }
+    if (ata_wait_not_busy(ch) != 0) return -1;
+
+    BlockSegment seg = { ata_trim_ranges, blocks * 512 };
+    if (ata_dma_prepare(dev, &seg, 1, 1) != 0) return -1;
+    // LBA48 task file: the TRIM bit goes in the features FIFO, the block
+    // count in the sector count; the LBA registers are unused.
+    outb(io + ATA_REG_DRIVE_HEAD, 0x40 | (dev->slave << 4));
+    ata_io_wait(ch);
+    outb(io + ATA_REG_FEATURES, 0);
+    outb(io + ATA_REG_SECTOR_COUNT, (uint8_t)(blocks >> 8));
+    outb(io + ATA_REG_LBA_LOW, 0);
+    outb(io + ATA_REG_LBA_MID, 0);
+    outb(io + ATA_REG_LBA_HIGH, 0);
+    outb(io + ATA_REG_FEATURES, ATA_DSM_TRIM);
+    outb(io + ATA_REG_SECTOR_COUNT, (uint8_t)blocks);
+    outb(io + ATA_REG_LBA_LOW, 0);
+    outb(io + ATA_REG_LBA_MID, 0);
+    outb(io + ATA_REG_LBA_HIGH, 0);
+    ch->irq_pending = 0;
+    outb(io + ATA_REG_COMMAND, ATA_CMD_DATA_SET_MANAGEMENT);
+    ata_io_wait(ch);
+
+    int ret = ata_dma_run(dev, 1);
+    if (ret != 0) print_string("ATA: DATA SET MANAGEMENT failed!\n");
+    return ret;
+}
+
+int ata_flush_cache(AtaDevice* dev) {
+    AtaChannel* ch = &ata_channels[dev->channel];
+    if (ata_wait_not_busy(ch) != 0) return -1;
+
+    outb(ch->io_base + ATA_REG_DRIVE_HEAD, 0xA0 | (dev->slave << 4));
+    ata_io_wait(ch);
+    ch->irq_pending = 0;
+    outb(ch->io_base + ATA_REG_COMMAND, dev->lba48 ? ATA_CMD_FLUSH_CACHE_EXT : ATA_CMD_FLUSH_CACHE);
+    ata_io_wait(ch);
+
+    int ret = ata_wait_done(ch, ATA_FLUSH_TIMEOUT_MS);
+    if (ret != 0) print_string("ATA: FLUSH CACHE failed!\n");
+    return ret;
+}
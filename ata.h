@@ -2,6 +2,7 @@
 #define ATA_H
 
 #include <stdint.h>
+#include "block.h"
 
 // Primary ATA Bus I/O Ports
 #define ATA_PORT_DATA          0x1F0
@@ -13,6 +14,26 @@
 #define ATA_PORT_DRIVE_HEAD    0x1F6
 #define ATA_PORT_STATUS        0x1F7
 #define ATA_PORT_COMMAND       0x1F7
+#define ATA_PORT_CONTROL       0x3F6
+
+// Secondary ATA Bus
+#define ATA_SECONDARY_PORT_DATA    0x170
+#define ATA_SECONDARY_PORT_CONTROL 0x376
+
+// Task file register offsets from a channel's I/O base
+#define ATA_REG_DATA         0
+#define ATA_REG_ERROR        1
+#define ATA_REG_FEATURES     1
+#define ATA_REG_SECTOR_COUNT 2
+#define ATA_REG_LBA_LOW      3
+#define ATA_REG_LBA_MID      4
+#define ATA_REG_LBA_HIGH     5
+#define ATA_REG_DRIVE_HEAD   6
+#define ATA_REG_STATUS       7
+#define ATA_REG_COMMAND      7
+
+// Device Control bits
+#define ATA_CONTROL_NIEN 0x02 // Set to mask the drive's INTRQ
 
 // Status Bits
 #define ATA_STATUS_BUSY 0x80
@@ -21,17 +42,121 @@
 #define ATA_STATUS_ERR  0x01
 
 // Commands
+#define ATA_CMD_DATA_SET_MANAGEMENT 0x06
 #define ATA_CMD_READ_SECTORS   0x20
+#define ATA_CMD_READ_SECTORS_EXT   0x24
+#define ATA_CMD_READ_DMA_EXT       0x25
+#define ATA_CMD_READ_MULTIPLE_EXT  0x29
 #define ATA_CMD_WRITE_SECTORS  0x30
+#define ATA_CMD_WRITE_SECTORS_EXT  0x34
+#define ATA_CMD_WRITE_DMA_EXT      0x35
+#define ATA_CMD_WRITE_MULTIPLE_EXT 0x39
+#define ATA_CMD_WRITE_DMA_FUA_EXT  0x3D
+#define ATA_CMD_READ_MULTIPLE  0xC4
+#define ATA_CMD_WRITE_MULTIPLE 0xC5
+#define ATA_CMD_SET_MULTIPLE   0xC6
+#define ATA_CMD_READ_DMA       0xC8
+#define ATA_CMD_WRITE_DMA      0xCA
+#define ATA_CMD_WRITE_MULTIPLE_FUA_EXT 0xCE
+#define ATA_CMD_FLUSH_CACHE    0xE7
+#define ATA_CMD_FLUSH_CACHE_EXT    0xEA
 #define ATA_CMD_IDENTIFY       0xEC
+#define ATA_CMD_SET_FEATURES   0xEF
+
+// SET FEATURES subcommands
+#define ATA_FEATURE_ENABLE_WCACHE 0x02
+
+// DATA SET MANAGEMENT: the feature bit selects TRIM, the data is 512-byte
+// blocks of 64 range entries, each a 48-bit LBA and a 16-bit length.
+#define ATA_DSM_TRIM           0x01
+#define ATA_TRIM_RANGES_PER_BLOCK 64
+#define ATA_TRIM_MAX_BLOCKS    8      // Blocks we send per command (4 KB)
+#define ATA_TRIM_RANGE_MAX     0xFFFF // Sectors one entry covers
+
+// Per-command limits
+#define ATA_MAX_SECTORS_LBA28 256
+#define ATA_MAX_SECTORS_LBA48 65536
+#define ATA_LBA28_LIMIT       0x10000000ULL // First LBA a 28-bit command can't reach
+
+// Bus-master IDE registers, offsets from a channel's bus-master base
+// (BAR4 for the primary channel, BAR4 + 8 for the secondary)
+#define ATA_BM_COMMAND 0x00
+#define ATA_BM_STATUS  0x02
+#define ATA_BM_PRDT    0x04
+
+#define ATA_BM_CMD_START 0x01
+#define ATA_BM_CMD_READ  0x08 // Bus master writes to memory (device -> RAM)
+#define ATA_BM_STATUS_ACTIVE 0x01
+#define ATA_BM_STATUS_ERROR  0x02
+#define ATA_BM_STATUS_IRQ    0x04
+
+// PIO transfer modes
+#define ATA_PIO_SINGLE   0 // One DRQ block per sector, one inw/outw per word
+#define ATA_PIO_MULTIPLE 1 // READ/WRITE MULTIPLE, rep insw/outsw per DRQ block
+
+// Completion modes
+#define ATA_COMPLETION_POLL 0 // Spin on the status port
+#define ATA_COMPLETION_IRQ  1 // Sleep in hlt until IRQ14/IRQ15 fires
 
-// Public Functions
+// One drive position: primary/secondary channel, master/slave.
+typedef struct {
+    uint16_t io_base;     // Task file registers (0x1F0 / 0x170)
+    uint16_t ctrl_base;   // Device control register (0x3F6 / 0x376)
+    uint16_t bm_base;     // Bus-master registers, 0 without DMA
+    uint8_t  channel;     // 0 = primary, 1 = secondary
+    uint8_t  slave;       // 0 = master, 1 = slave
+    int      lba48;
+    int      dma_available;
+    int      fua;         // Drive accepts the FUA EXT write commands
+    BlockDevice block;
+} AtaDevice;
 
-// Global state: 1 if drive is present and responsive, 0 otherwise.
+// Global state: 1 if any drive is present and responsive, 0 otherwise.
 extern int ata_drive_present;
 
+// 1 if any registered drive can use bus-master DMA.
+extern int ata_dma_available;
+
+// Probes all four PATA positions and registers each hard disk the user
+// accepts with the block layer.
 void ata_init();
-int ata_read_sectors(uint32_t lba, uint8_t num_sectors, void* buffer);
-int ata_write_sectors(uint32_t lba, uint8_t num_sectors, const void* buffer);
 
-#endif // ATA_H
\ No newline at end of file
+// Transfers 1..dev->block.caps.max_sectors sectors in a single command.
+// Requests the drive can't address are rejected, never truncated.
+int ata_read_sectors(AtaDevice* dev, uint64_t lba, uint32_t count, void* buffer);
+int ata_write_sectors(AtaDevice* dev, uint64_t lba, uint32_t count, const void* buffer);
+
+// Vectored transfers; segments follow the BlockSegment rules. With DMA the
+// whole vector is one command, otherwise each segment is its own command.
+int ata_readv(AtaDevice* dev, uint64_t lba, const BlockSegment* segs, int nsegs);
+int ata_writev(AtaDevice* dev, uint64_t lba, const BlockSegment* segs, int nsegs);
+
+// Like ata_write_sectors, but the data is on the media when it returns.
+// Uses WRITE DMA/MULTIPLE FUA EXT where the drive has them, otherwise a
+// plain write followed by a cache flush.
+int ata_write_sectors_fua(AtaDevice* dev, uint64_t lba, uint32_t count, const void* buffer);
+
+// FLUSH CACHE (EXT on LBA48 drives): returns once every earlier write has
+// left the drive's volatile cache.
+int ata_flush_cache(AtaDevice* dev);
+
+// TRIMs up to block.caps.max_discard_ranges ranges with one DATA SET
+// MANAGEMENT command. Needs the DMA path.
+int ata_trim(AtaDevice* dev, const BlockRange* ranges, int nranges);
+
+// Selects the PIO path used by ata_read_sectors/ata_write_sectors.
+// ATA_PIO_MULTIPLE falls back to ATA_PIO_SINGLE on drives that lack it.
+void ata_set_pio_mode(int mode);
+int ata_get_pio_mode();
+
+// Selects how the driver waits for DRQ blocks and command completion.
+void ata_set_completion_mode(int mode);
+int ata_get_completion_mode();
+
+// Enables or disables the bus-master DMA path. When enabled (the default
+// once DMA is available), ata_read_sectors/ata_write_sectors use READ/WRITE
+// DMA for every word-aligned buffer and PIO otherwise.
+void ata_set_dma_enabled(int enabled);
+int ata_get_dma_enabled();
+
+#endif // ATA_H
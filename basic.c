@@ -63,7 +63,7 @@ static int for_loop_sp = 0; // Stack pointer
 static int gosub_stack[MAX_GOSUB_STACK];
 static int gosub_sp = 0; // Stack pointer
 
-// Buffer for SAVE/LOAD operations
+// Buffer for LOAD
 static char file_io_buffer[MAX_PROGRAM_FILE_SIZE + 1];
 
 // --- Forward Declarations for the Parser ---
@@ -425,12 +425,11 @@ static void handle_save() {
         return;
     }
 
-    memset(file_io_buffer, 0, MAX_PROGRAM_FILE_SIZE + 1);
-    char* writer = file_io_buffer;
-    for(int i = 0; i < program_line_count; i++) {
+    // Stream the listing out a line at a time.
+    int fd = fs_create(filename);
+    int ok = fd >= 0;
+    for(int i = 0; ok && i < program_line_count; i++) {
         char line_buf[20];
-        const char* p = line_buf;
-        print_int(program[i].line_number); // This prints to screen, need an itoa
         
         // Simple itoa
         int n = program[i].line_number;
@@ -440,18 +439,16 @@ static void handle_save() {
             while(n>0) { temp[k++] = (n%10)+'0'; n/=10; }
             while(k>0) line_buf[j++] = temp[--k];
         }
-        line_buf[j] = '\0';
+        line_buf[j++] = ' ';
         // End of itoa
 
-        strcpy(writer, p);
-        writer += strlen(p);
-        *writer++ = ' ';
-        strcpy(writer, program[i].line_text);
-        writer += strlen(program[i].line_text);
-        *writer++ = '\n';
+        ok = fs_write(fd, line_buf, j) >= 0 &&
+             fs_write(fd, program[i].line_text, strlen(program[i].line_text)) >= 0 &&
+             fs_write(fd, "\n", 1) >= 0;
     }
+    if (fd >= 0 && fs_close(fd) != 0) ok = 0;
 
-    if (fs_write_file(filename, file_io_buffer, strlen(file_io_buffer)) == 0) {
+    if (ok) {
         print_string("SAVED ");
         print_string(filename);
         new_line();
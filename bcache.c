@@ -0,0 +1,567 @@
+#include "bcache.h"
+#include "timer.h"
+#include "shell.h"
+#include "extrainclude.h"
+
+typedef struct BcacheEntry {
+    BlockDevice* dev;
+    uint64_t block;                  // LBA / BCACHE_BLOCK_SECTORS
+    volatile uint8_t valid;          // Sectors holding disk (or newer) data
+    uint8_t dirty;                   // Sectors newer than the disk
+    volatile uint8_t pending;        // Sectors a readahead command is still filling
+    uint8_t fetched;                 // BCACHE_FETCH_*: why it was read in bulk
+    struct BcacheEntry* hash_next;   // Bucket chain, or the free list
+    struct BcacheEntry* prev;        // LRU list, most recent first
+    struct BcacheEntry* next;
+    uint8_t* data;
+} BcacheEntry;
+
+__attribute__((aligned(4096))) static uint8_t bcache_data[BCACHE_MAX_BLOCKS][BCACHE_BLOCK_SIZE];
+static uint8_t bcache_fill_buffer[BCACHE_BLOCK_SIZE];
+static BcacheEntry entries[BCACHE_MAX_BLOCKS];
+static BcacheEntry* hash_table[BCACHE_HASH_SIZE];
+static BcacheEntry lru;              // Sentinel: lru.next is the newest, lru.prev the oldest
+static BcacheEntry* free_list;
+static uint32_t budget = BCACHE_MAX_BLOCKS;
+static uint32_t used = 0;
+static uint32_t dirty_count = 0;
+static uint32_t last_sync_ms = 0;
+static BcacheStats stats;
+
+#define BCACHE_FETCH_NONE      0
+#define BCACHE_FETCH_DEMAND    1 // Part of a missed request, not read yet
+#define BCACHE_FETCH_READAHEAD 2 // Prefetched and not read yet
+
+// Sequential-read detection, one stream per device.
+typedef struct {
+    BlockDevice* dev;
+    uint64_t next_lba;   // Where the last read ended
+    uint64_t ra_end;     // End of what has been prefetched
+    uint32_t window;     // Sectors to keep ahead of the reader; 0 = off
+} BcacheStream;
+
+// One asynchronous readahead command and the blocks it fills.
+typedef struct {
+    volatile int busy;
+    int count;
+    BcacheEntry* entries[BCACHE_RA_CMD_BLOCKS];
+} BcacheRaCmd;
+
+static BcacheStream streams[BLOCK_MAX_DEVICES];
+static BcacheRaCmd ra_cmds[BCACHE_RA_CMDS];
+
+void bcache_init() {
+    lru.next = lru.prev = &lru;
+    free_list = 0;
+    for (int i = BCACHE_MAX_BLOCKS - 1; i >= 0; i--) {
+        entries[i].data = bcache_data[i];
+        entries[i].hash_next = free_list;
+        free_list = &entries[i];
+    }
+    for (int i = 0; i < BCACHE_HASH_SIZE; i++) hash_table[i] = 0;
+    for (int i = 0; i < BLOCK_MAX_DEVICES; i++) streams[i].dev = 0;
+    used = 0;
+    dirty_count = 0;
+    last_sync_ms = timer_ms();
+}
+
+static uint32_t bcache_hash(BlockDevice* dev, uint64_t block) {
+    uint32_t h = (uint32_t)block * 2654435761u;
+    h ^= (uint32_t)(block >> 32) ^ ((uint32_t)dev >> 4);
+    return (h ^ (h >> 16)) & (BCACHE_HASH_SIZE - 1);
+}
+
+static BcacheEntry* bcache_lookup(BlockDevice* dev, uint64_t block) {
+    for (BcacheEntry* e = hash_table[bcache_hash(dev, block)]; e; e = e->hash_next) {
+        if (e->dev == dev && e->block == block) return e;
+    }
+    return 0;
+}
+
+static void bcache_unlink(BcacheEntry* e) {
+    e->prev->next = e->next;
+    e->next->prev = e->prev;
+}
+
+static void bcache_touch(BcacheEntry* e) {
+    bcache_unlink(e);
+    e->next = lru.next;
+    e->prev = &lru;
+    lru.next->prev = e;
+    lru.next = e;
+}
+
+static void bcache_unhash(BcacheEntry* e) {
+    BcacheEntry** link = &hash_table[bcache_hash(e->dev, e->block)];
+    while (*link != e) link = &(*link)->hash_next;
+    *link = e->hash_next;
+}
+
+static BcacheStream* bcache_stream(BlockDevice* dev) {
+    for (int i = 0; i < BLOCK_MAX_DEVICES; i++) {
+        if (streams[i].dev == dev) return &streams[i];
+    }
+    for (int i = 0; i < BLOCK_MAX_DEVICES; i++) {
+        if (!streams[i].dev) {
+            streams[i].dev = dev;
+            streams[i].next_lba = 0;
+            streams[i].ra_end = 0;
+            streams[i].window = 0;
+            return &streams[i];
+        }
+    }
+    return 0;
+}
+
+// Waits for the readahead command filling `e`, if any. On timeout the
+// device's commands are aborted, which clears `pending`.
+static int bcache_wait(BcacheEntry* e) {
+    if (!e->pending) return 0;
+    uint32_t start = timer_ms();
+    for (;;) {
+        __asm__ volatile("cli" ::: "memory");
+        if (!e->pending) break;
+        if (timer_ms() - start > BCACHE_RA_TIMEOUT_MS) {
+            __asm__ volatile("sti");
+            print_string("Cache: Readahead timeout!\n");
+            e->dev->ops->abort(e->dev);
+            return -1;
+        }
+        e->dev->ops->wait_event(e->dev);
+    }
+    __asm__ volatile("sti" ::: "memory");
+    return 0;
+}
+
+static void bcache_ra_done(void* ctx, int status) {
+    BcacheRaCmd* cmd = (BcacheRaCmd*)ctx;
+    for (int i = 0; i < cmd->count; i++) {
+        BcacheEntry* e = cmd->entries[i];
+        if (status == 0) e->valid |= e->pending;
+        e->pending = 0;
+    }
+    cmd->busy = 0;
+}
+
+// Writes each run of dirty sectors back to the disk.
+static int bcache_writeback(BcacheEntry* e) {
+    uint64_t lba = e->block * BCACHE_BLOCK_SECTORS;
+    int s = 0;
+    while (s < BCACHE_BLOCK_SECTORS) {
+        if (!(e->dirty & (1 << s))) { s++; continue; }
+        int end = s;
+        while (end < BCACHE_BLOCK_SECTORS && (e->dirty & (1 << end))) end++;
+        if (block_dev_write(e->dev, lba + s, end - s, e->data + s * BLOCK_SECTOR_SIZE) != 0) {
+            print_string("Cache: Write-back failed on ");
+            print_string(e->dev->name);
+            new_line();
+            return -1;
+        }
+        s = end;
+    }
+    e->dirty = 0;
+    dirty_count--;
+    stats.writebacks++;
+    return 0;
+}
+
+// Removes the least recently used block, writing it back first. Blocks
+// a readahead is still filling are passed over. Prefetched blocks that
+// were never read mean the readahead ran too far: their stream's window
+// is halved.
+static int bcache_evict() {
+    BcacheEntry* e = lru.prev;
+    while (e != &lru && e->pending) e = e->prev;
+    if (e == &lru) return -1;
+    if (e->dirty && bcache_writeback(e) != 0) return -1;
+    if (e->fetched == BCACHE_FETCH_READAHEAD) {
+        stats.ra_wasted++;
+        BcacheStream* st = bcache_stream(e->dev);
+        if (st && st->window > BCACHE_RA_MIN_SECTORS) st->window /= 2;
+    }
+    bcache_unlink(e);
+    bcache_unhash(e);
+    e->hash_next = free_list;
+    free_list = e;
+    used--;
+    stats.evictions++;
+    return 0;
+}
+
+// Returns the entry for (dev, block), making an empty one if needed.
+static BcacheEntry* bcache_get(BlockDevice* dev, uint64_t block) {
+    BcacheEntry* e = bcache_lookup(dev, block);
+    if (e) {
+        bcache_touch(e);
+        return e;
+    }
+    if (used >= budget && bcache_evict() != 0) return 0;
+
+    e = free_list;
+    free_list = e->hash_next;
+    used++;
+    e->dev = dev;
+    e->block = block;
+    e->valid = 0;
+    e->dirty = 0;
+    e->pending = 0;
+    e->fetched = BCACHE_FETCH_NONE;
+    uint32_t h = bcache_hash(dev, block);
+    e->hash_next = hash_table[h];
+    hash_table[h] = e;
+    e->next = e->prev = &lru;
+    bcache_touch(e);
+    return e;
+}
+
+// Reads the sectors of `e` that aren't valid yet. The whole block is read
+// (up to the end of the disk) so neighbouring sectors come along for free.
+static int bcache_fill(BcacheEntry* e) {
+    uint64_t lba = e->block * BCACHE_BLOCK_SECTORS;
+    int sectors = BCACHE_BLOCK_SECTORS;
+    if (lba + sectors > e->dev->caps.sector_count) sectors = (int)(e->dev->caps.sector_count - lba);
+    if (sectors <= 0) return -1;
+    uint8_t missing = (uint8_t)(((1 << sectors) - 1) & ~e->valid);
+    if (!missing) return 0;
+
+    int first = __builtin_ctz(missing);
+    int last = 31 - __builtin_clz(missing);
+    if (block_dev_read(e->dev, lba + first, last - first + 1, bcache_fill_buffer) != 0) return -1;
+    for (int s = first; s <= last; s++) {
+        if (missing & (1 << s)) {
+            memcpy(e->data + s * BLOCK_SECTOR_SIZE,
+                   bcache_fill_buffer + (s - first) * BLOCK_SECTOR_SIZE, BLOCK_SECTOR_SIZE);
+        }
+    }
+    e->valid |= missing;
+    return 0;
+}
+
+// Copies `buf` into the cached blocks it overlaps. `dirty` marks the
+// sectors for write-back; otherwise they are clean copies of what was
+// just written to disk. Blocks not cached yet are only created when
+// `allocate` is set.
+static int bcache_store(BlockDevice* dev, uint64_t lba, uint32_t count, const uint8_t* buf,
+                        int dirty, int allocate) {
+    while (count > 0) {
+        uint64_t block = lba / BCACHE_BLOCK_SECTORS;
+        int offset = (int)(lba % BCACHE_BLOCK_SECTORS);
+        uint32_t n = BCACHE_BLOCK_SECTORS - offset;
+        if (n > count) n = count;
+        uint8_t mask = (uint8_t)(((1 << n) - 1) << offset);
+
+        BcacheEntry* e = allocate ? bcache_get(dev, block) : bcache_lookup(dev, block);
+        if (allocate && !e) return -1;
+        // The readahead's DMA must not land on top of the new data.
+        if (e && e->pending && bcache_wait(e) != 0) return -1;
+        if (e) {
+            memcpy(e->data + offset * BLOCK_SECTOR_SIZE, buf, n * BLOCK_SECTOR_SIZE);
+            e->valid |= mask;
+            if (dirty) {
+                if (!e->dirty) dirty_count++;
+                e->dirty |= mask;
+            } else if (e->dirty) {
+                e->dirty &= ~mask;
+                if (!e->dirty) dirty_count--;
+            }
+        }
+        buf += n * BLOCK_SECTOR_SIZE;
+        lba += n;
+        count -= n;
+    }
+    return 0;
+}
+
+// Sends one batch of freshly allocated blocks to the disk: queued when the
+// driver can run it in the background, read right away otherwise.
+static void bcache_ra_issue(BlockDevice* dev, BcacheRaCmd* cmd, uint64_t lba, BlockSegment* segs) {
+    if (cmd->count == 0) return;
+    if (dev->ops->submit) {
+        cmd->busy = 1;
+        if (dev->ops->submit(dev, lba, segs, cmd->count, 0, bcache_ra_done, cmd) == 0) return;
+        // Queue full: readahead is best effort, so drop it.
+        bcache_ra_done(cmd, -1);
+        return;
+    }
+    bcache_ra_done(cmd, block_dev_readv(dev, lba, segs, cmd->count));
+}
+
+// Allocates the uncached blocks in [from, to) and reads them in as few
+// commands as possible, tagging them with `fetched`.
+static void bcache_prefetch(BlockDevice* dev, uint64_t from, uint64_t to, uint8_t fetched) {
+    BcacheRaCmd* cmd = 0;
+    BlockSegment segs[BCACHE_RA_CMD_BLOCKS];
+    uint64_t cmd_lba = 0;
+    uint32_t max_blocks = BCACHE_RA_CMD_BLOCKS;
+    if (dev->ops->submit) {
+        // One command each, so the driver's limits apply.
+        if (dev->caps.max_segments < max_blocks) max_blocks = dev->caps.max_segments;
+        if (dev->caps.max_sectors / BCACHE_BLOCK_SECTORS < max_blocks) max_blocks = dev->caps.max_sectors / BCACHE_BLOCK_SECTORS;
+        if (max_blocks == 0) return;
+    }
+
+    for (uint64_t block = from / BCACHE_BLOCK_SECTORS; block * BCACHE_BLOCK_SECTORS < to; block++) {
+        if (cmd && (bcache_lookup(dev, block) || cmd->count == (int)max_blocks)) {
+            bcache_ra_issue(dev, cmd, cmd_lba, segs);
+            cmd = 0;
+        }
+        if (bcache_lookup(dev, block)) continue;
+        if (!cmd) {
+            for (int i = 0; i < BCACHE_RA_CMDS && !cmd; i++) {
+                if (!ra_cmds[i].busy) cmd = &ra_cmds[i];
+            }
+            if (!cmd) break; // Enough already in flight
+            cmd->count = 0;
+            cmd_lba = block * BCACHE_BLOCK_SECTORS;
+        }
+
+        uint64_t lba = block * BCACHE_BLOCK_SECTORS;
+        uint32_t sectors = BCACHE_BLOCK_SECTORS;
+        if (lba + sectors > dev->caps.sector_count) sectors = (uint32_t)(dev->caps.sector_count - lba);
+        BcacheEntry* e = bcache_get(dev, block);
+        if (!e) break;
+        e->pending = (uint8_t)((1 << sectors) - 1);
+        e->fetched = fetched;
+        if (fetched == BCACHE_FETCH_READAHEAD) stats.ra_blocks++;
+        segs[cmd->count].addr = e->data;
+        segs[cmd->count].len = sectors * BLOCK_SECTOR_SIZE;
+        cmd->entries[cmd->count++] = e;
+        if (sectors < BCACHE_BLOCK_SECTORS) break; // End of the disk
+    }
+    if (cmd) bcache_ra_issue(dev, cmd, cmd_lba, segs);
+    if (dev->ops->commit) dev->ops->commit(dev);
+}
+
+// Keeps `st->window` sectors prefetched past `pos`. The next window goes
+// out once the reader is halfway through the current one, so the disk
+// works on it while the caller uses the data, and the window doubles each
+// time up to a quarter of the cache.
+static void bcache_readahead(BcacheStream* st, uint64_t pos) {
+    uint32_t max = budget * BCACHE_BLOCK_SECTORS / 4;
+    if (max > BCACHE_RA_MAX_SECTORS) max = BCACHE_RA_MAX_SECTORS;
+    if (max < BCACHE_RA_MIN_SECTORS) return;
+    if (st->window > max) st->window = max;
+
+    if (st->ra_end < pos) st->ra_end = pos;
+    if (st->ra_end - pos >= st->window / 2) return;
+    uint64_t end = pos + st->window;
+    if (end > st->dev->caps.sector_count) end = st->dev->caps.sector_count;
+    if (end <= st->ra_end) return;
+    bcache_prefetch(st->dev, st->ra_end, end, BCACHE_FETCH_READAHEAD);
+    st->ra_end = end;
+    st->window = st->window * 2 > max ? max : st->window * 2;
+}
+
+static int bcache_bypass(uint32_t count) {
+    return count > budget * BCACHE_BLOCK_SECTORS / 4;
+}
+
+int bcache_read(BlockDevice* dev, uint64_t lba, uint32_t count, void* buf) {
+    if (!dev) return -1;
+    uint8_t* p = (uint8_t*)buf;
+
+    if (bcache_bypass(count)) {
+        stats.bypassed++;
+        if (block_dev_read(dev, lba, count, buf) != 0) return -1;
+        if (dirty_count == 0) return 0;
+        // The disk may be behind the cache: lay dirty sectors over it.
+        while (count > 0) {
+            int offset = (int)(lba % BCACHE_BLOCK_SECTORS);
+            uint32_t n = BCACHE_BLOCK_SECTORS - offset;
+            if (n > count) n = count;
+            BcacheEntry* e = bcache_lookup(dev, lba / BCACHE_BLOCK_SECTORS);
+            if (e && e->dirty) {
+                for (uint32_t s = 0; s < n; s++) {
+                    if (e->dirty & (1 << (offset + s))) {
+                        memcpy(p + s * BLOCK_SECTOR_SIZE, e->data + (offset + s) * BLOCK_SECTOR_SIZE,
+                               BLOCK_SECTOR_SIZE);
+                    }
+                }
+            }
+            p += n * BLOCK_SECTOR_SIZE;
+            lba += n;
+            count -= n;
+        }
+        return 0;
+    }
+
+    // A read starting where the last one ended turns readahead on; any
+    // other read turns it off.
+    BcacheStream* st = bcache_stream(dev);
+    if (st) {
+        if (lba != st->next_lba) {
+            st->window = 0;
+            st->ra_end = 0;
+        } else if (st->window == 0) {
+            st->window = BCACHE_RA_MIN_SECTORS;
+        }
+        st->next_lba = lba + count;
+    }
+
+    while (count > 0) {
+        uint64_t block = lba / BCACHE_BLOCK_SECTORS;
+        int offset = (int)(lba % BCACHE_BLOCK_SECTORS);
+        uint32_t n = BCACHE_BLOCK_SECTORS - offset;
+        if (n > count) n = count;
+        uint8_t mask = (uint8_t)(((1 << n) - 1) << offset);
+
+        BcacheEntry* e = bcache_lookup(dev, block);
+        int hit = 0;
+        if (e) {
+            bcache_wait(e);
+            hit = (e->valid & mask) == mask && e->fetched != BCACHE_FETCH_DEMAND;
+            if (e->fetched == BCACHE_FETCH_READAHEAD) stats.ra_hits++;
+            e->fetched = BCACHE_FETCH_NONE;
+        } else {
+            // Bring in the request's whole uncached run at once rather
+            // than one block per command.
+            bcache_prefetch(dev, lba, lba + count, BCACHE_FETCH_DEMAND);
+            e = bcache_lookup(dev, block);
+            if (e) {
+                bcache_wait(e);
+                e->fetched = BCACHE_FETCH_NONE;
+            }
+        }
+        if (hit) {
+            stats.hits++;
+            bcache_touch(e);
+        } else {
+            stats.misses++;
+            if (!e) e = bcache_get(dev, block);
+            if (!e || bcache_fill(e) != 0) return -1;
+        }
+        memcpy(p, e->data + offset * BLOCK_SECTOR_SIZE, n * BLOCK_SECTOR_SIZE);
+        p += n * BLOCK_SECTOR_SIZE;
+        lba += n;
+        count -= n;
+    }
+    if (st && st->window) bcache_readahead(st, lba);
+    return 0;
+}
+
+int bcache_write(BlockDevice* dev, uint64_t lba, uint32_t count, const void* buf) {
+    if (!dev) return -1;
+    if (bcache_bypass(count)) {
+        stats.bypassed++;
+        if (block_dev_write(dev, lba, count, buf) != 0) return -1;
+        return bcache_store(dev, lba, count, (const uint8_t*)buf, 0, 0);
+    }
+    return bcache_store(dev, lba, count, (const uint8_t*)buf, 1, 1);
+}
+
+int bcache_write_fua(BlockDevice* dev, uint64_t lba, uint32_t count, const void* buf) {
+    if (!dev) return -1;
+    if (block_dev_write_fua(dev, lba, count, buf) != 0) return -1;
+    return bcache_store(dev, lba, count, (const uint8_t*)buf, 0, !bcache_bypass(count));
+}
+
+// Queues each run of dirty sectors of `e` on its device's request queue.
+static int bcache_queue_dirty(BcacheEntry* e) {
+    uint64_t lba = e->block * BCACHE_BLOCK_SECTORS;
+    int s = 0;
+    while (s < BCACHE_BLOCK_SECTORS) {
+        if (!(e->dirty & (1 << s))) { s++; continue; }
+        int end = s;
+        while (end < BCACHE_BLOCK_SECTORS && (e->dirty & (1 << end))) end++;
+        if (block_queue_add(e->dev, lba + s, end - s, e->data + s * BLOCK_SECTOR_SIZE, 1) != 0) return -1;
+        s = end;
+    }
+    return 0;
+}
+
+// Everything dirty goes through the request queues at once, so the
+// scheduler can sort the write-back and merge neighbouring blocks.
+int bcache_sync(BlockDevice* dev) {
+    int ret = 0;
+    for (BcacheEntry* e = lru.next; e != &lru; e = e->next) {
+        if (e->dirty && (!dev || e->dev == dev) && bcache_queue_dirty(e) != 0) ret = -1;
+    }
+    if (block_queue_run(dev) != 0) ret = -1;
+    if (ret != 0) {
+        // Which write failed isn't known: keep everything dirty.
+        print_string("Cache: Write-back failed.\n");
+        return -1;
+    }
+    for (BcacheEntry* e = lru.next; e != &lru && dirty_count > 0; e = e->next) {
+        if (e->dirty && (!dev || e->dev == dev)) {
+            e->dirty = 0;
+            dirty_count--;
+            stats.writebacks++;
+        }
+    }
+    if (!dev) last_sync_ms = timer_ms();
+    return 0;
+}
+
+int bcache_invalidate(BlockDevice* dev) {
+    int ret = bcache_sync(dev);
+    BcacheEntry* e = lru.next;
+    while (e != &lru) {
+        BcacheEntry* next = e->next;
+        if (e->dev == dev) bcache_wait(e);
+        if (e->dev == dev && !e->dirty && !e->pending) {
+            bcache_unlink(e);
+            bcache_unhash(e);
+            e->hash_next = free_list;
+            free_list = e;
+            used--;
+        }
+        e = next;
+    }
+    return ret;
+}
+
+void bcache_discard(BlockDevice* dev, uint64_t lba, uint32_t count) {
+    uint64_t end = lba + count;
+    BcacheEntry* e = lru.next;
+    while (e != &lru) {
+        BcacheEntry* next = e->next;
+        uint64_t first = e->block * BCACHE_BLOCK_SECTORS;
+        if (e->dev == dev && first < end && first + BCACHE_BLOCK_SECTORS > lba) {
+            bcache_wait(e);
+            uint32_t from = lba > first ? (uint32_t)(lba - first) : 0;
+            uint32_t to = end < first + BCACHE_BLOCK_SECTORS ? (uint32_t)(end - first) : BCACHE_BLOCK_SECTORS;
+            uint8_t mask = (uint8_t)(((1u << to) - 1) & ~((1u << from) - 1));
+            if (e->dirty && !(e->dirty & ~mask)) dirty_count--;
+            e->dirty &= ~mask;
+            e->valid &= ~mask;
+            if (!e->valid && !e->pending) {
+                bcache_unlink(e);
+                bcache_unhash(e);
+                e->hash_next = free_list;
+                free_list = e;
+                used--;
+            }
+        }
+        e = next;
+    }
+}
+
+int bcache_set_budget(uint32_t blocks) {
+    if (blocks > BCACHE_MAX_BLOCKS) blocks = BCACHE_MAX_BLOCKS;
+    for (BcacheEntry* e = lru.next; e != &lru; e = e->next) bcache_wait(e);
+    while (used > blocks) {
+        if (bcache_evict() != 0) return -1;
+    }
+    budget = blocks;
+    return 0;
+}
+
+void bcache_get_stats(BcacheStats* out) {
+    *out = stats;
+    out->blocks = used;
+    out->dirty_blocks = dirty_count;
+    out->budget_blocks = budget;
+}
+
+void bcache_idle() {
+    if (dirty_count == 0) {
+        last_sync_ms = timer_ms();
+        return;
+    }
+    if (timer_ms() - last_sync_ms >= BCACHE_FLUSH_INTERVAL_MS) {
+        // A failing disk is retried once per interval, not on every call.
+        last_sync_ms = timer_ms();
+        bcache_sync(0);
+    }
+}
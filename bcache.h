@@ -0,0 +1,76 @@
+#ifndef BCACHE_H
+#define BCACHE_H
+
+#include <stdint.h>
+#include "block.h"
+
+// Write-back buffer cache under block_read/block_write. Data is held in
+// 4 KB blocks keyed by (device, block), with per-sector valid and dirty
+// bits, so small writes never need a read first. The least recently used
+// block is evicted (and written back if dirty) when the budget is full.
+#define BCACHE_BLOCK_SECTORS 8
+#define BCACHE_BLOCK_SIZE    (BCACHE_BLOCK_SECTORS * BLOCK_SECTOR_SIZE)
+#define BCACHE_MAX_BLOCKS    128  // Static pool: 512 KB
+#define BCACHE_HASH_SIZE     256  // Power of two
+
+// Readahead: a device read sequentially gets up to this many sectors
+// prefetched past the reader, starting small and doubling while the
+// prefetched data gets used.
+#define BCACHE_RA_MIN_SECTORS 16
+#define BCACHE_RA_MAX_SECTORS 256
+#define BCACHE_RA_CMD_BLOCKS  16   // Blocks per readahead command
+#define BCACHE_RA_CMDS        8    // Readahead commands in flight at once
+#define BCACHE_RA_TIMEOUT_MS  10000
+
+// Dirty data older than this is written back from the idle loop.
+#define BCACHE_FLUSH_INTERVAL_MS 5000
+
+typedef struct {
+    uint32_t hits;        // Block lookups fully served from memory
+    uint32_t misses;      // Block lookups that needed the disk
+    uint32_t evictions;
+    uint32_t writebacks;  // Dirty blocks written to disk
+    uint32_t bypassed;    // Requests too large to cache
+    uint32_t ra_blocks;   // Blocks read ahead
+    uint32_t ra_hits;     // ...that a reader then used
+    uint32_t ra_wasted;   // ...evicted unread
+    uint32_t blocks;      // Blocks in use
+    uint32_t dirty_blocks;
+    uint32_t budget_blocks;
+} BcacheStats;
+
+void bcache_init();
+
+// Cached transfers. Requests larger than a quarter of the budget go
+// straight to the device (keeping the cache coherent), so one big file
+// can't flush everything else out.
+int bcache_read(BlockDevice* dev, uint64_t lba, uint32_t count, void* buf);
+int bcache_write(BlockDevice* dev, uint64_t lba, uint32_t count, const void* buf);
+
+// Write-through with FUA: on the media when it returns, cached clean.
+int bcache_write_fua(BlockDevice* dev, uint64_t lba, uint32_t count, const void* buf);
+
+// Writes back every dirty block of `dev` (all devices if NULL). The data
+// may still sit in the drive's own cache; see block_dev_flush.
+int bcache_sync(BlockDevice* dev);
+
+// Writes back and then drops every block of `dev`, for when something
+// else is about to write the disk behind the cache's back.
+int bcache_invalidate(BlockDevice* dev);
+
+// Forgets cached data for sectors that are about to be discarded: dirty
+// data there is dropped rather than written back, and blocks left with
+// nothing valid are freed.
+void bcache_discard(BlockDevice* dev, uint64_t lba, uint32_t count);
+
+// Sets the memory budget in blocks (at most BCACHE_MAX_BLOCKS; 0 turns
+// the cache off), evicting down to it. Returns -1 if a write-back failed.
+int bcache_set_budget(uint32_t blocks);
+
+void bcache_get_stats(BcacheStats* stats);
+
+// Called while the system waits for input: writes back dirty data once
+// BCACHE_FLUSH_INTERVAL_MS has passed since the last sync.
+void bcache_idle();
+
+#endif // BCACHE_H
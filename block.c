@@ -1,61 +1,799 @@
 #include "block.h"
+#include "bcache.h"
+#include "timer.h"
+#include "extrainclude.h"
+#include "idt.h"
 #include "ata.h"
 #include "sata.h"
+#include "virtio_blk.h"
+#include "nvme.h"
 #include "shell.h" // For print_string
 
-// Enum to track which driver is active
-typedef enum {
-    ACTIVE_DRIVER_NONE,
-    ACTIVE_DRIVER_PATA,
-    ACTIVE_DRIVER_SATA
-} ActiveDriver;
-
-static ActiveDriver active_driver = ACTIVE_DRIVER_NONE;
+static BlockDevice* devices[BLOCK_MAX_DEVICES];
+static int device_count = 0;
+static BlockDevice* active_device = 0;
 int block_device_available = 0;
 
 void block_init() {
     print_string("Probing for block devices...\n");
-    
-    // Try PATA first
+    bcache_init();
+
+    // Every PATA position and every active AHCI port registers itself.
     ata_init();
-    if (ata_drive_present) {
-        print_string("Block layer: Using PATA driver.\n");
-        active_driver = ACTIVE_DRIVER_PATA;
-        block_device_available = 1;
+    sata_init();
+    virtio_blk_init();
+    nvme_init();
+
+    if (device_count == 0) {
+        print_string("Block layer: No usable PATA, SATA, virtio or NVMe device found.\n");
+        block_device_available = 0;
         return;
     }
 
-    // If PATA fails, try SATA/AHCI
-    sata_init();
-    if (sata_drive_present) {
-        print_string("Block layer: Using SATA/AHCI driver.\n");
-        active_driver = ACTIVE_DRIVER_SATA;
-        block_device_available = 1;
+    block_select(block_fastest_device());
+    print_string("Block layer: Using ");
+    print_string(active_device->name);
+    print_string(" (");
+    print_int(device_count);
+    print_string(" device(s) registered).\n");
+}
+
+int block_register(BlockDevice* dev) {
+    if (device_count == BLOCK_MAX_DEVICES) return -1;
+    // Seeks dominate on spinning PATA disks; NCQ disks and arrays of them
+    // do their own reordering.
+    memset(&dev->queue, 0, sizeof(BlockQueue));
+    dev->queue.scheduler = dev->type == BLOCK_TYPE_PATA ? BLOCK_SCHED_DEADLINE : BLOCK_SCHED_NOOP;
+    devices[device_count] = dev;
+    return device_count++;
+}
+
+int block_device_count() {
+    return device_count;
+}
+
+BlockDevice* block_get_device(int index) {
+    if (index < 0 || index >= device_count) return 0;
+    return devices[index];
+}
+
+BlockDevice* block_find_device(const char* name) {
+    for (int i = 0; i < device_count; i++) {
+        if (strcmp(devices[i]->name, name) == 0) return devices[i];
+    }
+    return 0;
+}
+
+void block_select(BlockDevice* dev) {
+    active_device = dev;
+    block_device_available = dev != 0;
+}
+
+BlockDevice* block_active_device() {
+    return active_device;
+}
+
+// Rough throughput ranking: paravirtual disks skip device emulation
+// entirely, NVMe's queue pairs beat NCQ, deep queues beat DMA, DMA beats
+// PIO, and bigger commands break ties.
+static uint32_t block_device_score(const BlockDevice* dev) {
+    uint32_t score = 0;
+    if (dev->type == BLOCK_TYPE_VIRTIO) score += 8000;
+    if (dev->type == BLOCK_TYPE_NVME) score += 5000 + dev->caps.queue_depth * 10;
+    if (dev->caps.flags & BLOCK_CAP_NCQ) score += 4000 + dev->caps.queue_depth * 10;
+    if (dev->caps.flags & BLOCK_CAP_DMA) score += 2000;
+    if (dev->caps.flags & BLOCK_CAP_MULTIPLE) score += 500;
+    score += dev->caps.max_sectors >> 8;
+    return score;
+}
+
+BlockDevice* block_fastest_device() {
+    BlockDevice* best = 0;
+    for (int i = 0; i < device_count; i++) {
+        if (!best || block_device_score(devices[i]) > block_device_score(best)) best = devices[i];
+    }
+    return best;
+}
+
+void block_print_devices() {
+    if (device_count == 0) {
+        print_string("(No block devices)\n");
         return;
     }
+    for (int i = 0; i < device_count; i++) {
+        BlockDevice* dev = devices[i];
+        print_string(dev == active_device ? "* " : "  ");
+        print_string(dev->name);
+        print_string(": ");
+        print_int((uint32_t)(dev->caps.sector_count >> 11));
+        print_string(" MB, max ");
+        print_int(dev->caps.max_sectors);
+        print_string(" sectors/cmd, qd ");
+        print_int(dev->caps.queue_depth);
+        print_string(", ");
+        print_int(dev->caps.max_segments);
+        print_string(" segs,");
+        if (dev->caps.flags & BLOCK_CAP_LBA48) print_string(" lba48");
+        if (dev->caps.flags & BLOCK_CAP_DMA) print_string(" dma");
+        if (dev->caps.udma_modes) {
+            print_string(" udma");
+            int mode = 0;
+            for (int m = 0; m < 7; m++) if (dev->caps.udma_modes & (1 << m)) mode = m;
+            print_int(mode);
+        }
+        if (dev->caps.flags & BLOCK_CAP_MULTIPLE) {
+            print_string(" mult");
+            print_int(dev->caps.multiple_sectors);
+        }
+        if (dev->caps.flags & BLOCK_CAP_NCQ) print_string(" ncq");
+        if (dev->caps.flags & BLOCK_CAP_WRITE_CACHE) print_string(" wcache");
+        if (dev->caps.flags & BLOCK_CAP_FUA) print_string(" fua");
+        if (dev->caps.flags & BLOCK_CAP_DISCARD) print_string(" trim");
+        print_string(", ");
+        print_string(block_scheduler_name(dev->queue.scheduler));
+        new_line();
+    }
+}
+
+#define BLOCK_OP_READ      0
+#define BLOCK_OP_WRITE     1
+#define BLOCK_OP_WRITE_FUA 2
+
+// Splits a request into maximal commands for the device.
+static int block_transfer(BlockDevice* dev, uint64_t lba, uint32_t count, void* buf, int op) {
+    if (!dev) return -1; // No driver available
+    uint32_t max = dev->caps.max_sectors;
+
+    uint8_t* p = (uint8_t*)buf;
+    while (count > 0) {
+        uint32_t chunk = count < max ? count : max;
+        int ret;
+        if (op == BLOCK_OP_READ) ret = dev->ops->read(dev, lba, chunk, p);
+        else if (op == BLOCK_OP_WRITE) ret = dev->ops->write(dev, lba, chunk, p);
+        else ret = dev->ops->write_fua(dev, lba, chunk, p);
+        if (ret != 0) return ret;
+        lba += chunk;
+        p += chunk * BLOCK_SECTOR_SIZE;
+        count -= chunk;
+    }
+    return 0;
+}
+
+static void block_complete(BlockRequest* req, int status) {
+    // Read these first: once `status` is set the waiter may reuse `req`.
+    block_callback_t callback = req->callback;
+    void* ctx = req->ctx;
+    req->status = status;
+    if (callback) callback(ctx, status);
+}
 
-    print_string("Block layer: No usable PATA or SATA device found.\n");
-    block_device_available = 0;
+// Per-command completion. `outstanding` carries one extra count while
+// block_submit is still issuing, so the request can't finish early.
+static void block_piece_done(void* ctx, int status) {
+    BlockRequest* req = (BlockRequest*)ctx;
+    if (status != 0) req->errors++;
+    if (--req->outstanding == 0) block_complete(req, req->errors ? -1 : 0);
 }
 
-int block_read(uint64_t lba, uint16_t count, void* buf) {
-    switch (active_driver) {
-        case ACTIVE_DRIVER_PATA:
-            return ata_read_sectors(lba, count, buf);
-        case ACTIVE_DRIVER_SATA:
-            return sata_read(0, lba, count, buf);
-        default:
-            return -1; // No driver available
+int block_submit(BlockRequest* req) {
+    BlockDevice* dev = req->dev;
+    req->status = BLOCK_STATUS_PENDING;
+    req->errors = 0;
+    if (!dev || req->lba + req->count > dev->caps.sector_count) {
+        block_complete(req, -1);
+        return -1;
+    }
+    if (!dev->ops->submit) {
+        int ret = block_transfer(dev, req->lba, req->count, req->buf, req->write ? BLOCK_OP_WRITE : BLOCK_OP_READ);
+        block_complete(req, ret == 0 ? 0 : -1);
+        return 0;
+    }
+
+    req->outstanding = 1;
+    uint64_t lba = req->lba;
+    uint32_t count = req->count;
+    uint8_t* p = (uint8_t*)req->buf;
+    uint32_t start = timer_ms();
+    while (count > 0) {
+        uint32_t take = count < dev->caps.max_sectors ? count : dev->caps.max_sectors;
+        BlockSegment seg = { p, take * BLOCK_SECTOR_SIZE };
+        uint32_t flags = irq_save();
+        req->outstanding++;
+        irq_restore(flags);
+
+        int ret;
+        while ((ret = dev->ops->submit(dev, lba, &seg, 1, req->write, block_piece_done, req)) == 1) {
+            // Every slot is busy: wait for one to free up.
+            __asm__ volatile("cli");
+            if (timer_ms() - start > BLOCK_TIMEOUT_MS) {
+                __asm__ volatile("sti");
+                ret = -1;
+                break;
+            }
+            dev->ops->wait_event(dev);
+        }
+        if (ret != 0) {
+            flags = irq_save();
+            req->outstanding--;
+            req->errors++;
+            irq_restore(flags);
+            break;
+        }
+        p += take * BLOCK_SECTOR_SIZE;
+        lba += take;
+        count -= take;
     }
+    if (dev->ops->commit) dev->ops->commit(dev);
+
+    uint32_t flags = irq_save();
+    block_piece_done(req, 0);
+    irq_restore(flags);
+    return 0;
+}
+
+int block_poll(BlockDevice* dev) {
+    if (!dev || !dev->ops->poll) return 0;
+    return dev->ops->poll(dev);
 }
 
-int block_write(uint64_t lba, uint16_t count, const void* buf) {
-    switch (active_driver) {
-        case ACTIVE_DRIVER_PATA:
-            return ata_write_sectors(lba, count, buf);
-        case ACTIVE_DRIVER_SATA:
-            return sata_write(0, lba, count, buf);
-        default:
-            return -1; // No driver available
+int block_wait(BlockRequest* req) {
+    BlockDevice* dev = req->dev;
+    uint32_t start = timer_ms();
+    for (;;) {
+        __asm__ volatile("cli" ::: "memory");
+        if (req->status != BLOCK_STATUS_PENDING) break;
+        if (timer_ms() - start > BLOCK_TIMEOUT_MS) {
+            __asm__ volatile("sti");
+            print_string("Block: Request timeout on ");
+            print_string(dev->name);
+            new_line();
+            // Runs the outstanding callbacks, which completes `req`.
+            dev->ops->abort(dev);
+            start = timer_ms();
+            continue;
+        }
+        dev->ops->wait_event(dev);
     }
-}
\ No newline at end of file
+    __asm__ volatile("sti" ::: "memory");
+    return req->status;
+}
+
+// --- Bounce buffers ---
+
+// Drivers DMA straight to and from the buffers they are handed, which
+// needs BLOCK_DMA_ALIGN. Misaligned buffers, and the partial sectors at
+// either end of a byte range, go through this small pool instead.
+#define BLOCK_BOUNCE_BUFFERS 4
+#define BLOCK_BOUNCE_SECTORS 32 // 16 KB each
+
+__attribute__((aligned(4096))) static uint8_t bounce_pool[BLOCK_BOUNCE_BUFFERS][BLOCK_BOUNCE_SECTORS * BLOCK_SECTOR_SIZE];
+static uint32_t bounce_free = (1u << BLOCK_BOUNCE_BUFFERS) - 1;
+
+static uint8_t* block_bounce_get() {
+    uint8_t* buf = 0;
+    uint32_t flags = irq_save();
+    if (bounce_free) {
+        int i = __builtin_ctz(bounce_free);
+        bounce_free &= ~(1u << i);
+        buf = bounce_pool[i];
+    }
+    irq_restore(flags);
+    if (!buf) print_string("Block: Out of bounce buffers!\n");
+    return buf;
+}
+
+static void block_bounce_put(uint8_t* buf) {
+    uint32_t flags = irq_save();
+    bounce_free |= 1u << ((buf - bounce_pool[0]) / sizeof(bounce_pool[0]));
+    irq_restore(flags);
+}
+
+static int block_aligned(const void* buf) {
+    return ((uint32_t)buf & (BLOCK_DMA_ALIGN - 1)) == 0;
+}
+
+// A transfer for a misaligned buffer, copied through a bounce buffer one
+// piece at a time.
+static int block_transfer_bounced(BlockDevice* dev, uint64_t lba, uint32_t count, uint8_t* buf, int op) {
+    uint8_t* bounce = block_bounce_get();
+    if (!bounce) return -1;
+    int ret = 0;
+    while (count > 0) {
+        uint32_t n = count < BLOCK_BOUNCE_SECTORS ? count : BLOCK_BOUNCE_SECTORS;
+        if (op != BLOCK_OP_READ) memcpy(bounce, buf, n * BLOCK_SECTOR_SIZE);
+        ret = block_transfer(dev, lba, n, bounce, op);
+        if (ret != 0) break;
+        if (op == BLOCK_OP_READ) memcpy(buf, bounce, n * BLOCK_SECTOR_SIZE);
+        buf += n * BLOCK_SECTOR_SIZE;
+        lba += n;
+        count -= n;
+    }
+    block_bounce_put(bounce);
+    return ret;
+}
+
+static int block_sync(BlockDevice* dev, uint64_t lba, uint32_t count, void* buf, int write) {
+    if (!dev) return -1;
+    if (count == 0) return 0;
+    if (!block_aligned(buf)) {
+        if (lba + count > dev->caps.sector_count) return -1;
+        return block_transfer_bounced(dev, lba, count, (uint8_t*)buf, write ? BLOCK_OP_WRITE : BLOCK_OP_READ);
+    }
+    BlockRequest req;
+    req.dev = dev;
+    req.lba = lba;
+    req.count = count;
+    req.buf = buf;
+    req.write = write;
+    req.callback = 0;
+    req.ctx = 0;
+    if (block_submit(&req) != 0) return -1;
+    return block_wait(&req);
+}
+
+int block_dev_read(BlockDevice* dev, uint64_t lba, uint32_t count, void* buf) {
+    return block_sync(dev, lba, count, buf, 0);
+}
+
+int block_dev_write(BlockDevice* dev, uint64_t lba, uint32_t count, const void* buf) {
+    return block_sync(dev, lba, count, (void*)buf, 1);
+}
+
+// Packs segments into commands of at most max_segments segments and
+// max_sectors sectors, splitting a segment across commands if it has to.
+static int block_transfer_vec(BlockDevice* dev, uint64_t lba, const BlockSegment* segs, int nsegs, int write) {
+    if (!dev) return -1;
+    for (int i = 0; i < nsegs; i++) {
+        if (segs[i].len == 0 || segs[i].len % BLOCK_SECTOR_SIZE) return -1;
+    }
+
+    int (*vec)(BlockDevice*, uint64_t, const BlockSegment*, int) = write ? dev->ops->writev : dev->ops->readv;
+    if (!vec) {
+        for (int i = 0; i < nsegs; i++) {
+            uint32_t count = segs[i].len / BLOCK_SECTOR_SIZE;
+            int ret = block_transfer(dev, lba, count, segs[i].addr, write ? BLOCK_OP_WRITE : BLOCK_OP_READ);
+            if (ret != 0) return ret;
+            lba += count;
+        }
+        return 0;
+    }
+
+    uint32_t max_sectors = dev->caps.max_sectors;
+    int max_segments = dev->caps.max_segments;
+    if (max_segments > BLOCK_MAX_SEGMENTS) max_segments = BLOCK_MAX_SEGMENTS;
+    if (max_segments < 1) max_segments = 1;
+
+    BlockSegment batch[BLOCK_MAX_SEGMENTS];
+    int n = 0;
+    uint32_t sectors = 0;
+    for (int i = 0; i < nsegs; i++) {
+        uint8_t* addr = (uint8_t*)segs[i].addr;
+        uint32_t left = segs[i].len / BLOCK_SECTOR_SIZE;
+        while (left > 0) {
+            uint32_t room = max_sectors - sectors;
+            uint32_t take = left < room ? left : room;
+            batch[n].addr = addr;
+            batch[n].len = take * BLOCK_SECTOR_SIZE;
+            n++;
+            sectors += take;
+            addr += take * BLOCK_SECTOR_SIZE;
+            left -= take;
+            if (sectors == max_sectors || n == max_segments) {
+                int ret = vec(dev, lba, batch, n);
+                if (ret != 0) return ret;
+                lba += sectors;
+                n = 0;
+                sectors = 0;
+            }
+        }
+    }
+    if (n > 0) return vec(dev, lba, batch, n);
+    return 0;
+}
+
+int block_dev_readv(BlockDevice* dev, uint64_t lba, const BlockSegment* segs, int nsegs) {
+    return block_transfer_vec(dev, lba, segs, nsegs, 0);
+}
+
+int block_dev_writev(BlockDevice* dev, uint64_t lba, const BlockSegment* segs, int nsegs) {
+    return block_transfer_vec(dev, lba, segs, nsegs, 1);
+}
+
+int block_dev_write_fua(BlockDevice* dev, uint64_t lba, uint32_t count, const void* buf) {
+    if (!dev) return -1;
+    // Without a volatile cache every completed write is already durable.
+    if (!(dev->caps.flags & BLOCK_CAP_WRITE_CACHE)) return block_dev_write(dev, lba, count, buf);
+    if (dev->ops->write_fua) {
+        if (!block_aligned(buf)) return block_transfer_bounced(dev, lba, count, (uint8_t*)buf, BLOCK_OP_WRITE_FUA);
+        return block_transfer(dev, lba, count, (void*)buf, BLOCK_OP_WRITE_FUA);
+    }
+    int ret = block_dev_write(dev, lba, count, buf);
+    if (ret != 0) return ret;
+    return block_dev_flush(dev);
+}
+
+int block_dev_flush(BlockDevice* dev) {
+    if (!dev) return -1;
+    if (!dev->ops->flush || !(dev->caps.flags & BLOCK_CAP_WRITE_CACHE)) return 0;
+    return dev->ops->flush(dev);
+}
+
+// --- Discard ---
+
+#define BLOCK_DISCARD_BATCH 256 // Ranges sorted and merged at a time
+
+static BlockRange discard_sorted[BLOCK_DISCARD_BATCH];
+static BlockRange discard_batch[BLOCK_DISCARD_BATCH];
+
+// Clips `ranges` to the device, sorts them by LBA and merges overlapping
+// or touching ones into discard_sorted. Returns how many are left.
+static int block_discard_merge(const BlockRange* ranges, int nranges, uint64_t limit) {
+    int n = 0;
+    for (int i = 0; i < nranges; i++) {
+        uint64_t lba = ranges[i].lba;
+        uint32_t count = ranges[i].count;
+        if (count == 0 || lba >= limit) continue;
+        if (lba + count > limit) count = (uint32_t)(limit - lba);
+        int j = n++;
+        while (j > 0 && discard_sorted[j - 1].lba > lba) {
+            discard_sorted[j] = discard_sorted[j - 1];
+            j--;
+        }
+        discard_sorted[j].lba = lba;
+        discard_sorted[j].count = count;
+    }
+
+    int merged = 0;
+    for (int i = 0; i < n; i++) {
+        if (merged > 0) {
+            BlockRange* last = &discard_sorted[merged - 1];
+            uint64_t last_end = last->lba + last->count;
+            uint64_t end = discard_sorted[i].lba + discard_sorted[i].count;
+            if (discard_sorted[i].lba <= last_end && end - last->lba <= 0xFFFFFFFF) {
+                if (end > last_end) last->count = (uint32_t)(end - last->lba);
+                continue;
+            }
+        }
+        discard_sorted[merged++] = discard_sorted[i];
+    }
+    return merged;
+}
+
+int block_dev_discard(BlockDevice* dev, const BlockRange* ranges, int nranges) {
+    if (!dev) return -1;
+    int supported = (dev->caps.flags & BLOCK_CAP_DISCARD) && dev->ops->discard && dev->caps.max_discard_ranges;
+    int per_command = supported ? dev->caps.max_discard_ranges : 0;
+    if (per_command > BLOCK_DISCARD_BATCH) per_command = BLOCK_DISCARD_BATCH;
+    uint32_t max_len = dev->caps.max_discard_sectors ? dev->caps.max_discard_sectors : 0xFFFFFFFF;
+
+    int ret = 0;
+    while (nranges > 0) {
+        int take = nranges < BLOCK_DISCARD_BATCH ? nranges : BLOCK_DISCARD_BATCH;
+        int n = block_discard_merge(ranges, take, dev->caps.sector_count);
+        ranges += take;
+        nranges -= take;
+
+        int batched = 0;
+        for (int i = 0; i < n; i++) {
+            uint64_t lba = discard_sorted[i].lba;
+            uint32_t left = discard_sorted[i].count;
+            bcache_discard(dev, lba, left);
+            if (!supported) continue;
+            while (left > 0) {
+                uint32_t piece = left < max_len ? left : max_len;
+                discard_batch[batched].lba = lba;
+                discard_batch[batched].count = piece;
+                if (++batched == per_command) {
+                    if (dev->ops->discard(dev, discard_batch, batched) != 0) ret = -1;
+                    batched = 0;
+                }
+                lba += piece;
+                left -= piece;
+            }
+        }
+        if (batched > 0 && dev->ops->discard(dev, discard_batch, batched) != 0) ret = -1;
+    }
+    return ret;
+}
+
+// --- Request queue ---
+
+#define BLOCK_QUEUE_POOL     128
+#define BLOCK_QUEUE_SEGMENTS 16   // Pieces one merged request can hold
+#define BLOCK_READ_EXPIRE_MS   500
+#define BLOCK_WRITE_EXPIRE_MS  5000
+#define BLOCK_WRITES_STARVED   16   // Reads deadline lets pass a waiting write
+
+struct BlockQueueEntry {
+    uint64_t lba;
+    uint32_t count;
+    int write;
+    uint32_t deadline_ms;
+    int nsegs;
+    BlockSegment segs[BLOCK_QUEUE_SEGMENTS];
+    BlockQueueEntry* next_free;
+};
+
+static BlockQueueEntry queue_entry_pool[BLOCK_QUEUE_POOL];
+static BlockQueueEntry* free_queue_entries = 0;
+static int queue_entry_pool_ready = 0;
+
+static BlockQueueEntry* block_queue_entry_alloc() {
+    if (!queue_entry_pool_ready) {
+        for (int i = 0; i < BLOCK_QUEUE_POOL; i++) {
+            queue_entry_pool[i].next_free = free_queue_entries;
+            free_queue_entries = &queue_entry_pool[i];
+        }
+        queue_entry_pool_ready = 1;
+    }
+    BlockQueueEntry* r = free_queue_entries;
+    if (r) free_queue_entries = r->next_free;
+    return r;
+}
+
+static void block_queue_entry_free(BlockQueueEntry* r) {
+    r->next_free = free_queue_entries;
+    free_queue_entries = r;
+}
+
+// Tries to join the new transfer onto a queued request that ends where it
+// starts (or starts where it ends), so both go out as one command.
+static int block_queue_merge(BlockDevice* dev, uint64_t lba, uint32_t count, uint8_t* buf, int write) {
+    BlockQueue* q = &dev->queue;
+    for (int i = q->count - 1; i >= 0; i--) {
+        BlockQueueEntry* r = q->reqs[i];
+        if (r->write != write || r->count + count > dev->caps.max_sectors) continue;
+        uint32_t len = count * BLOCK_SECTOR_SIZE;
+
+        if (r->lba + r->count == lba) {
+            BlockSegment* last = &r->segs[r->nsegs - 1];
+            if ((uint8_t*)last->addr + last->len == buf) {
+                last->len += len;
+            } else if (r->nsegs < BLOCK_QUEUE_SEGMENTS) {
+                r->segs[r->nsegs].addr = buf;
+                r->segs[r->nsegs].len = len;
+                r->nsegs++;
+            } else {
+                continue;
+            }
+            r->count += count;
+            return 1;
+        }
+        if (lba + count == r->lba) {
+            BlockSegment* first = &r->segs[0];
+            if (buf + len == (uint8_t*)first->addr) {
+                first->addr = buf;
+                first->len += len;
+            } else if (r->nsegs < BLOCK_QUEUE_SEGMENTS) {
+                for (int s = r->nsegs; s > 0; s--) r->segs[s] = r->segs[s - 1];
+                r->segs[0].addr = buf;
+                r->segs[0].len = len;
+                r->nsegs++;
+            } else {
+                continue;
+            }
+            r->lba = lba;
+            r->count += count;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+int block_queue_add(BlockDevice* dev, uint64_t lba, uint32_t count, void* buf, int write) {
+    if (!dev || count == 0 || lba + count > dev->caps.sector_count) return -1;
+    BlockQueue* q = &dev->queue;
+    q->queued++;
+
+    // Oversized requests are split so each piece can still merge.
+    if (count > dev->caps.max_sectors) {
+        uint8_t* p = (uint8_t*)buf;
+        while (count > 0) {
+            uint32_t take = count < dev->caps.max_sectors ? count : dev->caps.max_sectors;
+            q->queued--;
+            if (block_queue_add(dev, lba, take, p, write) != 0) return -1;
+            p += take * BLOCK_SECTOR_SIZE;
+            lba += take;
+            count -= take;
+        }
+        return 0;
+    }
+
+    if (block_queue_merge(dev, lba, count, (uint8_t*)buf, write)) {
+        q->merged++;
+        return 0;
+    }
+
+    int ret = 0;
+    if (q->count == BLOCK_QUEUE_MAX) ret = block_queue_run(dev);
+    BlockQueueEntry* r = block_queue_entry_alloc();
+    if (!r) {
+        // Other devices hold the whole pool.
+        if (block_queue_run(0) != 0) ret = -1;
+        r = block_queue_entry_alloc();
+    }
+    r->lba = lba;
+    r->count = count;
+    r->write = write;
+    r->deadline_ms = timer_ms() + (write ? BLOCK_WRITE_EXPIRE_MS : BLOCK_READ_EXPIRE_MS);
+    r->nsegs = 1;
+    r->segs[0].addr = buf;
+    r->segs[0].len = count * BLOCK_SECTOR_SIZE;
+    q->reqs[q->count++] = r;
+    return ret;
+}
+
+// The first request at or past the head in LBA order, wrapping around to
+// the lowest. `write` restricts the direction; -1 takes either.
+static int block_queue_next_lba(BlockQueue* q, int write) {
+    int ahead = -1, lowest = -1;
+    for (int i = 0; i < q->count; i++) {
+        BlockQueueEntry* r = q->reqs[i];
+        if (write >= 0 && r->write != write) continue;
+        if (r->lba >= q->head_lba && (ahead < 0 || r->lba < q->reqs[ahead]->lba)) ahead = i;
+        if (lowest < 0 || r->lba < q->reqs[lowest]->lba) lowest = i;
+    }
+    return ahead >= 0 ? ahead : lowest;
+}
+
+static int block_queue_pick(BlockQueue* q) {
+    if (q->scheduler == BLOCK_SCHED_NOOP) return 0;
+    if (q->scheduler == BLOCK_SCHED_CSCAN) return block_queue_next_lba(q, -1);
+
+    // Deadline: anything past its deadline goes first, oldest first.
+    uint32_t now = timer_ms();
+    for (int i = 0; i < q->count; i++) {
+        if ((int32_t)(now - q->reqs[i]->deadline_ms) >= 0) return i;
+    }
+    // Readers wait on their data, writers usually don't: sweep the reads,
+    // letting a write through every BLOCK_WRITES_STARVED reads.
+    int read = block_queue_next_lba(q, 0);
+    int write = block_queue_next_lba(q, 1);
+    if (read >= 0 && (write < 0 || q->writes_starved < BLOCK_WRITES_STARVED)) {
+        if (write >= 0) q->writes_starved++;
+        return read;
+    }
+    q->writes_starved = 0;
+    return write;
+}
+
+int block_queue_run(BlockDevice* dev) {
+    if (!dev) {
+        int ret = 0;
+        for (int i = 0; i < device_count; i++) {
+            if (devices[i]->queue.count && block_queue_run(devices[i]) != 0) ret = -1;
+        }
+        return ret;
+    }
+
+    BlockQueue* q = &dev->queue;
+    int ret = 0;
+    while (q->count > 0) {
+        int i = block_queue_pick(q);
+        BlockQueueEntry* r = q->reqs[i];
+        for (int j = i; j + 1 < q->count; j++) q->reqs[j] = q->reqs[j + 1];
+        q->count--;
+
+        q->seek_sectors += r->lba > q->head_lba ? r->lba - q->head_lba : q->head_lba - r->lba;
+        q->head_lba = r->lba + r->count;
+        q->dispatched++;
+        int err = r->write ? block_dev_writev(dev, r->lba, r->segs, r->nsegs)
+                           : block_dev_readv(dev, r->lba, r->segs, r->nsegs);
+        if (err != 0) ret = -1;
+        block_queue_entry_free(r);
+    }
+    return ret;
+}
+
+void block_set_scheduler(BlockDevice* dev, BlockScheduler scheduler) {
+    block_queue_run(dev);
+    dev->queue.scheduler = scheduler;
+    dev->queue.writes_starved = 0;
+}
+
+const char* block_scheduler_name(BlockScheduler scheduler) {
+    if (scheduler == BLOCK_SCHED_DEADLINE) return "deadline";
+    if (scheduler == BLOCK_SCHED_CSCAN) return "cscan";
+    return "noop";
+}
+
+// The active-device calls below go through the buffer cache.
+int block_read(uint64_t lba, uint32_t count, void* buf) {
+    return bcache_read(active_device, lba, count, buf);
+}
+
+int block_write(uint64_t lba, uint32_t count, const void* buf) {
+    return bcache_write(active_device, lba, count, buf);
+}
+
+int block_readv(uint64_t lba, const BlockSegment* segs, int nsegs) {
+    for (int i = 0; i < nsegs; i++) {
+        if (segs[i].len == 0 || segs[i].len % BLOCK_SECTOR_SIZE) return -1;
+        uint32_t count = segs[i].len / BLOCK_SECTOR_SIZE;
+        if (bcache_read(active_device, lba, count, segs[i].addr) != 0) return -1;
+        lba += count;
+    }
+    return 0;
+}
+
+int block_writev(uint64_t lba, const BlockSegment* segs, int nsegs) {
+    for (int i = 0; i < nsegs; i++) {
+        if (segs[i].len == 0 || segs[i].len % BLOCK_SECTOR_SIZE) return -1;
+        uint32_t count = segs[i].len / BLOCK_SECTOR_SIZE;
+        if (bcache_write(active_device, lba, count, segs[i].addr) != 0) return -1;
+        lba += count;
+    }
+    return 0;
+}
+
+// The partial sector at `lba`, `skip` bytes in, through a bounce buffer;
+// writes are read-modify-write.
+static int block_partial(uint64_t lba, uint32_t skip, uint8_t* p, uint32_t len, int write) {
+    uint8_t* bounce = block_bounce_get();
+    if (!bounce) return -1;
+    int ret = bcache_read(active_device, lba, 1, bounce);
+    if (ret == 0) {
+        if (write) {
+            memcpy(bounce + skip, p, len);
+            ret = bcache_write(active_device, lba, 1, bounce);
+        } else {
+            memcpy(p, bounce + skip, len);
+        }
+    }
+    block_bounce_put(bounce);
+    return ret;
+}
+
+static int block_bytes(uint64_t offset, uint8_t* p, uint32_t len, int write) {
+    if (!active_device) return -1;
+    uint64_t lba = offset / BLOCK_SECTOR_SIZE;
+    uint32_t skip = (uint32_t)(offset % BLOCK_SECTOR_SIZE);
+    if (skip && len > 0) {
+        uint32_t n = BLOCK_SECTOR_SIZE - skip;
+        if (n > len) n = len;
+        if (block_partial(lba, skip, p, n, write) != 0) return -1;
+        p += n;
+        len -= n;
+        lba++;
+    }
+    uint32_t whole = len / BLOCK_SECTOR_SIZE;
+    if (whole > 0) {
+        int ret = write ? bcache_write(active_device, lba, whole, p) : bcache_read(active_device, lba, whole, p);
+        if (ret != 0) return -1;
+        p += whole * BLOCK_SECTOR_SIZE;
+        len -= whole * BLOCK_SECTOR_SIZE;
+        lba += whole;
+    }
+    if (len > 0) return block_partial(lba, 0, p, len, write);
+    return 0;
+}
+
+int block_read_bytes(uint64_t offset, void* buf, uint32_t len) {
+    return block_bytes(offset, (uint8_t*)buf, len, 0);
+}
+
+int block_write_bytes(uint64_t offset, const void* buf, uint32_t len) {
+    return block_bytes(offset, (uint8_t*)buf, len, 1);
+}
+
+int block_write_fua(uint64_t lba, uint32_t count, const void* buf) {
+    return bcache_write_fua(active_device, lba, count, buf);
+}
+
+int block_flush() {
+    if (!active_device) return -1;
+    if (bcache_sync(active_device) != 0) return -1;
+    return block_dev_flush(active_device);
+}
+
+int block_discard(const BlockRange* ranges, int nranges) {
+    return block_dev_discard(active_device, ranges, nranges);
+}
+
+int block_sync_all() {
+    int ret = bcache_sync(0);
+    for (int i = 0; i < device_count; i++) {
+        if (block_dev_flush(devices[i]) != 0) ret = -1;
+    }
+    return ret;
+}
@@ -3,17 +3,262 @@
 
 #include <stdint.h>
 
+#define BLOCK_SECTOR_SIZE 512
+#define BLOCK_MAX_DEVICES 16
+#define BLOCK_MAX_SEGMENTS 64 // Most segments one vectored command may carry
+
+// Capability flags, filled in by each driver from its IDENTIFY data.
+#define BLOCK_CAP_LBA48       (1 << 0) // 48-bit addressing
+#define BLOCK_CAP_DMA         (1 << 1) // Transfers by DMA rather than PIO
+#define BLOCK_CAP_MULTIPLE    (1 << 2) // READ/WRITE MULTIPLE
+#define BLOCK_CAP_NCQ         (1 << 3) // Native Command Queuing
+#define BLOCK_CAP_WRITE_CACHE (1 << 4) // Volatile write cache is enabled
+#define BLOCK_CAP_FUA         (1 << 5) // Forced Unit Access writes
+#define BLOCK_CAP_DISCARD     (1 << 6) // Unused sectors can be handed back (TRIM)
+
+typedef enum {
+    BLOCK_TYPE_PATA,
+    BLOCK_TYPE_SATA,
+    BLOCK_TYPE_RAID,
+    BLOCK_TYPE_RAM,
+    BLOCK_TYPE_VIRTIO,
+    BLOCK_TYPE_NVME,
+    BLOCK_TYPE_CACHE
+} BlockDeviceType;
+
+// Capability descriptor for one device.
+typedef struct {
+    uint64_t sector_count;     // Capacity in 512-byte sectors
+    uint32_t max_sectors;      // Largest transfer one command can carry
+    uint32_t flags;            // BLOCK_CAP_*
+    uint8_t  udma_modes;       // Bitmask of supported Ultra DMA modes (0-6)
+    uint8_t  mwdma_modes;      // Bitmask of supported Multiword DMA modes (0-2)
+    uint8_t  multiple_sectors; // Sectors per DRQ block for READ/WRITE MULTIPLE
+    uint8_t  queue_depth;      // Commands the device can hold at once (1 without NCQ)
+    uint16_t max_segments;     // Segments one readv/writev command accepts
+    uint16_t max_discard_ranges;  // Ranges one discard command carries
+    uint32_t max_discard_sectors; // Longest single discard range
+} BlockCaps;
+
+// One piece of a vectored transfer. `len` is a multiple of
+// BLOCK_SECTOR_SIZE; consecutive segments cover consecutive sectors.
+typedef struct {
+    void*    addr;
+    uint32_t len;
+} BlockSegment;
+
+// A run of sectors, for discard.
+typedef struct {
+    uint64_t lba;
+    uint32_t count;
+} BlockRange;
+
+typedef struct BlockDevice BlockDevice;
+typedef struct BlockQueueEntry BlockQueueEntry;
+
+// How a device's request queue orders dispatch. Every scheduler merges
+// requests for adjacent LBAs in the same direction.
+typedef enum {
+    BLOCK_SCHED_NOOP,     // Arrival order; for drives that reorder themselves (NCQ)
+    BLOCK_SCHED_DEADLINE, // LBA order with reads first, but nothing waits past its deadline
+    BLOCK_SCHED_CSCAN     // Ascending LBA sweeps that wrap to the lowest pending LBA
+} BlockScheduler;
+
+#define BLOCK_QUEUE_MAX 64 // Requests one device holds before it is run
+
+// Per-device request queue. Requests wait here until block_queue_run.
+typedef struct {
+    BlockScheduler scheduler;
+    int count;
+    BlockQueueEntry* reqs[BLOCK_QUEUE_MAX]; // Arrival order
+    uint64_t head_lba;                   // Where the last dispatch ended
+    int writes_starved;                  // Reads dispatched while writes waited
+    uint32_t queued;                     // Requests added
+    uint32_t merged;                     // ...of which joined an earlier request
+    uint32_t dispatched;                 // Requests handed to the driver
+    uint64_t seek_sectors;               // Sum of |start - head_lba| over dispatches
+} BlockQueue;
+
+// Completion of an asynchronous driver command; `status` is 0 on success.
+// May run in interrupt context.
+typedef void (*block_callback_t)(void* ctx, int status);
+
+// Driver entry points. `count` never exceeds caps.max_sectors; the block
+// layer splits larger requests. Vectored calls carry at most
+// caps.max_segments segments and caps.max_sectors sectors in total.
+// Everything after `read` and `write` may be NULL.
+typedef struct {
+    int (*read)(BlockDevice* dev, uint64_t lba, uint32_t count, void* buf);
+    int (*write)(BlockDevice* dev, uint64_t lba, uint32_t count, const void* buf);
+    int (*write_fua)(BlockDevice* dev, uint64_t lba, uint32_t count, const void* buf);
+    int (*flush)(BlockDevice* dev);
+    int (*readv)(BlockDevice* dev, uint64_t lba, const BlockSegment* segs, int nsegs);
+    int (*writev)(BlockDevice* dev, uint64_t lba, const BlockSegment* segs, int nsegs);
+    // Asynchronous form of readv/writev, same limits. Returns 0 once the
+    // command is queued, 1 if every slot is busy (wait_event and retry),
+    // -1 if the request is invalid.
+    int (*submit)(BlockDevice* dev, uint64_t lba, const BlockSegment* segs, int nsegs, int write,
+                  block_callback_t callback, void* ctx);
+    // Waits for progress on submitted commands. Called with interrupts
+    // off right after checking the wait condition; returns with them on.
+    void (*wait_event)(BlockDevice* dev);
+    // Fails every outstanding command (callbacks run), for timeouts.
+    void (*abort)(BlockDevice* dev);
+    // Reaps finished commands without waiting. Returns how many finished.
+    int (*poll)(BlockDevice* dev);
+    // Tells the device about commands submitted since the last commit.
+    // Drivers that batch notifications set this; submit alone may not
+    // start anything, though wait_event always does.
+    void (*commit)(BlockDevice* dev);
+    // Tells the device the ranges hold nothing worth keeping. At most
+    // caps.max_discard_ranges ranges, each caps.max_discard_sectors long
+    // at most, sorted and not overlapping.
+    int (*discard)(BlockDevice* dev, const BlockRange* ranges, int nranges);
+} BlockDeviceOps;
+
+struct BlockDevice {
+    char name[8];              // "hda".."hdd" for PATA, "sda".. for AHCI ports, "md0".. for RAID, "ram0", "vda".. for virtio, "nvme0n1", "cache0"
+    BlockDeviceType type;
+    const BlockDeviceOps* ops;
+    BlockCaps caps;
+    void* driver_data;         // Owned by the driver
+    BlockQueue queue;
+};
+
+#define BLOCK_STATUS_PENDING 1 // BlockRequest.status until the request completes
+
+// One asynchronous transfer. The caller owns the memory and fills in the
+// first block of fields; it must stay valid (as must `buf`) until
+// `status` leaves BLOCK_STATUS_PENDING.
+typedef struct {
+    BlockDevice* dev;
+    uint64_t lba;
+    uint32_t count;
+    void* buf;
+    int write;
+    block_callback_t callback; // Optional; may run in interrupt context
+    void* ctx;                 // Passed to `callback`
+    volatile int status;       // BLOCK_STATUS_PENDING, then 0 or -1
+    // Private to block.c
+    volatile uint32_t outstanding;
+    volatile uint32_t errors;
+} BlockRequest;
+
 // Global flag to indicate if any usable block device was found.
 extern int block_device_available;
 
 // Initializes the block device subsystem.
-// It will probe for ATA and SATA devices and select one to use.
+// It probes every PATA position and AHCI port, registers each usable
+// device, and selects the fastest one for block_read/block_write.
 void block_init();
 
+// Adds a device to the registry. Returns its index, or -1 if full.
+int block_register(BlockDevice* dev);
+
+int block_device_count();
+BlockDevice* block_get_device(int index);
+BlockDevice* block_find_device(const char* name);
+
+// The device that block_read/block_write (and so hdd_fs) operate on.
+void block_select(BlockDevice* dev);
+BlockDevice* block_active_device();
+
+// Ranks registered devices by their capability descriptors (queueing, DMA,
+// per-command size) and returns the best, or NULL if none exist.
+BlockDevice* block_fastest_device();
+
+// Prints one line per registered device with its capabilities.
+void block_print_devices();
+
+// Starts `req` and returns without waiting where the driver allows it:
+// the range is split into maximal commands that run concurrently. On
+// synchronous-only drivers it completes before returning. Submitting may
+// still wait for a free command slot. Returns -1 (with `status` -1 and
+// the callback run) if the request is invalid, else 0.
+// Like block_dev_read, this works below the buffer cache.
+int block_submit(BlockRequest* req);
+
+// Reaps finished commands on `dev` without waiting, running callbacks.
+// Only polled backends need it; with interrupts completions come anyway.
+int block_poll(BlockDevice* dev);
+
+// Waits until `req` completes and returns its status. Gives up after
+// BLOCK_TIMEOUT_MS, failing every command outstanding on the device.
+#define BLOCK_TIMEOUT_MS 10000
+int block_wait(BlockRequest* req);
+
+// Per-device transfers, split into maximal commands. Return 0 on success.
+// block_dev_read/block_dev_write are block_submit plus block_wait. Buffers
+// aligned to BLOCK_DMA_ALIGN are used for DMA directly; others are copied
+// through a bounce buffer. block_submit and the vectored calls take
+// aligned buffers only.
+#define BLOCK_DMA_ALIGN 4
+int block_dev_read(BlockDevice* dev, uint64_t lba, uint32_t count, void* buf);
+int block_dev_write(BlockDevice* dev, uint64_t lba, uint32_t count, const void* buf);
+int block_dev_write_fua(BlockDevice* dev, uint64_t lba, uint32_t count, const void* buf);
+int block_dev_flush(BlockDevice* dev);
+
+// Declares the ranges unused: cached data for them is dropped (dirty or
+// not) and, where the device supports it, they are discarded in as few
+// commands as possible after sorting and merging. Reads of discarded
+// sectors return unspecified data. Returns -1 if a command failed; a
+// device without discard support succeeds without doing anything more.
+int block_dev_discard(BlockDevice* dev, const BlockRange* ranges, int nranges);
+
+// Vectored transfers: `nsegs` segments starting at `lba`. Segments are
+// packed into as few scatter-gather commands as the device allows; devices
+// without vectored support get one transfer per segment.
+int block_dev_readv(BlockDevice* dev, uint64_t lba, const BlockSegment* segs, int nsegs);
+int block_dev_writev(BlockDevice* dev, uint64_t lba, const BlockSegment* segs, int nsegs);
+
+// Queues a transfer on `dev` without starting it. `buf` must stay valid
+// until the queue has run. A full queue is run first to make room;
+// returns -1 if that run failed or the request is invalid.
+int block_queue_add(BlockDevice* dev, uint64_t lba, uint32_t count, void* buf, int write);
+
+// Dispatches everything queued on `dev` (every device if NULL) in the
+// order its scheduler picks. Returns -1 if any request failed.
+int block_queue_run(BlockDevice* dev);
+
+// Chooses the scheduler; PATA disks start on deadline, the rest on noop.
+void block_set_scheduler(BlockDevice* dev, BlockScheduler scheduler);
+const char* block_scheduler_name(BlockScheduler scheduler);
+
 // Reads `count` sectors from `lba` into `buf`. Returns 0 on success.
-int block_read(uint64_t lba, uint16_t count, void* buf);
+// Served from the buffer cache (bcache.h) where possible; misses and
+// large requests are split into as few maximal commands as possible.
+int block_read(uint64_t lba, uint32_t count, void* buf);
 
 // Writes `count` sectors from `buf` to `lba`. Returns 0 on success.
-int block_write(uint64_t lba, uint16_t count, const void* buf);
+// Small writes stay dirty in the buffer cache, and with a drive write
+// cache the data may not be on the media yet either; see below.
+int block_write(uint64_t lba, uint32_t count, const void* buf);
+
+// Vectored forms of block_read/block_write on the active device.
+int block_readv(uint64_t lba, const BlockSegment* segs, int nsegs);
+int block_writev(uint64_t lba, const BlockSegment* segs, int nsegs);
+
+// Byte-granular forms of block_read/block_write: `offset` is a byte
+// offset on the active device. Whole sectors in the middle move straight
+// between the disk (or cache) and `buf`; only partial sectors at either
+// end are bounced, and partial writes read the rest of the sector first.
+// Nothing outside buf[0..len) is touched.
+int block_read_bytes(uint64_t offset, void* buf, uint32_t len);
+int block_write_bytes(uint64_t offset, const void* buf, uint32_t len);
+
+// Writes that are on the media when this returns: a FUA write where the
+// device has one, otherwise a write followed by a flush.
+int block_write_fua(uint64_t lba, uint32_t count, const void* buf);
+
+// Barrier: writes back the buffer cache and returns once every completed
+// write is on the media, so later writes can't reach the disk ahead of
+// earlier ones.
+int block_flush();
+
+// block_dev_discard on the active device.
+int block_discard(const BlockRange* ranges, int nranges);
+
+// block_flush for every registered device (the `sync` command).
+int block_sync_all();
 
-#endif // BLOCK_H
\ No newline at end of file
+#endif // BLOCK_H
@@ -9,10 +9,14 @@ section .multiboot           ; Multiboot header (GRUB reads this)
 section .text
     global start
     extern main             ; The C kernel function
+    extern multiboot_magic  ; Handoff registers, kept for the C side (kernel.c)
+    extern multiboot_info
 
 start:
     cli                     ; Disable interrupts
     mov esp, stack_space    ; Set stack pointer
+    mov [multiboot_magic], eax ; 0x2BADB002 when loaded by a Multiboot loader
+    mov [multiboot_info], ebx  ; Physical address of the Multiboot info block
     call main               ; Call C kernel entry (kernel.c)
     hlt                     ; Halt when done
 
@@ -34,8 +34,9 @@
 #define CDG_INSTR_LOAD_CLUT_LOW   30
 #define CDG_INSTR_LOAD_CLUT_HIGH  31
 
-#define MAX_CDG_FILE_SIZE (CDG_PACKET_SIZE * 30000)
-static uint8_t file_buffer[MAX_CDG_FILE_SIZE];
+// Packets are streamed from the file this many at a time.
+#define CDG_READ_PACKETS 128
+static uint8_t packet_buffer[CDG_PACKET_SIZE * CDG_READ_PACKETS];
 
 // --- VGA DAC (Palette) Programming ---
 static void program_dac_color(uint8_t index, uint8_t r, uint8_t g, uint8_t b) {
@@ -131,8 +132,9 @@ void cdg_player_start(const char* filename) {
     print_string(filename);
     new_line();
 
-    int bytes_read = fs_read_file(filename, (char*)file_buffer);
-    if (bytes_read <= 0) {
+    int fd = fs_open(filename);
+    if (fd < 0 || fs_size(fd) < CDG_PACKET_SIZE) {
+        if (fd >= 0) fs_close(fd);
         print_string("Error: Could not read file or file is empty.\n");
         return;
     }
@@ -143,21 +145,27 @@ void cdg_player_start(const char* filename) {
     set_graphics_mode();
     memset((void*)GFX_VIDEO_MEMORY, 0, GFX_SCREEN_WIDTH * GFX_SCREEN_HEIGHT);
 
-    int total_packets = bytes_read / CDG_PACKET_SIZE;
     int packet_batch_size = 25;
+    int i = 0;
+    int stopped = 0;
+    int bytes_read;
+
+    while (!stopped && (bytes_read = fs_read(fd, packet_buffer, sizeof(packet_buffer))) >= CDG_PACKET_SIZE) {
+        int packets = bytes_read / CDG_PACKET_SIZE;
+        for (int p = 0; p < packets; p++, i++) {
+            if ((inb(0x64) & 1) && inb(0x60) == 1) {
+                stopped = 1;
+                break;
+            }
 
-    for (int i = 0; i < total_packets; i++) {
-        if ((inb(0x64) & 1) && inb(0x60) == 1) {
-            break;
-        }
-
-        const uint8_t* packet = &file_buffer[i * CDG_PACKET_SIZE];
-        handle_g_packet(packet);
+            handle_g_packet(&packet_buffer[p * CDG_PACKET_SIZE]);
 
-        if (i % packet_batch_size == 0) {
-            kernel_delay(1500000);
+            if (i % packet_batch_size == 0) {
+                kernel_delay(1500000);
+            }
         }
     }
+    fs_close(fd);
 
     set_text_mode();
     clear_screen();
@@ -0,0 +1,592 @@
+#include "diskbench.h"
+#include "block.h"
+#include "ata.h"
+#include "ahci.h"
+#include "virtio_blk.h"
+#include "timer.h"
+#include "shell.h"
+#include <stdint.h>
+
+// 2 MB: the largest file hdd_fs can hold, read sequentially from LBA 0.
+#define BENCH_TOTAL_SECTORS 4096
+#define BENCH_CHUNK_SECTORS 128
+
+__attribute__((aligned(4096))) static uint8_t bench_buffer[BENCH_CHUNK_SECTORS * 512];
+
+// Device the current benchmark runs against.
+static BlockDevice* bench_device = 0;
+
+// The ATA mode switches are driver-wide, so the PATA benchmarks use the
+// first registered PATA disk regardless of which device hdd_fs is on.
+static int bench_select_pata() {
+    for (int i = 0; i < block_device_count(); i++) {
+        BlockDevice* dev = block_get_device(i);
+        if (dev->type == BLOCK_TYPE_PATA) {
+            bench_device = dev;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Prints `bytes` over `us` as "N.NN MB/s" (1 byte/us == 1 MB/s).
+static void print_rate(uint32_t bytes, uint32_t us) {
+    if (us == 0) us = 1;
+    uint32_t centi = (uint32_t)udiv64((uint64_t)bytes * 100, us, 0);
+    print_int(centi / 100);
+    print_char('.');
+    if (centi % 100 < 10) print_char('0');
+    print_int(centi % 100);
+    print_string(" MB/s");
+}
+
+// Prints a/b as "N.NNx".
+static void print_ratio(uint32_t a, uint32_t b) {
+    if (b == 0) b = 1;
+    uint32_t centi = (uint32_t)udiv64((uint64_t)a * 100, b, 0);
+    print_int(centi / 100);
+    print_char('.');
+    if (centi % 100 < 10) print_char('0');
+    print_int(centi % 100);
+    print_char('x');
+}
+
+// Times a sequential read of BENCH_TOTAL_SECTORS through the block layer.
+// Returns the elapsed microseconds, or 0 if any read failed.
+static uint32_t bench_sequential_read() {
+    uint32_t start = timer_us();
+    for (uint32_t lba = 0; lba < BENCH_TOTAL_SECTORS; lba += BENCH_CHUNK_SECTORS) {
+        if (block_dev_read(bench_device, lba, BENCH_CHUNK_SECTORS, bench_buffer) != 0) return 0;
+    }
+    uint32_t us = timer_us() - start;
+    return us ? us : 1;
+}
+
+// Per-sector PIO (one inw per word) against READ MULTIPLE with rep insw.
+static void bench_pio() {
+    if (!bench_select_pata()) {
+        print_string("diskbench: PIO test needs a PATA drive.\n");
+        return;
+    }
+    int saved_mode = ata_get_pio_mode();
+    int saved_dma = ata_get_dma_enabled();
+    uint32_t bytes = BENCH_TOTAL_SECTORS * 512;
+
+    ata_set_dma_enabled(0);
+    ata_set_pio_mode(ATA_PIO_SINGLE);
+    uint32_t single_us = bench_sequential_read();
+
+    ata_set_pio_mode(ATA_PIO_MULTIPLE);
+    int have_multiple = (bench_device->caps.flags & BLOCK_CAP_MULTIPLE) != 0;
+    uint32_t multiple_us = have_multiple ? bench_sequential_read() : 0;
+
+    ata_set_pio_mode(saved_mode);
+    ata_set_dma_enabled(saved_dma);
+
+    print_string("Sequential read, ");
+    print_int(bytes / 1024);
+    print_string(" KB:\n");
+    print_string("  PIO per-sector : ");
+    if (single_us) print_rate(bytes, single_us); else print_string("read error");
+    new_line();
+    print_string("  PIO multiple   : ");
+    if (!have_multiple) print_string("not supported by drive");
+    else if (multiple_us) print_rate(bytes, multiple_us);
+    else print_string("read error");
+    new_line();
+    if (single_us && multiple_us) {
+        print_string("  Speedup        : ");
+        print_ratio(single_us, multiple_us);
+        new_line();
+    }
+}
+
+// Times `BENCH_LATENCY_READS` single-sector reads scattered over the first
+// BENCH_TOTAL_SECTORS sectors. Returns 0 if any read failed.
+#define BENCH_LATENCY_READS 256
+static int bench_latency(uint32_t* avg_us, uint32_t* max_us) {
+    uint32_t total = 0, worst = 0;
+    for (uint32_t i = 0; i < BENCH_LATENCY_READS; i++) {
+        uint32_t lba = (i * 7919) % BENCH_TOTAL_SECTORS;
+        uint64_t start = timer_read_tsc();
+        if (block_dev_read(bench_device, lba, 1, bench_buffer) != 0) return 0;
+        uint32_t us = timer_tsc_to_us(timer_read_tsc() - start);
+        total += us;
+        if (us > worst) worst = us;
+    }
+    *avg_us = total / BENCH_LATENCY_READS;
+    *max_us = worst;
+    return 1;
+}
+
+static void print_latency(const char* label, int ok, uint32_t avg_us, uint32_t max_us) {
+    print_string(label);
+    if (!ok) {
+        print_string("read error\n");
+        return;
+    }
+    print_string("avg ");
+    print_int(avg_us);
+    print_string(" us, max ");
+    print_int(max_us);
+    print_string(" us\n");
+}
+
+// Busy-polling the status port against sleeping in hlt until IRQ14.
+static void bench_irq() {
+    if (!bench_select_pata()) {
+        print_string("diskbench: IRQ test needs a PATA drive.\n");
+        return;
+    }
+    int saved_mode = ata_get_completion_mode();
+    uint32_t poll_avg, poll_max, irq_avg, irq_max;
+
+    ata_set_completion_mode(ATA_COMPLETION_POLL);
+    int poll_ok = bench_latency(&poll_avg, &poll_max);
+    ata_set_completion_mode(ATA_COMPLETION_IRQ);
+    int irq_ok = bench_latency(&irq_avg, &irq_max);
+    ata_set_completion_mode(saved_mode);
+
+    print_string("Single-sector read latency, ");
+    print_int(BENCH_LATENCY_READS);
+    print_string(" reads:\n");
+    print_latency("  Polling : ", poll_ok, poll_avg, poll_max);
+    print_latency("  IRQ14   : ", irq_ok, irq_avg, irq_max);
+}
+
+// Best PIO path (READ MULTIPLE if the drive has it) against bus-master DMA.
+static void bench_dma() {
+    if (!bench_select_pata()) {
+        print_string("diskbench: DMA test needs a PATA drive.\n");
+        return;
+    }
+    if (!(bench_device->caps.flags & BLOCK_CAP_DMA)) {
+        print_string("diskbench: no bus-master DMA on this controller/drive.\n");
+        return;
+    }
+    int saved_dma = ata_get_dma_enabled();
+    int saved_pio = ata_get_pio_mode();
+    uint32_t bytes = BENCH_TOTAL_SECTORS * 512;
+
+    ata_set_dma_enabled(0);
+    ata_set_pio_mode(ATA_PIO_MULTIPLE);
+    uint32_t pio_us = bench_sequential_read();
+    ata_set_dma_enabled(1);
+    uint32_t dma_us = bench_sequential_read();
+
+    ata_set_pio_mode(saved_pio);
+    ata_set_dma_enabled(saved_dma);
+
+    print_string("Sequential read, ");
+    print_int(bytes / 1024);
+    print_string(" KB:\n");
+    print_string("  PIO : ");
+    if (pio_us) print_rate(bytes, pio_us); else print_string("read error");
+    new_line();
+    print_string("  DMA : ");
+    if (dma_us) print_rate(bytes, dma_us); else print_string("read error");
+    new_line();
+    if (pio_us && dma_us) {
+        print_string("  Speedup : ");
+        print_ratio(pio_us, dma_us);
+        new_line();
+    }
+}
+
+// --- Queue depth ---
+// Random 4 KB reads over the first 1 GB of the first SATA disk, keeping
+// up to `depth` commands in flight through ahci_submit/ahci_poll.
+#define BENCH_QD_MAX      32
+#define BENCH_QD_READS    2048
+#define BENCH_QD_SECTORS  8
+#define BENCH_QD_SPAN     (1024 * 1024 * 2) // Sectors
+#define BENCH_QD_TIMEOUT_US 30000000
+
+__attribute__((aligned(4096))) static uint8_t bench_qd_buffer[BENCH_QD_MAX][BENCH_QD_SECTORS * 512];
+static volatile uint8_t bench_qd_inflight[BENCH_QD_MAX];
+static volatile uint32_t bench_qd_completed;
+static volatile uint32_t bench_qd_errors;
+static uint32_t bench_rand_state = 0x12345678;
+
+static uint32_t bench_rand() {
+    // xorshift32
+    bench_rand_state ^= bench_rand_state << 13;
+    bench_rand_state ^= bench_rand_state >> 17;
+    bench_rand_state ^= bench_rand_state << 5;
+    return bench_rand_state;
+}
+
+static void bench_qd_done(void* ctx, int status) {
+    bench_qd_inflight[(uint32_t)ctx] = 0;
+    bench_qd_completed++;
+    if (status != 0) bench_qd_errors++;
+}
+
+// Returns the elapsed microseconds for BENCH_QD_READS reads, or 0 on error.
+static uint32_t bench_qd_run(AhciPort* ap, int depth, uint32_t span) {
+    uint32_t issued = 0;
+    bench_qd_completed = 0;
+    bench_qd_errors = 0;
+    for (int i = 0; i < BENCH_QD_MAX; i++) bench_qd_inflight[i] = 0;
+
+    uint32_t start = timer_us();
+    while (bench_qd_completed < BENCH_QD_READS) {
+        for (int i = 0; i < depth && issued < BENCH_QD_READS; i++) {
+            if (bench_qd_inflight[i]) continue;
+            uint32_t lba = (bench_rand() % span) & ~(uint32_t)(BENCH_QD_SECTORS - 1);
+            // Completions run from the IRQ, so mark the slot before submitting.
+            bench_qd_inflight[i] = 1;
+            int ret = ahci_submit(ap, lba, BENCH_QD_SECTORS, bench_qd_buffer[i], 0,
+                                  bench_qd_done, (void*)(uint32_t)i);
+            if (ret != 0) {
+                bench_qd_inflight[i] = 0;
+                if (ret < 0) return 0;
+                break; // Every slot is busy
+            }
+            issued++;
+        }
+        ahci_poll(ap);
+        if (bench_qd_errors) return 0;
+        if (timer_us() - start > BENCH_QD_TIMEOUT_US) {
+            print_string("diskbench: queue stalled.\n");
+            return 0;
+        }
+    }
+    uint32_t us = timer_us() - start;
+    return us ? us : 1;
+}
+
+static void bench_qd() {
+    BlockDevice* dev = 0;
+    for (int i = 0; i < block_device_count(); i++) {
+        if (block_get_device(i)->type == BLOCK_TYPE_SATA) {
+            dev = block_get_device(i);
+            break;
+        }
+    }
+    if (!dev) {
+        print_string("diskbench: queue depth test needs a SATA drive.\n");
+        return;
+    }
+    AhciPort* ap = (AhciPort*)dev->driver_data;
+    uint32_t span = BENCH_QD_SPAN;
+    if (dev->caps.sector_count < span) span = (uint32_t)dev->caps.sector_count;
+
+    static const int depths[] = { 1, 4, 8, 32 };
+    print_string("Random 4 KB reads on ");
+    print_string(dev->name);
+    print_string(dev->caps.flags & BLOCK_CAP_NCQ ? " (NCQ, drive qd " : " (no NCQ, drive qd ");
+    print_int(dev->caps.queue_depth);
+    print_string("), ");
+    print_int(BENCH_QD_READS);
+    print_string(" reads:\n");
+
+    uint32_t qd1_us = 0;
+    for (int d = 0; d < 4; d++) {
+        uint32_t irqs = ahci_interrupt_count();
+        uint32_t us = bench_qd_run(ap, depths[d], span);
+        irqs = ahci_interrupt_count() - irqs;
+        if (d == 0) qd1_us = us;
+        print_string("  QD ");
+        if (depths[d] < 10) print_char(' ');
+        print_int(depths[d]);
+        print_string(" : ");
+        if (!us) {
+            print_string("read error\n");
+            continue;
+        }
+        print_int((uint32_t)udiv64((uint64_t)BENCH_QD_READS * 1000000, us, 0));
+        print_string(" IOPS");
+        if (d > 0 && qd1_us) {
+            print_string(" (");
+            print_ratio(qd1_us, us);
+            print_string(")");
+        }
+        print_string(", ");
+        print_int(irqs);
+        print_string(" irqs");
+        new_line();
+    }
+}
+
+// --- Scheduler replay ---
+// A synthetic trace in the shape of filesystem traffic: four files read
+// in interleaved 4 KB pieces plus scattered small reads (FIT, directory
+// and metadata lookups). Each batch of BENCH_QD_MAX requests is handed
+// over at once, as the buffer cache's write-back does, and replayed
+// straight to the disk in arrival order (the old behaviour) and through
+// each scheduler's queue. Reads only, so the filesystem is left alone.
+#define BENCH_REPLAY_REQUESTS 1024
+#define BENCH_REPLAY_STREAMS  4
+#define BENCH_REPLAY_SPAN     (128 * 1024 * 2) // Sectors
+
+typedef struct {
+    uint32_t lba;
+    uint8_t count;
+} BenchReplayRequest;
+
+static BenchReplayRequest bench_trace[BENCH_REPLAY_REQUESTS];
+
+static void bench_make_trace(uint32_t span) {
+    uint32_t stream_lba[BENCH_REPLAY_STREAMS];
+    bench_rand_state = 0x2468ace1;
+    for (int s = 0; s < BENCH_REPLAY_STREAMS; s++) {
+        stream_lba[s] = (bench_rand() % (span / 2)) & ~7u;
+    }
+    for (int i = 0; i < BENCH_REPLAY_REQUESTS; i++) {
+        uint32_t r = bench_rand();
+        if (r % 4 == 0) {
+            bench_trace[i].lba = r % (span - BENCH_QD_SECTORS);
+            bench_trace[i].count = 1 + (r >> 8) % BENCH_QD_SECTORS;
+        } else {
+            int s = (r >> 4) % BENCH_REPLAY_STREAMS;
+            bench_trace[i].lba = stream_lba[s];
+            bench_trace[i].count = BENCH_QD_SECTORS;
+            stream_lba[s] += BENCH_QD_SECTORS;
+        }
+    }
+}
+
+// Replays the trace; scheduler -1 means direct, in order. Returns the
+// elapsed microseconds (0 on error) and the commands and seek distance.
+static uint32_t bench_replay(BlockDevice* dev, int scheduler, uint32_t* commands, uint64_t* seek) {
+    BlockQueue* q = &dev->queue;
+    uint64_t head = 0;
+    *commands = 0;
+    *seek = 0;
+    if (scheduler >= 0) {
+        block_set_scheduler(dev, (BlockScheduler)scheduler);
+        q->head_lba = 0;
+        q->dispatched = 0;
+        q->seek_sectors = 0;
+    }
+
+    uint32_t start = timer_us();
+    for (int i = 0; i < BENCH_REPLAY_REQUESTS; i += BENCH_QD_MAX) {
+        for (int j = 0; j < BENCH_QD_MAX; j++) {
+            BenchReplayRequest* r = &bench_trace[i + j];
+            if (scheduler < 0) {
+                *seek += r->lba > head ? r->lba - head : head - r->lba;
+                head = r->lba + r->count;
+                (*commands)++;
+                if (block_dev_read(dev, r->lba, r->count, bench_qd_buffer[j]) != 0) return 0;
+            } else if (block_queue_add(dev, r->lba, r->count, bench_qd_buffer[j], 0) != 0) {
+                return 0;
+            }
+        }
+        if (scheduler >= 0 && block_queue_run(dev) != 0) return 0;
+    }
+    uint32_t us = timer_us() - start;
+    if (scheduler >= 0) {
+        *commands = q->dispatched;
+        *seek = q->seek_sectors;
+    }
+    return us ? us : 1;
+}
+
+static void bench_sched() {
+    BlockDevice* dev = block_active_device();
+    uint32_t span = BENCH_REPLAY_SPAN;
+    if (dev->caps.sector_count < span) span = (uint32_t)dev->caps.sector_count;
+    if (span < 1024) {
+        print_string("diskbench: disk too small for the replay.\n");
+        return;
+    }
+    bench_make_trace(span);
+
+    uint32_t bytes = 0;
+    for (int i = 0; i < BENCH_REPLAY_REQUESTS; i++) bytes += bench_trace[i].count * 512;
+
+    static const char* labels[] = { "  fifo     : ", "  noop     : ", "  deadline : ", "  cscan    : " };
+    BlockScheduler saved = dev->queue.scheduler;
+    uint32_t fifo_us = 0;
+
+    print_string("Replay of ");
+    print_int(BENCH_REPLAY_REQUESTS);
+    print_string(" reads in batches of ");
+    print_int(BENCH_QD_MAX);
+    print_string(" on ");
+    print_string(dev->name);
+    print_string(":\n");
+    for (int s = -1; s <= BLOCK_SCHED_CSCAN; s++) {
+        uint32_t commands;
+        uint64_t seek;
+        uint32_t us = bench_replay(dev, s, &commands, &seek);
+        if (s < 0) fifo_us = us;
+        print_string(labels[s + 1]);
+        if (!us) {
+            print_string("read error\n");
+            continue;
+        }
+        print_int(commands);
+        print_string(" cmds, seek ");
+        print_int((uint32_t)(seek >> 11));
+        print_string(" MB, ");
+        print_rate(bytes, us);
+        if (s >= 0 && fifo_us) {
+            print_string(" (");
+            print_ratio(fifo_us, us);
+            print_string(")");
+        }
+        new_line();
+    }
+    block_set_scheduler(dev, saved);
+}
+
+// --- Backend comparison ---
+// The same three workloads on the first PATA, SATA, virtio and NVMe disk:
+// sequential 2 MB reads, random 4 KB reads one at a time, and random 4 KB
+// reads kept as deep as the device allows (up to BENCH_QD_MAX) through
+// the driver's submit op. Under QEMU this shows what the emulated ATA and
+// AHCI register interfaces cost next to the paravirtual and NVMe queues.
+#define BENCH_BACKEND_READS 512
+
+// Keeps `depth` random reads in flight through dev->ops->submit, telling
+// the device about each refill in one commit. Returns the elapsed
+// microseconds for BENCH_QD_READS reads, or 0 on error.
+static uint32_t bench_submit_run(BlockDevice* dev, int depth, uint32_t span) {
+    uint32_t issued = 0;
+    bench_qd_completed = 0;
+    bench_qd_errors = 0;
+    for (int i = 0; i < BENCH_QD_MAX; i++) bench_qd_inflight[i] = 0;
+
+    uint32_t start = timer_us();
+    while (bench_qd_completed < BENCH_QD_READS) {
+        for (int i = 0; i < depth && issued < BENCH_QD_READS; i++) {
+            if (bench_qd_inflight[i]) continue;
+            uint32_t lba = (bench_rand() % span) & ~(uint32_t)(BENCH_QD_SECTORS - 1);
+            BlockSegment seg = { bench_qd_buffer[i], BENCH_QD_SECTORS * 512 };
+            bench_qd_inflight[i] = 1;
+            int ret = dev->ops->submit(dev, lba, &seg, 1, 0, bench_qd_done, (void*)(uint32_t)i);
+            if (ret != 0) {
+                bench_qd_inflight[i] = 0;
+                if (ret < 0) return 0;
+                break; // Device queue full
+            }
+            issued++;
+        }
+        if (dev->ops->commit) dev->ops->commit(dev);
+        if (dev->ops->poll) dev->ops->poll(dev);
+        if (bench_qd_errors) return 0;
+        if (timer_us() - start > BENCH_QD_TIMEOUT_US) {
+            print_string("diskbench: queue stalled.\n");
+            if (dev->ops->abort) dev->ops->abort(dev);
+            return 0;
+        }
+    }
+    uint32_t us = timer_us() - start;
+    return us ? us : 1;
+}
+
+// Returns the elapsed microseconds for BENCH_BACKEND_READS synchronous
+// random reads, or 0 on error.
+static uint32_t bench_random_read(BlockDevice* dev, uint32_t span) {
+    uint32_t start = timer_us();
+    for (int i = 0; i < BENCH_BACKEND_READS; i++) {
+        uint32_t lba = (bench_rand() % span) & ~(uint32_t)(BENCH_QD_SECTORS - 1);
+        if (block_dev_read(dev, lba, BENCH_QD_SECTORS, bench_qd_buffer[0]) != 0) return 0;
+    }
+    uint32_t us = timer_us() - start;
+    return us ? us : 1;
+}
+
+static void print_iops(uint32_t reads, uint32_t us) {
+    if (!us) {
+        print_string("read error");
+        return;
+    }
+    print_int((uint32_t)udiv64((uint64_t)reads * 1000000, us, 0));
+    print_string(" IOPS");
+}
+
+static void bench_backends() {
+    static const BlockDeviceType types[] = { BLOCK_TYPE_PATA, BLOCK_TYPE_SATA, BLOCK_TYPE_VIRTIO, BLOCK_TYPE_NVME };
+    static const char* labels[] = { "ATA   ", "AHCI  ", "virtio", "NVMe  " };
+    uint32_t base_seq = 0;
+    int found = 0;
+
+    print_string("Sequential 2 MB, random 4 KB at QD 1 and at device depth (max ");
+    print_int(BENCH_QD_MAX);
+    print_string("):\n");
+    for (int t = 0; t < 4; t++) {
+        BlockDevice* dev = 0;
+        for (int i = 0; i < block_device_count() && !dev; i++) {
+            if (block_get_device(i)->type == types[t]) dev = block_get_device(i);
+        }
+        if (!dev) continue;
+        found++;
+        uint32_t span = BENCH_QD_SPAN;
+        if (dev->caps.sector_count < span) span = (uint32_t)dev->caps.sector_count;
+        uint32_t kicks = virtio_blk_kick_count();
+        uint32_t irqs = virtio_blk_interrupt_count();
+
+        print_string("  ");
+        print_string(labels[t]);
+        print_string(" (");
+        print_string(dev->name);
+        print_string("): ");
+        bench_device = dev;
+        uint32_t seq = bench_sequential_read();
+        if (seq) {
+            print_rate(BENCH_TOTAL_SECTORS * 512, seq);
+            if (!base_seq) {
+                base_seq = seq;
+            } else {
+                print_string(" (");
+                print_ratio(base_seq, seq);
+                print_string(")");
+            }
+        } else {
+            print_string("read error");
+        }
+        print_string(", ");
+        print_iops(BENCH_BACKEND_READS, bench_random_read(dev, span));
+        print_string(", ");
+        if (dev->ops->submit) {
+            int depth = dev->caps.queue_depth < BENCH_QD_MAX ? dev->caps.queue_depth : BENCH_QD_MAX;
+            print_iops(BENCH_QD_READS, bench_submit_run(dev, depth, span));
+            print_string(" @ qd ");
+            print_int(depth);
+        } else {
+            print_string("no queueing");
+        }
+        new_line();
+        if (types[t] == BLOCK_TYPE_VIRTIO) {
+            print_string("          ");
+            print_int(virtio_blk_kick_count() - kicks);
+            print_string(" kicks, ");
+            print_int(virtio_blk_interrupt_count() - irqs);
+            print_string(" irqs\n");
+        }
+    }
+    if (!found) print_string("diskbench: no ATA, AHCI, virtio or NVMe disk registered.\n");
+}
+
+void diskbench_command(const char *args) {
+    while (*args == ' ') args++;
+    if (!block_device_available) {
+        print_string("diskbench: no block device available.\n");
+        return;
+    }
+    if (*args == '\0' || strcmp(args, "pio") == 0) {
+        bench_pio();
+    } else if (strcmp(args, "irq") == 0) {
+        bench_irq();
+    } else if (strcmp(args, "dma") == 0) {
+        bench_dma();
+    } else if (strcmp(args, "qd") == 0) {
+        bench_qd();
+    } else if (strcmp(args, "sched") == 0) {
+        bench_sched();
+    } else if (strcmp(args, "backends") == 0) {
+        bench_backends();
+    } else {
+        print_string("Usage: diskbench [pio|irq|dma|qd|sched|backends]\n");
+        print_string("  pio - per-sector PIO vs READ MULTIPLE throughput\n");
+        print_string("  irq - polled vs interrupt-driven completion latency\n");
+        print_string("  dma - PIO vs bus-master DMA throughput\n");
+        print_string("  qd  - SATA random-read IOPS at queue depth 1/4/8/32\n");
+        print_string("  sched - FS-like trace: in-order vs noop/deadline/cscan queues\n");
+        print_string("  backends - ATA vs AHCI vs virtio-blk vs NVMe throughput and IOPS\n");
+    }
+}
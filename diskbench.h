@@ -0,0 +1,7 @@
+#ifndef DISKBENCH_H
+#define DISKBENCH_H
+
+// Runs the block-layer benchmarks selected by `args` (see `diskbench help`).
+void diskbench_command(const char *args);
+
+#endif // DISKBENCH_H
@@ -5,106 +5,327 @@ from tkinter import ttk, messagebox, simpledialog, scrolledtext, filedialog
 
 # --- Constants mirroring the C code's hdd_fs.h ---
 HDD_SECTOR_SIZE = 512
-MAX_FILENAME_LEN = 32
-MAX_FILES = 12
+MAX_FILENAME_LEN = 48
 MAX_FILE_SIZE = 2 * 1024 * 1024  # 2 MB
 
 # The filesystem starts after a 15MB offset
 FS_LBA_OFFSET = 30720  # (15 * 1024 * 1024) / 512
 
+# Version 2 layout: sector numbers below are relative to FS_LBA_OFFSET.
+FS_MAGIC = 0x5346487F  # "\x7FHFS"
+FS_VERSION = 2
+FS_CLUSTER_SECTORS = 8  # 4 KB
+FS_MAX_CLUSTER_SECTORS = 128
+FS_DIR_MAX_ENTRIES = 8192
+FS_HASH_SECTORS = 64
+FS_EXTENTS = 8
+FS_ENTRIES_PER_SECTOR = 4
+FS_BUCKETS_PER_SECTOR = 128
+FS_BITS_PER_SECTOR = HDD_SECTOR_SIZE * 8
+
+# Version 1: one sector of 12 fixed entries.
+FS_V1_MAX_FILES = 12
+FS_V1_FILENAME_LEN = 32
+
+SB_FIELDS = ('magic', 'version', 'cluster_sectors', 'total_sectors', 'dir_start', 'dir_max_entries',
+             'dir_entries', 'hash_start', 'hash_sectors', 'data_start', 'total_clusters',
+             'next_free_cluster', 'file_count', 'bitmap_start', 'bitmap_sectors', 'dir_free')
+SB_STRUCT = struct.Struct('<16I')
+# filename, size_bytes, hash_next, extent_count, flags, reserved, then (start, count) pairs
+ENTRY_STRUCT = struct.Struct(f'<{MAX_FILENAME_LEN}sIIHHI{FS_EXTENTS * 2}I')
+V1_ENTRY_STRUCT = struct.Struct(f'<{FS_V1_FILENAME_LEN}sII')
+
+
+def fs_hash(name: bytes) -> int:
+    """FNV-1a, as in hdd_fs.c."""
+    h = 2166136261
+    for b in name:
+        h ^= b
+        h = (h * 16777619) & 0xFFFFFFFF
+    return h
+
+
 class SimpleFS:
-    def __init__(self, disk_path):
+    def __init__(self, disk_path, format=False):
         self.disk_path = disk_path
-        self.fit = []
-        self.next_free_lba = 1 # Relative to the partition start
-        self.entry_struct = struct.Struct(f'<{MAX_FILENAME_LEN}sII')
+        self.sb = {}
+        self.bitmap = bytearray()
+        self.converted = False
 
-        if not os.path.exists(self.disk_path):
+        if format or not os.path.exists(self.disk_path):
             self.format_disk()
         else:
-            self._load_fit()
-            self._calculate_next_free_lba()
+            self._mount()
 
     def _get_partition_offset(self):
         return FS_LBA_OFFSET * HDD_SECTOR_SIZE
 
-    def _load_fit(self):
-        try:
-            with open(self.disk_path, "rb") as f:
-                f.seek(self._get_partition_offset()) # Seek to partition start
-                fit_data = f.read(HDD_SECTOR_SIZE)
-            
-            self.fit = []
-            for i in range(MAX_FILES):
-                entry_data = fit_data[i*self.entry_struct.size : (i+1)*self.entry_struct.size]
-                if len(entry_data) < self.entry_struct.size: break
-                
-                filename_bytes, start_lba, size_bytes = self.entry_struct.unpack(entry_data)
-                filename = filename_bytes.split(b'\0', 1)[0].decode('utf-8', 'ignore')
-                self.fit.append({"filename": filename, "start_lba": start_lba, "size_bytes": size_bytes})
-        except Exception as e:
-            raise IOError(f"Error loading FIT: {e}")
-
-    def _write_fit(self):
-        fit_data = bytearray(HDD_SECTOR_SIZE)
-        for i, entry in enumerate(self.fit):
-            filename_bytes = entry['filename'].encode('utf-8')
-            packed_entry = self.entry_struct.pack(filename_bytes, entry['start_lba'], entry['size_bytes'])
-            start, end = i * self.entry_struct.size, (i+1) * self.entry_struct.size
-            fit_data[start:end] = packed_entry
-        
+    def _read(self, sector, count=1):
+        with open(self.disk_path, "rb") as f:
+            f.seek(self._get_partition_offset() + sector * HDD_SECTOR_SIZE)
+            data = f.read(count * HDD_SECTOR_SIZE)
+        return data.ljust(count * HDD_SECTOR_SIZE, b'\0')
+
+    def _write(self, sector, data):
         with open(self.disk_path, "r+b") as f:
-            f.seek(self._get_partition_offset()) # Seek to partition start
-            f.write(fit_data)
-
-    def _calculate_next_free_lba(self):
-        self.next_free_lba = 1
-        for entry in self.fit:
-            if entry['filename']:
-                num_sectors = (entry['size_bytes'] + HDD_SECTOR_SIZE - 1) // HDD_SECTOR_SIZE
-                file_end_lba = entry['start_lba'] + num_sectors
-                if file_end_lba > self.next_free_lba:
-                    self.next_free_lba = file_end_lba
+            f.seek(self._get_partition_offset() + sector * HDD_SECTOR_SIZE)
+            f.write(data)
+
+    def _partition_sectors(self):
+        sectors = os.path.getsize(self.disk_path) // HDD_SECTOR_SIZE - FS_LBA_OFFSET
+        return max(0, min(sectors, 0xFFFFFFFF))
+
+    def _layout(self, cluster_sectors, first_sector):
+        total = self._partition_sectors()
+        hash_start = first_sector + FS_DIR_MAX_ENTRIES // FS_ENTRIES_PER_SECTOR
+        data_start = (hash_start + FS_HASH_SECTORS + cluster_sectors - 1) & ~(cluster_sectors - 1)
+        if total <= data_start + cluster_sectors:
+            raise IOError("Disk image is too small.")
+        self.sb = dict.fromkeys(SB_FIELDS, 0)
+        self.sb.update(magic=FS_MAGIC, version=FS_VERSION, cluster_sectors=cluster_sectors,
+                       total_sectors=total, dir_start=first_sector, dir_max_entries=FS_DIR_MAX_ENTRIES,
+                       hash_start=hash_start, hash_sectors=FS_HASH_SECTORS, data_start=data_start,
+                       total_clusters=(total - data_start) // cluster_sectors)
+
+    def _save_superblock(self):
+        data = SB_STRUCT.pack(*(self.sb[k] for k in SB_FIELDS))
+        self._write(0, data.ljust(HDD_SECTOR_SIZE, b'\0'))
+
+    def _zero_hash(self):
+        self._write(self.sb['hash_start'], bytes(self.sb['hash_sectors'] * HDD_SECTOR_SIZE))
+
+    def _create_bitmap(self, first):
+        """Puts an empty bitmap in the data clusters from `first` on and
+        marks those clusters used."""
+        sectors = (self.sb['total_clusters'] + FS_BITS_PER_SECTOR - 1) // FS_BITS_PER_SECTOR
+        clusters = (sectors + self.sb['cluster_sectors'] - 1) // self.sb['cluster_sectors']
+        if first + clusters > self.sb['total_clusters']:
+            raise IOError("No room for the free-space bitmap.")
+        self.sb.update(bitmap_start=self.sb['data_start'] + first * self.sb['cluster_sectors'], bitmap_sectors=sectors)
+        self.bitmap = bytearray(sectors * HDD_SECTOR_SIZE)
+        self._write(self.sb['bitmap_start'], bytes(self.bitmap))
+        self._mark(first, clusters, True)
+
+    def _add_bitmap(self):
+        """Volumes written before the bitmap allocated by bumping
+        next_free_cluster: the bitmap goes there, then every live file's
+        extents are marked. The superblock is written last."""
+        self._create_bitmap(self.sb['next_free_cluster'])
+        for slot in range(self.sb['dir_entries']):
+            entry = self._read_entry(slot)
+            if entry['name']:
+                for start, count in entry['extents']:
+                    self._mark(start, count, True)
+        self.sb['next_free_cluster'] = 0
+        self._save_superblock()
+
+    def _mark(self, start, count, used):
+        """Sets or clears a run's bits and writes back the sectors touched."""
+        for c in range(start, start + count):
+            if used:
+                self.bitmap[c // 8] |= 1 << (c % 8)
+            else:
+                self.bitmap[c // 8] &= ~(1 << (c % 8))
+        first = start // FS_BITS_PER_SECTOR
+        last = (start + count - 1) // FS_BITS_PER_SECTOR if count else first - 1
+        for sector in range(first, last + 1):
+            chunk = self.bitmap[sector * HDD_SECTOR_SIZE:(sector + 1) * HDD_SECTOR_SIZE]
+            self._write(self.sb['bitmap_start'] + sector, bytes(chunk))
+
+    def _free_runs(self):
+        runs = []
+        run_start, run = 0, 0
+        c = 0
+        total = self.sb['total_clusters']
+        while c < total:
+            byte = self.bitmap[c // 8]
+            if c % 8 == 0 and byte in (0x00, 0xFF) and total - c >= 8:
+                step, used = 8, byte == 0xFF
+            else:
+                step, used = 1, bool(byte & (1 << (c % 8)))
+            if used:
+                if run:
+                    runs.append([run_start, run])
+                run = 0
+            else:
+                if not run:
+                    run_start = c
+                run += step
+            c += step
+        if run:
+            runs.append([run_start, run])
+        return runs
+
+    def free_clusters(self):
+        return sum(count for _, count in self._free_runs())
+
+    def _alloc(self, count):
+        """Same policy as hdd_fs.c: the smallest free run the rest fits in
+        whole, otherwise all of the largest run, and again. Returns the
+        extents without marking them."""
+        runs = self._free_runs()
+        extents = []
+        while count > 0:
+            if len(extents) == FS_EXTENTS or not runs:
+                raise IOError("Disk is full.")
+            fits = [r for r in runs if r[1] >= count]
+            run = min(fits, key=lambda r: r[1]) if fits else max(runs, key=lambda r: r[1])
+            take = min(run[1], count)
+            extents.append((run[0], take))
+            run[0] += take
+            run[1] -= take
+            if run[1] == 0:
+                runs.remove(run)
+            count -= take
+        return extents
+
+    def _mount(self):
+        raw = self._read(0)
+        values = dict(zip(SB_FIELDS, SB_STRUCT.unpack_from(raw)))
+        if values['magic'] == FS_MAGIC and values['version'] == FS_VERSION:
+            self.sb = values
+            if self.sb['bitmap_sectors'] == 0:
+                self._add_bitmap()
+            else:
+                self.bitmap = bytearray(self._read(self.sb['bitmap_start'], self.sb['bitmap_sectors']))
+            return
+        if values['magic'] == FS_MAGIC:
+            raise IOError(f"Unsupported filesystem version {values['version']}.")
+        self._convert_v1(raw)
+
+    def _convert_v1(self, raw):
+        """Copies a version 1 volume's files into a version 2 layout placed
+        after them, writing the superblock over the v1 table last."""
+        total = self._partition_sectors()
+        files = []
+        v1_end = 1
+        for i in range(FS_V1_MAX_FILES):
+            name_bytes, start_lba, size_bytes = V1_ENTRY_STRUCT.unpack_from(raw, i * V1_ENTRY_STRUCT.size)
+            if name_bytes[0] == 0:
+                continue
+            sectors = (size_bytes + HDD_SECTOR_SIZE - 1) // HDD_SECTOR_SIZE
+            if name_bytes[-1] != 0 or size_bytes > MAX_FILE_SIZE or start_lba == 0 or start_lba + sectors > total:
+                raise IOError("No version 1 or 2 filesystem found.")
+            files.append((name_bytes.split(b'\0', 1)[0], start_lba, size_bytes))
+            v1_end = max(v1_end, start_lba + sectors)
+
+        self._layout(FS_CLUSTER_SECTORS, v1_end)
+        self._zero_hash()
+        self._create_bitmap(0)
+        for name, start_lba, size_bytes in files:
+            data = self._read(start_lba, (size_bytes + HDD_SECTOR_SIZE - 1) // HDD_SECTOR_SIZE)[:size_bytes]
+            self._store(name, data)
+        self._save_superblock()
+        self.converted = True
+
+    def _read_entry(self, slot):
+        sector = self.sb['dir_start'] + slot // FS_ENTRIES_PER_SECTOR
+        offset = (slot % FS_ENTRIES_PER_SECTOR) * ENTRY_STRUCT.size
+        fields = ENTRY_STRUCT.unpack_from(self._read(sector), offset)
+        pairs = fields[6:]
+        return {"name": fields[0].split(b'\0', 1)[0], "size_bytes": fields[1], "hash_next": fields[2],
+                "extents": [(pairs[2 * i], pairs[2 * i + 1]) for i in range(fields[3])]}
+
+    def _write_entry(self, slot, entry, fresh=False):
+        sector = self.sb['dir_start'] + slot // FS_ENTRIES_PER_SECTOR
+        offset = (slot % FS_ENTRIES_PER_SECTOR) * ENTRY_STRUCT.size
+        # A fresh sector's other slots have never been handed out.
+        data = bytearray(HDD_SECTOR_SIZE) if fresh else bytearray(self._read(sector))
+        pairs = [v for extent in entry['extents'] for v in extent]
+        pairs += [0] * (FS_EXTENTS * 2 - len(pairs))
+        ENTRY_STRUCT.pack_into(data, offset, entry['name'], entry['size_bytes'], entry['hash_next'],
+                               len(entry['extents']), 0, 0, *pairs)
+        self._write(sector, bytes(data))
+
+    def _bucket(self, name):
+        return fs_hash(name) % (self.sb['hash_sectors'] * FS_BUCKETS_PER_SECTOR)
+
+    def _get_bucket(self, bucket):
+        sector = self.sb['hash_start'] + bucket // FS_BUCKETS_PER_SECTOR
+        return struct.unpack_from('<I', self._read(sector), (bucket % FS_BUCKETS_PER_SECTOR) * 4)[0]
+
+    def _set_bucket(self, bucket, head):
+        sector = self.sb['hash_start'] + bucket // FS_BUCKETS_PER_SECTOR
+        data = bytearray(self._read(sector))
+        struct.pack_into('<I', data, (bucket % FS_BUCKETS_PER_SECTOR) * 4, head)
+        self._write(sector, bytes(data))
+
+    def _lookup(self, name):
+        """Returns (slot, entry) for `name` (bytes), or (None, None)."""
+        head = self._get_bucket(self._bucket(name))
+        for _ in range(self.sb['dir_entries']):
+            if head == 0:
+                break
+            entry = self._read_entry(head - 1)
+            if entry['name'] == name:
+                return head - 1, entry
+            head = entry['hash_next']
+        return None, None
+
+    def _claim_slot(self):
+        """Returns (slot, fresh): a deleted slot if there is one, otherwise
+        the next one never used."""
+        if self.sb['dir_free']:
+            slot = self.sb['dir_free'] - 1
+            self.sb['dir_free'] = self._read_entry(slot)['hash_next']
+            return slot, False
+        slot = self.sb['dir_entries']
+        self.sb['dir_entries'] += 1
+        return slot, slot % FS_ENTRIES_PER_SECTOR == 0
+
+    def _store(self, name, data):
+        """Writes `data` to new clusters and links a new entry for it."""
+        if not self.sb['dir_free'] and self.sb['dir_entries'] == self.sb['dir_max_entries']:
+            raise IOError("Directory is full.")
+        cluster_bytes = self.sb['cluster_sectors'] * HDD_SECTOR_SIZE
+        extents = self._alloc((len(data) + cluster_bytes - 1) // cluster_bytes)
+        done = 0
+        for start, count in extents:
+            self._write(self.sb['data_start'] + start * self.sb['cluster_sectors'], data[done:done + count * cluster_bytes])
+            done += count * cluster_bytes
+        for start, count in extents:
+            self._mark(start, count, True)
+        slot, fresh = self._claim_slot()
+        self.sb['file_count'] += 1
+
+        bucket = self._bucket(name)
+        entry = {"name": name, "size_bytes": len(data), "hash_next": self._get_bucket(bucket), "extents": extents}
+        self._write_entry(slot, entry, fresh)
+        self._set_bucket(bucket, slot + 1)
+
+    def format_disk(self, cluster_sectors=FS_CLUSTER_SECTORS):
+        if cluster_sectors < 1 or cluster_sectors > FS_MAX_CLUSTER_SECTORS or cluster_sectors & (cluster_sectors - 1):
+            raise ValueError("Cluster size must be a power of two up to 64 KB.")
+        self._layout(cluster_sectors, 1)
+        self._zero_hash()
+        self._create_bitmap(0)
+        self._save_superblock()
 
-    def format_disk(self):
-        self.fit = [{"filename": "", "start_lba": 0, "size_bytes": 0} for _ in range(MAX_FILES)]
-        self.next_free_lba = 1
-        self._write_fit()
-    
     def list_files(self):
-        return [entry for entry in self.fit if entry['filename']]
-        
+        files = []
+        for slot in range(self.sb['dir_entries']):
+            entry = self._read_entry(slot)
+            if entry['name']:
+                files.append({"filename": entry['name'].decode('utf-8', 'ignore'), "size_bytes": entry['size_bytes']})
+        return files
+
     def read_file(self, filename):
-        for entry in self.fit:
-            if entry['filename'] == filename:
-                if entry['size_bytes'] == 0: return b''
-                num_sectors = (entry['size_bytes'] + HDD_SECTOR_SIZE - 1) // HDD_SECTOR_SIZE
-                offset = self._get_partition_offset() + (entry['start_lba'] * HDD_SECTOR_SIZE)
-                with open(self.disk_path, "rb") as f:
-                    f.seek(offset)
-                    data = f.read(num_sectors * HDD_SECTOR_SIZE)
-                return data[:entry['size_bytes']]
-        raise FileNotFoundError(f"File '{filename}' not found.")
+        slot, entry = self._lookup(filename.encode('utf-8'))
+        if entry is None:
+            raise FileNotFoundError(f"File '{filename}' not found.")
+        data = b''
+        for start, count in entry['extents']:
+            data += self._read(self.sb['data_start'] + start * self.sb['cluster_sectors'],
+                               count * self.sb['cluster_sectors'])
+        return data[:entry['size_bytes']]
 
     def write_file(self, filename, data: bytes):
-        if len(filename.encode('utf-8')) >= MAX_FILENAME_LEN: raise ValueError("Filename too long.")
+        name = filename.encode('utf-8')
+        if len(name) >= MAX_FILENAME_LEN: raise ValueError("Filename too long.")
         if len(data) > MAX_FILE_SIZE: raise ValueError("File data too large.")
-        if any(e['filename'] == filename for e in self.fit): raise FileExistsError("File already exists.")
-        
-        free_index = next((i for i, e in enumerate(self.fit) if not e['filename']), -1)
-        if free_index == -1: raise IOError("File table is full.")
-
-        num_sectors = (len(data) + HDD_SECTOR_SIZE - 1) // HDD_SECTOR_SIZE
-        file_lba = self.next_free_lba
-        
-        abs_offset = self._get_partition_offset() + (file_lba * HDD_SECTOR_SIZE)
-        with open(self.disk_path, "r+b") as f:
-            f.seek(abs_offset)
-            f.write(data)
-
-        self.fit[free_index] = {"filename": filename, "start_lba": file_lba, "size_bytes": len(data)}
-        self.next_free_lba += num_sectors
-        self._write_fit()
+        if self._lookup(name)[1] is not None: raise FileExistsError("File already exists.")
+        self._store(name, data)
+        self._save_superblock()
 
     def create_directory(self, dirname):
         if not dirname.endswith('/'):
@@ -112,12 +333,30 @@ class SimpleFS:
         self.write_file(dirname, b'')
 
     def delete_file(self, filename):
-        for i, entry in enumerate(self.fit):
-            if entry['filename'] == filename:
-                self.fit[i] = {"filename": "", "start_lba": 0, "size_bytes": 0}
-                self._write_fit()
-                return
-        raise FileNotFoundError(f"File '{filename}' not found.")
+        """Unlinks the entry, puts its slot on the free chain and frees its clusters."""
+        name = filename.encode('utf-8')
+        slot, entry = self._lookup(name)
+        if entry is None:
+            raise FileNotFoundError(f"File '{filename}' not found.")
+        bucket = self._bucket(name)
+        head = self._get_bucket(bucket)
+        if head == slot + 1:
+            self._set_bucket(bucket, entry['hash_next'])
+        else:
+            prev = head - 1
+            while True:
+                prev_entry = self._read_entry(prev)
+                if prev_entry['hash_next'] == slot + 1:
+                    prev_entry['hash_next'] = entry['hash_next']
+                    self._write_entry(prev, prev_entry)
+                    break
+                prev = prev_entry['hash_next'] - 1
+        self._write_entry(slot, {"name": b'', "size_bytes": 0, "hash_next": self.sb['dir_free'], "extents": []})
+        self.sb['dir_free'] = slot + 1
+        self.sb['file_count'] -= 1
+        self._save_superblock()
+        for start, count in entry['extents']:
+            self._mark(start, count, False)
 
 class FileSystemApp(tk.Tk):
     def __init__(self):
@@ -231,9 +470,15 @@ class FileSystemApp(tk.Tk):
         path = filedialog.askopenfilename(title="Open Disk Image", filetypes=[("Disk Image", "*.img"), ("All Files", "*.*")])
         if not path: return
         try:
-            self.fs = SimpleFS(path)
+            try:
+                self.fs = SimpleFS(path)
+            except IOError as e:
+                if not messagebox.askyesno("No Filesystem", f"{e}\n\nFormat the partition?"): raise
+                self.fs = SimpleFS(path, format=True)
             self.update_ui_state(is_loaded=True)
             self.refresh_file_list()
+            if self.fs.converted:
+                self.status_var.set(f"Converted to version {FS_VERSION}: {self.fs.disk_path}")
         except Exception as e:
             messagebox.showerror("Error", f"Failed to open disk image:\n{e}")
             self.close_disk_image()
@@ -2,6 +2,7 @@
 #define EXTRAINCLUDE_H
 
 #include <stddef.h> // For size_t
+#include <stdint.h>
 
 // --- Standard C Library String and Memory Functions ---
 // Implementations are located in kernel.c
@@ -18,6 +19,10 @@ int strncmp(const char *a, const char *b, size_t n);
 
 // Memory Manipulation
 void* memset(void *s, int c, size_t n);
+void* memcpy(void *dest, const void *src, size_t n); // Buffers must not overlap
+
+// 64-bit Arithmetic (no libgcc in the kernel link)
+uint64_t udiv64(uint64_t n, uint32_t d, uint32_t* rem);
 
 
 #endif // EXTRAINCLUDE_H
\ No newline at end of file
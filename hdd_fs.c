@@ -1,123 +1,1024 @@
 #include "hdd_fs.h"
 #include "block.h"
+#include "ssdcache.h"
 #include <stddef.h>
 #include "shell.h"
 #include "stdio.h"
 #include "extrainclude.h"
 
-// *** CORRECTED: Removed 'static' to make this a global definition ***
-FileIndexTable fs_table;
-static uint32_t next_free_lba;
+// The superblock stays in memory while mounted; directory and hash
+// sectors are read through the buffer cache as needed.
+__attribute__((aligned(16))) static FsSuperblock fs_sb;
+static int fs_mounted = 0;
+__attribute__((aligned(16))) static uint8_t fs_sector_buf[HDD_SECTOR_SIZE];
+
+// Staging for formatting, loading the bitmap and copying files out of a
+// v1 volume.
+#define FS_COPY_SECTORS 32
+__attribute__((aligned(4096))) static uint8_t fs_copy_buf[FS_COPY_SECTORS * HDD_SECTOR_SIZE];
+
+typedef struct {
+    int in_use;
+    uint32_t slot;
+    uint32_t size_bytes;
+    uint32_t offset;
+    int extent_count;
+    FsExtent extents[FS_EXTENTS];
+    uint32_t clusters;     // Clusters the extents cover
+    // Writable descriptors only
+    uint8_t* wbuf;         // Data from the extents' end on; NULL if read-only
+    uint32_t wbuf_len;
+    uint32_t marked;       // Leading clusters the bitmap already has
+    FsExtent reserve;      // Free clusters held for this file to grow into
+    int dirty;             // The entry on disk is out of date
+} FsOpenFile;
+
+static FsOpenFile fs_files[FS_MAX_OPEN];
+__attribute__((aligned(4096))) static uint8_t fs_write_bufs[FS_WRITERS][FS_WRITE_BUFFER];
+
+// Free runs of clusters, sorted by start and never adjacent.
+static FsExtent fs_free[FS_FREE_EXTENTS];
+static int fs_free_count = 0;
+static uint32_t fs_free_clusters = 0;
+
+static int fs_ready() {
+    return block_device_available && fs_mounted;
+}
+
+static uint64_t fs_byte(uint32_t sector) {
+    return (uint64_t)(FS_LBA_OFFSET + sector) * HDD_SECTOR_SIZE;
+}
+
+static uint64_t fs_cluster_byte(uint32_t cluster) {
+    return fs_byte(fs_sb.data_start + cluster * fs_sb.cluster_sectors);
+}
+
+// FNV-1a; diskmnt.py uses the same function.
+static uint32_t fs_hash(const char* name) {
+    uint32_t h = 2166136261u;
+    while (*name) {
+        h ^= (uint8_t)*name++;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+static uint32_t fs_bucket(const char* name) {
+    return fs_hash(name) % (fs_sb.hash_sectors * FS_BUCKETS_PER_SECTOR);
+}
+
+static int fs_save_superblock() {
+    return block_write_fua(FS_LBA_OFFSET, 1, &fs_sb);
+}
+
+// Rewrites `len` bytes at `offset` in one metadata sector, durably, so
+// metadata written after it can't reach the disk first. A fresh sector
+// starts out zeroed instead of being read.
+static int fs_patch(uint32_t sector, uint32_t offset, const void* data, uint32_t len, int fresh) {
+    if (fresh) memset(fs_sector_buf, 0, HDD_SECTOR_SIZE);
+    else if (block_read(FS_LBA_OFFSET + sector, 1, fs_sector_buf) != 0) return -1;
+    memcpy(fs_sector_buf + offset, data, len);
+    return block_write_fua(FS_LBA_OFFSET + sector, 1, fs_sector_buf);
+}
+
+static int fs_read_entry(uint32_t slot, FsEntry* e) {
+    return block_read_bytes(fs_byte(fs_sb.dir_start) + slot * sizeof(FsEntry), e, sizeof(FsEntry));
+}
+
+// Reads or writes `len` bytes at `offset` into a file laid out in
+// `extents`, touching only the sectors under them. Returns -1 if the
+// extents end first.
+static int fs_extents_io(const FsExtent* extents, int nextents, uint32_t offset, uint8_t* buf, uint32_t len, int write) {
+    uint32_t cluster_bytes = fs_sb.cluster_sectors * HDD_SECTOR_SIZE;
+    uint32_t base = 0; // File offset of extent i
+    uint32_t done = 0;
+    for (int i = 0; i < nextents && done < len; i++) {
+        uint32_t extent_bytes = extents[i].count * cluster_bytes;
+        uint32_t pos = offset + done;
+        if (pos < base + extent_bytes) {
+            uint32_t n = base + extent_bytes - pos;
+            if (n > len - done) n = len - done;
+            uint64_t at = fs_cluster_byte(extents[i].start) + (pos - base);
+            int ret = write ? block_write_bytes(at, buf + done, n) : block_read_bytes(at, buf + done, n);
+            if (ret != 0) return -1;
+            done += n;
+        }
+        base += extent_bytes;
+    }
+    return done == len ? 0 : -1;
+}
+
+// Reads up to `len` bytes from `offset` of a file. Returns the number
+// read, or -1.
+static int fs_read_extents(const FsExtent* extents, int nextents, uint32_t size_bytes, uint32_t offset, uint8_t* buf, uint32_t len) {
+    if (offset >= size_bytes) return 0;
+    if (len > size_bytes - offset) len = size_bytes - offset;
+    return fs_extents_io(extents, nextents, offset, buf, len, 0) == 0 ? (int)len : -1;
+}
+
+// Rewrites `len` bytes at `offset` within a directory entry.
+static int fs_patch_entry(uint32_t slot, uint32_t offset, const void* data, uint32_t len, int fresh) {
+    uint32_t sector = fs_sb.dir_start + slot / FS_ENTRIES_PER_SECTOR;
+    offset += (slot % FS_ENTRIES_PER_SECTOR) * sizeof(FsEntry);
+    return fs_patch(sector, offset, data, len, fresh);
+}
+
+static int fs_read_bucket(uint32_t bucket, uint32_t* head) {
+    return block_read_bytes(fs_byte(fs_sb.hash_start) + bucket * sizeof(uint32_t), head, sizeof(uint32_t));
+}
+
+static int fs_write_bucket(uint32_t bucket, uint32_t head) {
+    uint32_t sector = fs_sb.hash_start + bucket / FS_BUCKETS_PER_SECTOR;
+    return fs_patch(sector, (bucket % FS_BUCKETS_PER_SECTOR) * sizeof(uint32_t), &head, sizeof(uint32_t), 0);
+}
+
+// --- Free space ---
+
+// Returns a run to the free table, merging it with its neighbours. If
+// the table is full the smallest run is dropped; the bitmap still says
+// it's free, so the next mount finds it again.
+static void fs_give(uint32_t start, uint32_t count) {
+    if (count == 0) return;
+    int i = 0;
+    while (i < fs_free_count && fs_free[i].start < start) i++;
+    int prev = i > 0 && fs_free[i - 1].start + fs_free[i - 1].count == start;
+    int next = i < fs_free_count && start + count == fs_free[i].start;
+    fs_free_clusters += count;
+    if (prev && next) {
+        fs_free[i - 1].count += count + fs_free[i].count;
+        for (int j = i; j < fs_free_count - 1; j++) fs_free[j] = fs_free[j + 1];
+        fs_free_count--;
+        return;
+    }
+    if (prev) {
+        fs_free[i - 1].count += count;
+        return;
+    }
+    if (next) {
+        fs_free[i].start = start;
+        fs_free[i].count += count;
+        return;
+    }
+    if (fs_free_count == FS_FREE_EXTENTS) {
+        int smallest = 0;
+        for (int j = 1; j < fs_free_count; j++) {
+            if (fs_free[j].count < fs_free[smallest].count) smallest = j;
+        }
+        if (fs_free[smallest].count <= count) {
+            fs_free_clusters -= fs_free[smallest].count;
+            for (int j = smallest; j < fs_free_count - 1; j++) fs_free[j] = fs_free[j + 1];
+            fs_free_count--;
+            if (smallest < i) i--;
+        } else {
+            fs_free_clusters -= count;
+            return;
+        }
+    }
+    for (int j = fs_free_count; j > i; j--) fs_free[j] = fs_free[j - 1];
+    fs_free[i].start = start;
+    fs_free[i].count = count;
+    fs_free_count++;
+}
+
+// Takes `count` clusters from the front of free run `i`.
+static uint32_t fs_take(int i, uint32_t count) {
+    uint32_t start = fs_free[i].start;
+    fs_free[i].start += count;
+    fs_free[i].count -= count;
+    fs_free_clusters -= count;
+    if (fs_free[i].count == 0) {
+        for (int j = i; j < fs_free_count - 1; j++) fs_free[j] = fs_free[j + 1];
+        fs_free_count--;
+    }
+    return start;
+}
+
+// Takes one run of up to `count` clusters: from the smallest free run
+// holding them all, or else as many as the largest run has.
+static int fs_take_run(uint32_t count, FsExtent* out) {
+    if (fs_free_count == 0) return -1;
+    int best = -1;
+    int largest = 0;
+    for (int i = 0; i < fs_free_count; i++) {
+        if (fs_free[i].count >= count && (best < 0 || fs_free[i].count < fs_free[best].count)) best = i;
+        if (fs_free[i].count > fs_free[largest].count) largest = i;
+    }
+    int i = best >= 0 ? best : largest;
+    uint32_t take = fs_free[i].count < count ? fs_free[i].count : count;
+    out->start = fs_take(i, take);
+    out->count = take;
+    return 0;
+}
+
+// Finds room for `count` clusters: the smallest free run the rest fits
+// in whole, otherwise all of the largest run, and again until it's all
+// placed. Only the in-memory table changes; the caller marks the bitmap
+// once it's written the data. Returns the number of extents, or -1 with
+// nothing taken if the file would need more than FS_EXTENTS.
+static int fs_alloc(uint32_t count, FsExtent* out) {
+    if (count > fs_free_clusters) return -1;
+    int n = 0;
+    while (count > 0) {
+        if (n == FS_EXTENTS) {
+            while (n > 0) {
+                n--;
+                fs_give(out[n].start, out[n].count);
+            }
+            return -1;
+        }
+        fs_take_run(count, &out[n]);
+        count -= out[n].count;
+        n++;
+    }
+    return n;
+}
+
+// Sets or clears a run's bits in the on-disk bitmap, durably.
+static int fs_mark(uint32_t start, uint32_t count, int used) {
+    while (count > 0) {
+        uint32_t sector = fs_sb.bitmap_start + start / FS_BITS_PER_SECTOR;
+        uint32_t bit = start % FS_BITS_PER_SECTOR;
+        uint32_t n = FS_BITS_PER_SECTOR - bit;
+        if (n > count) n = count;
+        if (block_read(FS_LBA_OFFSET + sector, 1, fs_sector_buf) != 0) return -1;
+        for (uint32_t b = bit; b < bit + n; b++) {
+            if (used) fs_sector_buf[b / 8] |= 1 << (b % 8);
+            else fs_sector_buf[b / 8] &= ~(1 << (b % 8));
+        }
+        if (block_write_fua(FS_LBA_OFFSET + sector, 1, fs_sector_buf) != 0) return -1;
+        start += n;
+        count -= n;
+    }
+    return 0;
+}
+
+static int fs_mark_extents(const FsExtent* extents, int n, int used) {
+    for (int i = 0; i < n; i++) {
+        if (fs_mark(extents[i].start, extents[i].count, used) != 0) return -1;
+    }
+    return 0;
+}
+
+// Condenses the bitmap into the free table, reading it once.
+static int fs_load_free() {
+    fs_free_count = 0;
+    fs_free_clusters = 0;
+    uint32_t run_start = 0;
+    uint32_t run = 0;
+    uint32_t cluster = 0;
+    for (uint32_t s = 0; s < fs_sb.bitmap_sectors; s += FS_COPY_SECTORS) {
+        uint32_t n = fs_sb.bitmap_sectors - s < FS_COPY_SECTORS ? fs_sb.bitmap_sectors - s : FS_COPY_SECTORS;
+        if (block_read(FS_LBA_OFFSET + fs_sb.bitmap_start + s, n, fs_copy_buf) != 0) return -1;
+        for (uint32_t byte = 0; byte < n * HDD_SECTOR_SIZE && cluster < fs_sb.total_clusters; byte++) {
+            uint8_t bits = fs_copy_buf[byte];
+            // Whole bytes at a time where they're all free or all used.
+            if ((bits == 0x00 || bits == 0xFF) && fs_sb.total_clusters - cluster >= 8) {
+                if (bits == 0x00) {
+                    if (run == 0) run_start = cluster;
+                    run += 8;
+                } else if (run > 0) {
+                    fs_give(run_start, run);
+                    run = 0;
+                }
+                cluster += 8;
+                continue;
+            }
+            for (int b = 0; b < 8 && cluster < fs_sb.total_clusters; b++, cluster++) {
+                if (bits & (1 << b)) {
+                    if (run > 0) fs_give(run_start, run);
+                    run = 0;
+                } else {
+                    if (run == 0) run_start = cluster;
+                    run++;
+                }
+            }
+        }
+    }
+    if (run > 0) fs_give(run_start, run);
+    return 0;
+}
+
+// Finds `filename` through its hash bucket: usually one hash sector and
+// one directory sector. Returns the slot, or -1.
+static int fs_lookup(const char* filename, FsEntry* e) {
+    uint32_t next;
+    if (fs_read_bucket(fs_bucket(filename), &next) != 0) return -1;
+    // The chain can't be longer than the directory; stop a damaged one.
+    for (uint32_t steps = 0; next != 0 && steps < fs_sb.dir_entries; steps++) {
+        uint32_t slot = next - 1;
+        if (slot >= fs_sb.dir_entries || fs_read_entry(slot, e) != 0) return -1;
+        if (strcmp(e->filename, filename) == 0) return (int)slot;
+        next = e->hash_next;
+    }
+    return -1;
+}
+
+// Takes a deleted slot off the free chain, or else the next one never
+// used. `fresh` is set when the slot opens a new directory sector.
+static int fs_claim_slot(uint32_t* slot, int* fresh) {
+    *fresh = 0;
+    if (fs_sb.dir_free != 0) {
+        FsEntry e;
+        if (fs_sb.dir_free > fs_sb.dir_entries || fs_read_entry(fs_sb.dir_free - 1, &e) != 0) return -1;
+        *slot = fs_sb.dir_free - 1;
+        fs_sb.dir_free = e.hash_next;
+        return 0;
+    }
+    if (fs_sb.dir_entries == fs_sb.dir_max_entries) return -1;
+    *slot = fs_sb.dir_entries++;
+    *fresh = *slot % FS_ENTRIES_PER_SECTOR == 0;
+    return 0;
+}
+
+// Writes a new entry into an already claimed slot and puts it at the
+// head of its bucket's chain. The entry goes first, so the bucket never
+// points at a slot that isn't there yet.
+static int fs_link(uint32_t slot, int fresh, const char* filename, uint32_t size_bytes, const FsExtent* extents, int nextents) {
+    uint32_t bucket = fs_bucket(filename);
+    uint32_t head;
+    if (fs_read_bucket(bucket, &head) != 0) return -1;
+
+    FsEntry e;
+    memset(&e, 0, sizeof(FsEntry));
+    strncpy(e.filename, filename, MAX_FILENAME_LEN - 1);
+    e.size_bytes = size_bytes;
+    e.hash_next = head;
+    e.extent_count = nextents;
+    for (int i = 0; i < nextents; i++) e.extents[i] = extents[i];
+    if (fs_patch_entry(slot, 0, &e, sizeof(FsEntry), fresh) != 0) return -1;
+    return fs_write_bucket(bucket, slot + 1);
+}
+
+static uint32_t fs_partition_sectors() {
+    BlockDevice* dev = block_active_device();
+    if (!dev || dev->caps.sector_count <= FS_LBA_OFFSET) return 0;
+    uint64_t sectors = dev->caps.sector_count - FS_LBA_OFFSET;
+    return sectors > 0xFFFFFFFF ? 0xFFFFFFFF : (uint32_t)sectors;
+}
+
+// Lays out a fresh superblock with the directory at `first_sector`, the
+// hash after its reserved region and cluster-aligned data after that.
+static int fs_layout(uint32_t cluster_sectors, uint32_t first_sector) {
+    uint32_t total = fs_partition_sectors();
+    memset(&fs_sb, 0, sizeof(FsSuperblock));
+    fs_sb.magic = FS_MAGIC;
+    fs_sb.version = FS_VERSION;
+    fs_sb.cluster_sectors = cluster_sectors;
+    fs_sb.total_sectors = total;
+    fs_sb.dir_start = first_sector;
+    fs_sb.dir_max_entries = FS_DIR_MAX_ENTRIES;
+    fs_sb.hash_start = fs_sb.dir_start + FS_DIR_MAX_ENTRIES / FS_ENTRIES_PER_SECTOR;
+    fs_sb.hash_sectors = FS_HASH_SECTORS;
+    fs_sb.data_start = (fs_sb.hash_start + FS_HASH_SECTORS + cluster_sectors - 1) & ~(cluster_sectors - 1);
+    if (total <= fs_sb.data_start + cluster_sectors) return -1;
+    fs_sb.total_clusters = (total - fs_sb.data_start) / cluster_sectors;
+    return 0;
+}
+
+static int fs_zero(uint32_t start, uint32_t sectors) {
+    memset(fs_copy_buf, 0, sizeof(fs_copy_buf));
+    for (uint32_t s = 0; s < sectors; s += FS_COPY_SECTORS) {
+        uint32_t n = sectors - s < FS_COPY_SECTORS ? sectors - s : FS_COPY_SECTORS;
+        if (block_write(FS_LBA_OFFSET + start + s, n, fs_copy_buf) != 0) return -1;
+    }
+    return 0;
+}
+
+// Puts an empty bitmap in the data clusters from `first` on and marks
+// those clusters used.
+static int fs_create_bitmap(uint32_t first) {
+    fs_sb.bitmap_sectors = (fs_sb.total_clusters + FS_BITS_PER_SECTOR - 1) / FS_BITS_PER_SECTOR;
+    uint32_t clusters = (fs_sb.bitmap_sectors + fs_sb.cluster_sectors - 1) / fs_sb.cluster_sectors;
+    if (first > fs_sb.total_clusters || clusters > fs_sb.total_clusters - first) return -1;
+    fs_sb.bitmap_start = fs_sb.data_start + first * fs_sb.cluster_sectors;
+    if (fs_zero(fs_sb.bitmap_start, fs_sb.bitmap_sectors) != 0) return -1;
+    return fs_mark(first, clusters, 1);
+}
+
+// Volumes written before the bitmap allocated by bumping
+// next_free_cluster, so everything past it is free: the bitmap goes
+// there and then every live file's extents are marked, which also takes
+// back what deleting files from diskmnt.py used to leak. The superblock
+// is written last, so until then the volume is unchanged.
+static int fs_add_bitmap() {
+    print_string("HDD FS: Adding free-space bitmap... ");
+    if (fs_create_bitmap(fs_sb.next_free_cluster) != 0) return -1;
+    FsEntry e;
+    for (uint32_t slot = 0; slot < fs_sb.dir_entries; slot++) {
+        if (fs_read_entry(slot, &e) != 0) return -1;
+        if (e.filename[0] == '\0' || e.extent_count > FS_EXTENTS) continue;
+        for (int i = 0; i < e.extent_count; i++) {
+            if (e.extents[i].start > fs_sb.total_clusters || e.extents[i].count > fs_sb.total_clusters - e.extents[i].start) return -1;
+        }
+        if (fs_mark_extents(e.extents, e.extent_count, 1) != 0) return -1;
+    }
+    fs_sb.next_free_cluster = 0;
+    if (block_flush() != 0 || fs_save_superblock() != 0) return -1;
+    print_string("Done.\n");
+    return 0;
+}
+
+// Copies a version 1 volume's files into a version 2 layout placed after
+// them. Nothing the v1 table points at is touched, and the superblock
+// replaces the v1 table last, so a crash part way leaves the v1 volume
+// intact. The sectors the v1 files occupied are left unused.
+static int fs_convert_v1() {
+    FsV1Entry v1[FS_V1_MAX_FILES];
+    memcpy(v1, &fs_sb, sizeof(v1));
+    uint32_t total = fs_partition_sectors();
+    uint32_t v1_end = 1;
+    for (int i = 0; i < FS_V1_MAX_FILES; i++) {
+        if (v1[i].filename[0] == '\0') continue;
+        if (v1[i].filename[FS_V1_FILENAME_LEN - 1] != '\0' || v1[i].size_bytes > MAX_FILE_SIZE) return -1;
+        uint32_t end = v1[i].start_lba + (v1[i].size_bytes + HDD_SECTOR_SIZE - 1) / HDD_SECTOR_SIZE;
+        if (v1[i].start_lba == 0 || end > total) return -1;
+        if (end > v1_end) v1_end = end;
+    }
+    if (fs_layout(FS_CLUSTER_SECTORS, v1_end) != 0) return -1;
+    print_string("HDD FS: Converting version 1 volume... ");
+    if (fs_zero(fs_sb.hash_start, fs_sb.hash_sectors) != 0) return -1;
+    if (fs_create_bitmap(0) != 0 || fs_load_free() != 0) return -1;
+
+    uint32_t cluster_bytes = fs_sb.cluster_sectors * HDD_SECTOR_SIZE;
+    for (int i = 0; i < FS_V1_MAX_FILES; i++) {
+        if (v1[i].filename[0] == '\0') continue;
+        FsExtent extents[FS_EXTENTS];
+        int n = fs_alloc((v1[i].size_bytes + cluster_bytes - 1) / cluster_bytes, extents);
+        if (n < 0) return -1;
+        uint32_t src = v1[i].start_lba;
+        uint32_t left = (v1[i].size_bytes + HDD_SECTOR_SIZE - 1) / HDD_SECTOR_SIZE;
+        for (int x = 0; x < n; x++) {
+            uint32_t dest = fs_sb.data_start + extents[x].start * fs_sb.cluster_sectors;
+            uint32_t sectors = extents[x].count * fs_sb.cluster_sectors;
+            if (sectors > left) sectors = left;
+            for (uint32_t s = 0; s < sectors; s += FS_COPY_SECTORS) {
+                uint32_t c = sectors - s < FS_COPY_SECTORS ? sectors - s : FS_COPY_SECTORS;
+                if (block_read(FS_LBA_OFFSET + src + s, c, fs_copy_buf) != 0) return -1;
+                if (block_write(FS_LBA_OFFSET + dest + s, c, fs_copy_buf) != 0) return -1;
+            }
+            src += sectors;
+            left -= sectors;
+        }
+        if (block_flush() != 0 || fs_mark_extents(extents, n, 1) != 0) return -1;
+        uint32_t slot;
+        int fresh;
+        if (fs_claim_slot(&slot, &fresh) != 0) return -1;
+        fs_sb.file_count++;
+        if (fs_link(slot, fresh, v1[i].filename, v1[i].size_bytes, extents, n) != 0) return -1;
+    }
+    if (block_flush() != 0 || fs_save_superblock() != 0) return -1;
+    print_string("Done.\n");
+    return 0;
+}
 
 void fs_init() {
+    fs_mounted = 0;
+    memset(fs_files, 0, sizeof(fs_files));
     if (!block_device_available) {
         print_string("HDD FS: Skipping init, no block device available.\n");
         return;
     }
-    if (block_read(FS_LBA_OFFSET, 1, &fs_table) != 0) {
-        print_string("HDD FS: Error reading File Index Table. Disabling FS.\n");
+    if (ssdcache_check_raw(block_active_device()) != 0) {
+        print_string("HDD FS: Disabling FS.\n");
         block_device_available = 0;
         return;
     }
-    next_free_lba = 1;
-    for (int i = 0; i < MAX_FILES; i++) {
-        if (fs_table.entries[i].filename[0] != '\0') {
-            uint32_t num_sectors = (fs_table.entries[i].size_bytes + HDD_SECTOR_SIZE - 1) / HDD_SECTOR_SIZE;
-            uint32_t file_end_lba = fs_table.entries[i].start_lba + num_sectors;
-            if (file_end_lba > next_free_lba) {
-                next_free_lba = file_end_lba;
-            }
+    if (block_read(FS_LBA_OFFSET, 1, &fs_sb) != 0) {
+        print_string("HDD FS: Error reading superblock. Disabling FS.\n");
+        block_device_available = 0;
+        return;
+    }
+    if (fs_sb.magic != FS_MAGIC || fs_sb.version != FS_VERSION) {
+        if (fs_sb.magic == FS_MAGIC || fs_convert_v1() != 0) {
+            print_string("HDD FS: No usable filesystem found; run 'format'.\n");
+            return;
         }
     }
-    print_string("HDD FS Initialized. Partition starts at LBA ");
+    if (fs_sb.bitmap_sectors == 0 && fs_add_bitmap() != 0) {
+        print_string("HDD FS: Could not add a free-space bitmap; run 'format'.\n");
+        return;
+    }
+    if (fs_load_free() != 0) {
+        print_string("HDD FS: Error reading free-space bitmap.\n");
+        return;
+    }
+    fs_mounted = 1;
+    print_string("HDD FS Initialized (");
+    print_int(fs_sb.file_count);
+    print_string(" files, ");
+    print_int(fs_sb.cluster_sectors / 2);
+    print_string(" KB clusters, ");
+    print_int((uint32_t)((uint64_t)fs_free_clusters * fs_sb.cluster_sectors / 2048));
+    print_string(" MB free). Partition starts at LBA ");
     print_int(FS_LBA_OFFSET);
     print_string(".\n");
 }
 
-void fs_format_disk() {
+int fs_format(uint32_t cluster_sectors) {
     if (!block_device_available) {
         print_string("Error: No block device available.\n");
-        return;
+        return -1;
+    }
+    if (cluster_sectors == 0 || cluster_sectors > FS_MAX_CLUSTER_SECTORS || (cluster_sectors & (cluster_sectors - 1))) {
+        print_string("Error: Cluster size must be a power of two up to 64 KB.\n");
+        return -1;
     }
     print_string("Formatting data partition... ");
-    memset(&fs_table, 0, sizeof(FileIndexTable));
-    if (block_write(FS_LBA_OFFSET, 1, &fs_table) != 0) {
-        print_string("Error: Failed to write new FIT to disk.\n");
-        return;
+    fs_mounted = 0;
+    memset(fs_files, 0, sizeof(fs_files));
+    if (fs_layout(cluster_sectors, 1) != 0) {
+        print_string("Error: Disk is too small.\n");
+        return -1;
     }
-    fs_init();
+    // Everything after the superblock is free now; let an SSD know.
+    BlockRange range = { FS_LBA_OFFSET + 1, fs_sb.total_sectors - 1 };
+    if (block_discard(&range, 1) != 0) print_string("(discard failed) ");
+    if (fs_zero(fs_sb.hash_start, fs_sb.hash_sectors) != 0 || fs_create_bitmap(0) != 0 ||
+        block_flush() != 0 || fs_save_superblock() != 0 || fs_load_free() != 0) {
+        print_string("Error: Failed to write new filesystem to disk.\n");
+        return -1;
+    }
+    fs_mounted = 1;
     print_string("Done.\n");
+    return 0;
+}
+
+void fs_format_disk() {
+    fs_format(FS_CLUSTER_SECTORS);
+}
+
+int fs_exists(const char* filename) {
+    FsEntry e;
+    return fs_ready() && fs_lookup(filename, &e) >= 0;
+}
+
+int fs_readdir(uint32_t* cursor, char* filename, uint32_t* size_bytes) {
+    if (!fs_ready()) return 0;
+    FsEntry e;
+    while (*cursor < fs_sb.dir_entries) {
+        if (fs_read_entry((*cursor)++, &e) != 0) return 0;
+        if (e.filename[0] == '\0') continue;
+        memcpy(filename, e.filename, MAX_FILENAME_LEN);
+        filename[MAX_FILENAME_LEN - 1] = '\0';
+        *size_bytes = e.size_bytes;
+        return 1;
+    }
+    return 0;
 }
 
 void fs_list_files() {
-    if (!block_device_available) return;
+    if (!fs_ready()) return;
     print_string("--- HDD File Listing ---\n");
     print_string("Type | Name                           | Size (Bytes)\n");
     print_string("----------------------------------------------------\n");
     int count = 0;
-    for (int i = 0; i < MAX_FILES; i++) {
-        if (fs_table.entries[i].filename[0] != '\0') {
-            int len = strlen(fs_table.entries[i].filename);
-            if (fs_table.entries[i].filename[len - 1] == '/') {
-                print_string("[d]  | ");
-            } else {
-                print_string("[f]  | ");
-            }
-            print_string(fs_table.entries[i].filename);
-            for (int p = len; p < 30; p++) print_char(' ');
-            print_string(" | ");
-            print_int(fs_table.entries[i].size_bytes);
-            new_line();
-            count++;
+    uint32_t cursor = 0;
+    char name[MAX_FILENAME_LEN];
+    uint32_t size;
+    while (fs_readdir(&cursor, name, &size)) {
+        int len = strlen(name);
+        if (name[len - 1] == '/') {
+            print_string("[d]  | ");
+        } else {
+            print_string("[f]  | ");
         }
+        print_string(name);
+        for (int p = len; p < 30; p++) print_char(' ');
+        print_string(" | ");
+        print_int(size);
+        new_line();
+        count++;
     }
     if (count == 0) print_string("(No files found)\n");
 }
 
 int fs_read_file(const char* filename, char* buffer) {
-    if (!block_device_available) return -1;
-    for (int i = 0; i < MAX_FILES; i++) {
-        if (strcmp(fs_table.entries[i].filename, filename) == 0) {
-            FileEntry* entry = &fs_table.entries[i];
-            if (entry->size_bytes > MAX_FILE_SIZE) return -2;
-            uint32_t num_sectors = (entry->size_bytes + HDD_SECTOR_SIZE - 1) / HDD_SECTOR_SIZE;
-            if (block_read(entry->start_lba + FS_LBA_OFFSET, num_sectors, buffer) != 0) return -1;
-            buffer[entry->size_bytes] = '\0';
-            return entry->size_bytes;
+    if (!fs_ready()) return -1;
+    FsEntry e;
+    if (fs_lookup(filename, &e) < 0) return -1;
+    if (e.size_bytes > MAX_FILE_SIZE) return -2;
+    if (e.extent_count > FS_EXTENTS) return -1;
+    if (fs_read_extents(e.extents, e.extent_count, e.size_bytes, 0, (uint8_t*)buffer, e.size_bytes) != (int)e.size_bytes) return -1;
+    buffer[e.size_bytes] = '\0';
+    return e.size_bytes;
+}
+
+int fs_write_file(const char* filename, const char* data, uint32_t data_size) {
+    if (!fs_ready()) return -1;
+    if (data_size > MAX_FILE_SIZE) return -2;
+    int fd = fs_create(filename);
+    if (fd < 0) return fd;
+    int ret = fs_write(fd, data, data_size);
+    int synced = fs_close(fd);
+    if (ret == -6 || synced == -6) print_string("Error: Disk is full.\n");
+    if (ret < 0) return ret;
+    return synced;
+}
+
+int fs_delete_file(const char* filename) {
+    if (!fs_ready()) return -1;
+    FsEntry e;
+    int slot = fs_lookup(filename, &e);
+    if (slot < 0) return -1;
+    for (int fd = 0; fd < FS_MAX_OPEN; fd++) {
+        if (fs_files[fd].in_use && fs_files[fd].slot == (uint32_t)slot) return -2;
+    }
+    if (e.extent_count > FS_EXTENTS) return -1;
+    for (int i = 0; i < e.extent_count; i++) {
+        if (e.extents[i].start > fs_sb.total_clusters || e.extents[i].count > fs_sb.total_clusters - e.extents[i].start) return -1;
+    }
+
+    // Unlink it from its chain first, so it can't be found half deleted.
+    uint32_t bucket = fs_bucket(filename);
+    uint32_t next;
+    if (fs_read_bucket(bucket, &next) != 0) return -1;
+    if (next == (uint32_t)slot + 1) {
+        if (fs_write_bucket(bucket, e.hash_next) != 0) return -1;
+    } else {
+        FsEntry prev;
+        uint32_t steps = 0;
+        for (; next != 0 && steps < fs_sb.dir_entries; steps++) {
+            if (next > fs_sb.dir_entries || fs_read_entry(next - 1, &prev) != 0) return -1;
+            if (prev.hash_next == (uint32_t)slot + 1) break;
+            next = prev.hash_next;
         }
+        if (next == 0 || steps == fs_sb.dir_entries) return -1;
+        if (fs_patch_entry(next - 1, offsetof(FsEntry, hash_next), &e.hash_next, sizeof(uint32_t), 0) != 0) return -1;
+    }
+
+    // Then clear the slot onto the free chain. A crash before the bitmap
+    // is updated leaks the clusters rather than freeing them early.
+    FsEntry empty;
+    memset(&empty, 0, sizeof(FsEntry));
+    empty.hash_next = fs_sb.dir_free;
+    if (fs_patch_entry(slot, 0, &empty, sizeof(FsEntry), 0) != 0) return -1;
+    fs_sb.dir_free = slot + 1;
+    fs_sb.file_count--;
+    if (fs_save_superblock() != 0) return -1;
+    if (fs_mark_extents(e.extents, e.extent_count, 0) != 0) return -1;
+
+    BlockRange ranges[FS_EXTENTS];
+    for (int i = 0; i < e.extent_count; i++) {
+        fs_give(e.extents[i].start, e.extents[i].count);
+        ranges[i].lba = FS_LBA_OFFSET + fs_sb.data_start + (uint64_t)e.extents[i].start * fs_sb.cluster_sectors;
+        ranges[i].count = e.extents[i].count * fs_sb.cluster_sectors;
+    }
+    // Nothing needs the old contents now; a failed discard is harmless.
+    if (e.extent_count > 0) block_discard(ranges, e.extent_count);
+    return 0;
+}
+
+// --- Open files ---
+
+static FsOpenFile* fs_file(int fd) {
+    if (!fs_ready() || fd < 0 || fd >= FS_MAX_OPEN || !fs_files[fd].in_use) return NULL;
+    return &fs_files[fd];
+}
+
+static int fs_free_fd() {
+    for (int fd = 0; fd < FS_MAX_OPEN; fd++) {
+        if (!fs_files[fd].in_use) return fd;
     }
     return -1;
 }
 
-int fs_write_file(const char* filename, const char* data, uint32_t data_size) {
-    if (!block_device_available) return -1;
+static uint8_t* fs_free_write_buf() {
+    for (int b = 0; b < FS_WRITERS; b++) {
+        int fd = 0;
+        while (fd < FS_MAX_OPEN && !(fs_files[fd].in_use && fs_files[fd].wbuf == fs_write_bufs[b])) fd++;
+        if (fd == FS_MAX_OPEN) return fs_write_bufs[b];
+    }
+    return NULL;
+}
+
+// Opens directory slot `slot`, writable or not. Returns a descriptor,
+// -2 if the file is open in a way that conflicts, or -3 if there is no
+// descriptor (or write buffer) free.
+static int fs_open_slot(uint32_t slot, const FsEntry* e, int writable) {
+    if (e->extent_count > FS_EXTENTS) return -1;
+    for (int i = 0; i < FS_MAX_OPEN; i++) {
+        if (fs_files[i].in_use && fs_files[i].slot == slot && (writable || fs_files[i].wbuf)) return -2;
+    }
+    int fd = fs_free_fd();
+    uint8_t* wbuf = writable ? fs_free_write_buf() : NULL;
+    if (fd < 0 || (writable && !wbuf)) return -3;
+
+    FsOpenFile* f = &fs_files[fd];
+    memset(f, 0, sizeof(FsOpenFile));
+    f->in_use = 1;
+    f->slot = slot;
+    f->size_bytes = e->size_bytes;
+    f->extent_count = e->extent_count;
+    for (int i = 0; i < e->extent_count; i++) {
+        f->extents[i] = e->extents[i];
+        f->clusters += e->extents[i].count;
+    }
+    f->wbuf = wbuf;
+    f->marked = f->clusters;
+    return fd;
+}
+
+int fs_open(const char* filename) {
+    if (!fs_ready()) return -1;
+    FsEntry e;
+    int slot = fs_lookup(filename, &e);
+    if (slot < 0) return -1;
+    return fs_open_slot(slot, &e, 0);
+}
+
+int fs_open_write(const char* filename) {
+    if (!fs_ready()) return -1;
+    FsEntry e;
+    int slot = fs_lookup(filename, &e);
+    if (slot < 0) return -1;
+    return fs_open_slot(slot, &e, 1);
+}
+
+int fs_create(const char* filename) {
+    if (!fs_ready()) return -1;
     if (strlen(filename) >= MAX_FILENAME_LEN) {
         print_string("Error: Filename too long.\n");
         return -4;
     }
-    if (data_size > MAX_FILE_SIZE) return -2;
-    int free_index = -1;
-    for (int i = 0; i < MAX_FILES; i++) {
-        if (strcmp(fs_table.entries[i].filename, filename) == 0) {
-            print_string("Error: File already exists.\n");
-            return -5;
-        }
-        if (free_index == -1 && fs_table.entries[i].filename[0] == '\0') {
-            free_index = i;
+    FsEntry e;
+    int slot = fs_lookup(filename, &e);
+    if (slot >= 0) {
+        int fd = fs_open_slot(slot, &e, 1);
+        if (fd >= 0 && fs_truncate(fd, 0) != 0) {
+            fs_close(fd);
+            return -1;
         }
+        return fd;
     }
-    if (free_index == -1) {
-        print_string("Error: File table is full.\n");
+
+    // Make sure it can be opened before the entry goes to disk.
+    if (fs_free_fd() < 0 || !fs_free_write_buf()) return -3;
+    memset(&e, 0, sizeof(FsEntry));
+    uint32_t new_slot;
+    int fresh;
+    if (fs_claim_slot(&new_slot, &fresh) != 0) {
+        print_string("Error: Directory is full.\n");
         return -3;
     }
-    uint32_t num_sectors = (data_size + HDD_SECTOR_SIZE - 1) / HDD_SECTOR_SIZE;
-    if (block_write(next_free_lba + FS_LBA_OFFSET, num_sectors, data) != 0) return -1;
-    FileEntry* new_entry = &fs_table.entries[free_index];
-    strncpy(new_entry->filename, filename, MAX_FILENAME_LEN - 1);
-    new_entry->filename[MAX_FILENAME_LEN - 1] = '\0';
-    new_entry->start_lba = next_free_lba;
-    new_entry->size_bytes = data_size;
-    if (block_write(FS_LBA_OFFSET, 1, &fs_table) != 0) return -1;
-    next_free_lba += num_sectors;
-    return 0;
-}
\ No newline at end of file
+    fs_sb.file_count++;
+    if (fs_save_superblock() != 0 || fs_link(new_slot, fresh, filename, 0, NULL, 0) != 0) return -1;
+    return fs_open_slot(new_slot, &e, 1);
+}
+
+int fs_read(int fd, void* buf, uint32_t n) {
+    FsOpenFile* f = fs_file(fd);
+    if (!f) return -1;
+    if (f->offset >= f->size_bytes) return 0;
+    if (n > f->size_bytes - f->offset) n = f->size_bytes - f->offset;
+    // Up to the end of the clusters from disk, after that from the buffer.
+    uint32_t end = f->clusters * fs_sb.cluster_sectors * HDD_SECTOR_SIZE;
+    uint32_t on_disk = f->offset >= end ? 0 : end - f->offset;
+    if (on_disk > n) on_disk = n;
+    if (on_disk > 0 && fs_extents_io(f->extents, f->extent_count, f->offset, buf, on_disk, 0) != 0) return -1;
+    if (n > on_disk) memcpy((uint8_t*)buf + on_disk, f->wbuf + (f->offset + on_disk - end), n - on_disk);
+    f->offset += n;
+    return n;
+}
+
+int fs_seek(int fd, int32_t offset, int whence) {
+    FsOpenFile* f = fs_file(fd);
+    if (!f) return -1;
+    int64_t base;
+    if (whence == FS_SEEK_SET) base = 0;
+    else if (whence == FS_SEEK_CUR) base = f->offset;
+    else if (whence == FS_SEEK_END) base = f->size_bytes;
+    else return -1;
+    int64_t pos = base + offset;
+    if (pos < 0 || pos > f->size_bytes) return -1;
+    f->offset = (uint32_t)pos;
+    return (int)pos;
+}
+
+int fs_size(int fd) {
+    FsOpenFile* f = fs_file(fd);
+    return f ? (int)f->size_bytes : -1;
+}
+
+// Cuts a file's extents down to its first `keep` clusters and returns
+// the pieces cut off in `cut`.
+static int fs_cut(FsOpenFile* f, uint32_t keep, FsExtent* cut) {
+    int n = 0;
+    int count = 0;
+    uint32_t base = 0;
+    for (int i = 0; i < f->extent_count; i++) {
+        FsExtent* x = &f->extents[i];
+        uint32_t stay = keep > base ? keep - base : 0;
+        base += x->count;
+        if (stay >= x->count) {
+            count = i + 1;
+            continue;
+        }
+        cut[n].start = x->start + stay;
+        cut[n].count = x->count - stay;
+        n++;
+        x->count = stay;
+        if (stay > 0) count = i + 1;
+    }
+    f->extent_count = count;
+    if (f->clusters > keep) f->clusters = keep;
+    if (f->marked > keep) f->marked = keep;
+    return n;
+}
+
+// Adds `count` clusters to the end of a file from its reservation. An
+// empty reservation is refilled from the free run right after the last
+// extent if there is one, or else the run that best fits everything the
+// file could still grow by. Returns -6, with nothing added, if they
+// don't fit in FS_EXTENTS extents.
+static int fs_extend(FsOpenFile* f, uint32_t count) {
+    uint32_t cluster_bytes = fs_sb.cluster_sectors * HDD_SECTOR_SIZE;
+    uint32_t old = f->clusters;
+    while (count > 0) {
+        FsExtent* last = f->extent_count > 0 ? &f->extents[f->extent_count - 1] : NULL;
+        if (f->reserve.count == 0) {
+            uint32_t want = (MAX_FILE_SIZE + cluster_bytes - 1) / cluster_bytes;
+            want = want > f->clusters + count ? want - f->clusters : count;
+            int i = 0;
+            while (last && i < fs_free_count && fs_free[i].start != last->start + last->count) i++;
+            if (last && i < fs_free_count) {
+                f->reserve.count = fs_free[i].count < want ? fs_free[i].count : want;
+                f->reserve.start = fs_take(i, f->reserve.count);
+            } else if (fs_take_run(want, &f->reserve) != 0) {
+                break;
+            }
+        }
+        uint32_t take = f->reserve.count < count ? f->reserve.count : count;
+        if (last && last->start + last->count == f->reserve.start) {
+            last->count += take;
+        } else if (f->extent_count < FS_EXTENTS) {
+            f->extents[f->extent_count].start = f->reserve.start;
+            f->extents[f->extent_count].count = take;
+            f->extent_count++;
+        } else {
+            break;
+        }
+        f->reserve.start += take;
+        f->reserve.count -= take;
+        f->clusters += take;
+        count -= take;
+    }
+    if (count == 0) return 0;
+    FsExtent cut[FS_EXTENTS];
+    int n = fs_cut(f, old, cut);
+    for (int i = 0; i < n; i++) fs_give(cut[i].start, cut[i].count);
+    return -6;
+}
+
+// Gives the buffered data clusters and writes it out.
+static int fs_flush_buffer(FsOpenFile* f) {
+    if (f->wbuf_len == 0) return 0;
+    uint32_t cluster_bytes = fs_sb.cluster_sectors * HDD_SECTOR_SIZE;
+    uint32_t end = f->clusters * cluster_bytes;
+    int ret = fs_extend(f, (f->wbuf_len + cluster_bytes - 1) / cluster_bytes);
+    if (ret != 0) return ret;
+    if (fs_extents_io(f->extents, f->extent_count, end, f->wbuf, f->wbuf_len, 1) != 0) return -1;
+    f->wbuf_len = 0;
+    return 0;
+}
+
+// Marks the clusters added since the last sync in the bitmap.
+static int fs_mark_new(FsOpenFile* f) {
+    uint32_t base = 0;
+    for (int i = 0; i < f->extent_count && f->marked < f->clusters; i++) {
+        uint32_t end = base + f->extents[i].count;
+        if (f->marked < end) {
+            uint32_t skip = f->marked - base;
+            if (fs_mark(f->extents[i].start + skip, f->extents[i].count - skip, 1) != 0) return -1;
+            f->marked = end;
+        }
+        base = end;
+    }
+    return 0;
+}
+
+// Rewrites the size and extents in a file's entry, leaving its name and
+// chain link alone.
+static int fs_save_entry(FsOpenFile* f) {
+    uint32_t sector = fs_sb.dir_start + f->slot / FS_ENTRIES_PER_SECTOR;
+    if (block_read(FS_LBA_OFFSET + sector, 1, fs_sector_buf) != 0) return -1;
+    FsEntry* e = (FsEntry*)fs_sector_buf + f->slot % FS_ENTRIES_PER_SECTOR;
+    e->size_bytes = f->size_bytes;
+    e->extent_count = f->extent_count;
+    memset(e->extents, 0, sizeof(e->extents));
+    for (int i = 0; i < f->extent_count; i++) e->extents[i] = f->extents[i];
+    return block_write_fua(FS_LBA_OFFSET + sector, 1, fs_sector_buf);
+}
+
+static int fs_sync_file(FsOpenFile* f) {
+    if (!f->wbuf || !f->dirty) return 0;
+    int ret = fs_flush_buffer(f);
+    if (ret != 0) return ret;
+    // Data, then the bitmap, then the entry: a crash in between leaks
+    // the new clusters instead of pointing at ones that aren't written.
+    if (block_flush() != 0 || fs_mark_new(f) != 0 || fs_save_entry(f) != 0) return -1;
+    f->dirty = 0;
+    return 0;
+}
+
+int fs_write(int fd, const void* data, uint32_t n) {
+    FsOpenFile* f = fs_file(fd);
+    if (!f || !f->wbuf) return -1;
+    if (n > MAX_FILE_SIZE - f->offset) return -2;
+    uint32_t cluster_bytes = fs_sb.cluster_sectors * HDD_SECTOR_SIZE;
+    const uint8_t* src = data;
+    uint32_t left = n;
+    while (left > 0) {
+        uint32_t end = f->clusters * cluster_bytes;
+        uint32_t chunk;
+        if (f->offset < end) {
+            // Over clusters the file already has: in place.
+            chunk = end - f->offset < left ? end - f->offset : left;
+            if (fs_extents_io(f->extents, f->extent_count, f->offset, (uint8_t*)src, chunk, 1) != 0) return -1;
+        } else {
+            uint32_t at = f->offset - end;
+            if (at == FS_WRITE_BUFFER) {
+                int ret = fs_flush_buffer(f);
+                if (ret != 0) return ret;
+                continue;
+            }
+            chunk = FS_WRITE_BUFFER - at < left ? FS_WRITE_BUFFER - at : left;
+            memcpy(f->wbuf + at, src, chunk);
+            if (at + chunk > f->wbuf_len) f->wbuf_len = at + chunk;
+        }
+        f->dirty = 1;
+        f->offset += chunk;
+        if (f->offset > f->size_bytes) f->size_bytes = f->offset;
+        src += chunk;
+        left -= chunk;
+    }
+    return n;
+}
+
+int fs_append(int fd, const void* data, uint32_t n) {
+    FsOpenFile* f = fs_file(fd);
+    if (!f) return -1;
+    f->offset = f->size_bytes;
+    return fs_write(fd, data, n);
+}
+
+int fs_truncate(int fd, uint32_t size) {
+    FsOpenFile* f = fs_file(fd);
+    if (!f || !f->wbuf) return -1;
+    if (size > MAX_FILE_SIZE) return -2;
+    if (size > f->size_bytes) {
+        static const uint8_t zeros[HDD_SECTOR_SIZE];
+        uint32_t offset = f->offset;
+        f->offset = f->size_bytes;
+        while (f->offset < size) {
+            uint32_t n = size - f->offset < HDD_SECTOR_SIZE ? size - f->offset : HDD_SECTOR_SIZE;
+            int ret = fs_write(fd, zeros, n);
+            if (ret < 0) return ret;
+        }
+        f->offset = offset;
+        return 0;
+    }
+
+    int ret = fs_sync_file(f);
+    if (ret != 0) return ret;
+    uint32_t cluster_bytes = fs_sb.cluster_sectors * HDD_SECTOR_SIZE;
+    FsExtent cut[FS_EXTENTS];
+    int n = fs_cut(f, (size + cluster_bytes - 1) / cluster_bytes, cut);
+    f->size_bytes = size;
+    if (f->offset > size) f->offset = size;
+    // The entry lets go of the clusters before they're freed.
+    if (fs_save_entry(f) != 0 || fs_mark_extents(cut, n, 0) != 0) return -1;
+
+    BlockRange ranges[FS_EXTENTS];
+    for (int i = 0; i < n; i++) {
+        fs_give(cut[i].start, cut[i].count);
+        ranges[i].lba = FS_LBA_OFFSET + fs_sb.data_start + (uint64_t)cut[i].start * fs_sb.cluster_sectors;
+        ranges[i].count = cut[i].count * fs_sb.cluster_sectors;
+    }
+    if (n > 0) block_discard(ranges, n);
+    return 0;
+}
+
+int fs_sync(int fd) {
+    FsOpenFile* f = fs_file(fd);
+    if (!f) return -1;
+    return fs_sync_file(f);
+}
+
+int fs_sync_all() {
+    if (!fs_ready()) return 0;
+    int ret = 0;
+    for (int fd = 0; fd < FS_MAX_OPEN; fd++) {
+        if (fs_files[fd].in_use && fs_sync_file(&fs_files[fd]) != 0) ret = -1;
+    }
+    return ret;
+}
+
+int fs_close(int fd) {
+    FsOpenFile* f = fs_file(fd);
+    if (!f) return -1;
+    int ret = fs_sync_file(f);
+    // Whatever the reservation still holds goes back; it was never marked.
+    fs_give(f->reserve.start, f->reserve.count);
+    f->in_use = 0;
+    return ret;
+}
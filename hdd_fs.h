@@ -3,31 +3,164 @@
 
 #include <stdint.h>
 
-#define MAX_FILENAME_LEN 32
-#define MAX_FILES 12
+#define MAX_FILENAME_LEN 48
 #define MAX_FILE_SIZE (1024 * 1024 * 2)
 #define HDD_SECTOR_SIZE 512
 #define FS_LBA_OFFSET 30720
 
+// --- On-disk format, version 2 ---
+// Sector numbers are relative to FS_LBA_OFFSET. Sector 0 is the
+// superblock; the directory, the name hash and the data clusters follow
+// wherever it says. Directory slots are handed out in order and the
+// directory grows into its reserved region a sector at a time; deleted
+// slots are chained through `hash_next` and reused first.
+#define FS_MAGIC   0x5346487F // "\x7FHFS": no v1 filename starts with 0x7F
+#define FS_VERSION 2
+
+#define FS_CLUSTER_SECTORS 8      // Default allocation unit, 4 KB
+#define FS_MAX_CLUSTER_SECTORS 128
+#define FS_DIR_MAX_ENTRIES 8192   // 2048 directory sectors reserved
+#define FS_HASH_SECTORS    64     // 8192 buckets
+#define FS_EXTENTS         8      // Extents one entry can hold
+
+// Free space is a bitmap, a bit per cluster set while it's in use, kept
+// in data clusters of its own. At mount it's condensed into a table of
+// free runs; a run that doesn't fit in the table is forgotten until the
+// next mount.
+#define FS_BITS_PER_SECTOR (HDD_SECTOR_SIZE * 8)
+#define FS_FREE_EXTENTS    1024
+
+// Open-file table. A descriptor holds a copy of the file's extents, so
+// reads through it go straight to the sectors they need.
+#define FS_MAX_OPEN 8
+
+// Writable descriptors hold data written past the end of the file's
+// clusters in a buffer and only allocate clusters for it when the buffer
+// fills or the file is synced. Each also keeps a reservation of free
+// clusters following its last extent, so a file written as a stream
+// grows one extent. The entry and the bitmap on disk catch up on
+// fs_sync and fs_close.
+#define FS_WRITERS      2
+#define FS_WRITE_BUFFER (64 * 1024)
+
+#define FS_SEEK_SET 0
+#define FS_SEEK_CUR 1
+#define FS_SEEK_END 2
+
+// A run of clusters; cluster 0 starts at the superblock's data_start.
+typedef struct {
+    uint32_t start;
+    uint32_t count;
+} __attribute__((packed)) FsExtent;
+
+// One directory slot. An empty name marks a free slot. Entries whose
+// names hash to the same bucket are chained through `hash_next`.
 typedef struct {
     char filename[MAX_FILENAME_LEN];
-    uint32_t start_lba;
     uint32_t size_bytes;
-} __attribute__((packed)) FileEntry;
+    uint32_t hash_next;          // Next slot in the chain + 1, 0 ends it
+    uint16_t extent_count;
+    uint16_t flags;
+    uint32_t reserved;
+    FsExtent extents[FS_EXTENTS];
+} __attribute__((packed)) FsEntry;
+
+#define FS_ENTRIES_PER_SECTOR (HDD_SECTOR_SIZE / sizeof(FsEntry))
+#define FS_BUCKETS_PER_SECTOR (HDD_SECTOR_SIZE / sizeof(uint32_t))
 
 typedef struct {
-    FileEntry entries[MAX_FILES];
-    char padding[512 - (MAX_FILES * sizeof(FileEntry))];
-} __attribute__((packed)) FileIndexTable;
+    uint32_t magic;
+    uint32_t version;
+    uint32_t cluster_sectors;
+    uint32_t total_sectors;      // Partition size
+    uint32_t dir_start;
+    uint32_t dir_max_entries;    // Slots the reserved region holds
+    uint32_t dir_entries;        // Slots handed out so far
+    uint32_t hash_start;         // Bucket heads: slot + 1, 0 if empty
+    uint32_t hash_sectors;
+    uint32_t data_start;
+    uint32_t total_clusters;
+    uint32_t next_free_cluster;  // Only used by volumes without a bitmap
+    uint32_t file_count;
+    uint32_t bitmap_start;       // 0 on volumes written before the bitmap
+    uint32_t bitmap_sectors;
+    uint32_t dir_free;           // First deleted slot + 1, 0 if none
+    uint8_t padding[HDD_SECTOR_SIZE - 16 * sizeof(uint32_t)];
+} __attribute__((packed)) FsSuperblock;
 
-// Make the file table globally accessible
-extern FileIndexTable fs_table;
+// Version 1: a single sector of 12 fixed entries, each file one run of
+// sectors from `start_lba`. fs_init converts these volumes to version 2.
+#define FS_V1_MAX_FILES 12
+#define FS_V1_FILENAME_LEN 32
+
+typedef struct {
+    char filename[FS_V1_FILENAME_LEN];
+    uint32_t start_lba;
+    uint32_t size_bytes;
+} __attribute__((packed)) FsV1Entry;
 
 // Public Functions
 void fs_init();
 void fs_list_files();
+// Reads the file into `buffer` and NUL-terminates it, so `buffer` needs
+// the file's size plus one byte. Returns the size, or a negative error.
 int fs_read_file(const char* filename, char* buffer);
+// Writes a whole file, replacing any file of that name. Returns 0, or -1
+// on a disk error, -2 if it's over MAX_FILE_SIZE, -3 if there's no free
+// directory slot or descriptor, -4 if the name is too long or -6 if the
+// disk is full.
 int fs_write_file(const char* filename, const char* data, uint32_t data_size);
+// Removes the file and frees (and discards) its clusters. Returns 0, -1
+// if it doesn't exist or the disk fails, or -2 if it's open.
+int fs_delete_file(const char* filename);
+
+// Opens a file for reading at offset 0. Returns a descriptor, -1 if it
+// doesn't exist, -2 if it's open for writing or -3 if FS_MAX_OPEN files
+// are already open. Mounting or formatting drops every descriptor
+// without syncing it.
+int fs_open(const char* filename);
+// Opens an existing file for reading and writing at offset 0. Returns a
+// descriptor, -1, -2 if it's already open, or -3 if no descriptor or
+// write buffer is free.
+int fs_open_write(const char* filename);
+// Opens a file for reading and writing, creating it or emptying it
+// first. Returns a descriptor or an fs_open_write/fs_write_file error.
+int fs_create(const char* filename);
+// Reads up to `n` bytes from the descriptor's offset and advances it.
+// Only the sectors under those bytes are read. Returns the number of
+// bytes read, 0 at the end of the file, or -1.
+int fs_read(int fd, void* buf, uint32_t n);
+// Moves the offset relative to FS_SEEK_SET, FS_SEEK_CUR or FS_SEEK_END;
+// it can't go outside the file. Returns the new offset, or -1.
+int fs_seek(int fd, int32_t offset, int whence);
+// Returns the file's size, or -1.
+int fs_size(int fd);
+// Writes `n` bytes at the offset and advances it: over the file's data
+// in place and growing it past its end. Returns `n`, or -1, -2 if the
+// file would pass MAX_FILE_SIZE, or -6 if the disk is full.
+int fs_write(int fd, const void* data, uint32_t n);
+// fs_write at the end of the file, wherever the offset is.
+int fs_append(int fd, const void* data, uint32_t n);
+// Shrinks the file, freeing its clusters past `size` and syncing at
+// once, or grows it with zeros. The offset stays within the file.
+int fs_truncate(int fd, uint32_t size);
+// Writes out buffered data, then the bitmap and the file's entry.
+int fs_sync(int fd);
+// fs_sync on every writable descriptor.
+int fs_sync_all();
+// Syncs a writable descriptor and releases it. Returns fs_sync's result.
+int fs_close(int fd);
+// Formats with FS_CLUSTER_SECTORS clusters.
 void fs_format_disk();
+// Formats with `cluster_sectors` clusters (a power of two up to
+// FS_MAX_CLUSTER_SECTORS). Returns 0 on success.
+int fs_format(uint32_t cluster_sectors);
+
+// 1 if `filename` exists.
+int fs_exists(const char* filename);
+// Walks the directory: start with *cursor = 0 and call until it returns
+// 0. Each call fills in the next file's name (MAX_FILENAME_LEN bytes)
+// and size.
+int fs_readdir(uint32_t* cursor, char* filename, uint32_t* size_bytes);
 
-#endif // HDD_FS_H
\ No newline at end of file
+#endif // HDD_FS_H
@@ -0,0 +1,218 @@
+#include "idt.h"
+#include "ports.h"
+#include "shell.h"
+
+#define PIC1_COMMAND 0x20
+#define PIC1_DATA    0x21
+#define PIC2_COMMAND 0xA0
+#define PIC2_DATA    0xA1
+#define PIC_EOI      0x20
+#define PIC_READ_ISR 0x0B
+
+#define IDT_ENTRIES 256
+#define IDT_INTERRUPT_GATE 0x8E // Present, ring 0, 32-bit interrupt gate
+
+// Local APIC
+#define IA32_APIC_BASE_MSR  0x1B
+#define APIC_BASE_ENABLE    (1 << 11)
+#define LAPIC_REG_ID        0x020
+#define LAPIC_REG_EOI       0x0B0
+#define LAPIC_REG_SPURIOUS  0x0F0
+#define LAPIC_SW_ENABLE     0x100
+#define LAPIC_SPURIOUS_VECTOR 0xFF
+
+typedef struct {
+    uint16_t offset_low;
+    uint16_t selector;
+    uint8_t  zero;
+    uint8_t  type_attr;
+    uint16_t offset_high;
+} __attribute__((packed)) IdtEntry;
+
+typedef struct {
+    uint16_t limit;
+    uint32_t base;
+} __attribute__((packed)) IdtPointer;
+
+__attribute__((aligned(8))) static IdtEntry idt[IDT_ENTRIES];
+static irq_handler_t irq_handlers[IRQ_MSI_BASE + IRQ_MSI_COUNT];
+static volatile uint32_t* lapic = 0;
+
+// --- Entry stubs ---
+// Each stub pushes its IRQ number and joins a common path that saves the
+// general registers and calls irq_dispatch(). GRUB's flat segments are left
+// as they are.
+#define IRQ_STUB(n) \
+    ".globl irq_stub_" #n "\n" \
+    "irq_stub_" #n ":\n" \
+    "    pushl $" #n "\n" \
+    "    jmp irq_common\n"
+
+__asm__(
+    ".text\n"
+    IRQ_STUB(0)  IRQ_STUB(1)  IRQ_STUB(2)  IRQ_STUB(3)
+    IRQ_STUB(4)  IRQ_STUB(5)  IRQ_STUB(6)  IRQ_STUB(7)
+    IRQ_STUB(8)  IRQ_STUB(9)  IRQ_STUB(10) IRQ_STUB(11)
+    IRQ_STUB(12) IRQ_STUB(13) IRQ_STUB(14) IRQ_STUB(15)
+    IRQ_STUB(16) IRQ_STUB(17) IRQ_STUB(18) IRQ_STUB(19)
+    IRQ_STUB(20) IRQ_STUB(21) IRQ_STUB(22) IRQ_STUB(23)
+    // The local APIC's spurious vector needs no EOI.
+    ".globl irq_stub_spurious\n"
+    "irq_stub_spurious:\n"
+    "    iret\n"
+    "irq_common:\n"
+    "    pusha\n"
+    "    cld\n"
+    "    pushl 32(%esp)\n"
+    "    call irq_dispatch\n"
+    "    addl $4, %esp\n"
+    "    popa\n"
+    "    addl $4, %esp\n"
+    "    iret\n"
+);
+
+extern void irq_stub_0(), irq_stub_1(), irq_stub_2(), irq_stub_3(),
+            irq_stub_4(), irq_stub_5(), irq_stub_6(), irq_stub_7(),
+            irq_stub_8(), irq_stub_9(), irq_stub_10(), irq_stub_11(),
+            irq_stub_12(), irq_stub_13(), irq_stub_14(), irq_stub_15(),
+            irq_stub_16(), irq_stub_17(), irq_stub_18(), irq_stub_19(),
+            irq_stub_20(), irq_stub_21(), irq_stub_22(), irq_stub_23(),
+            irq_stub_spurious();
+
+static void (*const irq_stubs[IRQ_MSI_BASE + IRQ_MSI_COUNT])() = {
+    irq_stub_0, irq_stub_1, irq_stub_2, irq_stub_3,
+    irq_stub_4, irq_stub_5, irq_stub_6, irq_stub_7,
+    irq_stub_8, irq_stub_9, irq_stub_10, irq_stub_11,
+    irq_stub_12, irq_stub_13, irq_stub_14, irq_stub_15,
+    irq_stub_16, irq_stub_17, irq_stub_18, irq_stub_19,
+    irq_stub_20, irq_stub_21, irq_stub_22, irq_stub_23
+};
+
+static void idt_set_gate(uint8_t vector, uint32_t handler) {
+    uint16_t cs;
+    __asm__ volatile("mov %%cs, %0" : "=r"(cs));
+    idt[vector].offset_low = handler & 0xFFFF;
+    idt[vector].selector = cs;
+    idt[vector].zero = 0;
+    idt[vector].type_attr = IDT_INTERRUPT_GATE;
+    idt[vector].offset_high = handler >> 16;
+}
+
+static uint16_t pic_read_isr() {
+    outb(PIC1_COMMAND, PIC_READ_ISR);
+    outb(PIC2_COMMAND, PIC_READ_ISR);
+    return (inb(PIC2_COMMAND) << 8) | inb(PIC1_COMMAND);
+}
+
+// Called from irq_common with interrupts disabled.
+void irq_dispatch(int irq) {
+    // MSIs are acknowledged at the local APIC, not the PICs.
+    if (irq >= IRQ_MSI_BASE) {
+        if (irq_handlers[irq]) irq_handlers[irq](irq);
+        lapic[LAPIC_REG_EOI / 4] = 0;
+        return;
+    }
+
+    // IRQ7/IRQ15 can be spurious: the ISR bit is clear and no EOI is owed
+    // (except the cascade EOI to the master for a spurious IRQ15).
+    if ((irq == 7 || irq == 15) && !(pic_read_isr() & (1 << irq))) {
+        if (irq == 15) outb(PIC1_COMMAND, PIC_EOI);
+        return;
+    }
+
+    if (irq_handlers[irq]) irq_handlers[irq](irq);
+
+    if (irq >= 8) outb(PIC2_COMMAND, PIC_EOI);
+    outb(PIC1_COMMAND, PIC_EOI);
+}
+
+void irq_mask(int irq) {
+    uint16_t port = irq < 8 ? PIC1_DATA : PIC2_DATA;
+    outb(port, inb(port) | (1 << (irq & 7)));
+}
+
+void irq_unmask(int irq) {
+    uint16_t port = irq < 8 ? PIC1_DATA : PIC2_DATA;
+    outb(port, inb(port) & ~(1 << (irq & 7)));
+    if (irq >= 8) outb(PIC1_DATA, inb(PIC1_DATA) & ~(1 << 2)); // Cascade line
+}
+
+int irq_has_handler(int irq) {
+    return irq_handlers[irq] != 0;
+}
+
+void irq_install_handler(int irq, irq_handler_t handler) {
+    irq_handlers[irq] = handler;
+    irq_unmask(irq);
+}
+
+static uint64_t rdmsr(uint32_t msr) {
+    uint32_t lo, hi;
+    __asm__ volatile("rdmsr" : "=a"(lo), "=d"(hi) : "c"(msr));
+    return ((uint64_t)hi << 32) | lo;
+}
+
+// Finds the local APIC (CPUID.1:EDX bit 9, then IA32_APIC_BASE) and sets
+// the software-enable bit. The PICs keep working through LINT0 as before.
+static int lapic_enable() {
+    if (lapic) return 1;
+    uint32_t eax = 1, ebx, ecx, edx;
+    __asm__ volatile("cpuid" : "+a"(eax), "=b"(ebx), "=c"(ecx), "=d"(edx));
+    if (!(edx & (1 << 9))) return 0;
+
+    uint64_t base = rdmsr(IA32_APIC_BASE_MSR);
+    if (!(base & APIC_BASE_ENABLE)) return 0;
+    lapic = (volatile uint32_t*)(uint32_t)(base & 0xFFFFF000);
+    lapic[LAPIC_REG_SPURIOUS / 4] = LAPIC_SW_ENABLE | LAPIC_SPURIOUS_VECTOR;
+    return 1;
+}
+
+uint32_t lapic_msi_address() {
+    uint8_t apic_id = lapic[LAPIC_REG_ID / 4] >> 24;
+    return 0xFEE00000 | ((uint32_t)apic_id << 12);
+}
+
+int irq_alloc_msi(irq_handler_t handler) {
+    if (!lapic_enable()) return -1;
+    for (int irq = IRQ_MSI_BASE; irq < IRQ_MSI_BASE + IRQ_MSI_COUNT; irq++) {
+        if (!irq_handlers[irq]) {
+            irq_handlers[irq] = handler;
+            return irq;
+        }
+    }
+    return -1;
+}
+
+// Moves the PICs off the CPU exception vectors (ICW1-ICW4) and masks
+// every line.
+static void pic_remap() {
+    outb(PIC1_COMMAND, 0x11);
+    outb(PIC2_COMMAND, 0x11);
+    outb(PIC1_DATA, IRQ_VECTOR_BASE);
+    outb(PIC2_DATA, IRQ_VECTOR_BASE + 8);
+    outb(PIC1_DATA, 0x04); // Slave on IRQ2
+    outb(PIC2_DATA, 0x02); // Cascade identity
+    outb(PIC1_DATA, 0x01); // 8086 mode
+    outb(PIC2_DATA, 0x01);
+    outb(PIC1_DATA, 0xFF);
+    outb(PIC2_DATA, 0xFF);
+}
+
+void idt_init() {
+    memset(idt, 0, sizeof(idt));
+    for (int i = 0; i < 16; i++) {
+        idt_set_gate(IRQ_VECTOR_BASE + i, (uint32_t)irq_stubs[i]);
+    }
+    for (int i = 0; i < IRQ_MSI_COUNT; i++) {
+        idt_set_gate(MSI_VECTOR_BASE + i, (uint32_t)irq_stubs[IRQ_MSI_BASE + i]);
+    }
+    idt_set_gate(LAPIC_SPURIOUS_VECTOR, (uint32_t)irq_stub_spurious);
+
+    pic_remap();
+
+    IdtPointer idtr;
+    idtr.limit = sizeof(idt) - 1;
+    idtr.base = (uint32_t)idt;
+    __asm__ volatile("lidt %0" : : "m"(idtr));
+    __asm__ volatile("sti");
+}
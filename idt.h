@@ -0,0 +1,63 @@
+#ifndef IDT_H
+#define IDT_H
+
+#include <stdint.h>
+
+// Legacy PIC lines are remapped to vectors 0x20-0x2F.
+#define IRQ_VECTOR_BASE 0x20
+
+#define IRQ_TIMER      0
+#define IRQ_ATA_PRIMARY   14
+#define IRQ_ATA_SECONDARY 15
+
+// Message-signalled interrupts bypass the PICs and go to the local APIC on
+// vectors 0x30-0x37. They are numbered 16-23, after the PIC lines.
+#define IRQ_MSI_BASE    16
+#define IRQ_MSI_COUNT   8
+#define MSI_VECTOR_BASE 0x30
+
+typedef void (*irq_handler_t)(int irq);
+
+// Loads the IDT, remaps both PICs with every line masked, and enables
+// interrupts. Lines are unmasked one by one as drivers register handlers.
+void idt_init();
+
+// Installs `handler` for a PIC line and unmasks it.
+void irq_install_handler(int irq, irq_handler_t handler);
+
+void irq_mask(int irq);
+void irq_unmask(int irq);
+
+// 1 if a driver already owns this line or MSI IRQ.
+int irq_has_handler(int irq);
+
+// Software-enables the local APIC and claims an MSI vector for `handler`.
+// Returns the IRQ number (IRQ_MSI_BASE..), or -1 if the CPU has no local
+// APIC or every MSI vector is taken.
+int irq_alloc_msi(irq_handler_t handler);
+
+// The vector an MSI IRQ number is delivered on, and the message address
+// that targets the boot CPU's local APIC.
+static inline uint8_t irq_msi_vector(int irq) {
+    return MSI_VECTOR_BASE + irq - IRQ_MSI_BASE;
+}
+uint32_t lapic_msi_address();
+
+// Disables interrupts and returns the previous EFLAGS, for state shared
+// with an interrupt handler. Pair with irq_restore.
+static inline uint32_t irq_save() {
+    uint32_t flags;
+    __asm__ volatile("pushfl; popl %0; cli" : "=r"(flags) : : "memory");
+    return flags;
+}
+
+static inline void irq_restore(uint32_t flags) {
+    if (flags & 0x200) __asm__ volatile("sti" : : : "memory");
+}
+
+// Sleeps until the next interrupt. Interrupts must be enabled.
+static inline void cpu_idle() {
+    __asm__ volatile("hlt");
+}
+
+#endif // IDT_H
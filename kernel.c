@@ -7,6 +7,9 @@
 #include "stdio.h"
 #include "extrainclude.h"
 #include "graphics.h" // Needed for the graphical function declarations
+#include "timer.h"
+#include "idt.h"
+#include "bcache.h"
 
 // --- NEW GLOBAL STATE VARIABLE ---
 // This flag controls the output redirection for the entire OS.
@@ -22,6 +25,7 @@ int strncmp(const char *a, const char *b, size_t n) { for (size_t i = 0; i < n;
 char *strncpy(char *dest, const char *src, size_t n) { size_t i = 0; for (; i < n && src[i] != '\0'; i++) { dest[i] = src[i]; } for (; i < n; i++) { dest[i] = '\0'; } return dest; }
 size_t strlen(const char* str) { size_t len = 0; while (str[len]) { len++; } return len; }
 void* memset(void *s, int c, size_t n) { unsigned char* p = (unsigned char*)s; while(n--) { *p++ = (unsigned char)c; } return s; }
+void* memcpy(void* dest, const void* src, size_t n) { void* d = dest; size_t words = n >> 2; __asm__ volatile("rep movsl; movl %3, %%ecx; rep movsb" : "+D"(d), "+S"(src), "+c"(words) : "r"(n & 3) : "memory"); return dest; }
 void* memmove(void* dest, const void* src, size_t n) { unsigned char* p_dest = (unsigned char*)dest; const unsigned char* p_src = (const unsigned char*)src; if (p_dest < p_src) { for (size_t i = 0; i < n; i++) { p_dest[i] = p_src[i]; } } else if (p_dest > p_src) { for (size_t i = n; i > 0; i--) { p_dest[i-1] = p_src[i-1]; } } return dest; }
 
 
@@ -39,6 +43,10 @@ uint8_t terminal_fg_color = 15; // White
 uint8_t terminal_bg_color = 0;  // Black
 char input_buffer[INPUT_BUFFER_SIZE];
 
+// Multiboot handoff, stored by boot.asm before main runs.
+uint32_t multiboot_magic = 0;
+uint32_t multiboot_info = 0;
+
 // (Port I/O functions are here as before...)
 void outb(uint16_t port, uint8_t val) { __asm__ volatile ("outb %0, %1" : : "a"(val), "Nd"(port)); }
 uint8_t inb(uint16_t port) { uint8_t data; __asm__ volatile ("inb %1, %0" : "=a"(data) : "Nd"(port)); return data; }
@@ -46,6 +54,22 @@ void outw(uint16_t port, uint16_t val) { __asm__ volatile("outw %0, %1" : : "a"(
 uint16_t inw(uint16_t port) { uint16_t ret; __asm__ volatile("inw %1, %0" : "=a"(ret) : "Nd"(port)); return ret; }
 void outl(uint16_t port, uint32_t val) { __asm__ volatile("outl %0, %1" : : "a"(val), "Nd"(port)); }
 uint32_t inl(uint16_t port) { uint32_t ret; __asm__ volatile("inl %1, %0" : "=a"(ret) : "Nd"(port)); return ret; }
+void insw(uint16_t port, void* buf, uint32_t count) { __asm__ volatile("cld; rep insw" : "+D"(buf), "+c"(count) : "d"(port) : "memory"); }
+void outsw(uint16_t port, const void* buf, uint32_t count) { __asm__ volatile("cld; rep outsw" : "+S"(buf), "+c"(count) : "d"(port) : "memory"); }
+void insl(uint16_t port, void* buf, uint32_t count) { __asm__ volatile("cld; rep insl" : "+D"(buf), "+c"(count) : "d"(port) : "memory"); }
+void outsl(uint16_t port, const void* buf, uint32_t count) { __asm__ volatile("cld; rep outsl" : "+S"(buf), "+c"(count) : "d"(port) : "memory"); }
+
+// 64-by-32 bit unsigned division. We link without libgcc, so plain `/` on a
+// uint64_t would leave an unresolved __udivdi3.
+uint64_t udiv64(uint64_t n, uint32_t d, uint32_t* rem) {
+    uint32_t hi = (uint32_t)(n >> 32), lo = (uint32_t)n;
+    uint32_t q_hi = hi / d;
+    uint32_t r = hi % d;
+    uint32_t q_lo;
+    __asm__("divl %4" : "=a"(q_lo), "=d"(r) : "a"(lo), "d"(r), "rm"(d));
+    if (rem) *rem = r;
+    return ((uint64_t)q_hi << 32) | q_lo;
+}
 
 // ==== TERMINAL ====
 
@@ -180,7 +204,7 @@ void print_hex(uint32_t val) {
 // (Keyboard functions remain unchanged...)
 char scancode_map[128] = { 0, 27,'1','2','3','4','5','6','7','8','9','0','-','=', '\b', '\t', 'q','w','e','r','t','y','u','i','o','p','[',']','\n', 0, 'a','s','d','f','g','h','j','k','l',';','\'','`', 0, '\\', 'z','x','c','v','b','n','m',',','.','/', 0, '*', 0, ' ', };
 char scancode_shift[128] = { 0, 27,'!','@','#','$','%','^','&','*','(',')','_','+', '\b', '\t', 'Q','W','E','R','T','Y','U','I','O','P','{','}','\n', 0, 'A','S','D','F','G','H','J','K','L',':','"','~', 0, '|', 'Z','X','C','V','B','N','M','<','>','?', 0, '*', 0, ' ', };
-char get_single_keypress() { while (1) { while ((inb(0x64) & 1) == 0) {} uint8_t scancode = inb(0x60); if (scancode & 0x80) { scancode &= 0x7F; if (scancode == 42 || scancode == 54) shift = 0; } else { if (scancode == 42 || scancode == 54) { shift = 1; } else { char c = shift ? scancode_shift[scancode] : scancode_map[scancode]; if (c) { return c; } } } } }
+char get_single_keypress() { while (1) { while ((inb(0x64) & 1) == 0) { bcache_idle(); } uint8_t scancode = inb(0x60); if (scancode & 0x80) { scancode &= 0x7F; if (scancode == 42 || scancode == 54) shift = 0; } else { if (scancode == 42 || scancode == 54) { shift = 1; } else { char c = shift ? scancode_shift[scancode] : scancode_map[scancode]; if (c) { return c; } } } } }
 
 // --- MODIFIED: get_user_input now calls the redirected backspace_vga() ---
 void get_user_input(char* buffer, int max_len) {
@@ -215,6 +239,8 @@ void main(void) {
     clear_screen();
 
     print_string("ChucklesOS2 booting...\n");
+    idt_init();
+    timer_init();
     block_init();
     fs_init();
     new_line();
@@ -43,11 +43,11 @@ static void handle_install_command() {
         return;
     }
 
-    for (uint32_t i = 0; i < sectors_to_write; i++) {
-        if (block_write(i, 1, (void*)(image_ptr + (i * HDD_SECTOR_SIZE))) != 0) {
-            print_string("FAILED.\n");
-            return;
-        }
+    // One call: the block layer splits it into maximal commands.
+    // Flush so the image is on the media before the user reboots.
+    if (block_write(0, sectors_to_write, image_ptr) != 0 || block_flush() != 0) {
+        print_string("FAILED.\n");
+        return;
     }
     print_string("OK\n");
 
@@ -0,0 +1,722 @@
+#include "nvme.h"
+#include "pci.h"
+#include "idt.h"
+#include "timer.h"
+#include "shell.h"
+#include "extrainclude.h"
+
+#define PCI_CLASS_MASS_STORAGE 0x01
+#define PCI_SUBCLASS_NVM       0x08
+#define PCI_PROGIF_NVME        0x02
+
+#define NVME_IRQ_NONE 0
+#define NVME_IRQ_INTX 1
+#define NVME_IRQ_MSI  2
+
+typedef struct {
+    block_callback_t callback;
+    void* ctx;
+} NvmeSlot;
+
+// One submission/completion queue pair. Command identifiers are slot
+// numbers, so a completion leads straight back to its callback.
+typedef struct {
+    uint16_t id;                 // 0 is the admin queue
+    uint16_t entries;
+    NvmeCommand* sq;
+    volatile NvmeCompletion* cq;
+    volatile uint32_t* sq_doorbell;
+    volatile uint32_t* cq_doorbell;
+    uint16_t sq_tail;
+    uint16_t sq_rung;            // Tail as last written to the doorbell
+    uint16_t cq_head;
+    uint8_t phase;               // Phase tag new completions carry
+    uint32_t slot_mask;          // Slots usable on this queue
+    volatile uint32_t busy;      // Slots with a command in flight
+    volatile int inflight;
+    NvmeSlot slots[NVME_QUEUE_SLOTS];
+    uint64_t (*prp_lists)[NVME_PRP_LIST_ENTRIES]; // One per slot
+    uint32_t commands;
+    uint32_t doorbells;
+} NvmeQueue;
+
+typedef struct {
+    PciAddress pci;
+    volatile uint8_t* regs;
+    uint32_t doorbell_stride;
+    uint32_t ready_timeout_ms;   // CAP.TO
+    uint32_t max_entries;        // CAP.MQES
+    int irq_mode;
+    uint16_t admin_cid;
+    NvmeQueue admin;
+    NvmeQueue io[NVME_IO_QUEUES];
+    volatile int io_queue_count;
+    uint32_t nsid;
+    int write_cache;             // Volatile write cache present
+    int dsm;                     // Dataset Management supported
+    BlockDevice block;
+} NvmeController;
+
+__attribute__((aligned(4096))) static NvmeCommand nvme_admin_sq[NVME_PAGE_SIZE / sizeof(NvmeCommand)];
+__attribute__((aligned(4096))) static NvmeCompletion nvme_admin_cq[NVME_PAGE_SIZE / sizeof(NvmeCompletion)];
+__attribute__((aligned(4096))) static NvmeCommand nvme_io_sq[NVME_IO_QUEUES][NVME_PAGE_SIZE / sizeof(NvmeCommand)];
+__attribute__((aligned(4096))) static NvmeCompletion nvme_io_cq[NVME_IO_QUEUES][NVME_PAGE_SIZE / sizeof(NvmeCompletion)];
+__attribute__((aligned(4096))) static uint64_t nvme_prp_lists[NVME_IO_QUEUES][NVME_QUEUE_SLOTS][NVME_PRP_LIST_ENTRIES];
+__attribute__((aligned(4096))) static uint8_t nvme_identify_buf[NVME_PAGE_SIZE];
+__attribute__((aligned(4096))) static NvmeDsmRange nvme_dsm_ranges[NVME_DSM_RANGES];
+static NvmeController nvme;
+static int nvme_present = 0;
+static volatile uint32_t nvme_interrupts = 0;
+
+static inline void nvme_barrier() {
+    __asm__ volatile("" ::: "memory");
+}
+
+static inline uint32_t nvme_read32(NvmeController* c, uint32_t reg) {
+    return *(volatile uint32_t*)(c->regs + reg);
+}
+
+static inline void nvme_write32(NvmeController* c, uint32_t reg, uint32_t value) {
+    *(volatile uint32_t*)(c->regs + reg) = value;
+}
+
+static uint64_t nvme_read64(NvmeController* c, uint32_t reg) {
+    uint32_t lo = nvme_read32(c, reg);
+    return ((uint64_t)nvme_read32(c, reg + 4) << 32) | lo;
+}
+
+static void nvme_write64(NvmeController* c, uint32_t reg, uint64_t value) {
+    nvme_write32(c, reg, (uint32_t)value);
+    nvme_write32(c, reg + 4, (uint32_t)(value >> 32));
+}
+
+static void nvme_queue_setup(NvmeController* c, NvmeQueue* q, uint16_t id, uint16_t entries,
+                             NvmeCommand* sq, NvmeCompletion* cq) {
+    memset(sq, 0, entries * sizeof(NvmeCommand));
+    memset(cq, 0, entries * sizeof(NvmeCompletion));
+    q->id = id;
+    q->entries = entries;
+    q->sq = sq;
+    q->cq = cq;
+    q->sq_doorbell = (volatile uint32_t*)(c->regs + NVME_REG_DOORBELLS + (2 * id) * c->doorbell_stride);
+    q->cq_doorbell = (volatile uint32_t*)(c->regs + NVME_REG_DOORBELLS + (2 * id + 1) * c->doorbell_stride);
+    q->sq_tail = 0;
+    q->sq_rung = 0;
+    q->cq_head = 0;
+    q->phase = 1;
+    q->busy = 0;
+    q->inflight = 0;
+    // One entry stays empty so a full queue differs from an empty one.
+    uint32_t slots = entries - 1 < NVME_QUEUE_SLOTS ? entries - 1 : NVME_QUEUE_SLOTS;
+    q->slot_mask = slots == 32 ? 0xFFFFFFFF : (1u << slots) - 1;
+}
+
+// Runs one admin command to completion by polling. The admin queue
+// shares interrupt vector 0 with the I/O queues, so it is masked for the
+// duration. Timed with the TSC, which also works with interrupts off.
+static int nvme_admin(NvmeController* c, NvmeCommand* cmd, uint32_t* result) {
+    NvmeQueue* q = &c->admin;
+    cmd->cid = c->admin_cid++;
+    if (c->irq_mode != NVME_IRQ_NONE) nvme_write32(c, NVME_REG_INTMS, 1);
+    memcpy(&q->sq[q->sq_tail], cmd, sizeof(NvmeCommand));
+    if (++q->sq_tail == q->entries) q->sq_tail = 0;
+    nvme_barrier();
+    *q->sq_doorbell = q->sq_tail;
+
+    int ret = -1;
+    uint32_t start = timer_us();
+    for (;;) {
+        volatile NvmeCompletion* e = &q->cq[q->cq_head];
+        if ((e->status & 1) == q->phase) {
+            uint16_t cid = e->cid;
+            uint16_t status = e->status >> 1;
+            uint32_t value = e->result;
+            if (++q->cq_head == q->entries) {
+                q->cq_head = 0;
+                q->phase ^= 1;
+            }
+            *q->cq_doorbell = q->cq_head;
+            if (cid != cmd->cid) continue; // Left over from before a timeout
+            if (result) *result = value;
+            ret = status == 0 ? 0 : -1;
+            break;
+        }
+        if (timer_us() - start > NVME_TIMEOUT_MS * 1000) {
+            print_string("NVMe: Admin command timeout!\n");
+            break;
+        }
+    }
+    if (c->irq_mode != NVME_IRQ_NONE) nvme_write32(c, NVME_REG_INTMC, 1);
+    return ret;
+}
+
+// Finishes every posted completion on one I/O queue. Called in interrupt
+// context or with interrupts off.
+static int nvme_reap(NvmeQueue* q) {
+    int done = 0;
+    uint16_t head = q->cq_head;
+    for (;;) {
+        volatile NvmeCompletion* e = &q->cq[q->cq_head];
+        if ((e->status & 1) != q->phase) break;
+        nvme_barrier();
+        uint16_t cid = e->cid;
+        int status = (e->status >> 1) ? -1 : 0;
+        if (++q->cq_head == q->entries) {
+            q->cq_head = 0;
+            q->phase ^= 1;
+        }
+        if (cid >= NVME_QUEUE_SLOTS || !(q->busy & (1u << cid))) continue;
+
+        block_callback_t callback = q->slots[cid].callback;
+        void* ctx = q->slots[cid].ctx;
+        // Free the slot first so the callback can submit again.
+        q->busy &= ~(1u << cid);
+        q->inflight--;
+        if (callback) callback(ctx, status);
+        done++;
+    }
+    if (q->cq_head != head) *q->cq_doorbell = q->cq_head;
+    return done;
+}
+
+static void nvme_irq_handler(int irq) {
+    (void)irq;
+    nvme_interrupts++;
+    for (int i = 0; i < nvme.io_queue_count; i++) nvme_reap(&nvme.io[i]);
+}
+
+// Fills in PRP1/PRP2 for `segs`, using the slot's PRP list past two
+// pages. Only the first segment may start, and only the last may end,
+// inside a page; anything else can't be described and returns -1.
+static int nvme_build_prp(NvmeQueue* q, int slot, const BlockSegment* segs, int nsegs, NvmeCommand* cmd) {
+    uint64_t* list = q->prp_lists[slot];
+    uint32_t first = (uint32_t)segs[0].addr;
+    int count = 0; // Pages after the first
+    for (int i = 0; i < nsegs; i++) {
+        uint32_t addr = (uint32_t)segs[i].addr;
+        uint32_t end = addr + segs[i].len;
+        if (segs[i].len == 0 || (addr & 3)) return -1;
+        if (i > 0 && (addr & (NVME_PAGE_SIZE - 1))) return -1;
+        if (i < nsegs - 1 && (end & (NVME_PAGE_SIZE - 1))) return -1;
+        uint32_t page = i == 0 ? (addr & ~(NVME_PAGE_SIZE - 1)) + NVME_PAGE_SIZE : addr;
+        for (; page < end; page += NVME_PAGE_SIZE) {
+            if (count == NVME_PRP_LIST_ENTRIES) return -1;
+            list[count++] = page;
+        }
+    }
+    cmd->prp1 = first;
+    if (count == 0) cmd->prp2 = 0;
+    else if (count == 1) cmd->prp2 = list[0];
+    else cmd->prp2 = (uint32_t)list;
+    return 0;
+}
+
+// Builds an I/O command on the least loaded queue pair without ringing
+// its doorbell. Returns 0, 1 if every slot is busy, or -1 if the request
+// can't be expressed (or the controller is gone). Dataset Management has
+// no LBA: `lba` is its range count less one and `cdw12_flags` its CDW11.
+static int nvme_queue_io(NvmeController* c, uint8_t opcode, uint64_t lba, const BlockSegment* segs, int nsegs,
+                         uint32_t cdw12_flags, block_callback_t callback, void* ctx) {
+    uint32_t sectors = 0;
+    for (int i = 0; i < nsegs; i++) sectors += segs[i].len / BLOCK_SECTOR_SIZE;
+    if (opcode != NVME_CMD_DSM && nsegs > 0 && (sectors == 0 || sectors > c->block.caps.max_sectors)) return -1;
+
+    uint32_t flags = irq_save();
+    if (c->io_queue_count == 0) {
+        irq_restore(flags);
+        return -1;
+    }
+    NvmeQueue* q = 0;
+    for (int i = 0; i < c->io_queue_count; i++) {
+        NvmeQueue* candidate = &c->io[i];
+        if (!(candidate->slot_mask & ~candidate->busy)) continue;
+        if (!q || candidate->inflight < q->inflight) q = candidate;
+    }
+    if (!q) {
+        irq_restore(flags);
+        return 1;
+    }
+    int slot = __builtin_ctz(q->slot_mask & ~q->busy);
+    NvmeCommand* cmd = &q->sq[q->sq_tail];
+    memset(cmd, 0, sizeof(NvmeCommand));
+    cmd->opcode = opcode;
+    cmd->cid = slot;
+    cmd->nsid = c->nsid;
+    if (nsegs > 0) {
+        if (nvme_build_prp(q, slot, segs, nsegs, cmd) != 0) {
+            irq_restore(flags);
+            return -1;
+        }
+        if (opcode == NVME_CMD_DSM) {
+            cmd->cdw10 = (uint32_t)lba;
+            cmd->cdw11 = cdw12_flags;
+        } else {
+            cmd->cdw10 = (uint32_t)lba;
+            cmd->cdw11 = (uint32_t)(lba >> 32);
+            cmd->cdw12 = (sectors - 1) | cdw12_flags;
+        }
+    }
+    q->slots[slot].callback = callback;
+    q->slots[slot].ctx = ctx;
+    q->busy |= 1u << slot;
+    q->inflight++;
+    q->commands++;
+    if (++q->sq_tail == q->entries) q->sq_tail = 0;
+    irq_restore(flags);
+    return 0;
+}
+
+// Rings the doorbell of every queue with unannounced commands: one MMIO
+// write per queue covers the whole batch.
+static void nvme_commit_queues(NvmeController* c) {
+    uint32_t flags = irq_save();
+    for (int i = 0; i < c->io_queue_count; i++) {
+        NvmeQueue* q = &c->io[i];
+        if (q->sq_tail == q->sq_rung) continue;
+        nvme_barrier();
+        *q->sq_doorbell = q->sq_tail;
+        q->sq_rung = q->sq_tail;
+        q->doorbells++;
+    }
+    irq_restore(flags);
+}
+
+// Waits for progress. Called with interrupts off; returns with them on.
+static void nvme_wait(NvmeController* c) {
+    nvme_commit_queues(c);
+    if (c->irq_mode != NVME_IRQ_NONE) {
+        __asm__ volatile("sti; hlt");
+    } else {
+        for (int i = 0; i < c->io_queue_count; i++) nvme_reap(&c->io[i]);
+        __asm__ volatile("sti");
+    }
+}
+
+static int nvme_start(NvmeController* c);
+
+// Disables the controller, which drops every queue, fails whatever was in
+// flight and brings it back up.
+static void nvme_reset(NvmeController* c) {
+    uint32_t flags = irq_save();
+    int count = c->io_queue_count;
+    c->io_queue_count = 0;
+    nvme_write32(c, NVME_REG_CC, 0);
+    for (int i = 0; i < count; i++) {
+        NvmeQueue* q = &c->io[i];
+        uint32_t busy = q->busy;
+        q->busy = 0;
+        q->inflight = 0;
+        for (int slot = 0; slot < NVME_QUEUE_SLOTS; slot++) {
+            if ((busy & (1u << slot)) && q->slots[slot].callback) {
+                q->slots[slot].callback(q->slots[slot].ctx, -1);
+            }
+        }
+    }
+    if (nvme_start(c) != 0) print_string("NVMe: Controller did not come back after reset.\n");
+    irq_restore(flags);
+}
+
+typedef struct {
+    volatile int pending;
+    volatile int errors;
+} NvmeSync;
+
+static void nvme_sync_done(void* ctx, int status) {
+    NvmeSync* sync = (NvmeSync*)ctx;
+    sync->pending--;
+    if (status != 0) sync->errors++;
+}
+
+// Runs a transfer to completion. Segments that can't share a PRP list
+// (joins off a page boundary) go out as separate commands, all queued
+// before the doorbell is rung.
+static int nvme_run(NvmeController* c, uint8_t opcode, uint64_t lba, const BlockSegment* segs, int nsegs,
+                    uint32_t cdw12_flags) {
+    NvmeSync sync = { 0, 0 };
+    uint32_t start = timer_ms();
+    int i = 0;
+    do {
+        int n = nsegs > 0 ? 1 : 0;
+        uint32_t sectors = n ? segs[i].len / BLOCK_SECTOR_SIZE : 0;
+        while (n && i + n < nsegs &&
+               !(((uint32_t)segs[i + n - 1].addr + segs[i + n - 1].len) & (NVME_PAGE_SIZE - 1)) &&
+               !((uint32_t)segs[i + n].addr & (NVME_PAGE_SIZE - 1))) {
+            sectors += segs[i + n].len / BLOCK_SECTOR_SIZE;
+            n++;
+        }
+
+        uint32_t flags = irq_save();
+        sync.pending++;
+        irq_restore(flags);
+        int ret;
+        while ((ret = nvme_queue_io(c, opcode, lba, segs + i, n, cdw12_flags, nvme_sync_done, &sync)) == 1) {
+            __asm__ volatile("cli");
+            if (timer_ms() - start > NVME_TIMEOUT_MS) {
+                __asm__ volatile("sti");
+                ret = -1;
+                break;
+            }
+            nvme_wait(c);
+        }
+        if (ret != 0) {
+            flags = irq_save();
+            sync.pending--;
+            sync.errors++;
+            irq_restore(flags);
+            break;
+        }
+        lba += sectors;
+        i += n;
+    } while (i < nsegs);
+    nvme_commit_queues(c);
+
+    for (;;) {
+        __asm__ volatile("cli" ::: "memory");
+        if (sync.pending == 0) break;
+        if (timer_ms() - start > NVME_TIMEOUT_MS) {
+            __asm__ volatile("sti");
+            print_string("NVMe: Command timeout!\n");
+            nvme_reset(c);
+            return -1;
+        }
+        nvme_wait(c);
+    }
+    __asm__ volatile("sti" ::: "memory");
+    return sync.errors ? -1 : 0;
+}
+
+// --- Block layer glue ---
+
+static int nvme_block_read(BlockDevice* dev, uint64_t lba, uint32_t count, void* buf) {
+    BlockSegment seg = { buf, count * BLOCK_SECTOR_SIZE };
+    return nvme_run((NvmeController*)dev->driver_data, NVME_CMD_READ, lba, &seg, 1, 0);
+}
+
+static int nvme_block_write(BlockDevice* dev, uint64_t lba, uint32_t count, const void* buf) {
+    BlockSegment seg = { (void*)buf, count * BLOCK_SECTOR_SIZE };
+    return nvme_run((NvmeController*)dev->driver_data, NVME_CMD_WRITE, lba, &seg, 1, 0);
+}
+
+static int nvme_block_write_fua(BlockDevice* dev, uint64_t lba, uint32_t count, const void* buf) {
+    BlockSegment seg = { (void*)buf, count * BLOCK_SECTOR_SIZE };
+    return nvme_run((NvmeController*)dev->driver_data, NVME_CMD_WRITE, lba, &seg, 1, NVME_RW_FUA);
+}
+
+static int nvme_block_flush(BlockDevice* dev) {
+    return nvme_run((NvmeController*)dev->driver_data, NVME_CMD_FLUSH, 0, 0, 0, 0);
+}
+
+static int nvme_block_readv(BlockDevice* dev, uint64_t lba, const BlockSegment* segs, int nsegs) {
+    return nvme_run((NvmeController*)dev->driver_data, NVME_CMD_READ, lba, segs, nsegs, 0);
+}
+
+static int nvme_block_writev(BlockDevice* dev, uint64_t lba, const BlockSegment* segs, int nsegs) {
+    return nvme_run((NvmeController*)dev->driver_data, NVME_CMD_WRITE, lba, segs, nsegs, 0);
+}
+
+// One command per call, so the segments must form one PRP list; the
+// buffer cache's page-aligned blocks always do.
+static int nvme_block_submit(BlockDevice* dev, uint64_t lba, const BlockSegment* segs, int nsegs, int write,
+                             block_callback_t callback, void* ctx) {
+    if (nsegs <= 0) return -1;
+    return nvme_queue_io((NvmeController*)dev->driver_data, write ? NVME_CMD_WRITE : NVME_CMD_READ,
+                         lba, segs, nsegs, 0, callback, ctx);
+}
+
+static void nvme_block_wait_event(BlockDevice* dev) {
+    nvme_wait((NvmeController*)dev->driver_data);
+}
+
+static void nvme_block_abort(BlockDevice* dev) {
+    nvme_reset((NvmeController*)dev->driver_data);
+}
+
+static int nvme_block_poll(BlockDevice* dev) {
+    NvmeController* c = (NvmeController*)dev->driver_data;
+    uint32_t flags = irq_save();
+    int done = 0;
+    for (int i = 0; i < c->io_queue_count; i++) done += nvme_reap(&c->io[i]);
+    irq_restore(flags);
+    return done;
+}
+
+static void nvme_block_commit(BlockDevice* dev) {
+    nvme_commit_queues((NvmeController*)dev->driver_data);
+}
+
+// Deallocates up to NVME_DSM_RANGES ranges with one Dataset Management
+// command. The range page is shared, which is fine as the call is
+// synchronous.
+static int nvme_block_discard(BlockDevice* dev, const BlockRange* ranges, int nranges) {
+    if (nranges <= 0 || nranges > (int)NVME_DSM_RANGES) return -1;
+    memset(nvme_dsm_ranges, 0, nranges * sizeof(NvmeDsmRange));
+    for (int i = 0; i < nranges; i++) {
+        if (ranges[i].count == 0 || ranges[i].lba + ranges[i].count > dev->caps.sector_count) return -1;
+        nvme_dsm_ranges[i].sectors = ranges[i].count;
+        nvme_dsm_ranges[i].lba = ranges[i].lba;
+    }
+    BlockSegment seg = { nvme_dsm_ranges, NVME_PAGE_SIZE };
+    return nvme_run((NvmeController*)dev->driver_data, NVME_CMD_DSM, nranges - 1, &seg, 1, NVME_DSM_AD);
+}
+
+static const BlockDeviceOps nvme_block_ops = {
+    nvme_block_read,
+    nvme_block_write,
+    nvme_block_write_fua,
+    nvme_block_flush,
+    nvme_block_readv,
+    nvme_block_writev,
+    nvme_block_submit,
+    nvme_block_wait_event,
+    nvme_block_abort,
+    nvme_block_poll,
+    nvme_block_commit,
+    nvme_block_discard,
+};
+
+// --- Setup ---
+
+static int nvme_wait_ready(NvmeController* c, int ready) {
+    uint32_t start = timer_us();
+    for (;;) {
+        uint32_t csts = nvme_read32(c, NVME_REG_CSTS);
+        if (ready && (csts & NVME_CSTS_CFS)) return -1;
+        if (((csts & NVME_CSTS_RDY) != 0) == ready) return 0;
+        if (timer_us() - start > c->ready_timeout_ms * 1000) return -1;
+    }
+}
+
+// Disables the controller, points it at a fresh admin queue and enables
+// it with 4 KB pages and the NVM command set.
+static int nvme_enable(NvmeController* c) {
+    nvme_write32(c, NVME_REG_CC, 0);
+    if (nvme_wait_ready(c, 0) != 0) return -1;
+
+    nvme_queue_setup(c, &c->admin, 0, NVME_ADMIN_ENTRIES, nvme_admin_sq, nvme_admin_cq);
+    nvme_write32(c, NVME_REG_AQA, ((NVME_ADMIN_ENTRIES - 1) << 16) | (NVME_ADMIN_ENTRIES - 1));
+    nvme_write64(c, NVME_REG_ASQ, (uint32_t)nvme_admin_sq);
+    nvme_write64(c, NVME_REG_ACQ, (uint32_t)nvme_admin_cq);
+    nvme_write32(c, NVME_REG_CC, NVME_CC_EN | NVME_CC_IOSQES | NVME_CC_IOCQES);
+    return nvme_wait_ready(c, 1);
+}
+
+// Asks for NVME_IO_QUEUES queue pairs and creates as many as the
+// controller grants. Every completion queue interrupts on vector 0.
+static int nvme_create_io_queues(NvmeController* c) {
+    NvmeCommand cmd;
+    uint32_t granted;
+    memset(&cmd, 0, sizeof(cmd));
+    cmd.opcode = NVME_ADMIN_SET_FEATURES;
+    cmd.cdw10 = NVME_FEATURE_NUM_QUEUES;
+    cmd.cdw11 = ((NVME_IO_QUEUES - 1) << 16) | (NVME_IO_QUEUES - 1);
+    if (nvme_admin(c, &cmd, &granted) != 0) return -1;
+
+    int count = NVME_IO_QUEUES;
+    if ((int)(granted & 0xFFFF) + 1 < count) count = (granted & 0xFFFF) + 1;
+    if ((int)(granted >> 16) + 1 < count) count = (granted >> 16) + 1;
+    uint16_t entries = c->max_entries < NVME_IO_ENTRIES ? c->max_entries : NVME_IO_ENTRIES;
+
+    for (int i = 0; i < count; i++) {
+        NvmeQueue* q = &c->io[i];
+        uint16_t qid = i + 1;
+        nvme_queue_setup(c, q, qid, entries, nvme_io_sq[i], nvme_io_cq[i]);
+        q->prp_lists = nvme_prp_lists[i];
+
+        memset(&cmd, 0, sizeof(cmd));
+        cmd.opcode = NVME_ADMIN_CREATE_CQ;
+        cmd.prp1 = (uint32_t)nvme_io_cq[i];
+        cmd.cdw10 = ((uint32_t)(entries - 1) << 16) | qid;
+        cmd.cdw11 = 0x1 | (c->irq_mode != NVME_IRQ_NONE ? 0x2 : 0); // Contiguous, interrupts on
+        if (nvme_admin(c, &cmd, 0) != 0) break;
+
+        memset(&cmd, 0, sizeof(cmd));
+        cmd.opcode = NVME_ADMIN_CREATE_SQ;
+        cmd.prp1 = (uint32_t)nvme_io_sq[i];
+        cmd.cdw10 = ((uint32_t)(entries - 1) << 16) | qid;
+        cmd.cdw11 = ((uint32_t)qid << 16) | 0x1; // Completes on CQ `qid`, contiguous
+        if (nvme_admin(c, &cmd, 0) != 0) break;
+        c->io_queue_count++;
+    }
+    return c->io_queue_count > 0 ? 0 : -1;
+}
+
+static int nvme_start(NvmeController* c) {
+    if (nvme_enable(c) != 0) return -1;
+    return nvme_create_io_queues(c);
+}
+
+// Reads the controller's transfer limit and write cache, and namespace
+// 1's size. Only 512-byte LBA formats are taken, as everything above the
+// block layer assumes BLOCK_SECTOR_SIZE.
+static int nvme_identify(NvmeController* c) {
+    NvmeCommand cmd;
+    memset(&cmd, 0, sizeof(cmd));
+    cmd.opcode = NVME_ADMIN_IDENTIFY;
+    cmd.prp1 = (uint32_t)nvme_identify_buf;
+    cmd.cdw10 = NVME_IDENTIFY_CONTROLLER;
+    if (nvme_admin(c, &cmd, 0) != 0) {
+        print_string("NVMe: Identify Controller failed.\n");
+        return -1;
+    }
+    uint8_t mdts = nvme_identify_buf[77]; // Max transfer, 2^n minimum pages (0 = none)
+    uint32_t namespaces = *(uint32_t*)(nvme_identify_buf + 516);
+    c->write_cache = nvme_identify_buf[525] & 0x01;
+    c->dsm = (*(uint16_t*)(nvme_identify_buf + 520) & NVME_ONCS_DSM) != 0;
+    c->block.caps.max_sectors = NVME_MAX_SECTORS;
+    if (mdts && mdts < 12 && (8u << mdts) < NVME_MAX_SECTORS) c->block.caps.max_sectors = 8u << mdts;
+    if (namespaces == 0) {
+        print_string("NVMe: Controller has no namespaces.\n");
+        return -1;
+    }
+
+    c->nsid = 1;
+    memset(&cmd, 0, sizeof(cmd));
+    cmd.opcode = NVME_ADMIN_IDENTIFY;
+    cmd.nsid = c->nsid;
+    cmd.prp1 = (uint32_t)nvme_identify_buf;
+    cmd.cdw10 = NVME_IDENTIFY_NAMESPACE;
+    if (nvme_admin(c, &cmd, 0) != 0) {
+        print_string("NVMe: Identify Namespace failed.\n");
+        return -1;
+    }
+    uint64_t size = *(uint64_t*)nvme_identify_buf;
+    uint8_t format = nvme_identify_buf[26] & 0x0F;
+    uint32_t lbaf = *(uint32_t*)(nvme_identify_buf + 128 + format * 4);
+    if (size == 0) {
+        print_string("NVMe: Namespace 1 is not active.\n");
+        return -1;
+    }
+    if (((lbaf >> 16) & 0xFF) != 9) {
+        print_string("NVMe: Namespace 1 doesn't use 512-byte blocks, skipped.\n");
+        return -1;
+    }
+    c->block.caps.sector_count = size;
+    return 0;
+}
+
+// MSI to the local APIC if the function has it, else the INTx line
+// through the PIC, else completions are polled. MSI-X is not used.
+static void nvme_setup_interrupts(NvmeController* c) {
+    if (pci_find_capability(&c->pci, PCI_CAP_ID_MSI)) {
+        int irq = irq_alloc_msi(nvme_irq_handler);
+        if (irq >= 0 && pci_enable_msi(&c->pci, lapic_msi_address(), irq_msi_vector(irq))) {
+            c->irq_mode = NVME_IRQ_MSI;
+            return;
+        }
+    }
+    uint8_t line = pci_read_dword(c->pci.bus, c->pci.device, c->pci.function, PCI_INTERRUPT_LINE) & 0xFF;
+    // Lines are not shared between drivers here.
+    if (line >= 16 || irq_has_handler(line)) return;
+    irq_install_handler(line, nvme_irq_handler);
+    c->irq_mode = NVME_IRQ_INTX;
+}
+
+static const char* nvme_interrupt_mode() {
+    if (nvme.irq_mode == NVME_IRQ_MSI) return "MSI";
+    if (nvme.irq_mode == NVME_IRQ_INTX) return "INTx";
+    return "polling";
+}
+
+void nvme_init() {
+    NvmeController* c = &nvme;
+    PciAddress pci;
+    if (!pci_find_class(PCI_CLASS_MASS_STORAGE, PCI_SUBCLASS_NVM, &pci)) return;
+    uint32_t class_info = pci_read_dword(pci.bus, pci.device, pci.function, PCI_CLASS_INFO);
+    if (((class_info >> 8) & 0xFF) != PCI_PROGIF_NVME) return;
+
+    uint32_t bar0 = pci_read_dword(pci.bus, pci.device, pci.function, PCI_BAR0);
+    if (bar0 & 0x01) return; // Registers are always memory-mapped
+    if ((bar0 & 0x06) == 0x04 && pci_read_dword(pci.bus, pci.device, pci.function, PCI_BAR0 + 4) != 0) {
+        print_string("NVMe: BAR0 is above 4 GB, skipped.\n");
+        return;
+    }
+    pci_enable(&pci, PCI_COMMAND_MEMORY | PCI_COMMAND_BUS_MASTER);
+
+    memset(c, 0, sizeof(NvmeController));
+    c->pci = pci;
+    c->regs = (volatile uint8_t*)(bar0 & 0xFFFFFFF0);
+    uint64_t cap = nvme_read64(c, NVME_REG_CAP);
+    if (NVME_CAP_MPSMIN(cap) != 0) {
+        print_string("NVMe: Controller doesn't support 4 KB pages, skipped.\n");
+        return;
+    }
+    c->doorbell_stride = 4u << NVME_CAP_DSTRD(cap);
+    c->ready_timeout_ms = NVME_CAP_TO(cap) ? NVME_CAP_TO(cap) * 500 : 500;
+    c->max_entries = NVME_CAP_MQES(cap);
+
+    if (nvme_enable(c) != 0) {
+        print_string("NVMe: Controller failed to become ready.\n");
+        return;
+    }
+    if (nvme_identify(c) != 0) return;
+    nvme_setup_interrupts(c);
+    if (nvme_create_io_queues(c) != 0) {
+        print_string("NVMe: Could not create I/O queues.\n");
+        nvme_write32(c, NVME_REG_CC, 0);
+        return;
+    }
+
+    BlockCaps* caps = &c->block.caps;
+    caps->max_segments = NVME_MAX_SEGMENTS;
+    caps->flags = BLOCK_CAP_DMA | BLOCK_CAP_LBA48 | BLOCK_CAP_FUA;
+    if (c->write_cache) caps->flags |= BLOCK_CAP_WRITE_CACHE;
+    if (c->dsm) {
+        caps->flags |= BLOCK_CAP_DISCARD;
+        caps->max_discard_ranges = NVME_DSM_RANGES;
+        caps->max_discard_sectors = 0xFFFFFFFF;
+    }
+    uint32_t depth = 0;
+    for (int i = 0; i < c->io_queue_count; i++) {
+        for (uint32_t mask = c->io[i].slot_mask; mask; mask >>= 1) depth += mask & 1;
+    }
+    caps->queue_depth = depth;
+
+    strcpy(c->block.name, "nvme0n1");
+    c->block.type = BLOCK_TYPE_NVME;
+    c->block.ops = &nvme_block_ops;
+    c->block.driver_data = c;
+    if (block_register(&c->block) < 0) return;
+    nvme_present = 1;
+
+    print_string("NVMe: ");
+    print_string(c->block.name);
+    print_string(", ");
+    print_int((uint32_t)(caps->sector_count >> 11));
+    print_string(" MB, ");
+    print_int(c->io_queue_count);
+    print_string(" I/O queue pair(s), qd ");
+    print_int(depth);
+    print_string(", ");
+    print_string(nvme_interrupt_mode());
+    new_line();
+}
+
+void nvme_print_stats() {
+    if (!nvme_present) {
+        print_string("(No NVMe controller)\n");
+        return;
+    }
+    for (int i = 0; i < nvme.io_queue_count; i++) {
+        NvmeQueue* q = &nvme.io[i];
+        print_string("  queue ");
+        print_int(q->id);
+        print_string(": ");
+        print_int(q->entries);
+        print_string(" entries, ");
+        print_int(q->commands);
+        print_string(" commands, ");
+        print_int(q->doorbells);
+        print_string(" doorbells, ");
+        print_int(q->inflight);
+        print_string(" in flight\n");
+    }
+    print_string("  ");
+    print_int(nvme_interrupts);
+    print_string(" interrupts (");
+    print_string(nvme_interrupt_mode());
+    print_string(")\n");
+}
+
+uint32_t nvme_interrupt_count() {
+    return nvme_interrupts;
+}
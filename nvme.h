@@ -0,0 +1,109 @@
+#ifndef NVME_H
+#define NVME_H
+
+#include <stdint.h>
+#include "block.h"
+
+// Controller registers, offsets from BAR0 (NVMe 1.4 section 3.1).
+#define NVME_REG_CAP   0x00 // 64-bit Controller Capabilities
+#define NVME_REG_VS    0x08
+#define NVME_REG_INTMS 0x0C // Interrupt Mask Set (INTx/MSI only)
+#define NVME_REG_INTMC 0x10 // Interrupt Mask Clear
+#define NVME_REG_CC    0x14
+#define NVME_REG_CSTS  0x1C
+#define NVME_REG_AQA   0x24
+#define NVME_REG_ASQ   0x28 // 64-bit
+#define NVME_REG_ACQ   0x30 // 64-bit
+#define NVME_REG_DOORBELLS 0x1000
+
+#define NVME_CAP_MQES(cap)   ((uint32_t)((cap) & 0xFFFF) + 1) // Entries per I/O queue
+#define NVME_CAP_TO(cap)     ((uint32_t)((cap) >> 24) & 0xFF) // Ready timeout, 500 ms units
+#define NVME_CAP_DSTRD(cap)  ((uint32_t)((cap) >> 32) & 0xF)  // Doorbell stride, 4 << n bytes
+#define NVME_CAP_MPSMIN(cap) ((uint32_t)((cap) >> 48) & 0xF)  // Smallest page, 4 KB << n
+
+#define NVME_CC_EN       (1 << 0)
+#define NVME_CC_IOSQES   (6 << 16) // 64-byte submission entries
+#define NVME_CC_IOCQES   (4 << 20) // 16-byte completion entries
+#define NVME_CSTS_RDY    (1 << 0)
+#define NVME_CSTS_CFS    (1 << 1)  // Controller Fatal Status
+
+// Admin opcodes
+#define NVME_ADMIN_CREATE_SQ    0x01
+#define NVME_ADMIN_CREATE_CQ    0x05
+#define NVME_ADMIN_IDENTIFY     0x06
+#define NVME_ADMIN_SET_FEATURES 0x09
+#define NVME_FEATURE_NUM_QUEUES 0x07
+#define NVME_IDENTIFY_NAMESPACE  0x00
+#define NVME_IDENTIFY_CONTROLLER 0x01
+
+// NVM command set opcodes
+#define NVME_CMD_FLUSH 0x00
+#define NVME_CMD_WRITE 0x01
+#define NVME_CMD_READ  0x02
+#define NVME_CMD_DSM   0x09       // Dataset Management
+#define NVME_RW_FUA    (1u << 30) // In CDW12
+#define NVME_DSM_AD    (1u << 2)  // In CDW11: deallocate the ranges
+#define NVME_ONCS_DSM  (1u << 2)  // Identify Controller ONCS bit
+
+// Dataset Management range entry; a command carries one page of them.
+typedef struct {
+    uint32_t attributes;
+    uint32_t sectors;
+    uint64_t lba;
+} __attribute__((packed)) NvmeDsmRange;
+
+typedef struct {
+    uint8_t  opcode;
+    uint8_t  flags;
+    uint16_t cid;
+    uint32_t nsid;
+    uint64_t reserved;
+    uint64_t mptr;
+    uint64_t prp1;
+    uint64_t prp2;
+    uint32_t cdw10;
+    uint32_t cdw11;
+    uint32_t cdw12;
+    uint32_t cdw13;
+    uint32_t cdw14;
+    uint32_t cdw15;
+} __attribute__((packed)) NvmeCommand;
+
+typedef struct {
+    uint32_t result;
+    uint32_t reserved;
+    uint16_t sq_head;
+    uint16_t sq_id;
+    uint16_t cid;
+    uint16_t status; // Bit 0 is the phase tag
+} __attribute__((packed)) NvmeCompletion;
+
+#define NVME_PAGE_SIZE 4096
+
+// Queue sizes we ask for; the controller may allow fewer (CAP.MQES,
+// Number of Queues). Each I/O queue pair keeps up to NVME_QUEUE_SLOTS
+// commands in flight, one per bit of its busy mask, so the submission
+// queue can never fill.
+#define NVME_ADMIN_ENTRIES  16
+#define NVME_IO_QUEUES      2
+#define NVME_IO_ENTRIES     64
+#define NVME_QUEUE_SLOTS    32
+// A PRP list holds the pages after the first; 256 covers 1 MB at any
+// alignment and makes each list 2 KB, so it never crosses a page.
+#define NVME_PRP_LIST_ENTRIES 256
+#define NVME_MAX_SECTORS    2048
+#define NVME_MAX_SEGMENTS   BLOCK_MAX_SEGMENTS
+#define NVME_DSM_RANGES     (NVME_PAGE_SIZE / sizeof(NvmeDsmRange))
+#define NVME_TIMEOUT_MS     10000
+
+// Finds the first NVMe controller, brings it up with NVME_IO_QUEUES
+// submission/completion queue pairs and registers namespace 1 as
+// "nvme0n1".
+void nvme_init();
+
+// Prints per-queue command counts, doorbell writes and interrupts.
+void nvme_print_stats();
+
+uint32_t nvme_interrupt_count();
+
+#endif // NVME_H
@@ -6,17 +6,112 @@
 // PCI Configuration Data Port
 #define PCI_CONFIG_DATA    0xCFC
 
-uint32_t pci_read_dword(uint8_t bus, uint8_t device, uint8_t function, uint8_t offset) {
-    // Create the address dword
-    uint32_t address = (uint32_t)((uint32_t)bus << 16) |
-                       ((uint32_t)device << 11) |
-                       ((uint32_t)function << 8) |
-                       (offset & 0xFC) | // lower 2 bits must be 0
-                       0x80000000;       // Enable bit
+static uint32_t pci_config_address(uint8_t bus, uint8_t device, uint8_t function, uint8_t offset) {
+    return (uint32_t)((uint32_t)bus << 16) |
+           ((uint32_t)device << 11) |
+           ((uint32_t)function << 8) |
+           (offset & 0xFC) | // lower 2 bits must be 0
+           0x80000000;       // Enable bit
+}
 
+uint32_t pci_read_dword(uint8_t bus, uint8_t device, uint8_t function, uint8_t offset) {
     // Write the address to the address port
-    outl(PCI_CONFIG_ADDRESS, address);
+    outl(PCI_CONFIG_ADDRESS, pci_config_address(bus, device, function, offset));
 
     // Read the data from the data port
     return inl(PCI_CONFIG_DATA);
-}
\ No newline at end of file
+}
+
+void pci_write_dword(uint8_t bus, uint8_t device, uint8_t function, uint8_t offset, uint32_t value) {
+    outl(PCI_CONFIG_ADDRESS, pci_config_address(bus, device, function, offset));
+    outl(PCI_CONFIG_DATA, value);
+}
+
+int pci_find_class(uint8_t class_code, uint8_t subclass, PciAddress* out) {
+    for (uint16_t bus = 0; bus < 256; bus++) {
+        for (uint8_t device = 0; device < 32; device++) {
+            if ((pci_read_dword(bus, device, 0, PCI_VENDOR_ID) & 0xFFFF) == 0xFFFF) continue;
+
+            // Bit 7 of the header type marks a multi-function device.
+            uint8_t functions = (pci_read_dword(bus, device, 0, PCI_HEADER_TYPE) & 0x00800000) ? 8 : 1;
+            for (uint8_t function = 0; function < functions; function++) {
+                if ((pci_read_dword(bus, device, function, PCI_VENDOR_ID) & 0xFFFF) == 0xFFFF) continue;
+
+                uint32_t class_info = pci_read_dword(bus, device, function, PCI_CLASS_INFO);
+                if (((class_info >> 24) & 0xFF) == class_code &&
+                    ((class_info >> 16) & 0xFF) == subclass) {
+                    out->bus = bus;
+                    out->device = device;
+                    out->function = function;
+                    return 1;
+                }
+            }
+        }
+    }
+    return 0;
+}
+
+int pci_find_device(uint16_t vendor, uint16_t device_id, int index, PciAddress* out) {
+    uint32_t wanted = ((uint32_t)device_id << 16) | vendor;
+    for (uint16_t bus = 0; bus < 256; bus++) {
+        for (uint8_t device = 0; device < 32; device++) {
+            if ((pci_read_dword(bus, device, 0, PCI_VENDOR_ID) & 0xFFFF) == 0xFFFF) continue;
+
+            uint8_t functions = (pci_read_dword(bus, device, 0, PCI_HEADER_TYPE) & 0x00800000) ? 8 : 1;
+            for (uint8_t function = 0; function < functions; function++) {
+                if (pci_read_dword(bus, device, function, PCI_VENDOR_ID) != wanted) continue;
+                if (index-- > 0) continue;
+                out->bus = bus;
+                out->device = device;
+                out->function = function;
+                return 1;
+            }
+        }
+    }
+    return 0;
+}
+
+void pci_enable(const PciAddress* addr, uint16_t command_bits) {
+    uint32_t command = pci_read_dword(addr->bus, addr->device, addr->function, PCI_COMMAND);
+    pci_write_dword(addr->bus, addr->device, addr->function, PCI_COMMAND, command | command_bits);
+}
+
+uint8_t pci_find_capability(const PciAddress* addr, uint8_t cap_id) {
+    uint32_t command = pci_read_dword(addr->bus, addr->device, addr->function, PCI_COMMAND);
+    if (!((command >> 16) & PCI_STATUS_CAP_LIST)) return 0;
+
+    uint8_t offset = pci_read_dword(addr->bus, addr->device, addr->function, PCI_CAPABILITIES) & 0xFC;
+    // Bounded so a malformed (looping) list can't hang us.
+    for (int i = 0; i < 48 && offset; i++) {
+        uint32_t header = pci_read_dword(addr->bus, addr->device, addr->function, offset);
+        if ((header & 0xFF) == cap_id) return offset;
+        offset = (header >> 8) & 0xFC;
+    }
+    return 0;
+}
+
+// MSI capability layout: dword 0 holds the ID, next pointer and message
+// control (bit 0 enable, bit 7 64-bit address). The address follows, then
+// the upper address on 64-bit capable devices, then the 16-bit data.
+int pci_enable_msi(const PciAddress* addr, uint32_t message_address, uint16_t message_data) {
+    uint8_t cap = pci_find_capability(addr, PCI_CAP_ID_MSI);
+    if (!cap) return 0;
+
+    uint32_t header = pci_read_dword(addr->bus, addr->device, addr->function, cap);
+    uint16_t control = header >> 16;
+    uint8_t data_offset = cap + 8;
+
+    pci_write_dword(addr->bus, addr->device, addr->function, cap + 4, message_address);
+    if (control & 0x80) {
+        pci_write_dword(addr->bus, addr->device, addr->function, cap + 8, 0);
+        data_offset = cap + 12;
+    }
+    uint32_t data = pci_read_dword(addr->bus, addr->device, addr->function, data_offset);
+    pci_write_dword(addr->bus, addr->device, addr->function, data_offset, (data & 0xFFFF0000) | message_data);
+
+    // One message (multiple message enable = 0), then enable.
+    control = (control & ~0x0070) | 0x0001;
+    pci_write_dword(addr->bus, addr->device, addr->function, cap, (header & 0xFFFF) | ((uint32_t)control << 16));
+    pci_enable(addr, PCI_COMMAND_INTX_DISABLE);
+    return 1;
+}
@@ -3,7 +3,60 @@
 
 #include <stdint.h>
 
+// Standard configuration space offsets
+#define PCI_VENDOR_ID       0x00
+#define PCI_COMMAND         0x04 // Command (low 16 bits) and status (high 16 bits)
+#define PCI_CLASS_INFO      0x08
+#define PCI_HEADER_TYPE     0x0C
+#define PCI_BAR0            0x10
+#define PCI_BAR4            0x20
+#define PCI_BAR5            0x24
+#define PCI_CAPABILITIES    0x34
+#define PCI_INTERRUPT_LINE  0x3C
+
+// Command register bits
+#define PCI_COMMAND_IO          0x0001
+#define PCI_COMMAND_MEMORY      0x0002
+#define PCI_COMMAND_BUS_MASTER  0x0004
+#define PCI_COMMAND_INTX_DISABLE 0x0400
+
+// Status register bits
+#define PCI_STATUS_CAP_LIST     0x0010
+
+// Capability IDs
+#define PCI_CAP_ID_MSI          0x05
+
+// A device location on the bus.
+typedef struct {
+    uint8_t bus;
+    uint8_t device;
+    uint8_t function;
+} PciAddress;
+
 // Reads a 32-bit double word from the configuration space of a PCI device.
 uint32_t pci_read_dword(uint8_t bus, uint8_t device, uint8_t function, uint8_t offset);
 
-#endif // PCI_H
\ No newline at end of file
+// Writes a 32-bit double word to the configuration space of a PCI device.
+void pci_write_dword(uint8_t bus, uint8_t device, uint8_t function, uint8_t offset, uint32_t value);
+
+// Finds the first function (including non-zero functions of multi-function
+// devices) with the given class and subclass. Returns 1 and fills `out` if
+// one is found.
+int pci_find_class(uint8_t class_code, uint8_t subclass, PciAddress* out);
+
+// Finds the `index`th function (counting from 0) with the given vendor
+// and device IDs. Returns 1 and fills `out` if there is one.
+int pci_find_device(uint16_t vendor, uint16_t device_id, int index, PciAddress* out);
+
+// Sets bits in a device's command register (e.g. PCI_COMMAND_BUS_MASTER).
+void pci_enable(const PciAddress* addr, uint16_t command_bits);
+
+// Walks the capability list. Returns the config offset of capability
+// `cap_id`, or 0 if the device doesn't have it.
+uint8_t pci_find_capability(const PciAddress* addr, uint8_t cap_id);
+
+// Programs and enables a single MSI message and disables INTx.
+// Returns 1 on success, 0 if the device has no MSI capability.
+int pci_enable_msi(const PciAddress* addr, uint32_t message_address, uint16_t message_data);
+
+#endif // PCI_H
@@ -19,5 +19,12 @@ void outl(uint16_t port, uint32_t val);
 // Read a dword (32-bit) from a port
 uint32_t inl(uint16_t port);
 
+// String I/O: move `count` words (or dwords) between a port and memory
+// with a single `rep ins`/`rep outs` instruction.
+void insw(uint16_t port, void* buf, uint32_t count);
+void outsw(uint16_t port, const void* buf, uint32_t count);
+void insl(uint16_t port, void* buf, uint32_t count);
+void outsl(uint16_t port, const void* buf, uint32_t count);
+
 
 #endif // PORTS_H
\ No newline at end of file
@@ -0,0 +1,533 @@
+#include "raid.h"
+#include "bcache.h"
+#include "idt.h"
+#include "timer.h"
+#include "shell.h"
+#include "extrainclude.h"
+
+// Time budget for one request across all members.
+#define RAID_TIMEOUT_MS 10000
+
+// Member commands one request can have in flight before it waits for
+// them all and starts over.
+#define RAID_MAX_CMDS 64
+
+// RAID-1 reads at least this long are split across both members.
+#define RAID1_SPLIT_SECTORS 128
+
+static RaidDevice raid_devices[RAID_MAX_DEVICES];
+static int raid_device_count = 0;
+
+struct RaidIo;
+
+// One asynchronous member command, for its completion accounting.
+typedef struct {
+    struct RaidIo* io;
+    RaidMember* member;
+    uint32_t start_us;
+    int write;
+} RaidCmd;
+
+// Completion state for one request fanned out over several members.
+// Callbacks run in interrupt context, so the main path only changes
+// `outstanding` and member `inflight` counts with interrupts off.
+typedef struct RaidIo {
+    volatile int outstanding;
+    volatile int errors;
+    int cmd_count;
+    RaidCmd cmds[RAID_MAX_CMDS];
+} RaidIo;
+
+// Segments bound for one member, to go out as a single command.
+typedef struct {
+    uint64_t lba;
+    uint32_t sectors;
+    int nsegs;
+    BlockSegment segs[AHCI_PRDT_ENTRIES];
+} RaidBatch;
+
+static void raid_account(RaidMember* m, int write, uint32_t latency_us) {
+    if (write) m->writes++;
+    else m->reads++;
+    m->completions++;
+    m->total_latency_us += latency_us;
+    if (latency_us > m->max_latency_us) m->max_latency_us = latency_us;
+}
+
+static void raid_cmd_done(void* ctx, int status) {
+    RaidCmd* cmd = (RaidCmd*)ctx;
+    cmd->member->inflight--;
+    raid_account(cmd->member, cmd->write, timer_us() - cmd->start_us);
+    cmd->io->outstanding--;
+    if (status != 0) cmd->io->errors++;
+}
+
+static void raid_init_io(RaidIo* io) {
+    io->outstanding = 0;
+    io->errors = 0;
+    io->cmd_count = 0;
+}
+
+// Waits for every member command of `io`. On timeout the members are
+// aborted, which runs the remaining callbacks, so `io` is never left
+// referenced by the HBA.
+static int raid_wait(RaidDevice* r, RaidIo* io) {
+    uint32_t start = timer_ms();
+    int next = 0;
+    for (;;) {
+        __asm__ volatile("cli");
+        if (io->outstanding == 0) break;
+        if (timer_ms() - start > RAID_TIMEOUT_MS) {
+            __asm__ volatile("sti");
+            print_string("RAID: Member timeout!\n");
+            for (int i = 0; i < r->member_count; i++) {
+                if (r->members[i].port) ahci_abort(r->members[i].port);
+            }
+            break;
+        }
+        // Without interrupts this polls one member per step.
+        while (!r->members[next].port) next = (next + 1) % r->member_count;
+        ahci_wait_event(r->members[next].port);
+        next = (next + 1) % r->member_count;
+    }
+    __asm__ volatile("sti");
+    io->cmd_count = 0;
+    return io->errors ? -1 : 0;
+}
+
+// Submits one command to an AHCI member, waiting for a free slot if its
+// queue is full.
+static int raid_submit(RaidDevice* r, RaidMember* m, uint64_t lba, const BlockSegment* segs,
+                       int nsegs, int flags, RaidIo* io) {
+    // Out of command records: let the ones in flight finish first.
+    if (io->cmd_count == RAID_MAX_CMDS && raid_wait(r, io) != 0) return -1;
+
+    RaidCmd* cmd = &io->cmds[io->cmd_count++];
+    cmd->io = io;
+    cmd->member = m;
+    cmd->write = (flags & AHCI_SUBMIT_WRITE) != 0;
+
+    uint32_t start = timer_ms();
+    uint32_t irq_flags = irq_save();
+    io->outstanding++;
+    m->inflight++;
+    if (m->inflight > m->max_inflight) m->max_inflight = m->inflight;
+    irq_restore(irq_flags);
+
+    cmd->start_us = timer_us();
+    int ret;
+    while ((ret = ahci_submitv(m->port, lba, segs, nsegs, flags, raid_cmd_done, cmd)) != 0) {
+        __asm__ volatile("cli");
+        if (ret < 0 || timer_ms() - start > RAID_TIMEOUT_MS) {
+            io->outstanding--;
+            io->errors++;
+            m->inflight--;
+            __asm__ volatile("sti");
+            return -1;
+        }
+        ahci_wait_event(m->port);
+    }
+    m->next_lba = lba;
+    for (int i = 0; i < nsegs; i++) m->next_lba += segs[i].len / BLOCK_SECTOR_SIZE;
+    return 0;
+}
+
+// Runs `count` sectors on member `m`: queued without waiting on AHCI
+// members, to completion through the block layer on the others.
+static int raid_member_transfer(RaidDevice* r, RaidMember* m, uint64_t lba, uint32_t count,
+                                void* buf, int flags, RaidIo* io) {
+    uint8_t* p = (uint8_t*)buf;
+    if (m->port) {
+        while (count > 0) {
+            uint32_t take = count < AHCI_MAX_SECTORS ? count : AHCI_MAX_SECTORS;
+            BlockSegment seg = { p, take * BLOCK_SECTOR_SIZE };
+            if (raid_submit(r, m, lba, &seg, 1, flags, io) != 0) return -1;
+            p += take * BLOCK_SECTOR_SIZE;
+            lba += take;
+            count -= take;
+        }
+        return 0;
+    }
+
+    int write = (flags & AHCI_SUBMIT_WRITE) != 0;
+    m->inflight++;
+    if (m->inflight > m->max_inflight) m->max_inflight = m->inflight;
+    uint32_t start = timer_us();
+    int ret;
+    if (!write) ret = block_dev_read(m->dev, lba, count, p);
+    else if (flags & AHCI_SUBMIT_FUA) ret = block_dev_write_fua(m->dev, lba, count, p);
+    else ret = block_dev_write(m->dev, lba, count, p);
+    raid_account(m, write, timer_us() - start);
+    m->inflight--;
+    m->next_lba = lba + count;
+    if (ret != 0) io->errors++;
+    return ret;
+}
+
+// Walks the request chunk by chunk and gathers each member's pieces into
+// one scatter-gather command. Every member's command is in flight before
+// we wait for any of them.
+static int raid0_transfer(RaidDevice* r, uint64_t lba, uint32_t count, void* buf, int flags) {
+    static RaidBatch batches[RAID_MAX_MEMBERS];
+    static RaidIo io;
+    uint8_t* p = (uint8_t*)buf;
+    int ret = 0;
+
+    raid_init_io(&io);
+    for (int m = 0; m < r->member_count; m++) {
+        batches[m].nsegs = 0;
+        batches[m].sectors = 0;
+    }
+
+    while (count > 0 && ret == 0) {
+        uint32_t offset, member;
+        uint64_t chunk = udiv64(lba, r->chunk_sectors, &offset);
+        uint64_t row = udiv64(chunk, r->member_count, &member);
+        uint64_t member_lba = row * r->chunk_sectors + offset;
+        uint32_t take = r->chunk_sectors - offset;
+        if (take > count) take = count;
+
+        RaidBatch* batch = &batches[member];
+        if (batch->nsegs > 0 && (batch->nsegs == AHCI_PRDT_ENTRIES ||
+                                 batch->sectors + take > AHCI_MAX_SECTORS ||
+                                 batch->lba + batch->sectors != member_lba)) {
+            ret = raid_submit(r, &r->members[member], batch->lba, batch->segs, batch->nsegs, flags, &io);
+            batch->nsegs = 0;
+            batch->sectors = 0;
+        }
+        if (batch->nsegs == 0) batch->lba = member_lba;
+        batch->segs[batch->nsegs].addr = p;
+        batch->segs[batch->nsegs].len = take * BLOCK_SECTOR_SIZE;
+        batch->nsegs++;
+        batch->sectors += take;
+
+        p += take * BLOCK_SECTOR_SIZE;
+        lba += take;
+        count -= take;
+    }
+    for (int m = 0; m < r->member_count && ret == 0; m++) {
+        RaidBatch* batch = &batches[m];
+        if (batch->nsegs > 0) ret = raid_submit(r, &r->members[m], batch->lba, batch->segs, batch->nsegs, flags, &io);
+    }
+
+    if (raid_wait(r, &io) != 0) return -1;
+    return ret;
+}
+
+static int raid0_read(BlockDevice* dev, uint64_t lba, uint32_t count, void* buf) {
+    return raid0_transfer((RaidDevice*)dev->driver_data, lba, count, buf, 0);
+}
+
+static int raid0_write(BlockDevice* dev, uint64_t lba, uint32_t count, const void* buf) {
+    return raid0_transfer((RaidDevice*)dev->driver_data, lba, count, (void*)buf, AHCI_SUBMIT_WRITE);
+}
+
+static int raid0_write_fua(BlockDevice* dev, uint64_t lba, uint32_t count, const void* buf) {
+    return raid0_transfer((RaidDevice*)dev->driver_data, lba, count, (void*)buf,
+                          AHCI_SUBMIT_WRITE | AHCI_SUBMIT_FUA);
+}
+
+static int raid_flush(BlockDevice* dev) {
+    RaidDevice* r = (RaidDevice*)dev->driver_data;
+    int ret = 0;
+    for (int i = 0; i < r->member_count; i++) {
+        if (block_dev_flush(r->members[i].dev) != 0) ret = -1;
+    }
+    return ret;
+}
+
+static const BlockDeviceOps raid0_ops = {
+    raid0_read,
+    raid0_write,
+    raid0_write_fua,
+    raid_flush,
+    0,
+    0,
+};
+
+static const BlockDeviceOps raid0_ops_no_fua = {
+    raid0_read,
+    raid0_write,
+    0,
+    raid_flush,
+    0,
+    0,
+};
+
+// Picks the member to read `lba` from: an idle member over a busy one,
+// then the one whose last command ended nearest `lba` (a sequential
+// stream stays on one disk, random reads go to the closer head), then
+// the one with fewer reads so far.
+static RaidMember* raid1_pick(RaidDevice* r, uint64_t lba) {
+    RaidMember* best = 0;
+    int best_busy = 0;
+    uint64_t best_dist = 0;
+    for (int i = 0; i < r->member_count; i++) {
+        RaidMember* m = &r->members[i];
+        int busy = m->inflight > 0 || (m->port && m->port->busy);
+        uint64_t dist = m->next_lba > lba ? m->next_lba - lba : lba - m->next_lba;
+        if (best) {
+            if (busy != best_busy) {
+                if (busy) continue;
+            } else if (dist != best_dist) {
+                if (dist > best_dist) continue;
+            } else if (m->reads >= best->reads) {
+                continue;
+            }
+        }
+        best = m;
+        best_busy = busy;
+        best_dist = dist;
+    }
+    return best;
+}
+
+static int raid1_read(BlockDevice* dev, uint64_t lba, uint32_t count, void* buf) {
+    static RaidIo io;
+    RaidDevice* r = (RaidDevice*)dev->driver_data;
+    RaidMember* first = raid1_pick(r, lba);
+    RaidMember* other = first == &r->members[0] ? &r->members[1] : &r->members[0];
+
+    raid_init_io(&io);
+    if (count >= RAID1_SPLIT_SECTORS) {
+        // Both disks read half each. Queue the AHCI half first so it runs
+        // while a synchronous member works through its own half.
+        uint32_t half = (count / 2) & ~7u;
+        RaidMember* head = first;
+        RaidMember* tail = other;
+        uint8_t* p = (uint8_t*)buf + half * BLOCK_SECTOR_SIZE;
+        if (!tail->port && head->port) {
+            raid_member_transfer(r, head, lba, half, buf, 0, &io);
+            raid_member_transfer(r, tail, lba + half, count - half, p, 0, &io);
+        } else {
+            raid_member_transfer(r, tail, lba + half, count - half, p, 0, &io);
+            raid_member_transfer(r, head, lba, half, buf, 0, &io);
+        }
+        if (raid_wait(r, &io) == 0) return 0;
+    } else {
+        raid_member_transfer(r, first, lba, count, buf, 0, &io);
+        if (raid_wait(r, &io) == 0) return 0;
+    }
+
+    // A failed read is retried whole on the other member before giving up.
+    print_string("RAID: Read error, retrying on ");
+    print_string(other->dev->name);
+    new_line();
+    raid_init_io(&io);
+    raid_member_transfer(r, other, lba, count, buf, 0, &io);
+    return raid_wait(r, &io);
+}
+
+// Writes go to both members: queued on an AHCI member first, so the
+// other member's copy is written at the same time.
+static int raid1_transfer_write(RaidDevice* r, uint64_t lba, uint32_t count, const void* buf, int flags) {
+    static RaidIo io;
+    raid_init_io(&io);
+    for (int pass = 0; pass < 2; pass++) {
+        for (int i = 0; i < r->member_count; i++) {
+            RaidMember* m = &r->members[i];
+            if ((m->port != 0) == (pass == 0)) raid_member_transfer(r, m, lba, count, (void*)buf, flags, &io);
+        }
+    }
+    return raid_wait(r, &io);
+}
+
+static int raid1_write(BlockDevice* dev, uint64_t lba, uint32_t count, const void* buf) {
+    return raid1_transfer_write((RaidDevice*)dev->driver_data, lba, count, buf, AHCI_SUBMIT_WRITE);
+}
+
+static int raid1_write_fua(BlockDevice* dev, uint64_t lba, uint32_t count, const void* buf) {
+    return raid1_transfer_write((RaidDevice*)dev->driver_data, lba, count, buf,
+                                AHCI_SUBMIT_WRITE | AHCI_SUBMIT_FUA);
+}
+
+static const BlockDeviceOps raid1_ops = {
+    raid1_read,
+    raid1_write,
+    raid1_write_fua,
+    raid_flush,
+    0,
+    0,
+};
+
+static const BlockDeviceOps raid1_ops_no_fua = {
+    raid1_read,
+    raid1_write,
+    0,
+    raid_flush,
+    0,
+    0,
+};
+
+static RaidDevice* raid_alloc() {
+    if (raid_device_count == RAID_MAX_DEVICES) {
+        print_string("RAID: No free md device.\n");
+        return 0;
+    }
+    RaidDevice* r = &raid_devices[raid_device_count];
+    memset(r, 0, sizeof(RaidDevice));
+    r->block.name[0] = 'm';
+    r->block.name[1] = 'd';
+    r->block.name[2] = '0' + raid_device_count;
+    r->block.name[3] = '\0';
+    r->block.type = BLOCK_TYPE_RAID;
+    r->block.driver_data = r;
+    return r;
+}
+
+static void raid_add_member(RaidDevice* r, BlockDevice* dev) {
+    // From now on the member is written through the md device only.
+    bcache_invalidate(dev);
+    RaidMember* m = &r->members[r->member_count++];
+    m->dev = dev;
+    m->port = dev->type == BLOCK_TYPE_SATA ? (AhciPort*)dev->driver_data : 0;
+}
+
+static int raid_finish(RaidDevice* r) {
+    if (block_register(&r->block) < 0) {
+        print_string("RAID: Block registry is full.\n");
+        return -1;
+    }
+    raid_device_count++;
+    return 0;
+}
+
+RaidDevice* raid0_create(uint32_t chunk_sectors) {
+    if (chunk_sectors < RAID_MIN_CHUNK_SECTORS || chunk_sectors > RAID_MAX_CHUNK_SECTORS ||
+        chunk_sectors % RAID_MIN_CHUNK_SECTORS) {
+        print_string("RAID: Chunk must be a multiple of 4 KB, at most 4 MB.\n");
+        return 0;
+    }
+    int n = ahci_port_count();
+    if (n > RAID_MAX_MEMBERS) n = RAID_MAX_MEMBERS;
+    if (n < 2) {
+        print_string("RAID: Striping needs at least two SATA disks.\n");
+        return 0;
+    }
+    RaidDevice* r = raid_alloc();
+    if (!r) return 0;
+
+    r->level = 0;
+    r->chunk_sectors = chunk_sectors;
+
+    // Capacity is set by the smallest member, rounded down to whole chunks.
+    uint64_t member_sectors = ahci_get_port(0)->block.caps.sector_count;
+    uint32_t flags = BLOCK_CAP_DMA | BLOCK_CAP_LBA48 | BLOCK_CAP_NCQ | BLOCK_CAP_FUA;
+    uint32_t depth = 0;
+    for (int i = 0; i < n; i++) {
+        AhciPort* ap = ahci_get_port(i);
+        raid_add_member(r, &ap->block);
+        if (ap->block.caps.sector_count < member_sectors) member_sectors = ap->block.caps.sector_count;
+        flags &= ap->block.caps.flags | ~(BLOCK_CAP_LBA48 | BLOCK_CAP_NCQ | BLOCK_CAP_FUA);
+        if (ap->block.caps.flags & BLOCK_CAP_WRITE_CACHE) flags |= BLOCK_CAP_WRITE_CACHE;
+        depth += ap->block.caps.queue_depth;
+    }
+    uint32_t rem;
+    udiv64(member_sectors, chunk_sectors, &rem);
+    member_sectors -= rem;
+
+    BlockCaps* caps = &r->block.caps;
+    caps->sector_count = member_sectors * n;
+    // Room for a maximal command on every member; a misaligned request
+    // just costs some members a second command.
+    caps->max_sectors = n * AHCI_MAX_SECTORS;
+    caps->max_segments = 1;
+    caps->flags = flags;
+    caps->queue_depth = depth > 255 ? 255 : depth;
+    r->block.ops = (flags & BLOCK_CAP_FUA) ? &raid0_ops : &raid0_ops_no_fua;
+
+    if (raid_finish(r) != 0) return 0;
+
+    print_string("RAID: ");
+    print_string(r->block.name);
+    print_string(" stripes ");
+    for (int i = 0; i < n; i++) {
+        print_string(r->members[i].dev->name);
+        print_char(i + 1 < n ? ',' : ' ');
+    }
+    print_string("with ");
+    print_int(chunk_sectors / 2);
+    print_string(" KB chunks, ");
+    print_int((uint32_t)(caps->sector_count >> 11));
+    print_string(" MB.\n");
+    return r;
+}
+
+RaidDevice* raid1_create(BlockDevice* a, BlockDevice* b) {
+    if (!a || !b || a == b) {
+        print_string("RAID: Mirroring needs two different disks.\n");
+        return 0;
+    }
+    if (a->type == BLOCK_TYPE_RAID || b->type == BLOCK_TYPE_RAID) {
+        print_string("RAID: md devices can't be mirror members.\n");
+        return 0;
+    }
+    RaidDevice* r = raid_alloc();
+    if (!r) return 0;
+
+    r->level = 1;
+    raid_add_member(r, a);
+    raid_add_member(r, b);
+
+    const BlockCaps* ca = &a->caps;
+    const BlockCaps* cb = &b->caps;
+    BlockCaps* caps = &r->block.caps;
+    caps->sector_count = ca->sector_count < cb->sector_count ? ca->sector_count : cb->sector_count;
+    // Large requests are cut into member-sized commands below, and a split
+    // read puts half on each member.
+    uint32_t member_max = ca->max_sectors < cb->max_sectors ? ca->max_sectors : cb->max_sectors;
+    caps->max_sectors = 2 * member_max;
+    caps->max_segments = 1;
+    caps->flags = ca->flags & cb->flags & (BLOCK_CAP_LBA48 | BLOCK_CAP_DMA | BLOCK_CAP_FUA);
+    caps->flags |= (ca->flags | cb->flags) & BLOCK_CAP_WRITE_CACHE;
+    uint32_t depth = ca->queue_depth + cb->queue_depth;
+    caps->queue_depth = depth > 255 ? 255 : depth;
+    r->block.ops = (caps->flags & BLOCK_CAP_FUA) ? &raid1_ops : &raid1_ops_no_fua;
+
+    if (raid_finish(r) != 0) return 0;
+
+    print_string("RAID: ");
+    print_string(r->block.name);
+    print_string(" mirrors ");
+    print_string(a->name);
+    print_char(',');
+    print_string(b->name);
+    print_string(", ");
+    print_int((uint32_t)(caps->sector_count >> 11));
+    print_string(" MB.\n");
+    return r;
+}
+
+void raid_print_stats() {
+    if (raid_device_count == 0) {
+        print_string("(No md devices)\n");
+        return;
+    }
+    for (int d = 0; d < raid_device_count; d++) {
+        RaidDevice* r = &raid_devices[d];
+        print_string(r->block.name);
+        print_string(": raid");
+        print_int(r->level);
+        new_line();
+        for (int i = 0; i < r->member_count; i++) {
+            RaidMember* m = &r->members[i];
+            uint32_t rem;
+            uint32_t avg = m->completions ? (uint32_t)udiv64(m->total_latency_us, m->completions, &rem) : 0;
+            print_string("  ");
+            print_string(m->dev->name);
+            print_string(": ");
+            print_int(m->reads);
+            print_string(" reads, ");
+            print_int(m->writes);
+            print_string(" writes, qd ");
+            print_int(m->inflight);
+            print_string(" (max ");
+            print_int(m->max_inflight);
+            print_string("), latency avg ");
+            print_int(avg);
+            print_string(" us, max ");
+            print_int(m->max_latency_us);
+            print_string(" us\n");
+        }
+    }
+}
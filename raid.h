@@ -0,0 +1,58 @@
+#ifndef RAID_H
+#define RAID_H
+
+#include <stdint.h>
+#include "block.h"
+#include "ahci.h"
+
+#define RAID_MAX_MEMBERS 8
+#define RAID_MAX_DEVICES 2
+
+// Chunk size limits, in sectors: 4 KB up to one full AHCI command.
+#define RAID_MIN_CHUNK_SECTORS 8
+#define RAID_MAX_CHUNK_SECTORS AHCI_MAX_SECTORS
+
+// One member disk and its counters. AHCI members run their commands
+// asynchronously (several members, and several commands per member, at
+// once); other members are driven synchronously.
+typedef struct {
+    BlockDevice* dev;
+    AhciPort* port;              // NULL unless the member is an AHCI port
+    uint64_t next_lba;           // Where the member's last command ended
+    volatile uint32_t inflight;  // Commands currently queued on the member
+    uint32_t max_inflight;
+    uint32_t reads;
+    uint32_t writes;
+    uint32_t completions;
+    uint64_t total_latency_us;
+    uint32_t max_latency_us;
+} RaidMember;
+
+// RAID-0: chunk c lives on member c % n at member LBA (c / n) * chunk,
+// so each member sees one contiguous range per request.
+// RAID-1: every member holds the whole device.
+typedef struct {
+    int level;
+    int member_count;
+    RaidMember members[RAID_MAX_MEMBERS];
+    uint32_t chunk_sectors;      // RAID-0 only
+    BlockDevice block;
+} RaidDevice;
+
+// Stripes every AHCI disk into a new "mdN" block device with the given
+// chunk size (a multiple of 8 sectors). The array is not persistent:
+// it has to be recreated with the same chunk size after each boot.
+// Returns the device, or NULL (with a message) if it can't be built.
+RaidDevice* raid0_create(uint32_t chunk_sectors);
+
+// Mirrors two block devices (PATA+SATA or two AHCI ports) into a new
+// "mdN" device. Writes go to both; reads go to an idle member, preferring
+// the one whose last access ended closest to the request, and large reads
+// are split across both. Not persistent either, and the members are not
+// resynchronised: create it over disks that already match, or format it.
+RaidDevice* raid1_create(BlockDevice* a, BlockDevice* b);
+
+// Prints every md device with its per-member counters.
+void raid_print_stats();
+
+#endif // RAID_H
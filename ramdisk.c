@@ -0,0 +1,115 @@
+#include "ramdisk.h"
+#include "shell.h"
+#include "extrainclude.h"
+
+#define MULTIBOOT_BOOTLOADER_MAGIC 0x2BADB002
+#define MULTIBOOT_INFO_MEMORY      0x01 // mem_lower/mem_upper are valid
+
+extern uint32_t multiboot_magic;
+extern uint32_t multiboot_info;
+
+static BlockDevice ramdisk;
+static int ramdisk_present = 0;
+
+// End of the memory above 1 MB, from the Multiboot info block, or 0 if
+// the loader didn't report it.
+static uint32_t ramdisk_memory_end() {
+    if (multiboot_magic != MULTIBOOT_BOOTLOADER_MAGIC || !multiboot_info) return 0;
+    const uint32_t* info = (const uint32_t*)multiboot_info;
+    if (!(info[0] & MULTIBOOT_INFO_MEMORY)) return 0;
+    uint32_t upper_kb = info[2];
+    if (upper_kb > (0xFFFFFFFF - 0x100000) / 1024) return 0xFFFFFFFF;
+    return 0x100000 + upper_kb * 1024;
+}
+
+static uint8_t* ramdisk_sector(uint64_t lba) {
+    return (uint8_t*)RAMDISK_BASE + (uint32_t)lba * BLOCK_SECTOR_SIZE;
+}
+
+static int ramdisk_check(BlockDevice* dev, uint64_t lba, uint32_t count) {
+    return lba + count <= dev->caps.sector_count ? 0 : -1;
+}
+
+static int ramdisk_read(BlockDevice* dev, uint64_t lba, uint32_t count, void* buf) {
+    if (ramdisk_check(dev, lba, count) != 0) return -1;
+    memcpy(buf, ramdisk_sector(lba), count * BLOCK_SECTOR_SIZE);
+    return 0;
+}
+
+static int ramdisk_write(BlockDevice* dev, uint64_t lba, uint32_t count, const void* buf) {
+    if (ramdisk_check(dev, lba, count) != 0) return -1;
+    memcpy(ramdisk_sector(lba), buf, count * BLOCK_SECTOR_SIZE);
+    return 0;
+}
+
+static int ramdisk_readv(BlockDevice* dev, uint64_t lba, const BlockSegment* segs, int nsegs) {
+    for (int i = 0; i < nsegs; i++) {
+        uint32_t count = segs[i].len / BLOCK_SECTOR_SIZE;
+        if (ramdisk_read(dev, lba, count, segs[i].addr) != 0) return -1;
+        lba += count;
+    }
+    return 0;
+}
+
+static int ramdisk_writev(BlockDevice* dev, uint64_t lba, const BlockSegment* segs, int nsegs) {
+    for (int i = 0; i < nsegs; i++) {
+        uint32_t count = segs[i].len / BLOCK_SECTOR_SIZE;
+        if (ramdisk_write(dev, lba, count, segs[i].addr) != 0) return -1;
+        lba += count;
+    }
+    return 0;
+}
+
+// Writes are durable as soon as they are copied, so no write_fua or flush.
+static const BlockDeviceOps ramdisk_ops = {
+    ramdisk_read,
+    ramdisk_write,
+    0,
+    0,
+    ramdisk_readv,
+    ramdisk_writev,
+};
+
+BlockDevice* ramdisk_create(uint32_t size_mb) {
+    if (ramdisk_present) {
+        print_string("RAM disk: ram0 already exists.\n");
+        return 0;
+    }
+    if (size_mb == 0 || size_mb > (0xFFFFFFFF - RAMDISK_BASE) >> 20) {
+        print_string("RAM disk: Bad size.\n");
+        return 0;
+    }
+    uint32_t end = ramdisk_memory_end();
+    uint32_t bytes = size_mb << 20;
+    if (end == 0) {
+        print_string("RAM disk: Memory size unknown, assuming it fits.\n");
+    } else if (end < RAMDISK_BASE || end - RAMDISK_BASE < bytes) {
+        print_string("RAM disk: Only ");
+        print_int(end > RAMDISK_BASE ? (end - RAMDISK_BASE) >> 20 : 0);
+        print_string(" MB free above 16 MB.\n");
+        return 0;
+    }
+
+    memset((void*)RAMDISK_BASE, 0, bytes);
+    strcpy(ramdisk.name, "ram0");
+    ramdisk.type = BLOCK_TYPE_RAM;
+    ramdisk.ops = &ramdisk_ops;
+    ramdisk.driver_data = 0;
+    ramdisk.caps.sector_count = bytes / BLOCK_SECTOR_SIZE;
+    ramdisk.caps.max_sectors = 65536;
+    ramdisk.caps.max_segments = BLOCK_MAX_SEGMENTS;
+    ramdisk.caps.flags = BLOCK_CAP_LBA48;
+    ramdisk.caps.queue_depth = 1;
+    if (block_register(&ramdisk) < 0) {
+        print_string("RAM disk: Block registry is full.\n");
+        return 0;
+    }
+    ramdisk_present = 1;
+
+    print_string("RAM disk: ram0, ");
+    print_int(size_mb);
+    print_string(" MB at 0x");
+    print_hex(RAMDISK_BASE);
+    new_line();
+    return &ramdisk;
+}
@@ -0,0 +1,20 @@
+#ifndef RAMDISK_H
+#define RAMDISK_H
+
+#include <stdint.h>
+#include "block.h"
+
+// The RAM disk occupies physical memory from here up; nothing else in
+// the kernel uses memory above 16 MB.
+#define RAMDISK_BASE 0x01000000
+
+// Room for the boot area hdd_fs skips (FS_LBA_OFFSET sectors, 15 MB)
+// plus a filesystem of useful size.
+#define RAMDISK_DEFAULT_MB 32
+
+// Creates and registers "ram0", a zeroed disk of `size_mb` megabytes.
+// Refuses sizes past the end of memory as reported by the boot loader.
+// Returns the device, or NULL (with a message) on failure.
+BlockDevice* ramdisk_create(uint32_t size_mb);
+
+#endif // RAMDISK_H
@@ -1,25 +1,117 @@
 #include "sata.h"
 #include "ahci.h"
+#include "block.h"
 #include "shell.h"
 
 int sata_drive_present = 0; // ADDED: The missing definition of the variable
-extern HBA_PORT* active_port; // From ahci.c
+
+static int sata_block_read(BlockDevice* dev, uint64_t lba, uint32_t count, void* buf) {
+    return ahci_read((AhciPort*)dev->driver_data, lba, count, buf);
+}
+
+static int sata_block_write(BlockDevice* dev, uint64_t lba, uint32_t count, const void* buf) {
+    return ahci_write((AhciPort*)dev->driver_data, lba, count, buf);
+}
+
+static int sata_block_write_fua(BlockDevice* dev, uint64_t lba, uint32_t count, const void* buf) {
+    AhciPort* ap = (AhciPort*)dev->driver_data;
+    if (!(dev->caps.flags & BLOCK_CAP_FUA)) {
+        int ret = ahci_write(ap, lba, count, buf);
+        if (ret != 0) return ret;
+        return ahci_flush(ap);
+    }
+    return ahci_write_fua(ap, lba, count, buf);
+}
+
+static int sata_block_flush(BlockDevice* dev) {
+    return ahci_flush((AhciPort*)dev->driver_data);
+}
+
+static int sata_block_readv(BlockDevice* dev, uint64_t lba, const BlockSegment* segs, int nsegs) {
+    return ahci_readv((AhciPort*)dev->driver_data, lba, segs, nsegs);
+}
+
+static int sata_block_writev(BlockDevice* dev, uint64_t lba, const BlockSegment* segs, int nsegs) {
+    return ahci_writev((AhciPort*)dev->driver_data, lba, segs, nsegs);
+}
+
+static int sata_block_submit(BlockDevice* dev, uint64_t lba, const BlockSegment* segs, int nsegs, int write,
+                             block_callback_t callback, void* ctx) {
+    return ahci_submitv((AhciPort*)dev->driver_data, lba, segs, nsegs, write ? AHCI_SUBMIT_WRITE : 0,
+                        callback, ctx);
+}
+
+static void sata_block_wait_event(BlockDevice* dev) {
+    ahci_wait_event((AhciPort*)dev->driver_data);
+}
+
+static void sata_block_abort(BlockDevice* dev) {
+    ahci_abort((AhciPort*)dev->driver_data);
+}
+
+static int sata_block_poll(BlockDevice* dev) {
+    return ahci_poll((AhciPort*)dev->driver_data);
+}
+
+static int sata_block_discard(BlockDevice* dev, const BlockRange* ranges, int nranges) {
+    return ahci_trim((AhciPort*)dev->driver_data, ranges, nranges);
+}
+
+static const BlockDeviceOps sata_block_ops = {
+    sata_block_read,
+    sata_block_write,
+    sata_block_write_fua,
+    sata_block_flush,
+    sata_block_readv,
+    sata_block_writev,
+    sata_block_submit,
+    sata_block_wait_event,
+    sata_block_abort,
+    sata_block_poll,
+    0,
+    sata_block_discard,
+};
 
 void sata_init() {
     ahci_init();
-    if (ahci_drive_present) {
-        sata_drive_present = 1;
+    if (!ahci_drive_present) return;
+    sata_drive_present = 1;
+
+    for (int i = 0; i < ahci_port_count(); i++) {
+        AhciPort* ap = ahci_get_port(i);
+        ap->block.name[0] = 's';
+        ap->block.name[1] = 'd';
+        ap->block.name[2] = 'a' + i;
+        ap->block.name[3] = '\0';
+        ap->block.type = BLOCK_TYPE_SATA;
+        ap->block.ops = &sata_block_ops;
+        ap->block.driver_data = ap;
+        block_register(&ap->block);
     }
 }
 
+int sata_drive_count() {
+    return ahci_port_count();
+}
+
 int sata_read(uint32_t drive, uint64_t lba, uint32_t count, void* buf) {
-    if (!sata_drive_present || !active_port) return -1;
-    // 'drive' is ignored for now as we only support one
-    return ahci_read(active_port, lba, count, buf);
+    AhciPort* ap = ahci_get_port(drive);
+    if (!sata_drive_present || !ap) return -1;
+    return ahci_read(ap, lba, count, buf);
 }
 
 int sata_write(uint32_t drive, uint64_t lba, uint32_t count, const void* buf) {
-    if (!sata_drive_present || !active_port) return -1;
-    // 'drive' is ignored for now as we only support one
-    return ahci_write(active_port, lba, count, buf);
-}
\ No newline at end of file
+    AhciPort* ap = ahci_get_port(drive);
+    if (!sata_drive_present || !ap) return -1;
+    return ahci_write(ap, lba, count, buf);
+}
+
+int sata_flush(uint32_t drive) {
+    AhciPort* ap = ahci_get_port(drive);
+    if (!sata_drive_present || !ap) return -1;
+    return ahci_flush(ap);
+}
+
+uint32_t sata_max_sectors() {
+    return AHCI_MAX_SECTORS;
+}
@@ -6,13 +6,24 @@
 // Global flag set by the driver if a usable SATA device is found
 extern int sata_drive_present;
 
-// Initializes the SATA subsystem (which in turn initializes AHCI).
+// Initializes the SATA subsystem (which in turn initializes AHCI) and
+// registers each disk with the block layer as "sda", "sdb", ...
 void sata_init();
 
-// Reads `count` sectors from `lba` into `buf`. Returns 0 on success.
+// Number of SATA disks; valid `drive` values are 0..sata_drive_count()-1,
+// in AHCI port order.
+int sata_drive_count();
+
+// Reads `count` sectors from `lba` of `drive` into `buf`. Returns 0 on success.
 int sata_read(uint32_t drive, uint64_t lba, uint32_t count, void* buf);
 
-// Writes `count` sectors from `buf` to `lba`. Returns 0 on success.
+// Writes `count` sectors from `buf` to `lba` of `drive`. Returns 0 on success.
 int sata_write(uint32_t drive, uint64_t lba, uint32_t count, const void* buf);
 
-#endif // SATA_H
\ No newline at end of file
+// Flushes `drive`'s volatile write cache. Returns 0 on success.
+int sata_flush(uint32_t drive);
+
+// Largest `count` a single sata_read/sata_write accepts.
+uint32_t sata_max_sectors();
+
+#endif // SATA_H
@@ -5,17 +5,24 @@
 #include "color.h"
 #include "cdg_player.h"
 #include "graphics.h"
+#include "diskbench.h"
+#include "block.h"
+#include "ahci.h"
+#include "raid.h"
+#include "ssdcache.h"
+#include "bcache.h"
+#include "ramdisk.h"
+#include "nvme.h"
 
+// /bin programs are linked to run here (app_linker.ld). linker.ld keeps
+// the kernel out of PROGRAM_WINDOW_START..PROGRAM_WINDOW_END.
 #define BINARY_LOAD_ADDRESS 0x200000
+extern char PROGRAM_WINDOW_END[];
 
 // External kernel variables
 extern char input_buffer[];
 extern int IsGraphics; // Get access to the new global state flag
 
-// Extern the file table so `ls` can inspect it directly
-extern FileIndexTable fs_table;
-
-static char hdd_file_buffer[MAX_FILE_SIZE + 1];
 static char current_working_dir[128] = "/";
 
 // External function prototypes
@@ -53,12 +60,11 @@ static void handle_ls(const char* args) {
     print_string("-------------------------\n");
 
     int count = 0;
-    int cwd_len = strlen(current_working_dir);
-
-    for (int i = 0; i < MAX_FILES; i++) {
-        const char* entry_name = fs_table.entries[i].filename;
-        if (entry_name[0] == '\0') continue;
+    uint32_t cursor = 0;
+    char entry_name[MAX_FILENAME_LEN];
+    uint32_t size_bytes;
 
+    while (fs_readdir(&cursor, entry_name, &size_bytes)) {
         const char* name_to_print = NULL;
 
         if (strcmp(current_working_dir, "/") == 0) {
@@ -119,6 +125,303 @@ static void handle_md(const char* args) {
     }
 }
 
+// Prints a file a sector's worth at a time.
+static void handle_read(const char* args) {
+    char full_path[128];
+    get_full_path(full_path, args);
+    int fd = fs_open(full_path);
+    if (fd < 0) {
+        print_string("Error reading file.\n");
+        return;
+    }
+    char chunk[HDD_SECTOR_SIZE + 1];
+    int n;
+    while ((n = fs_read(fd, chunk, HDD_SECTOR_SIZE)) > 0) {
+        chunk[n] = '\0';
+        print_string(chunk);
+    }
+    fs_close(fd);
+    if (n < 0) print_string("\nError reading file.\n");
+    else new_line();
+}
+
+// Reads a program into the load window. Returns its size, or -1 if it
+// doesn't exist, is empty or wouldn't fit below PROGRAM_WINDOW_END.
+static int load_program(const char* path) {
+    int fd = fs_open(path);
+    if (fd < 0) return -1;
+    int size = fs_size(fd);
+    int n = -1;
+    if (size > 0 && (uint32_t)size <= (uint32_t)PROGRAM_WINDOW_END - BINARY_LOAD_ADDRESS) {
+        n = fs_read(fd, (void*)BINARY_LOAD_ADDRESS, size);
+    }
+    fs_close(fd);
+    return n == size ? n : -1;
+}
+
+// Removes a file, or a directory once nothing is left in it.
+static void handle_rm(const char* args) {
+    if (strlen(args) == 0) {
+        print_string("Usage: rm <file|directory>\n");
+        return;
+    }
+    char full_path[130];
+    get_full_path(full_path, args);
+    if (!fs_exists(full_path)) {
+        strcat(full_path, "/");
+        if (!fs_exists(full_path)) {
+            print_string("File not found: ");
+            print_string(args);
+            new_line();
+            return;
+        }
+    }
+    int len = strlen(full_path);
+    if (full_path[len - 1] == '/') {
+        uint32_t cursor = 0;
+        char entry_name[MAX_FILENAME_LEN];
+        uint32_t size_bytes;
+        while (fs_readdir(&cursor, entry_name, &size_bytes)) {
+            if (strncmp(entry_name, full_path, len) == 0 && entry_name[len] != '\0') {
+                print_string("Directory not empty.\n");
+                return;
+            }
+        }
+    }
+    if (fs_delete_file(full_path) != 0) {
+        print_string("Error removing file.\n");
+    }
+}
+
+// Parses a decimal number and advances `*p` past it and any spaces.
+// Returns -1 if there is no number.
+static int parse_uint(const char** p) {
+    const char* s = *p;
+    int val = -1;
+    while (*s >= '0' && *s <= '9') {
+        val = (val < 0 ? 0 : val * 10) + (*s - '0');
+        s++;
+    }
+    while (*s == ' ') s++;
+    *p = s;
+    return val;
+}
+
+// `blk ccc [off | <commands> <ms>]`: AHCI command completion coalescing.
+static void handle_blk_ccc(const char* args) {
+    uint8_t commands;
+    uint16_t timeout_ms;
+    if (*args != '\0') {
+        int ret;
+        if (strcmp(args, "off") == 0) {
+            ret = ahci_set_coalescing(0, 0);
+        } else {
+            int c = parse_uint(&args);
+            int ms = parse_uint(&args);
+            if (c < 1 || c > 255 || ms < 1 || ms > 65535) {
+                print_string("Usage: blk ccc [off | <commands 1-255> <timeout ms>]\n");
+                return;
+            }
+            ret = ahci_set_coalescing(c, ms);
+        }
+        if (ret != 0) {
+            print_string("Coalescing not available on this HBA.\n");
+            return;
+        }
+    }
+    print_string("AHCI interrupts: ");
+    print_string(ahci_interrupt_mode());
+    print_string(", ");
+    print_int(ahci_interrupt_count());
+    print_string(" taken. Coalescing: ");
+    if (ahci_get_coalescing(&commands, &timeout_ms)) {
+        print_int(commands);
+        print_string(" commands or ");
+        print_int(timeout_ms);
+        print_string(" ms\n");
+    } else {
+        print_string("off\n");
+    }
+}
+
+// `cache` shows buffer cache statistics; `cache size <KB>` sets its budget.
+static void handle_cache(const char* args) {
+    if (strncmp(args, "size ", 5) == 0) {
+        const char* p = args + 5;
+        int kb = parse_uint(&p);
+        if (kb < 0) {
+            print_string("Usage: cache size <KB>\n");
+            return;
+        }
+        if (bcache_set_budget((uint32_t)kb / (BCACHE_BLOCK_SIZE / 1024)) != 0) {
+            print_string("Cache: Write-back failed, budget unchanged.\n");
+            return;
+        }
+    } else if (*args) {
+        print_string("Usage: cache [size <KB>]\n");
+        return;
+    }
+
+    BcacheStats st;
+    bcache_get_stats(&st);
+    uint32_t lookups = st.hits + st.misses;
+    print_string("Cache: ");
+    print_int(st.blocks * (BCACHE_BLOCK_SIZE / 1024));
+    print_string(" of ");
+    print_int(st.budget_blocks * (BCACHE_BLOCK_SIZE / 1024));
+    print_string(" KB used, ");
+    print_int(st.dirty_blocks);
+    print_string(" dirty blocks\n");
+    print_string("  ");
+    print_int(st.hits);
+    print_string(" hits, ");
+    print_int(st.misses);
+    print_string(" misses (");
+    print_int(lookups ? st.hits * 100 / lookups : 0);
+    print_string("%), ");
+    print_int(st.evictions);
+    print_string(" evictions, ");
+    print_int(st.writebacks);
+    print_string(" write-backs, ");
+    print_int(st.bypassed);
+    print_string(" uncached\n");
+    print_string("  readahead: ");
+    print_int(st.ra_blocks);
+    print_string(" blocks, ");
+    print_int(st.ra_hits);
+    print_string(" used, ");
+    print_int(st.ra_wasted);
+    print_string(" wasted\n");
+}
+
+// `blk cache` shows the SSD cache's counters; `blk cache <ssd> <origin>
+// [wt|wb]` builds it, `blk cache mode wt|wb` switches modes and
+// `blk cache clean` writes every dirty line back.
+static void handle_blk_cache(char* args) {
+    while (*args == ' ') args++;
+    if (*args == '\0') {
+        ssdcache_print_stats();
+        return;
+    }
+    if (strcmp(args, "clean") == 0) {
+        if (ssdcache_clean() == 0) print_string("OK\n");
+        else print_string("Error.\n");
+        return;
+    }
+    if (strcmp(args, "mode wt") == 0 || strcmp(args, "mode wb") == 0) {
+        ssdcache_set_mode(args[6] == 'b' ? SSDCACHE_WRITE_BACK : SSDCACHE_WRITE_THROUGH);
+        return;
+    }
+    char* ssd = args;
+    char* origin = ssd;
+    while (*origin && *origin != ' ') origin++;
+    if (*origin) *origin++ = '\0';
+    while (*origin == ' ') origin++;
+    char* mode = origin;
+    while (*mode && *mode != ' ') mode++;
+    if (*mode) *mode++ = '\0';
+    while (*mode == ' ') mode++;
+    if (*origin == '\0' || (*mode && strcmp(mode, "wt") != 0 && strcmp(mode, "wb") != 0)) {
+        print_string("Usage: blk cache [<ssd> <origin> [wt|wb] | mode wt|wb | clean]\n");
+        return;
+    }
+    BlockDevice* cache_dev = block_find_device(ssd);
+    BlockDevice* origin_dev = block_find_device(origin);
+    if (!cache_dev || !origin_dev) {
+        print_string("No such device.\n");
+        return;
+    }
+    ssdcache_create(cache_dev, origin_dev, strcmp(mode, "wb") == 0 ? SSDCACHE_WRITE_BACK : SSDCACHE_WRITE_THROUGH);
+}
+
+// `blk` lists block devices; `blk use <name>` moves the filesystem to one;
+// `blk raid` shows the md devices' per-member counters.
+static void handle_blk(char* args) {
+    if (strlen(args) == 0) {
+        block_print_devices();
+        return;
+    }
+    if (strncmp(args, "ccc", 3) == 0 && (args[3] == '\0' || args[3] == ' ')) {
+        args += 3;
+        while (*args == ' ') args++;
+        handle_blk_ccc(args);
+        return;
+    }
+    if (strncmp(args, "use ", 4) == 0) {
+        BlockDevice* dev = block_find_device(args + 4);
+        if (!dev) {
+            print_string("No such device.\n");
+            return;
+        }
+        block_select(dev);
+        strcpy(current_working_dir, "/");
+        fs_init();
+        return;
+    }
+    if (strncmp(args, "raid0", 5) == 0 && (args[5] == '\0' || args[5] == ' ')) {
+        const char* p = args + 5;
+        while (*p == ' ') p++;
+        int chunk_kb = *p ? parse_uint(&p) : 64;
+        if (chunk_kb > 0) raid0_create(chunk_kb * 2);
+        else print_string("Usage: blk raid0 [chunk KB]\n");
+        return;
+    }
+    if (strncmp(args, "raid1 ", 6) == 0) {
+        char* a = args + 6;
+        while (*a == ' ') a++;
+        char* b = a;
+        while (*b && *b != ' ') b++;
+        if (*b) *b++ = '\0';
+        while (*b == ' ') b++;
+        if (*a == '\0' || *b == '\0') {
+            print_string("Usage: blk raid1 <device> <device>\n");
+            return;
+        }
+        raid1_create(block_find_device(a), block_find_device(b));
+        return;
+    }
+    if (strncmp(args, "sched ", 6) == 0) {
+        char* name = args + 6;
+        while (*name == ' ') name++;
+        char* sched = name;
+        while (*sched && *sched != ' ') sched++;
+        if (*sched) *sched++ = '\0';
+        while (*sched == ' ') sched++;
+        BlockDevice* dev = block_find_device(name);
+        if (!dev) {
+            print_string("No such device.\n");
+            return;
+        }
+        if (strcmp(sched, "noop") == 0) block_set_scheduler(dev, BLOCK_SCHED_NOOP);
+        else if (strcmp(sched, "deadline") == 0) block_set_scheduler(dev, BLOCK_SCHED_DEADLINE);
+        else if (strcmp(sched, "cscan") == 0) block_set_scheduler(dev, BLOCK_SCHED_CSCAN);
+        else print_string("Usage: blk sched <device> <noop|deadline|cscan>\n");
+        return;
+    }
+    if (strncmp(args, "ramdisk", 7) == 0 && (args[7] == '\0' || args[7] == ' ')) {
+        const char* p = args + 7;
+        while (*p == ' ') p++;
+        int size_mb = *p ? parse_uint(&p) : RAMDISK_DEFAULT_MB;
+        if (size_mb > 0) ramdisk_create(size_mb);
+        else print_string("Usage: blk ramdisk [MB]\n");
+        return;
+    }
+    if (strcmp(args, "nvme") == 0) {
+        nvme_print_stats();
+        return;
+    }
+    if (strcmp(args, "raid") == 0) {
+        raid_print_stats();
+        return;
+    }
+    if (strncmp(args, "cache", 5) == 0 && (args[5] == '\0' || args[5] == ' ')) {
+        handle_blk_cache(args + 5);
+        return;
+    }
+    print_string("Usage: blk [use <device> | sched <device> <sched> | ccc ... | raid0 [chunk KB] |\n");
+    print_string("           raid1 <dev> <dev> | raid | ramdisk [MB] | nvme | cache ...]\n");
+}
+
 static void handle_cd(const char* args) {
     if (strlen(args) == 0) return;
     if (strcmp(args, "/") == 0) {
@@ -147,15 +450,7 @@ static void handle_cd(const char* args) {
         strcpy(temp_path, new_path);
         strcat(temp_path, "/");
         
-        int found = 0;
-        for (int i = 0; i < MAX_FILES; i++) {
-            if (strcmp(fs_table.entries[i].filename, temp_path) == 0) {
-                found = 1;
-                break;
-            }
-        }
-
-        if (found) {
+        if (fs_exists(temp_path)) {
             strcpy(current_working_dir, "/");
             strcat(current_working_dir, new_path);
         } else {
@@ -182,8 +477,8 @@ void process_command() {
 
     if (strcmp(command, "help") == 0) {
         new_line();
-        print_string("System: help, cls, mr, color, graphics, textmode\n");
-        print_string("FS:     ls, cd, md, read, write, format\n");
+        print_string("System: help, cls, mr, color, graphics, textmode, diskbench, blk, cache, sync\n");
+        print_string("FS:     ls, cd, md, rm, read, write, format\n");
         print_string("Apps:   snake, basic, cdg (graphical)\n");
     } else if (strcmp(command, "cls") == 0) {
         clear_screen();
@@ -212,11 +507,12 @@ void process_command() {
         handle_cd(args);
     } else if (strcmp(command, "md") == 0 || strcmp(command, "mkdir") == 0) {
         handle_md(args);
+    } else if (strcmp(command, "rm") == 0 || strcmp(command, "del") == 0) {
+        new_line();
+        handle_rm(args);
     } else if (strcmp(command, "read") == 0 || strcmp(command, "cat") == 0) {
-        new_line(); char p[128]; get_full_path(p, args);
-        int bytes = fs_read_file(p, hdd_file_buffer);
-        if (bytes >= 0) { print_string(hdd_file_buffer); new_line(); }
-        else { print_string("Error reading file.\n"); }
+        new_line();
+        handle_read(args);
     } else if (strcmp(command, "write") == 0 || strcmp(command, "wr") == 0) {
         new_line(); char* fn = args; char* data = NULL;
         for (int i = 0; args[i] != '\0'; i++) {
@@ -226,7 +522,10 @@ void process_command() {
             if (fs_write_file(p, data, strlen(data))==0) print_string("OK\n"); else print_string("Error.\n");
         } else { print_string("Usage: write <file> <data>\n"); }
     } else if (strcmp(command, "format") == 0) {
-        fs_format_disk();
+        const char* p = args;
+        int cluster_kb = *p ? parse_uint(&p) : FS_CLUSTER_SECTORS / 2;
+        if (cluster_kb > 0) fs_format(cluster_kb * 2);
+        else print_string("Usage: format [cluster KB]\n");
     } else if (strcmp(command, "snake") == 0) {
         snake_game();
     } else if (strcmp(command, "basic") == 0) {
@@ -235,6 +534,20 @@ void process_command() {
         handle_color_command(args);
     } else if (strcmp(command, "mr") == 0) {
         mem_read_command(args);
+    } else if (strcmp(command, "diskbench") == 0) {
+        diskbench_command(args);
+    } else if (strcmp(command, "sync") == 0) {
+        new_line();
+        // Flush the devices even if a file failed to sync.
+        int ret = fs_sync_all();
+        if (block_sync_all() != 0) ret = -1;
+        if (ret != 0) print_string("sync: Write error.\n");
+    } else if (strcmp(command, "cache") == 0) {
+        new_line();
+        handle_cache(args);
+    } else if (strcmp(command, "blk") == 0) {
+        new_line();
+        handle_blk(args);
     } else if (strcmp(command, "cdg") == 0) {
         if (*args == '\0') {
             print_string("Usage: cdg <filename>\n");
@@ -247,9 +560,7 @@ void process_command() {
         char full_path[128];
         get_full_path(full_path, command);
         
-        int bytes_read = fs_read_file(full_path, (char*)BINARY_LOAD_ADDRESS);
-
-        if (bytes_read > 0) {
+        if (load_program(full_path) > 0) {
             void (*app)(void) = (void*)BINARY_LOAD_ADDRESS;
             app();
         } else {
@@ -0,0 +1,530 @@
+#include "ssdcache.h"
+#include "bcache.h"
+#include "shell.h"
+#include "timer.h"
+#include "extrainclude.h"
+
+static SsdCache ssdcache;
+static int ssdcache_present = 0;
+
+__attribute__((aligned(4096))) static SsdCacheEntry ssd_map[SSDCACHE_MAX_LINES];
+static uint32_t ssd_stamp[SSDCACHE_MAX_LINES];
+__attribute__((aligned(4096))) static uint8_t ssd_line_buf[SSDCACHE_LINE_SECTORS * BLOCK_SECTOR_SIZE];
+// Separate from ssd_line_buf, which may hold the line being promoted
+// while its victim is written back.
+__attribute__((aligned(4096))) static uint8_t ssd_writeback_buf[SSDCACHE_LINE_SECTORS * BLOCK_SECTOR_SIZE];
+__attribute__((aligned(16))) static uint8_t ssd_header_buf[BLOCK_SECTOR_SIZE];
+__attribute__((aligned(16))) static uint8_t ssd_label_buf[BLOCK_SECTOR_SIZE];
+
+// Recent misses, direct-mapped by origin line.
+static uint32_t ssd_history_line[SSDCACHE_HISTORY];
+static uint8_t ssd_history_count[SSDCACHE_HISTORY];
+
+static uint64_t ssd_slot_lba(SsdCache* c, int slot) {
+    return c->data_lba + (uint64_t)slot * SSDCACHE_LINE_SECTORS;
+}
+
+static int ssd_lookup(SsdCache* c, uint32_t line) {
+    int base = (int)(line % c->sets) * SSDCACHE_WAYS;
+    for (int w = 0; w < SSDCACHE_WAYS; w++) {
+        if (ssd_map[base + w].line == line) return base + w;
+    }
+    return -1;
+}
+
+static void ssd_touch(SsdCache* c, int slot) {
+    ssd_stamp[slot] = ++c->clock;
+}
+
+// Writes the map sector holding `slot`'s entry, durably: later data
+// writes to the slot must not reach the disk ahead of it.
+static int ssd_save_entry(SsdCache* c, int slot) {
+    uint32_t sector = slot / SSDCACHE_ENTRIES_PER_SECTOR;
+    return block_dev_write_fua(c->cache, 1 + sector, 1, &ssd_map[sector * SSDCACHE_ENTRIES_PER_SECTOR]);
+}
+
+static int ssd_save_header(SsdCache* c) {
+    SsdCacheHeader* h = (SsdCacheHeader*)ssd_header_buf;
+    memset(ssd_header_buf, 0, sizeof(ssd_header_buf));
+    h->magic = SSDCACHE_MAGIC;
+    h->version = SSDCACHE_VERSION;
+    h->line_sectors = SSDCACHE_LINE_SECTORS;
+    h->lines = c->lines;
+    h->origin_sectors = c->origin->caps.sector_count;
+    h->mode = c->mode;
+    h->map_sectors = c->map_sectors;
+    h->generation = c->generation;
+    return block_dev_write_fua(c->cache, 0, 1, ssd_header_buf);
+}
+
+// Reads `dev`'s label. Returns 0, or -1 if it has none.
+static int ssd_read_label(BlockDevice* dev, SsdCacheLabel* label) {
+    if (dev->caps.sector_count == 0) return -1;
+    if (block_dev_read(dev, dev->caps.sector_count - 1, 1, ssd_label_buf) != 0) return -1;
+    memcpy(label, ssd_label_buf, sizeof(SsdCacheLabel));
+    return label->magic == SSDCACHE_LABEL_MAGIC ? 0 : -1;
+}
+
+static int ssd_write_label(BlockDevice* dev, const SsdCacheLabel* label) {
+    memset(ssd_label_buf, 0, sizeof(ssd_label_buf));
+    memcpy(ssd_label_buf, label, sizeof(SsdCacheLabel));
+    return block_dev_write_fua(dev, dev->caps.sector_count - 1, 1, ssd_label_buf);
+}
+
+static int ssd_save_label(SsdCache* c, int dirty) {
+    SsdCacheLabel label = { SSDCACHE_LABEL_MAGIC, c->generation, 1, (uint32_t)dirty };
+    return ssd_write_label(c->origin, &label);
+}
+
+// The label must say dirty before the first dirty line is recorded.
+static int ssd_label_dirty(SsdCache* c) {
+    if (c->dirty > 0) return 0;
+    return ssd_save_label(c, 1);
+}
+
+// Copies a dirty slot back to the origin and marks it clean.
+static int ssd_writeback(SsdCache* c, int slot) {
+    SsdCacheEntry* e = &ssd_map[slot];
+    if (!(e->flags & SSDCACHE_DIRTY)) return 0;
+    if (block_dev_read(c->cache, ssd_slot_lba(c, slot), SSDCACHE_LINE_SECTORS, ssd_writeback_buf) != 0) return -1;
+    uint64_t lba = (uint64_t)e->line * SSDCACHE_LINE_SECTORS;
+    if (block_dev_write_fua(c->origin, lba, SSDCACHE_LINE_SECTORS, ssd_writeback_buf) != 0) return -1;
+    e->flags &= ~SSDCACHE_DIRTY;
+    c->dirty--;
+    c->stats.writebacks++;
+    return ssd_save_entry(c, slot);
+}
+
+// Frees a slot in `line`'s set: an empty one if there is one, else the
+// least recently used, written back first if dirty. The emptied entry
+// is saved before the slot is reused, so a crash can never leave the
+// map naming the old line over the new line's data.
+static int ssd_victim(SsdCache* c, uint32_t line) {
+    int base = (int)(line % c->sets) * SSDCACHE_WAYS;
+    int slot = base;
+    for (int w = 0; w < SSDCACHE_WAYS; w++) {
+        if (ssd_map[base + w].line == SSDCACHE_EMPTY) return base + w;
+        if (ssd_stamp[base + w] < ssd_stamp[slot]) slot = base + w;
+    }
+    if (ssd_writeback(c, slot) != 0) return -1;
+    ssd_map[slot].line = SSDCACHE_EMPTY;
+    ssd_map[slot].flags = 0;
+    c->stats.evictions++;
+    if (ssd_save_entry(c, slot) != 0) return -1;
+    return slot;
+}
+
+// Puts a whole line on the cache disk.
+static int ssd_install(SsdCache* c, uint32_t line, const void* data, int dirty) {
+    if (dirty && ssd_label_dirty(c) != 0) return -1;
+    int slot = ssd_victim(c, line);
+    if (slot < 0) return -1;
+    if (block_dev_write_fua(c->cache, ssd_slot_lba(c, slot), SSDCACHE_LINE_SECTORS, data) != 0) return -1;
+    ssd_map[slot].line = line;
+    ssd_map[slot].flags = dirty ? SSDCACHE_DIRTY : 0;
+    if (dirty) c->dirty++;
+    ssd_touch(c, slot);
+    c->stats.promotions++;
+    return ssd_save_entry(c, slot);
+}
+
+// Counts a miss on `line`; returns 1 once it has missed often enough to
+// be worth promoting.
+static int ssd_note_miss(uint32_t line) {
+    uint32_t h = (line * 2654435761u) & (SSDCACHE_HISTORY - 1);
+    if (ssd_history_line[h] != line) {
+        ssd_history_line[h] = line;
+        ssd_history_count[h] = 0;
+    }
+    if (++ssd_history_count[h] < SSDCACHE_PROMOTE_MISSES) return 0;
+    ssd_history_line[h] = SSDCACHE_EMPTY;
+    return 1;
+}
+
+// Reads a run of missed sectors from the origin in one command, then
+// promotes the lines in it that keep missing. Partial lines are read
+// whole for that.
+static int ssd_read_misses(SsdCache* c, uint64_t lba, uint32_t count, uint8_t* buf, int stream) {
+    if (block_dev_read(c->origin, lba, count, buf) != 0) return -1;
+    if (stream) return 0;
+    while (count > 0) {
+        uint32_t line = (uint32_t)(lba / SSDCACHE_LINE_SECTORS);
+        uint32_t offset = (uint32_t)(lba % SSDCACHE_LINE_SECTORS);
+        uint32_t n = SSDCACHE_LINE_SECTORS - offset;
+        if (n > count) n = count;
+        if (ssd_note_miss(line)) {
+            const void* data = buf;
+            if (n != SSDCACHE_LINE_SECTORS) {
+                uint64_t start = (uint64_t)line * SSDCACHE_LINE_SECTORS;
+                if (block_dev_read(c->origin, start, SSDCACHE_LINE_SECTORS, ssd_line_buf) != 0) return -1;
+                data = ssd_line_buf;
+            }
+            // A failed promotion only costs the cache, not the read.
+            ssd_install(c, line, data, 0);
+        }
+        buf += n * BLOCK_SECTOR_SIZE;
+        lba += n;
+        count -= n;
+    }
+    return 0;
+}
+
+// Hits are read from the cache disk line by line; consecutive misses are
+// gathered and read from the origin together.
+static int ssdcache_read(BlockDevice* dev, uint64_t lba, uint32_t count, void* buf) {
+    SsdCache* c = (SsdCache*)dev->driver_data;
+    uint8_t* p = (uint8_t*)buf;
+    int stream = count >= SSDCACHE_STREAM_SECTORS;
+    if (stream) c->stats.bypassed++;
+    uint64_t miss_lba = 0;
+    uint32_t miss_count = 0;
+    uint8_t* miss_buf = 0;
+
+    while (count > 0) {
+        uint32_t line = (uint32_t)(lba / SSDCACHE_LINE_SECTORS);
+        uint32_t offset = (uint32_t)(lba % SSDCACHE_LINE_SECTORS);
+        uint32_t n = SSDCACHE_LINE_SECTORS - offset;
+        if (n > count) n = count;
+        int slot = ssd_lookup(c, line);
+        if (slot >= 0) {
+            if (miss_count > 0 && ssd_read_misses(c, miss_lba, miss_count, miss_buf, stream) != 0) return -1;
+            miss_count = 0;
+            if (block_dev_read(c->cache, ssd_slot_lba(c, slot) + offset, n, p) != 0) return -1;
+            ssd_touch(c, slot);
+            c->stats.read_hits++;
+        } else {
+            if (miss_count == 0) {
+                miss_lba = lba;
+                miss_buf = p;
+            }
+            miss_count += n;
+            c->stats.read_misses++;
+        }
+        p += n * BLOCK_SECTOR_SIZE;
+        lba += n;
+        count -= n;
+    }
+    if (miss_count > 0) return ssd_read_misses(c, miss_lba, miss_count, miss_buf, stream);
+    return 0;
+}
+
+static int ssd_write_origin(SsdCache* c, uint64_t lba, uint32_t count, const void* buf, int fua) {
+    if (fua) return block_dev_write_fua(c->origin, lba, count, buf);
+    return block_dev_write(c->origin, lba, count, buf);
+}
+
+// Write-through: the origin gets everything and cached lines are
+// updated in place. Write-back: cached lines are only written on the
+// cache disk and marked dirty, and whole uncached lines are promoted
+// dirty; partial misses still go to the origin, as caching them would
+// need a read first.
+static int ssdcache_transfer_write(SsdCache* c, uint64_t lba, uint32_t count, const uint8_t* p, int fua) {
+    int write_back = c->mode == SSDCACHE_WRITE_BACK;
+    int stream = count >= SSDCACHE_STREAM_SECTORS;
+    if (!write_back && ssd_write_origin(c, lba, count, p, fua) != 0) return -1;
+
+    uint64_t miss_lba = 0;
+    uint32_t miss_count = 0;
+    const uint8_t* miss_buf = 0;
+    while (count > 0) {
+        uint32_t line = (uint32_t)(lba / SSDCACHE_LINE_SECTORS);
+        uint32_t offset = (uint32_t)(lba % SSDCACHE_LINE_SECTORS);
+        uint32_t n = SSDCACHE_LINE_SECTORS - offset;
+        if (n > count) n = count;
+        int slot = ssd_lookup(c, line);
+        int handled = 1;
+        if (slot >= 0) {
+            c->stats.write_hits++;
+            // Persist the dirty flag before the data: a crash in between
+            // must not leave new data in a slot the map calls clean.
+            if (write_back && !(ssd_map[slot].flags & SSDCACHE_DIRTY)) {
+                if (ssd_label_dirty(c) != 0) return -1;
+                ssd_map[slot].flags |= SSDCACHE_DIRTY;
+                c->dirty++;
+                if (ssd_save_entry(c, slot) != 0) return -1;
+            }
+            uint64_t at = ssd_slot_lba(c, slot) + offset;
+            int ret = fua ? block_dev_write_fua(c->cache, at, n, p) : block_dev_write(c->cache, at, n, p);
+            if (ret != 0) return -1;
+            ssd_touch(c, slot);
+        } else {
+            c->stats.write_misses++;
+            handled = !write_back;
+            if (write_back && n == SSDCACHE_LINE_SECTORS && !stream && ssd_install(c, line, p, 1) == 0) handled = 1;
+        }
+        if (handled) {
+            if (miss_count > 0 && ssd_write_origin(c, miss_lba, miss_count, miss_buf, fua) != 0) return -1;
+            miss_count = 0;
+        } else {
+            if (miss_count == 0) {
+                miss_lba = lba;
+                miss_buf = p;
+            }
+            miss_count += n;
+        }
+        p += n * BLOCK_SECTOR_SIZE;
+        lba += n;
+        count -= n;
+    }
+    if (miss_count > 0) return ssd_write_origin(c, miss_lba, miss_count, miss_buf, fua);
+    return 0;
+}
+
+static int ssdcache_write(BlockDevice* dev, uint64_t lba, uint32_t count, const void* buf) {
+    return ssdcache_transfer_write((SsdCache*)dev->driver_data, lba, count, (const uint8_t*)buf, 0);
+}
+
+static int ssdcache_write_fua(BlockDevice* dev, uint64_t lba, uint32_t count, const void* buf) {
+    return ssdcache_transfer_write((SsdCache*)dev->driver_data, lba, count, (const uint8_t*)buf, 1);
+}
+
+static int ssdcache_flush(BlockDevice* dev) {
+    SsdCache* c = (SsdCache*)dev->driver_data;
+    int ret = block_dev_flush(c->cache);
+    if (block_dev_flush(c->origin) != 0) ret = -1;
+    return ret;
+}
+
+static const BlockDeviceOps ssdcache_ops = {
+    ssdcache_read,
+    ssdcache_write,
+    ssdcache_write_fua,
+    ssdcache_flush,
+    0,
+    0,
+};
+
+// Largest line count whose map and lines fit on the cache disk.
+static void ssd_size(SsdCache* c) {
+    uint64_t lines = udiv64(c->cache->caps.sector_count, SSDCACHE_LINE_SECTORS, 0);
+    if (lines > SSDCACHE_MAX_LINES) lines = SSDCACHE_MAX_LINES;
+    c->lines = (uint32_t)lines & ~(SSDCACHE_WAYS - 1);
+    while (c->lines > 0) {
+        c->map_sectors = (c->lines + SSDCACHE_ENTRIES_PER_SECTOR - 1) / SSDCACHE_ENTRIES_PER_SECTOR;
+        // Lines start on a line boundary after the header and the map.
+        c->data_lba = (1 + c->map_sectors + SSDCACHE_LINE_SECTORS - 1) & ~(uint64_t)(SSDCACHE_LINE_SECTORS - 1);
+        if (c->data_lba + (uint64_t)c->lines * SSDCACHE_LINE_SECTORS <= c->cache->caps.sector_count) break;
+        c->lines -= SSDCACHE_WAYS;
+    }
+    c->sets = c->lines / SSDCACHE_WAYS;
+}
+
+// Reuses the map on the cache disk if it was written for this origin
+// with this geometry and the origin's label still matches it. Returns 1
+// if it was, 0 if the cache starts empty, or -1 if the map has dirty
+// lines for an origin that was used without it.
+static int ssd_load(SsdCache* c) {
+    SsdCacheLabel label;
+    int labelled = ssd_read_label(c->origin, &label) == 0;
+    // New generations mix in the clock, so two cache disks formatted for
+    // the same origin don't end up with the same one.
+    c->generation = (labelled ? label.generation : 0) + (timer_us() | 1);
+
+    if (block_dev_read(c->cache, 0, 1, ssd_header_buf) != 0) return 0;
+    SsdCacheHeader* h = (SsdCacheHeader*)ssd_header_buf;
+    if (h->magic != SSDCACHE_MAGIC || h->version != SSDCACHE_VERSION ||
+        h->line_sectors != SSDCACHE_LINE_SECTORS || h->lines != c->lines ||
+        h->map_sectors != c->map_sectors || h->origin_sectors != c->origin->caps.sector_count) {
+        return 0;
+    }
+    SsdCacheMode mode = (SsdCacheMode)h->mode;
+    uint32_t generation = h->generation;
+    if (block_dev_read(c->cache, 1, c->map_sectors, ssd_map) != 0) return 0;
+    uint32_t dirty = 0;
+    for (uint32_t i = 0; i < c->lines; i++) {
+        if (ssd_map[i].line != SSDCACHE_EMPTY && (ssd_map[i].flags & SSDCACHE_DIRTY)) dirty++;
+    }
+    if (!labelled || !label.attached || label.generation != generation) {
+        // The origin changed without us: clean lines may be stale, and
+        // dirty ones would overwrite whatever was written since.
+        if (dirty == 0) return 0;
+        print_string("SSD cache: ");
+        print_string(c->origin->name);
+        print_string(" was changed without cache0, which still holds ");
+        print_int(dirty);
+        print_string(" unwritten lines. Not reusing them.\n");
+        return -1;
+    }
+    c->mode = mode;
+    c->generation = generation;
+    c->dirty = dirty;
+    return 1;
+}
+
+// Writes an empty map, then the header that makes it valid.
+static int ssd_format(SsdCache* c) {
+    for (uint32_t i = 0; i < c->map_sectors * SSDCACHE_ENTRIES_PER_SECTOR; i++) {
+        ssd_map[i].line = SSDCACHE_EMPTY;
+        ssd_map[i].flags = 0;
+        ssd_map[i].reserved = 0;
+    }
+    if (block_dev_write_fua(c->cache, 1, c->map_sectors, ssd_map) != 0) return -1;
+    if (ssd_save_label(c, 0) != 0) return -1;
+    return ssd_save_header(c);
+}
+
+SsdCache* ssdcache_create(BlockDevice* cache, BlockDevice* origin, SsdCacheMode mode) {
+    if (!cache || !origin || cache == origin) {
+        print_string("SSD cache: Needs two different disks.\n");
+        return 0;
+    }
+    if (ssdcache_present) {
+        print_string("SSD cache: cache0 already exists.\n");
+        return 0;
+    }
+    SsdCache* c = &ssdcache;
+    memset(c, 0, sizeof(SsdCache));
+    c->cache = cache;
+    c->origin = origin;
+    c->mode = mode;
+    ssd_size(c);
+    if (c->lines == 0) {
+        print_string("SSD cache: Cache disk is too small.\n");
+        return 0;
+    }
+    // Lines are numbered in 32 bits.
+    if (udiv64(origin->caps.sector_count, SSDCACHE_LINE_SECTORS, 0) >= SSDCACHE_EMPTY) {
+        print_string("SSD cache: Origin disk is too large.\n");
+        return 0;
+    }
+    for (int i = 0; i < SSDCACHE_HISTORY; i++) ssd_history_line[i] = SSDCACHE_EMPTY;
+    memset(ssd_stamp, 0, sizeof(ssd_stamp));
+
+    // From now on both disks are reached through cache0 only.
+    bcache_invalidate(cache);
+    bcache_invalidate(origin);
+
+    int warm = ssd_load(c);
+    if (warm < 0) return 0;
+    if (!warm && ssd_format(c) != 0) {
+        print_string("SSD cache: Failed to write the map.\n");
+        return 0;
+    }
+
+    BlockCaps* caps = &c->block.caps;
+    // Whole lines only, so a line never runs past the origin's end or
+    // over its label.
+    caps->sector_count = (origin->caps.sector_count - 1) & ~(uint64_t)(SSDCACHE_LINE_SECTORS - 1);
+    caps->max_sectors = origin->caps.max_sectors;
+    caps->max_segments = 1;
+    caps->queue_depth = 1;
+    caps->flags = origin->caps.flags & (BLOCK_CAP_LBA48 | BLOCK_CAP_DMA);
+    // write_fua is always there; it falls back to flushes on each disk.
+    caps->flags |= BLOCK_CAP_FUA | BLOCK_CAP_WRITE_CACHE;
+    strcpy(c->block.name, "cache0");
+    c->block.type = BLOCK_TYPE_CACHE;
+    c->block.ops = &ssdcache_ops;
+    c->block.driver_data = c;
+    if (block_register(&c->block) < 0) {
+        print_string("SSD cache: Block registry is full.\n");
+        return 0;
+    }
+    ssdcache_present = 1;
+    if (c->mode != mode) ssdcache_set_mode(mode);
+
+    print_string("SSD cache: cache0 keeps ");
+    print_string(origin->name);
+    print_string(" on ");
+    print_string(cache->name);
+    print_string(", ");
+    print_int(c->lines / 128);
+    print_string(" MB, ");
+    print_string(c->mode == SSDCACHE_WRITE_BACK ? "write-back" : "write-through");
+    print_string(warm ? ", warm.\n" : ", empty.\n");
+    return c;
+}
+
+int ssdcache_clean() {
+    if (!ssdcache_present) return -1;
+    SsdCache* c = &ssdcache;
+    int ret = 0;
+    for (uint32_t slot = 0; slot < c->lines && c->dirty > 0; slot++) {
+        if (ssd_map[slot].line != SSDCACHE_EMPTY && ssd_writeback(c, (int)slot) != 0) ret = -1;
+    }
+    if (ret == 0 && ssd_save_label(c, 0) != 0) ret = -1;
+    return ret;
+}
+
+int ssdcache_check_raw(BlockDevice* dev) {
+    if (!dev || dev->type == BLOCK_TYPE_CACHE) return 0;
+    if (ssdcache_present && (dev == ssdcache.origin || dev == ssdcache.cache)) {
+        print_string("SSD cache: ");
+        print_string(dev->name);
+        print_string(" belongs to cache0; use cache0 instead.\n");
+        return -1;
+    }
+    SsdCacheLabel label;
+    if (ssd_read_label(dev, &label) != 0 || !label.attached) return 0;
+    if (label.dirty) {
+        print_string("SSD cache: ");
+        print_string(dev->name);
+        print_string(" is missing writes still on its cache disk. Assemble cache0 and run 'blk cache clean' first.\n");
+        return -1;
+    }
+    // Writes from here on bypass the cache, so its map is stale.
+    label.attached = 0;
+    if (ssd_write_label(dev, &label) != 0) {
+        print_string("SSD cache: Failed to update the label on ");
+        print_string(dev->name);
+        print_string(".\n");
+        return -1;
+    }
+    return 0;
+}
+
+int ssdcache_set_mode(SsdCacheMode mode) {
+    if (!ssdcache_present) return -1;
+    SsdCache* c = &ssdcache;
+    if (c->mode == SSDCACHE_WRITE_BACK && mode != SSDCACHE_WRITE_BACK && ssdcache_clean() != 0) {
+        print_string("SSD cache: Write-back failed, staying in write-back mode.\n");
+        return -1;
+    }
+    c->mode = mode;
+    return ssd_save_header(c);
+}
+
+static void ssd_print_rate(uint32_t hits, uint32_t misses) {
+    uint32_t total = hits + misses;
+    print_int(hits);
+    print_string(" hits, ");
+    print_int(misses);
+    print_string(" misses (");
+    print_int(total ? (uint32_t)udiv64((uint64_t)hits * 100, total, 0) : 0);
+    print_string("% hit rate)\n");
+}
+
+void ssdcache_print_stats() {
+    if (!ssdcache_present) {
+        print_string("(No SSD cache)\n");
+        return;
+    }
+    SsdCache* c = &ssdcache;
+    uint32_t used = 0;
+    for (uint32_t i = 0; i < c->lines; i++) {
+        if (ssd_map[i].line != SSDCACHE_EMPTY) used++;
+    }
+    print_string(c->block.name);
+    print_string(": ");
+    print_string(c->origin->name);
+    print_string(" on ");
+    print_string(c->cache->name);
+    print_string(c->mode == SSDCACHE_WRITE_BACK ? ", write-back, " : ", write-through, ");
+    print_int(used);
+    print_string("/");
+    print_int(c->lines);
+    print_string(" lines used, ");
+    print_int(c->dirty);
+    print_string(" dirty\n  reads:  ");
+    ssd_print_rate(c->stats.read_hits, c->stats.read_misses);
+    print_string("  writes: ");
+    ssd_print_rate(c->stats.write_hits, c->stats.write_misses);
+    print_string("  ");
+    print_int(c->stats.promotions);
+    print_string(" promoted, ");
+    print_int(c->stats.evictions);
+    print_string(" evicted, ");
+    print_int(c->stats.writebacks);
+    print_string(" written back, ");
+    print_int(c->stats.bypassed);
+    print_string(" streams bypassed\n");
+}
@@ -0,0 +1,120 @@
+#ifndef SSDCACHE_H
+#define SSDCACHE_H
+
+#include <stdint.h>
+#include "block.h"
+
+// Keeps the hot lines of a slow origin disk (a PATA spindle, say) on a
+// fast cache disk. The cache disk holds a header at LBA 0, the line map
+// after it and then the lines themselves. The map is updated on the cache
+// disk as lines come and go, so the cache is still warm after a reboot.
+//
+// The origin's last sector holds a label with the generation of the
+// cache it belongs to; cache0 ends before it. A map is only reused while
+// the label still names it. Using the origin without cache0 (mounting it
+// directly, say) clears the label, so the map is dropped the next time
+// cache0 is assembled. While the cache holds dirty lines the label says
+// so, and the origin can't be used without cache0 at all.
+#define SSDCACHE_LINE_SECTORS 16     // 8 KB lines
+#define SSDCACHE_WAYS         8      // Lines per set; LRU within a set
+#define SSDCACHE_MAX_LINES    32768  // 256 MB of cache, 256 KB of map in memory
+
+// A line is promoted on its second miss while it's still in the recent
+// miss history, so data read once doesn't push out hot data. Requests
+// this large are streams and never promoted.
+#define SSDCACHE_PROMOTE_MISSES 2
+#define SSDCACHE_HISTORY        1024 // Power of two
+#define SSDCACHE_STREAM_SECTORS 256
+
+#define SSDCACHE_MAGIC   0x43445353 // "SSDC"
+#define SSDCACHE_VERSION 2
+#define SSDCACHE_LABEL_MAGIC 0x4F445353 // "SSDO"
+
+typedef enum {
+    SSDCACHE_WRITE_THROUGH, // Writes complete once they're on the origin
+    SSDCACHE_WRITE_BACK     // Whole-line writes stay on the cache disk
+} SsdCacheMode;
+
+#define SSDCACHE_EMPTY 0xFFFFFFFF
+#define SSDCACHE_DIRTY 0x0001 // Newer than the origin's copy
+
+// One map entry, as stored on the cache disk.
+typedef struct {
+    uint32_t line;     // Origin line held in this slot, or SSDCACHE_EMPTY
+    uint16_t flags;    // SSDCACHE_DIRTY
+    uint16_t reserved;
+} __attribute__((packed)) SsdCacheEntry;
+
+#define SSDCACHE_ENTRIES_PER_SECTOR (BLOCK_SECTOR_SIZE / sizeof(SsdCacheEntry))
+
+// Cache disk LBA 0. The map is only trusted if the geometry and the
+// origin's size still match and the origin's label has the same
+// generation.
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t line_sectors;
+    uint32_t lines;
+    uint64_t origin_sectors;
+    uint32_t mode;
+    uint32_t map_sectors;
+    uint32_t generation;
+} __attribute__((packed)) SsdCacheHeader;
+
+// The origin's last sector.
+typedef struct {
+    uint32_t magic;      // SSDCACHE_LABEL_MAGIC
+    uint32_t generation; // The cache header's, while attached
+    uint32_t attached;   // Cleared once the origin is used without cache0
+    uint32_t dirty;      // Set before the cache's first dirty line
+} __attribute__((packed)) SsdCacheLabel;
+
+typedef struct {
+    uint32_t read_hits;    // Lines read from the cache disk
+    uint32_t read_misses;  // Lines read from the origin
+    uint32_t write_hits;
+    uint32_t write_misses;
+    uint32_t promotions;   // Lines copied onto the cache disk
+    uint32_t evictions;
+    uint32_t writebacks;   // Dirty lines copied back to the origin
+    uint32_t bypassed;     // Stream requests that skipped promotion
+} SsdCacheStats;
+
+typedef struct {
+    BlockDevice* cache;
+    BlockDevice* origin;
+    SsdCacheMode mode;
+    uint32_t lines;
+    uint32_t sets;
+    uint32_t map_sectors;
+    uint32_t generation;
+    uint64_t data_lba;      // Where slot 0 starts on the cache disk
+    uint32_t dirty;         // Dirty slots
+    uint32_t clock;         // LRU stamp source
+    SsdCacheStats stats;
+    BlockDevice block;
+} SsdCache;
+
+// Registers "cache0": `origin` cached on `cache`. An existing map on
+// `cache` is reused if the origin's label still matches it, otherwise the
+// cache starts empty; a map with dirty lines for an origin that has
+// changed since is refused. Everything on `cache` is overwritten.
+// Returns the device, or NULL (with a message) if it can't be built.
+SsdCache* ssdcache_create(BlockDevice* cache, BlockDevice* origin, SsdCacheMode mode);
+
+// Call before using `dev` without cache0. Returns -1 (with a message) if
+// it belongs to cache0 or its cache still holds dirty lines; otherwise
+// clears its label, if any, and returns 0.
+int ssdcache_check_raw(BlockDevice* dev);
+
+// Switches modes; leaving write-back copies every dirty line back first.
+int ssdcache_set_mode(SsdCacheMode mode);
+
+// Copies every dirty line back to the origin and marks its label clean.
+// Returns -1 on an I/O error.
+int ssdcache_clean();
+
+// Prints hit rates, promotions, evictions and write-backs.
+void ssdcache_print_stats();
+
+#endif // SSDCACHE_H
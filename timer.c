@@ -0,0 +1,79 @@
+#include "timer.h"
+#include "ports.h"
+#include "shell.h"
+#include "idt.h"
+
+// PIT runs at a fixed 1.193182 MHz on every PC.
+#define PIT_FREQUENCY      1193182
+#define PIT_PORT_CHANNEL0  0x40
+#define PIT_PORT_CHANNEL2  0x42
+#define PIT_PORT_COMMAND   0x43
+#define PIT_PORT_GATE      0x61
+
+#define CALIBRATE_MS 10
+
+static uint32_t tsc_per_us = 1; // Never zero, so early callers can't divide by zero.
+static uint64_t tsc_at_init = 0;
+static volatile uint32_t timer_ticks = 0;
+
+static void timer_irq_handler(int irq) {
+    timer_ticks++;
+}
+
+uint32_t timer_ms() {
+    return timer_ticks * (1000 / TIMER_HZ);
+}
+
+uint64_t timer_read_tsc() {
+    uint32_t lo, hi;
+    __asm__ volatile("rdtsc" : "=a"(lo), "=d"(hi));
+    return ((uint64_t)hi << 32) | lo;
+}
+
+uint32_t timer_tsc_to_us(uint64_t cycles) {
+    return (uint32_t)udiv64(cycles, tsc_per_us, 0);
+}
+
+uint32_t timer_us() {
+    return timer_tsc_to_us(timer_read_tsc() - tsc_at_init);
+}
+
+// Counts TSC cycles across a 10ms one-shot on PIT channel 2. Channel 2 is
+// gated through port 0x61 and its output can be polled there, so this works
+// before any interrupt handling is set up.
+void timer_init() {
+    uint16_t count = (PIT_FREQUENCY * CALIBRATE_MS) / 1000;
+
+    // Gate high, speaker off.
+    uint8_t gate = inb(PIT_PORT_GATE);
+    outb(PIT_PORT_GATE, (gate & ~0x02) | 0x01);
+
+    // Channel 2, lobyte/hibyte, mode 0 (interrupt on terminal count).
+    outb(PIT_PORT_COMMAND, 0xB0);
+    outb(PIT_PORT_CHANNEL2, count & 0xFF);
+    outb(PIT_PORT_CHANNEL2, count >> 8);
+
+    // Restart the count by toggling the gate.
+    gate = inb(PIT_PORT_GATE) & ~0x01;
+    outb(PIT_PORT_GATE, gate);
+    outb(PIT_PORT_GATE, gate | 0x01);
+
+    uint64_t start = timer_read_tsc();
+    while ((inb(PIT_PORT_GATE) & 0x20) == 0);
+    uint64_t end = timer_read_tsc();
+
+    tsc_per_us = (uint32_t)udiv64(end - start, CALIBRATE_MS * 1000, 0);
+    if (tsc_per_us == 0) tsc_per_us = 1;
+    tsc_at_init = end;
+
+    // Channel 0, lobyte/hibyte, mode 2 (rate generator).
+    uint16_t divisor = PIT_FREQUENCY / TIMER_HZ;
+    outb(PIT_PORT_COMMAND, 0x34);
+    outb(PIT_PORT_CHANNEL0, divisor & 0xFF);
+    outb(PIT_PORT_CHANNEL0, divisor >> 8);
+    irq_install_handler(IRQ_TIMER, timer_irq_handler);
+
+    print_string("Timer: TSC runs at ");
+    print_int(tsc_per_us);
+    print_string(" MHz.\n");
+}
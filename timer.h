@@ -0,0 +1,25 @@
+#ifndef TIMER_H
+#define TIMER_H
+
+#include <stdint.h>
+
+// PIT channel 0 tick rate. The tick wakes `hlt` waits and bounds timeouts.
+#define TIMER_HZ 1000
+
+// Calibrates the CPU timestamp counter against the PIT and starts the
+// periodic tick on IRQ0. Must be called after idt_init().
+void timer_init();
+
+// Milliseconds since timer_init(), counted by the IRQ0 tick.
+uint32_t timer_ms();
+
+// Raw timestamp counter value.
+uint64_t timer_read_tsc();
+
+// Converts a TSC delta into microseconds.
+uint32_t timer_tsc_to_us(uint64_t cycles);
+
+// Microseconds since timer_init(). Wraps after ~71 minutes.
+uint32_t timer_us();
+
+#endif // TIMER_H
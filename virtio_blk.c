@@ -0,0 +1,469 @@
+#include "virtio_blk.h"
+#include "pci.h"
+#include "ports.h"
+#include "idt.h"
+#include "timer.h"
+#include "shell.h"
+#include "extrainclude.h"
+
+// Legacy split ring layout for `n` entries: descriptors, then the
+// available ring, then (on the next page) the used ring.
+#define VRING_ALIGN(x)       (((x) + 4095) & ~4095)
+#define VRING_USED_OFFSET(n) VRING_ALIGN(16 * (n) + 6 + 2 * (n))
+#define VRING_BYTES(n)       (VRING_USED_OFFSET(n) + VRING_ALIGN(6 + 8 * (n)))
+
+#define VIRTIO_STATUS_PENDING 0xFF // Request status until the device writes it
+#define VIRTIO_SYNC_PENDING   1    // virtio_blk_run's status until the callback
+
+// Header, up to VIRTIO_BLK_MAX_SEGMENTS data descriptors, status byte.
+#define VIRTIO_INDIRECT_ENTRIES (VIRTIO_BLK_MAX_SEGMENTS + 2)
+
+typedef struct {
+    VirtioBlkHeader header;
+    volatile uint8_t status;
+    block_callback_t callback;
+    void* ctx;
+} VirtioBlkSlot;
+
+typedef struct {
+    uint16_t io_base;
+    int irq_line;                  // -1 when polling
+    uint32_t features;             // Negotiated feature bits
+    uint16_t queue_size;
+    uint32_t slot_mask;            // Request slots usable on this queue
+    uint32_t size_max;             // Largest data descriptor, 0 = no limit
+    VringDesc* desc;
+    volatile uint16_t* avail;      // flags, idx, ring[queue_size], used_event
+    volatile uint16_t* used;       // flags, idx, then the used elements
+    volatile VringUsedElem* used_ring;
+    volatile uint16_t* avail_event;
+    uint16_t avail_idx;            // Next avail->idx to publish
+    uint16_t kicked_idx;           // avail->idx at the last notification
+    uint16_t last_used;            // Used entries reaped so far
+    volatile uint32_t busy;        // Slots the device owns
+    VringDesc* indirect;           // VIRTIO_BLK_SLOTS tables
+    VirtioBlkSlot slots[VIRTIO_BLK_SLOTS];
+    BlockDevice block;
+} VirtioBlkDevice;
+
+__attribute__((aligned(4096))) static uint8_t virtio_rings[VIRTIO_BLK_MAX_DEVICES][VRING_BYTES(VIRTIO_QUEUE_MAX)];
+__attribute__((aligned(16))) static VringDesc virtio_indirect[VIRTIO_BLK_MAX_DEVICES][VIRTIO_BLK_SLOTS * VIRTIO_INDIRECT_ENTRIES];
+static VirtioBlkDevice virtio_devices[VIRTIO_BLK_MAX_DEVICES];
+static int virtio_device_count = 0;
+static uint16_t virtio_irq_lines = 0;     // PIC lines our handler owns
+static volatile uint32_t virtio_interrupts = 0;
+static uint32_t virtio_kicks = 0;
+
+// Orders the avail index store before the loads that decide whether to
+// notify (x86 only reorders stores after later loads).
+static inline void virtio_mb() {
+    __asm__ volatile("lock; addl $0, 0(%%esp)" ::: "memory");
+}
+
+static inline void virtio_barrier() {
+    __asm__ volatile("" ::: "memory");
+}
+
+// Finishes every used element. Called in interrupt context or with
+// interrupts off.
+static int virtio_blk_reap(VirtioBlkDevice* vd) {
+    int done = 0;
+    while (vd->last_used != vd->used[1]) {
+        virtio_barrier();
+        uint32_t slot = vd->used_ring[vd->last_used & (vd->queue_size - 1)].id;
+        vd->last_used++;
+        if (slot >= VIRTIO_BLK_SLOTS || !(vd->busy & (1u << slot))) continue;
+
+        VirtioBlkSlot* s = &vd->slots[slot];
+        int status = s->status == VIRTIO_BLK_S_OK ? 0 : -1;
+        block_callback_t callback = s->callback;
+        void* ctx = s->ctx;
+        // Free the slot first so the callback can submit again.
+        vd->busy &= ~(1u << slot);
+        if (callback) callback(ctx, status);
+        done++;
+    }
+    // With EVENT_IDX the device interrupts once it passes used_event:
+    // ask for the very next completion.
+    if (vd->features & VIRTIO_RING_F_EVENT_IDX) vd->avail[2 + vd->queue_size] = vd->last_used;
+    return done;
+}
+
+static void virtio_blk_irq_handler(int irq) {
+    for (int i = 0; i < virtio_device_count; i++) {
+        VirtioBlkDevice* vd = &virtio_devices[i];
+        if (vd->irq_line != irq) continue;
+        // Reading the ISR acknowledges the (level-triggered) interrupt.
+        if (inb(vd->io_base + VIRTIO_REG_ISR) & 0x01) {
+            virtio_interrupts++;
+            virtio_blk_reap(vd);
+        }
+    }
+}
+
+// Notifies the device of everything published since the last kick,
+// unless it has said it doesn't need to hear about it.
+static void virtio_blk_kick(VirtioBlkDevice* vd) {
+    uint16_t new_idx = vd->avail_idx;
+    uint16_t old_idx = vd->kicked_idx;
+    if (new_idx == old_idx) return;
+    vd->kicked_idx = new_idx;
+    virtio_mb();
+
+    int notify;
+    if (vd->features & VIRTIO_RING_F_EVENT_IDX) {
+        uint16_t event = *vd->avail_event;
+        notify = (uint16_t)(new_idx - event - 1) < (uint16_t)(new_idx - old_idx);
+    } else {
+        notify = !(vd->used[0] & VRING_USED_F_NO_NOTIFY);
+    }
+    if (notify) {
+        outw(vd->io_base + VIRTIO_REG_QUEUE_NOTIFY, 0);
+        virtio_kicks++;
+    }
+}
+
+// Builds one request in a free slot and publishes it on the available
+// ring without notifying the device. Returns 0, 1 if every slot is busy,
+// or -1 if the request doesn't fit the indirect table.
+static int virtio_blk_queue(VirtioBlkDevice* vd, uint32_t type, uint64_t lba, const BlockSegment* segs,
+                            int nsegs, block_callback_t callback, void* ctx) {
+    uint32_t flags = irq_save();
+    uint32_t free = vd->slot_mask & ~vd->busy;
+    if (!free) {
+        irq_restore(flags);
+        return 1;
+    }
+    int slot = __builtin_ctz(free);
+    VirtioBlkSlot* s = &vd->slots[slot];
+    VringDesc* table = vd->indirect + slot * VIRTIO_INDIRECT_ENTRIES;
+    uint16_t data_flags = VRING_DESC_F_NEXT | (type == VIRTIO_BLK_T_IN ? VRING_DESC_F_WRITE : 0);
+
+    s->header.type = type;
+    s->header.reserved = 0;
+    s->header.sector = lba;
+    s->status = VIRTIO_STATUS_PENDING;
+    s->callback = callback;
+    s->ctx = ctx;
+
+    int n = 0;
+    table[n].addr = (uint32_t)&s->header;
+    table[n].len = sizeof(VirtioBlkHeader);
+    table[n].flags = VRING_DESC_F_NEXT;
+    table[n].next = n + 1;
+    n++;
+    for (int i = 0; i < nsegs; i++) {
+        uint8_t* addr = (uint8_t*)segs[i].addr;
+        uint32_t left = segs[i].len;
+        while (left > 0) {
+            uint32_t len = vd->size_max && left > vd->size_max ? vd->size_max : left;
+            if (n == VIRTIO_INDIRECT_ENTRIES - 1) {
+                irq_restore(flags);
+                return -1;
+            }
+            table[n].addr = (uint32_t)addr;
+            table[n].len = len;
+            table[n].flags = data_flags;
+            table[n].next = n + 1;
+            n++;
+            addr += len;
+            left -= len;
+        }
+    }
+    table[n].addr = (uint32_t)&s->status;
+    table[n].len = 1;
+    table[n].flags = VRING_DESC_F_WRITE;
+    table[n].next = 0;
+    n++;
+
+    // Ring descriptor `slot` always carries slot `slot`'s table.
+    vd->desc[slot].addr = (uint32_t)table;
+    vd->desc[slot].len = n * sizeof(VringDesc);
+    vd->desc[slot].flags = VRING_DESC_F_INDIRECT;
+    vd->desc[slot].next = 0;
+    vd->busy |= 1u << slot;
+
+    vd->avail[2 + (vd->avail_idx & (vd->queue_size - 1))] = slot;
+    virtio_barrier();
+    vd->avail_idx++;
+    vd->avail[1] = vd->avail_idx;
+    irq_restore(flags);
+    return 0;
+}
+
+// Waits for progress. Called with interrupts off; returns with them on.
+// Anything published but not yet announced is kicked first, since the
+// caller may be waiting on it.
+static void virtio_blk_wait(VirtioBlkDevice* vd) {
+    virtio_blk_kick(vd);
+    if (vd->irq_line >= 0) {
+        __asm__ volatile("sti; hlt");
+    } else {
+        virtio_blk_reap(vd);
+        __asm__ volatile("sti");
+    }
+}
+
+static int virtio_blk_start(VirtioBlkDevice* vd, uint8_t* ring, int quiet);
+
+// Resets the device, fails every outstanding request and starts afresh.
+static void virtio_blk_abort_device(VirtioBlkDevice* vd) {
+    uint32_t flags = irq_save();
+    outb(vd->io_base + VIRTIO_REG_STATUS, 0);
+    uint32_t busy = vd->busy;
+    vd->busy = 0;
+    for (int slot = 0; slot < VIRTIO_BLK_SLOTS; slot++) {
+        if ((busy & (1u << slot)) && vd->slots[slot].callback) {
+            vd->slots[slot].callback(vd->slots[slot].ctx, -1);
+        }
+    }
+    virtio_blk_start(vd, (uint8_t*)vd->desc, 1);
+    irq_restore(flags);
+}
+
+static void virtio_blk_sync_done(void* ctx, int status) {
+    *(volatile int*)ctx = status;
+}
+
+// Runs one request to completion.
+static int virtio_blk_run(VirtioBlkDevice* vd, uint32_t type, uint64_t lba, const BlockSegment* segs, int nsegs) {
+    volatile int status = VIRTIO_SYNC_PENDING;
+    uint32_t start = timer_ms();
+    int ret;
+    while ((ret = virtio_blk_queue(vd, type, lba, segs, nsegs, virtio_blk_sync_done, (void*)&status)) == 1) {
+        __asm__ volatile("cli");
+        if (timer_ms() - start > VIRTIO_TIMEOUT_MS) {
+            __asm__ volatile("sti");
+            return -1;
+        }
+        virtio_blk_wait(vd);
+    }
+    if (ret != 0) return -1;
+    virtio_blk_kick(vd);
+
+    for (;;) {
+        __asm__ volatile("cli" ::: "memory");
+        if (status != VIRTIO_SYNC_PENDING) break;
+        if (timer_ms() - start > VIRTIO_TIMEOUT_MS) {
+            __asm__ volatile("sti");
+            print_string("virtio-blk: Request timeout!\n");
+            virtio_blk_abort_device(vd);
+            return -1;
+        }
+        virtio_blk_wait(vd);
+    }
+    __asm__ volatile("sti" ::: "memory");
+    return status;
+}
+
+// --- Block layer glue ---
+
+static int virtio_blk_read(BlockDevice* dev, uint64_t lba, uint32_t count, void* buf) {
+    BlockSegment seg = { buf, count * BLOCK_SECTOR_SIZE };
+    return virtio_blk_run((VirtioBlkDevice*)dev->driver_data, VIRTIO_BLK_T_IN, lba, &seg, 1);
+}
+
+static int virtio_blk_write(BlockDevice* dev, uint64_t lba, uint32_t count, const void* buf) {
+    VirtioBlkDevice* vd = (VirtioBlkDevice*)dev->driver_data;
+    BlockSegment seg = { (void*)buf, count * BLOCK_SECTOR_SIZE };
+    if (vd->features & VIRTIO_BLK_F_RO) return -1;
+    return virtio_blk_run(vd, VIRTIO_BLK_T_OUT, lba, &seg, 1);
+}
+
+static int virtio_blk_flush(BlockDevice* dev) {
+    return virtio_blk_run((VirtioBlkDevice*)dev->driver_data, VIRTIO_BLK_T_FLUSH, 0, 0, 0);
+}
+
+static int virtio_blk_readv(BlockDevice* dev, uint64_t lba, const BlockSegment* segs, int nsegs) {
+    return virtio_blk_run((VirtioBlkDevice*)dev->driver_data, VIRTIO_BLK_T_IN, lba, segs, nsegs);
+}
+
+static int virtio_blk_writev(BlockDevice* dev, uint64_t lba, const BlockSegment* segs, int nsegs) {
+    VirtioBlkDevice* vd = (VirtioBlkDevice*)dev->driver_data;
+    if (vd->features & VIRTIO_BLK_F_RO) return -1;
+    return virtio_blk_run(vd, VIRTIO_BLK_T_OUT, lba, segs, nsegs);
+}
+
+// Requests are only published here; the device hears about a batch of
+// them at once from commit (or from the next wait).
+static int virtio_blk_submit(BlockDevice* dev, uint64_t lba, const BlockSegment* segs, int nsegs, int write,
+                             block_callback_t callback, void* ctx) {
+    VirtioBlkDevice* vd = (VirtioBlkDevice*)dev->driver_data;
+    if (write && (vd->features & VIRTIO_BLK_F_RO)) return -1;
+    return virtio_blk_queue(vd, write ? VIRTIO_BLK_T_OUT : VIRTIO_BLK_T_IN, lba, segs, nsegs, callback, ctx);
+}
+
+static void virtio_blk_wait_event(BlockDevice* dev) {
+    virtio_blk_wait((VirtioBlkDevice*)dev->driver_data);
+}
+
+static void virtio_blk_abort(BlockDevice* dev) {
+    virtio_blk_abort_device((VirtioBlkDevice*)dev->driver_data);
+}
+
+static int virtio_blk_poll(BlockDevice* dev) {
+    uint32_t flags = irq_save();
+    int done = virtio_blk_reap((VirtioBlkDevice*)dev->driver_data);
+    irq_restore(flags);
+    return done;
+}
+
+static void virtio_blk_commit(BlockDevice* dev) {
+    virtio_blk_kick((VirtioBlkDevice*)dev->driver_data);
+}
+
+static const BlockDeviceOps virtio_blk_ops = {
+    virtio_blk_read,
+    virtio_blk_write,
+    0,
+    virtio_blk_flush,
+    virtio_blk_readv,
+    virtio_blk_writev,
+    virtio_blk_submit,
+    virtio_blk_wait_event,
+    virtio_blk_abort,
+    virtio_blk_poll,
+    virtio_blk_commit,
+};
+
+// --- Setup ---
+
+// Legacy initialisation: reset, acknowledge, negotiate features, hand the
+// device queue 0, then DRIVER_OK. Also used to restart after an abort.
+static int virtio_blk_start(VirtioBlkDevice* vd, uint8_t* ring, int quiet) {
+    uint16_t io = vd->io_base;
+    outb(io + VIRTIO_REG_STATUS, 0);
+    outb(io + VIRTIO_REG_STATUS, VIRTIO_STATUS_ACKNOWLEDGE);
+    outb(io + VIRTIO_REG_STATUS, VIRTIO_STATUS_ACKNOWLEDGE | VIRTIO_STATUS_DRIVER);
+
+    uint32_t offered = inl(io + VIRTIO_REG_DEVICE_FEATURES);
+    if (!(offered & VIRTIO_RING_F_INDIRECT_DESC)) {
+        if (!quiet) print_string("virtio-blk: Device lacks indirect descriptors, skipped.\n");
+        outb(io + VIRTIO_REG_STATUS, VIRTIO_STATUS_FAILED);
+        return -1;
+    }
+    vd->features = offered & (VIRTIO_BLK_F_SIZE_MAX | VIRTIO_BLK_F_SEG_MAX | VIRTIO_BLK_F_RO |
+                              VIRTIO_BLK_F_FLUSH | VIRTIO_RING_F_INDIRECT_DESC | VIRTIO_RING_F_EVENT_IDX);
+    outl(io + VIRTIO_REG_GUEST_FEATURES, vd->features);
+
+    outw(io + VIRTIO_REG_QUEUE_SELECT, 0);
+    uint16_t size = inw(io + VIRTIO_REG_QUEUE_SIZE);
+    // Legacy devices fix the size, and it is always a power of two.
+    if (size == 0 || size > VIRTIO_QUEUE_MAX || (size & (size - 1))) {
+        if (!quiet) print_string("virtio-blk: Unsupported queue size, skipped.\n");
+        outb(io + VIRTIO_REG_STATUS, VIRTIO_STATUS_FAILED);
+        return -1;
+    }
+    vd->queue_size = size;
+    vd->slot_mask = size >= VIRTIO_BLK_SLOTS ? 0xFFFFFFFF : (1u << size) - 1;
+
+    memset(ring, 0, VRING_BYTES(size));
+    vd->desc = (VringDesc*)ring;
+    vd->avail = (volatile uint16_t*)(ring + 16 * size);
+    vd->used = (volatile uint16_t*)(ring + VRING_USED_OFFSET(size));
+    vd->used_ring = (volatile VringUsedElem*)(vd->used + 2);
+    vd->avail_event = (volatile uint16_t*)(vd->used_ring + size);
+    vd->avail_idx = 0;
+    vd->kicked_idx = 0;
+    vd->last_used = 0;
+    vd->busy = 0;
+    // Polled devices needn't interrupt at all.
+    if (vd->irq_line < 0) vd->avail[0] = VRING_AVAIL_F_NO_INTERRUPT;
+
+    outl(io + VIRTIO_REG_QUEUE_PFN, (uint32_t)ring >> 12);
+    outb(io + VIRTIO_REG_STATUS, VIRTIO_STATUS_ACKNOWLEDGE | VIRTIO_STATUS_DRIVER | VIRTIO_STATUS_DRIVER_OK);
+    return 0;
+}
+
+// INTx only: the legacy interface without MSI-X. Lines aren't shared
+// with other drivers, but virtio devices may share one between them.
+static void virtio_blk_setup_irq(VirtioBlkDevice* vd, const PciAddress* pci) {
+    uint8_t line = pci_read_dword(pci->bus, pci->device, pci->function, PCI_INTERRUPT_LINE) & 0xFF;
+    vd->irq_line = -1;
+    if (line >= 16) return;
+    if (!(virtio_irq_lines & (1u << line))) {
+        if (irq_has_handler(line)) return;
+        irq_install_handler(line, virtio_blk_irq_handler);
+        virtio_irq_lines |= 1u << line;
+    }
+    vd->irq_line = line;
+}
+
+static void virtio_blk_probe(const PciAddress* pci) {
+    uint32_t bar0 = pci_read_dword(pci->bus, pci->device, pci->function, PCI_BAR0);
+    if (!(bar0 & 0x01)) return; // Legacy registers live in an I/O BAR
+    pci_enable(pci, PCI_COMMAND_IO | PCI_COMMAND_BUS_MASTER);
+
+    int index = virtio_device_count;
+    VirtioBlkDevice* vd = &virtio_devices[index];
+    memset(vd, 0, sizeof(VirtioBlkDevice));
+    vd->io_base = bar0 & 0xFFFC;
+    vd->indirect = virtio_indirect[index];
+    virtio_blk_setup_irq(vd, pci);
+    if (virtio_blk_start(vd, virtio_rings[index], 0) != 0) return;
+
+    uint16_t cfg = vd->io_base + VIRTIO_REG_CONFIG;
+    uint64_t capacity = inl(cfg + VIRTIO_BLK_CFG_CAPACITY) |
+                        ((uint64_t)inl(cfg + VIRTIO_BLK_CFG_CAPACITY + 4) << 32);
+    uint32_t seg_max = VIRTIO_BLK_MAX_SEGMENTS;
+    if (vd->features & VIRTIO_BLK_F_SEG_MAX) {
+        uint32_t device_max = inl(cfg + VIRTIO_BLK_CFG_SEG_MAX);
+        if (device_max && device_max < seg_max) seg_max = device_max;
+    }
+    BlockCaps* caps = &vd->block.caps;
+    caps->sector_count = capacity;
+    caps->max_sectors = VIRTIO_BLK_MAX_SECTORS;
+    caps->max_segments = seg_max;
+    if (vd->features & VIRTIO_BLK_F_SIZE_MAX) {
+        // Long segments are split into size_max pieces, so leave room.
+        vd->size_max = inl(cfg + VIRTIO_BLK_CFG_SIZE_MAX) & ~(uint32_t)(BLOCK_SECTOR_SIZE - 1);
+        if (vd->size_max) {
+            caps->max_segments = seg_max / 2 ? seg_max / 2 : 1;
+            uint32_t limit = caps->max_segments * (vd->size_max / BLOCK_SECTOR_SIZE);
+            if (limit < caps->max_sectors) caps->max_sectors = limit;
+        }
+    }
+    caps->flags = BLOCK_CAP_DMA | BLOCK_CAP_LBA48;
+    if (vd->features & VIRTIO_BLK_F_FLUSH) caps->flags |= BLOCK_CAP_WRITE_CACHE;
+    uint32_t slots = vd->queue_size < VIRTIO_BLK_SLOTS ? vd->queue_size : VIRTIO_BLK_SLOTS;
+    caps->queue_depth = slots;
+
+    vd->block.name[0] = 'v';
+    vd->block.name[1] = 'd';
+    vd->block.name[2] = 'a' + index;
+    vd->block.name[3] = '\0';
+    vd->block.type = BLOCK_TYPE_VIRTIO;
+    vd->block.ops = &virtio_blk_ops;
+    vd->block.driver_data = vd;
+    if (block_register(&vd->block) < 0) {
+        outb(vd->io_base + VIRTIO_REG_STATUS, 0);
+        return;
+    }
+    virtio_device_count++;
+
+    print_string("virtio-blk: ");
+    print_string(vd->block.name);
+    print_string(", ");
+    print_int((uint32_t)(capacity >> 11));
+    print_string(" MB, queue ");
+    print_int(vd->queue_size);
+    if (vd->features & VIRTIO_RING_F_EVENT_IDX) print_string(", event idx");
+    if (vd->features & VIRTIO_BLK_F_RO) print_string(", read-only");
+    print_string(vd->irq_line >= 0 ? ", INTx\n" : ", polling\n");
+}
+
+void virtio_blk_init() {
+    PciAddress pci;
+    for (int i = 0; virtio_device_count < VIRTIO_BLK_MAX_DEVICES &&
+                    pci_find_device(VIRTIO_PCI_VENDOR, VIRTIO_PCI_DEVICE_BLK, i, &pci); i++) {
+        virtio_blk_probe(&pci);
+    }
+}
+
+uint32_t virtio_blk_interrupt_count() {
+    return virtio_interrupts;
+}
+
+uint32_t virtio_blk_kick_count() {
+    return virtio_kicks;
+}
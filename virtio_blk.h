@@ -0,0 +1,90 @@
+#ifndef VIRTIO_BLK_H
+#define VIRTIO_BLK_H
+
+#include <stdint.h>
+#include "block.h"
+
+// Legacy ("transitional") virtio PCI IDs for a block device.
+#define VIRTIO_PCI_VENDOR     0x1AF4
+#define VIRTIO_PCI_DEVICE_BLK 0x1001
+
+// Legacy virtio PCI registers, offsets from the BAR0 I/O base.
+#define VIRTIO_REG_DEVICE_FEATURES 0x00 // 32-bit
+#define VIRTIO_REG_GUEST_FEATURES  0x04 // 32-bit
+#define VIRTIO_REG_QUEUE_PFN       0x08 // 32-bit, queue address / 4096
+#define VIRTIO_REG_QUEUE_SIZE      0x0C // 16-bit
+#define VIRTIO_REG_QUEUE_SELECT    0x0E // 16-bit
+#define VIRTIO_REG_QUEUE_NOTIFY    0x10 // 16-bit
+#define VIRTIO_REG_STATUS          0x12 // 8-bit
+#define VIRTIO_REG_ISR             0x13 // 8-bit, cleared by reading
+#define VIRTIO_REG_CONFIG          0x14 // Device config (MSI-X off)
+
+// Device status bits
+#define VIRTIO_STATUS_ACKNOWLEDGE 0x01
+#define VIRTIO_STATUS_DRIVER      0x02
+#define VIRTIO_STATUS_DRIVER_OK   0x04
+#define VIRTIO_STATUS_FAILED      0x80
+
+// Feature bits
+#define VIRTIO_BLK_F_SIZE_MAX       (1u << 1)  // Config size_max is valid
+#define VIRTIO_BLK_F_SEG_MAX        (1u << 2)  // Config seg_max is valid
+#define VIRTIO_BLK_F_RO             (1u << 5)
+#define VIRTIO_BLK_F_FLUSH          (1u << 9)  // Volatile write cache + FLUSH
+#define VIRTIO_RING_F_INDIRECT_DESC (1u << 28)
+#define VIRTIO_RING_F_EVENT_IDX     (1u << 29)
+
+// Config space (from VIRTIO_REG_CONFIG)
+#define VIRTIO_BLK_CFG_CAPACITY 0x00 // 64-bit, in 512-byte sectors
+#define VIRTIO_BLK_CFG_SIZE_MAX 0x08
+#define VIRTIO_BLK_CFG_SEG_MAX  0x0C
+
+// Request types and status
+#define VIRTIO_BLK_T_IN    0
+#define VIRTIO_BLK_T_OUT   1
+#define VIRTIO_BLK_T_FLUSH 4
+#define VIRTIO_BLK_S_OK    0
+
+// Split virtqueue structures (virtio 1.0 section 2.6, legacy layout).
+#define VRING_DESC_F_NEXT      0x01
+#define VRING_DESC_F_WRITE     0x02 // Device writes this buffer
+#define VRING_DESC_F_INDIRECT  0x04 // Buffer is a table of descriptors
+#define VRING_AVAIL_F_NO_INTERRUPT 0x01
+#define VRING_USED_F_NO_NOTIFY     0x01
+
+typedef struct {
+    uint64_t addr;
+    uint32_t len;
+    uint16_t flags;
+    uint16_t next;
+} __attribute__((packed)) VringDesc;
+
+typedef struct {
+    uint32_t id;
+    uint32_t len;
+} __attribute__((packed)) VringUsedElem;
+
+typedef struct {
+    uint32_t type;
+    uint32_t reserved;
+    uint64_t sector;
+} __attribute__((packed)) VirtioBlkHeader;
+
+// Largest queue the legacy interface lets the device pick that we accept,
+// and how many requests we keep in flight on it. Each request takes one
+// ring descriptor pointing at its own indirect table.
+#define VIRTIO_QUEUE_MAX        256
+#define VIRTIO_BLK_SLOTS        32
+#define VIRTIO_BLK_MAX_SEGMENTS 32
+#define VIRTIO_BLK_MAX_SECTORS  2048 // 1 MB per request
+#define VIRTIO_BLK_MAX_DEVICES  2
+#define VIRTIO_TIMEOUT_MS       10000
+
+// Finds every virtio-blk PCI function and registers it as "vda", "vdb".
+void virtio_blk_init();
+
+// Interrupts taken so far and notifications (queue kicks) sent, summed
+// over all devices.
+uint32_t virtio_blk_interrupt_count();
+uint32_t virtio_blk_kick_count();
+
+#endif // VIRTIO_BLK_H